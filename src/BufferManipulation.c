@@ -98,19 +98,41 @@ static int Shell_Base64Dec_Callback(const void* data, size_t size,
 }
 MI_Result Base64DecodeBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer)
 {
-    toBuffer->bufferLength = fromBuffer->bufferUsed;
+    MI_Result miResult;
+
+    toBuffer->bufferLength = ((fromBuffer->bufferUsed + 3) / 4) * 3;
     toBuffer->bufferUsed = 0;
     toBuffer->buffer = malloc(toBuffer->bufferLength);
 
     if (toBuffer->buffer == NULL)
         return MI_RESULT_SERVER_LIMITS_EXCEEDED;
 
-    if (Base64Dec(fromBuffer->buffer,
-        fromBuffer->bufferLength,
-        Shell_Base64Dec_Callback, toBuffer) == -1)
+    miResult = Base64DecodeBufferInto(fromBuffer, toBuffer);
+    if (miResult != MI_RESULT_OK)
     {
         free(toBuffer->buffer);
         toBuffer->buffer = NULL;
+    }
+    return miResult;
+}
+
+/* Base64DecodeBufferInto
+ * Decode into toBuffer->buffer, which the caller owns and which holds toBuffer->bufferLength
+ * bytes. MI_RESULT_SERVER_LIMITS_EXCEEDED means the buffer is too small and nothing was
+ * written, so the caller can fall back to Base64DecodeBuffer.
+ */
+MI_Result Base64DecodeBufferInto(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer)
+{
+    toBuffer->bufferUsed = 0;
+
+    if (((fromBuffer->bufferUsed + 3) / 4) * 3 > toBuffer->bufferLength)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    if (Base64Dec(fromBuffer->buffer,
+        fromBuffer->bufferUsed,
+        Shell_Base64Dec_Callback, toBuffer) == -1)
+    {
+        toBuffer->bufferUsed = 0;
         return MI_RESULT_FAILED;
     }
     return MI_RESULT_OK;
@@ -131,7 +153,10 @@ static int Shell_Base64Enc_Callback(const char* data, size_t size,
 
 MI_Result Base64EncodeBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer)
 {
-    toBuffer->bufferLength = ((fromBuffer->bufferUsed * 4) / 3) + sizeof(MI_Char) + (sizeof(MI_T('=')) * 2);
+    /* Four characters for every three bytes or part of three, plus the terminator */
+    if (fromBuffer->bufferUsed > ((((MI_Uint32) -1 - sizeof(MI_Char)) / 4) * 3))
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    toBuffer->bufferLength = (((fromBuffer->bufferUsed + 2) / 3) * 4) + sizeof(MI_Char);
     toBuffer->bufferUsed = 0;
     toBuffer->buffer = malloc(toBuffer->bufferLength);
 
@@ -172,69 +197,130 @@ typedef struct _CompressionHeader
 /* CalculateTotalUncompressedSize
 * This function enumerates the compressed buffer chunks to calculate the total
 * uncompressed size. It is used to allocate a buffer big enough for the full
-* uncompressed buffer.
+* uncompressed buffer. The buffer comes off the wire, so every header and the
+* payload it describes are checked against what is left of the buffer before
+* anything is read from them; a malformed buffer fails with MI_RESULT_FAILED
+* and a total that does not fit in an MI_Uint32 with
+* MI_RESULT_SERVER_LIMITS_EXCEEDED.
 * NOTE: The CompressionHeader sizes are adjusted to accomodate the protocol bug.
 */
-static MI_Uint32 CalculateTotalUncompressedSize(DecodeBuffer *compressedBuffer)
+static MI_Result CalculateTotalUncompressedSize(DecodeBuffer *compressedBuffer, MI_Uint32 *totalSize)
 {
-    CompressionHeader *header;
+    const CompressionHeader *header;
     const MI_Uint8* bufferCursor = (const MI_Uint8*)compressedBuffer->buffer;
-    const MI_Uint8* endOfBuffer = bufferCursor + compressedBuffer->bufferLength;
+    const MI_Uint8* endOfBuffer = bufferCursor + compressedBuffer->bufferUsed;
+    MI_Uint32 chunkSize;
     MI_Uint32 currentSize = 0;
 
     while (bufferCursor < endOfBuffer)
     {
-        header = (CompressionHeader*)bufferCursor;
-        currentSize += (header->originalSize + 1); /* On the wire size is off-by-one */
-
-                                                   /* Move to next block */
-        bufferCursor += (header->compressedSize + 1); /* On the wire size is off-by-one */
+        if ((size_t)(endOfBuffer - bufferCursor) < sizeof(CompressionHeader))
+        {
+            return MI_RESULT_FAILED;
+        }
+        header = (const CompressionHeader*)bufferCursor;
         bufferCursor += sizeof(CompressionHeader);
+
+        chunkSize = header->compressedSize + 1; /* On the wire size is off-by-one */
+        if ((size_t)(endOfBuffer - bufferCursor) < chunkSize)
+        {
+            return MI_RESULT_FAILED;
+        }
+        chunkSize = header->originalSize + 1; /* On the wire size is off-by-one */
+        if (currentSize > (MI_Uint32)-1 - chunkSize)
+        {
+            return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+        }
+        currentSize += chunkSize;
+
+        /* Move to next block */
+        bufferCursor += header->compressedSize + 1;
     }
 
-    return currentSize;
+    *totalSize = currentSize;
+    return MI_RESULT_OK;
 }
 
 /* DecompressBuffer
 * Decompress the appended compressed chunks into a single buffer. This function
 * allocates the destination buffer and the caller needs to free the buffer.
+*/
+MI_Result DecompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer)
+{
+    void *workspace = NULL;
+    MI_Result miResult;
+
+    memset(toBuffer, 0, sizeof(*toBuffer));
+
+    /* Allocate the result buffer for decompression */
+    miResult = CalculateTotalUncompressedSize(fromBuffer, &toBuffer->bufferLength);
+    if (miResult != MI_RESULT_OK)
+    {
+        return miResult;
+    }
+    toBuffer->buffer = malloc(toBuffer->bufferLength);
+    if (toBuffer->buffer == NULL)
+    {
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    }
+
+    miResult = DecompressBufferInto(fromBuffer, toBuffer, &workspace);
+
+    free(workspace);
+
+    if (miResult != MI_RESULT_OK)
+    {
+        free(toBuffer->buffer);
+        toBuffer->buffer = NULL;
+    }
+    return miResult;
+}
+
+/* DecompressBufferInto
+* Decompress the appended compressed chunks into toBuffer->buffer, which the caller owns
+* and which holds toBuffer->bufferLength bytes. The decompression workspace is allocated
+* on first use and handed back through *workspace so a caller decoding many messages only
+* pays for it once; the caller frees it. MI_RESULT_SERVER_LIMITS_EXCEEDED with nothing
+* written means the buffer is too small for the uncompressed data, MI_RESULT_FAILED that
+* the chunk framing is malformed.
 * NOTE: This code compensates for the protocol bug where the CompressionHeader values
 *       are encoded incorrectly.
 */
-MI_Result DecompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer)
+MI_Result DecompressBufferInto(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, void **workspace)
 {
     MI_Uint32 wsCompressSize, wsDecompressSize;
-    void * workspace = NULL;
     MI_Uint8* fromBufferCursor;
     MI_Uint8* fromBufferEnd;
     MI_Uint8* toBufferCursor;
     MI_Uint32 status;
+    MI_Uint32 totalSize;
     MI_Result miResult = MI_RESULT_OK;
 
-    memset(toBuffer, 0, sizeof(*toBuffer));
-
+    toBuffer->bufferUsed = 0;
 
-    /* Decompression code needs a working buffer. We really need to cache this buffer
-    * so we don't need to keep reallocating and freeing it. We only need one for each
-    * of Send/Receive */
-    if (CompressWorkSpaceSizeXpressHuff(&wsCompressSize, &wsDecompressSize) != STATUS_SUCCESS)
+    /* Validates the framing of every chunk, so the loop below can trust the headers */
+    miResult = CalculateTotalUncompressedSize(fromBuffer, &totalSize);
+    if (miResult != MI_RESULT_OK)
     {
-        GOTO_ERROR(MI_RESULT_FAILED);
+        return miResult;
     }
-
-    workspace = malloc(wsDecompressSize);
-    if (workspace == NULL)
+    if (totalSize > toBuffer->bufferLength)
     {
-        GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
     }
 
-    /* Allocate the result buffer for decompression */
-    toBuffer->bufferUsed = 0;
-    toBuffer->bufferLength = CalculateTotalUncompressedSize(fromBuffer);
-    toBuffer->buffer = malloc(toBuffer->bufferLength);
-    if (toBuffer->buffer == NULL)
+    if (*workspace == NULL)
     {
-        GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        if (CompressWorkSpaceSizeXpressHuff(&wsCompressSize, &wsDecompressSize) != STATUS_SUCCESS)
+        {
+            GOTO_ERROR(MI_RESULT_FAILED);
+        }
+
+        *workspace = malloc(wsDecompressSize);
+        if (*workspace == NULL)
+        {
+            GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
     }
 
     toBufferCursor = (MI_Uint8*)toBuffer->buffer;
@@ -248,8 +334,8 @@ MI_Result DecompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer)
         MI_Uint32 bufferUsed = 0;
         CompressionHeader *compressionHeader = (CompressionHeader*)fromBufferCursor;
 
-        /* Shouldn't fail but to be same make sure we have enough buffer */
-        if ((toBuffer->bufferUsed + compressionHeader->originalSize + 1) > toBuffer->bufferLength)
+        /* Shouldn't fail but to be safe make sure we have enough buffer */
+        if ((MI_Uint32)compressionHeader->originalSize + 1 > toBuffer->bufferLength - toBuffer->bufferUsed)
         {
             GOTO_ERROR(MI_RESULT_FAILED);
         }
@@ -273,7 +359,7 @@ MI_Result DecompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer)
                 fromBufferCursor,
                 compressionHeader->compressedSize + 1, /* Adjusting for incorrect compression header */
                 &bufferUsed,
-                workspace,
+                *workspace,
                 NULL,
                 NULL,
                 0
@@ -291,19 +377,9 @@ MI_Result DecompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer)
     }
 
 error:
-    free(workspace);
-
-    if (miResult != MI_RESULT_OK)
-    {
-        free(toBuffer->buffer);
-        toBuffer->buffer = NULL;
-    }
     return miResult;
 }
 
-/* Maximum concompressed buffer size is 64K */
-#define MAX_COMPRESS_BUFFER_BLOCK (64*1024)
-
 static size_t min(size_t a, size_t b)
 {
     if (a < b)
@@ -312,6 +388,77 @@ static size_t min(size_t a, size_t b)
         return b;
 }
 
+/* CompressChunk
+* Compresses a single chunk of up to MAX_COMPRESS_BUFFER_BLOCK bytes into toBufferCursor,
+* prepending its CompressionHeader. The caller needs to make sure there is space for the
+* header plus the uncompressed chunk size as the chunk is stored uncompressed if
+* compression does not make it any smaller.
+* NOTE: This code compensates for the protocol bug in CompressionHeader
+*/
+static MI_Result CompressChunk(void *workspace, MI_Uint8 *fromBufferCursor, size_t chunkSize, MI_Uint8 *toBufferCursor, MI_Uint32 *bytesWritten)
+{
+    MI_Uint32 actualToChunkSize = 0;
+    CompressionHeader *compressionHeader = (CompressionHeader*)toBufferCursor;
+    MI_Uint32 status;
+
+    toBufferCursor += sizeof(CompressionHeader);
+
+    status = CompressBufferProgress(
+        fromBufferCursor,
+        chunkSize,
+        toBufferCursor,
+        chunkSize,
+        &actualToChunkSize,
+        workspace,
+        NULL,
+        0,
+        0
+        );
+    if (status == STATUS_BUFFER_TOO_SMALL)
+    {
+        /* Compressed buffer was going to be bigger than the uncompressed buffer so lets just
+        * use the original.
+        */
+        memcpy(toBufferCursor, fromBufferCursor, chunkSize);
+        actualToChunkSize = chunkSize;
+    }
+    else if (status != STATUS_SUCCESS)
+    {
+        return MI_RESULT_FAILED;
+    }
+
+    /* NOTE: Size encodings on the wire were originally implemented incorrectly so we need
+    * to adjust our encodings of the sizes as well.
+    */
+    compressionHeader->originalSize = chunkSize - 1;
+    compressionHeader->compressedSize = actualToChunkSize - 1;
+
+    *bytesWritten = sizeof(CompressionHeader) + actualToChunkSize;
+    return MI_RESULT_OK;
+}
+
+/* AllocateCompressWorkspace
+* Allocates and initializes the workspace the xpress compressor needs. The workspace can
+* be reused for any number of chunks, and consecutive chunks that are similar share the
+* work of building their Huffman tables.
+*/
+static void *AllocateCompressWorkspace(void)
+{
+    MI_Uint32 wsCompressSize, wsDecompressSize;
+    void *workspace;
+
+    if (CompressWorkSpaceSizeXpressHuff(&wsCompressSize, &wsDecompressSize) != STATUS_SUCCESS)
+    {
+        return NULL;
+    }
+    workspace = malloc(wsCompressSize);
+    if (workspace)
+    {
+        CompressWorkSpaceInitXpressHuff(workspace);
+    }
+    return workspace;
+}
+
 /* CompressBuffer
 * Compresses the buffer into chunks, compressing each 64K chunk of data with its own
 * CompressionHeader prepended to each chunk.
@@ -319,7 +466,6 @@ static size_t min(size_t a, size_t b)
 */
 MI_Result CompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, MI_Uint32 extraSpaceToAllocate)
 {
-    MI_Uint32 wsCompressSize, wsDecompressSize;
     void * workspace = NULL;
     MI_Uint8* fromBufferCursor;
     MI_Uint8* fromBufferEnd;
@@ -344,12 +490,10 @@ MI_Result CompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, MI_Ui
         GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
 
-    /* Get the compression workspace size and allocate it. We really need to cache this */
-    if (CompressWorkSpaceSizeXpressHuff(&wsCompressSize, &wsDecompressSize) != STATUS_SUCCESS)
-    {
-        GOTO_ERROR(MI_RESULT_FAILED);
-    }
-    workspace = malloc(wsCompressSize);
+    /* Get the compression workspace. Callers compressing many buffers should use the
+    * CompressStream functions which keep the workspace between calls.
+    */
+    workspace = AllocateCompressWorkspace();
     if (workspace == NULL)
     {
         GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
@@ -367,49 +511,21 @@ MI_Result CompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, MI_Ui
         * will just use the uncompressed buffer itself for this chunk.
         */
         size_t chunkSize = min((size_t)(fromBufferEnd - fromBufferCursor), MAX_COMPRESS_BUFFER_BLOCK);
-        MI_Uint32 actualToChunkSize = 0;
-        CompressionHeader *compressionHeader = (CompressionHeader*)toBufferCursor;
-        MI_Uint32 status;
+        MI_Uint32 bytesWritten = 0;
 
         if ((toBuffer->bufferUsed + chunkSize + sizeof(CompressionHeader)) > toBuffer->bufferLength)
         {
             GOTO_ERROR(MI_RESULT_FAILED);
         }
-        toBufferCursor += sizeof(CompressionHeader);
-        toBuffer->bufferUsed += sizeof(CompressionHeader);
-
-        status = CompressBufferProgress(
-            fromBufferCursor,
-            chunkSize,
-            toBufferCursor,
-            chunkSize,
-            &actualToChunkSize,
-            workspace,
-            NULL,
-            0,
-            0
-            );
-        if (status == STATUS_BUFFER_TOO_SMALL)
-        {
-            /* Compressed buffer was going to be bigger than the uncompressed buffer so lets just
-            * use the original.
-            */
-            memcpy(toBufferCursor, fromBufferCursor, chunkSize);
-            actualToChunkSize = chunkSize;
-        }
-        else if (status != STATUS_SUCCESS)
+
+        miResult = CompressChunk(workspace, fromBufferCursor, chunkSize, toBufferCursor, &bytesWritten);
+        if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR(MI_RESULT_FAILED);
+            GOTO_ERROR(miResult);
         }
 
-        /* NOTE: Size encodings on the wire were originally implemented incorrectly so we need
-        * to adjust our encodings of the sizes as well.
-        */
-        compressionHeader->originalSize = chunkSize - 1;
-        compressionHeader->compressedSize = actualToChunkSize - 1;
-
-        toBuffer->bufferUsed += actualToChunkSize;
-        toBufferCursor += actualToChunkSize;
+        toBuffer->bufferUsed += bytesWritten;
+        toBufferCursor += bytesWritten;
 
         fromBufferCursor += chunkSize;
     }
@@ -426,3 +542,162 @@ error:
 
     return miResult;
 }
+
+/* CompressStreamInit
+* Initializes an incremental compressor. The compression workspace and the pending input
+* chunk are allocated once here and kept until CompressStreamDestroy so a long running
+* stream does not keep reallocating them.
+*/
+MI_Result CompressStreamInit(CompressStream *stream)
+{
+    memset(stream, 0, sizeof(*stream));
+
+    stream->workspace = AllocateCompressWorkspace();
+    stream->pending = malloc(MAX_COMPRESS_BUFFER_BLOCK);
+    if ((stream->workspace == NULL) || (stream->pending == NULL))
+    {
+        CompressStreamDestroy(stream);
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    }
+    return MI_RESULT_OK;
+}
+
+/* CompressStreamReset
+* Throws away pending input and chunks not yet handed out after a failure, along with the
+* Huffman table of the last block, so the next message does not follow on from half of this one.
+*/
+static void CompressStreamReset(CompressStream *stream)
+{
+    stream->pendingUsed = 0;
+    stream->output.bufferUsed = 0;
+    CompressWorkSpaceInitXpressHuff(stream->workspace);
+}
+
+/* CompressStreamReserve
+* Makes sure the output buffer has space for another bytesNeeded bytes, growing it
+* geometrically so appending chunks stays cheap.
+*/
+static MI_Result CompressStreamReserve(CompressStream *stream, MI_Uint32 bytesNeeded)
+{
+    MI_Uint32 newLength;
+    MI_Char *newBuffer;
+
+    if ((stream->output.bufferUsed + bytesNeeded) <= stream->output.bufferLength)
+        return MI_RESULT_OK;
+
+    newLength = stream->output.bufferLength ? stream->output.bufferLength : (sizeof(CompressionHeader) + MAX_COMPRESS_BUFFER_BLOCK);
+    while (newLength < (stream->output.bufferUsed + bytesNeeded))
+    {
+        newLength *= 2;
+    }
+
+    newBuffer = realloc(stream->output.buffer, newLength);
+    if (newBuffer == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    stream->output.buffer = newBuffer;
+    stream->output.bufferLength = newLength;
+    return MI_RESULT_OK;
+}
+
+/* CompressStreamFlush
+* Compresses whatever input is pending into a complete CompressionHeader framed chunk
+* even if it is less than 64K. Call this at a PSRP message boundary so the message can be
+* sent without waiting for more data. On failure the stream is reset.
+*/
+MI_Result CompressStreamFlush(CompressStream *stream)
+{
+    MI_Uint32 bytesWritten = 0;
+    MI_Result miResult;
+
+    if (stream->pendingUsed == 0)
+        return MI_RESULT_OK;
+
+    miResult = CompressStreamReserve(stream, sizeof(CompressionHeader) + stream->pendingUsed);
+    if (miResult == MI_RESULT_OK)
+    {
+        miResult = CompressChunk(stream->workspace,
+                                 stream->pending,
+                                 stream->pendingUsed,
+                                 (MI_Uint8*)stream->output.buffer + stream->output.bufferUsed,
+                                 &bytesWritten);
+    }
+    if (miResult != MI_RESULT_OK)
+    {
+        CompressStreamReset(stream);
+        return miResult;
+    }
+
+    stream->output.bufferUsed += bytesWritten;
+    stream->pendingUsed = 0;
+    return MI_RESULT_OK;
+}
+
+/* CompressStreamFeed
+* Adds more uncompressed data to the stream. Each time 64K of input accumulates a chunk
+* is compressed and appended to the output straight away. On failure the stream is reset
+* and none of this data is kept.
+*/
+MI_Result CompressStreamFeed(CompressStream *stream, const void *data, MI_Uint32 dataLength)
+{
+    const MI_Uint8 *dataCursor = (const MI_Uint8*)data;
+    MI_Result miResult;
+
+    while (dataLength)
+    {
+        size_t copySize = min(dataLength, MAX_COMPRESS_BUFFER_BLOCK - stream->pendingUsed);
+
+        memcpy(stream->pending + stream->pendingUsed, dataCursor, copySize);
+        stream->pendingUsed += copySize;
+        dataCursor += copySize;
+        dataLength -= copySize;
+
+        if (stream->pendingUsed == MAX_COMPRESS_BUFFER_BLOCK)
+        {
+            miResult = CompressStreamFlush(stream);
+            if (miResult != MI_RESULT_OK)
+                return miResult;
+        }
+    }
+    return MI_RESULT_OK;
+}
+
+/* CompressStreamFinish
+* Flushes any pending input and hands the compressed chunks over to the caller, who
+* needs to free toBuffer->buffer. extraSpaceToAllocate bytes are left spare on the end
+* of the buffer, the same as CompressBuffer. The stream keeps its workspace and can be
+* fed again straight away, whether or not this succeeded.
+*/
+MI_Result CompressStreamFinish(CompressStream *stream, DecodeBuffer *toBuffer, MI_Uint32 extraSpaceToAllocate)
+{
+    MI_Result miResult;
+
+    memset(toBuffer, 0, sizeof(*toBuffer));
+
+    miResult = CompressStreamFlush(stream);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    miResult = CompressStreamReserve(stream, extraSpaceToAllocate);
+    if (miResult != MI_RESULT_OK)
+    {
+        CompressStreamReset(stream);
+        return miResult;
+    }
+
+    *toBuffer = stream->output;
+    memset(&stream->output, 0, sizeof(stream->output));
+    return MI_RESULT_OK;
+}
+
+/* CompressStreamDestroy
+* Frees everything owned by the stream, including any output that has not been handed
+* over by CompressStreamFinish.
+*/
+void CompressStreamDestroy(CompressStream *stream)
+{
+    free(stream->workspace);
+    free(stream->pending);
+    free(stream->output.buffer);
+    memset(stream, 0, sizeof(*stream));
+}
@@ -20,11 +20,33 @@ typedef struct _DecodeBuffer
     MI_Uint32 bufferUsed;
 } DecodeBuffer;
 
+/* Maximum concompressed buffer size is 64K */
+#define MAX_COMPRESS_BUFFER_BLOCK (64*1024)
+
+/* Incremental compressor. Input is fed in as it is produced and each 64K of it is
+ * compressed into a CompressionHeader framed chunk as soon as it is available.
+ */
+typedef struct _CompressStream
+{
+    void *workspace;
+    MI_Uint8 *pending;      /* Uncompressed input waiting for a full chunk or a flush */
+    MI_Uint32 pendingUsed;
+    DecodeBuffer output;    /* Compressed chunks not yet handed out */
+} CompressStream;
+
 MI_Result Base64DecodeBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer);
+MI_Result Base64DecodeBufferInto(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer);
 MI_Result Base64EncodeBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer);
 MI_Result DecompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer);
+MI_Result DecompressBufferInto(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, void **workspace);
 MI_Result CompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, MI_Uint32 extraSpaceToAllocate);
 
+MI_Result CompressStreamInit(CompressStream *stream);
+MI_Result CompressStreamFeed(CompressStream *stream, const void *data, MI_Uint32 dataLength);
+MI_Result CompressStreamFlush(CompressStream *stream);
+MI_Result CompressStreamFinish(CompressStream *stream, DecodeBuffer *toBuffer, MI_Uint32 extraSpaceToAllocate);
+void CompressStreamDestroy(CompressStream *stream);
+
 MI_Boolean Utf8ToUtf16Le(Batch *batch, const char *from, MI_Char16 **to);
 MI_Boolean Utf16LeToUtf8(Batch *batch, const MI_Char16 *from, char **to);
 size_t Utf16LeStrLenBytes(const MI_Char16* str);
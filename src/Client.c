@@ -9,8 +9,13 @@
 
 #include <iconv.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
 #include <pal/strings.h>
 #include <pal/atomic.h>
+#include <pal/lock.h>
+#include <pal/thread.h>
+#include <pal/sleep.h>
 #include <base/result.h>
 #include <base/logbase.h>
 #include <base/log.h>
@@ -22,6 +27,7 @@
 #include "Command.h"
 #include "DesiredStream.h"
 #include "Utilities.h"
+#include "DebugLog.h"
 
 /* Disable the provider APIs so we can use the provider RTTI */
 void MI_CALL Shell_Load(Shell_Self** self, MI_Module_Self* selfModule, MI_Context* context) {}
@@ -51,8 +57,57 @@ void MI_CALL Command_DeleteInstance( Command_Self* self, MI_Context* context, co
 #define SHELL_LOGGING_FILE "shellclient"
 
 
+/* Number of Receive requests kept outstanding per receive operation, set with
+ * receivepipelinedepth in omiserver.conf. Servers that only allow one Receive at
+ * a time need the default of 1.
+ */
+#define RECEIVE_PIPELINE_DEPTH_DEFAULT 1
+#define RECEIVE_PIPELINE_DEPTH_MAX 8
+
+/* Whether shells ask the server for xpress compression of stream data, set with
+ * clientcompression=true in omiserver.conf. It stays off until the decoder has been checked
+ * against what Windows servers send, and WSMAN_FLAG_NO_COMPRESSION still turns it off.
+ */
+#define CLIENT_COMPRESSION_DEFAULT MI_FALSE
+
+/* Number of finished operation objects of each type a shell keeps for reuse */
+#define WSMAN_OPERATION_POOL_MAX 16
+
+/* Number of distinct Receive stream names a shell remembers the UTF-16 form of */
+#define WSMAN_STREAM_NAME_CACHE_MAX 8
+
+/* Idle MI sessions kept for later shells to the same destination, which then skip the TCP
+ * connect, TLS handshake and authentication a new MI session costs. Pooling is turned on with
+ * sessionpoolmaxperhost in omiserver.conf, the number of idle sessions kept per destination,
+ * and sessionpoolmaxidle is how many seconds one may sit unused before it is closed. Only a
+ * session that has just deleted a shell cleanly goes back, and a create that fails on a pooled
+ * one is sent again on a new session in case the server dropped it while it was idle.
+ */
+#define SESSION_POOL_MAX_PER_HOST 64
+#define SESSION_POOL_MAX_IDLE_DEFAULT 60
+
 #define GOTO_ERROR(message, result) { miResult = result; errorMessage=message; __LOGE(("%s (result=%u)", errorMessage, miResult)); goto error; }
 
+/* What an MI session was opened with. Only a shell with an identical key may reuse one. */
+typedef struct _WSMAN_SESSION_KEY
+{
+    char *destination;          /* transport://host:port/prefix, what the per host limit counts */
+    char *settings;             /* the other destination options that change how the session talks to the server */
+    MI_Uint32 authenticationMechanism;
+    char *username;             /* the credentials themselves, "" when there are none */
+    char *password;             /* cleared before the memory holding it is freed */
+} WSMAN_SESSION_KEY;
+
+typedef struct _WSMAN_POOLED_SESSION
+{
+    struct _WSMAN_POOLED_SESSION *next;
+    MI_Session miSession;
+    WSMAN_SESSION_KEY key;      /* strings are allocated along with the entry */
+    MI_Uint64 idleSince;
+} WSMAN_POOLED_SESSION;
+
+void MI_CALL CloseSessionComplete(_In_opt_ void *competionContext);
+
 static void LogFunctionStart(const char *function)
 {
     __LOGD(("%s: START", function));
@@ -65,6 +120,15 @@ static void LogFunctionEnd(const char *function, MI_Result miResult)
 struct WSMAN_API
 {
     MI_Application application;
+    MI_Uint32 receivePipelineDepth;
+    MI_Boolean compression;
+
+    /* Idle sessions, most recently used first, and the statistics, protected by sessionPoolLock */
+    Lock sessionPoolLock;
+    WSMAN_POOLED_SESSION *sessionPool;
+    MI_Uint32 sessionPoolMaxPerHost;    /* 0 when pooling is off */
+    MI_Uint64 sessionPoolMaxIdle;       /* microseconds */
+    WSMAN_SESSION_POOL_STATISTICS sessionPoolStatistics;
 };
 
 struct WSMAN_SESSION
@@ -74,6 +138,53 @@ struct WSMAN_SESSION
     char *hostname;
     MI_DestinationOptions destinationOptions;
     MI_Char *redirectLocation;
+
+    /* What destinationOptions have been set to, which decides the pooled MI sessions a shell may use */
+    MI_Boolean useSsl;
+    MI_Uint32 port;                     /* 0 for the wsman default of the transport */
+    char *httpUrl;
+    MI_Boolean packetPrivacy;
+    char *uiLocale;
+    char *dataLocale;
+    MI_Uint32 maxEnvelopeSize;
+    MI_Uint32 timeoutMs;
+    MI_Uint32 authenticationMechanism;
+    char *username;
+    char *password;
+};
+
+/* An MI request another thread may cancel, such as a shell create or a command run. A cancel
+ * only reaches MI_Operation_Cancel while the request is in flight, and the request's callback
+ * waits for any cancel under way before it closes the operation, the same as a Receive slot.
+ */
+typedef struct _WSMAN_CANCELLABLE
+{
+    Lock lock;
+    MI_Boolean inFlight;            /* issued and its final result not in yet */
+    MI_Boolean issuing;             /* the MI_Session call sending it has not returned */
+    MI_Boolean cancelled;           /* a cancel was asked for while it was in flight */
+    volatile ptrdiff_t cancelling;  /* cancels in progress */
+} WSMAN_CANCELLABLE;
+
+typedef struct _WSMAN_STREAM_NAME
+{
+    char *name;
+    MI_Char16 *name16;
+} WSMAN_STREAM_NAME;
+
+/* Shell methods that change the connection rather than run anything, indexing controlOptions */
+typedef enum
+{
+    WSMAN_SHELL_CONTROL_DISCONNECT = 0,
+    WSMAN_SHELL_CONTROL_RECONNECT = 1,
+    WSMAN_SHELL_CONTROL_CONNECT = 2
+} WSMAN_SHELL_CONTROL;
+
+static const char *_shellControlActions[] =
+{
+    "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Disconnect",
+    "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Reconnect",
+    "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Connect"
 };
 
 struct WSMAN_SHELL
@@ -85,9 +196,57 @@ struct WSMAN_SHELL
     Shell *shellInstance;
     MI_Session miSession;
     MI_Operation miCreateShellOperation;
+    WSMAN_CANCELLABLE create;
     MI_Operation miDeleteShellOperation;
     MI_OperationOptions operationOptions;
+    WSMAN_SESSION_KEY sessionKey; /* Pool miSession goes back to once the shell is deleted */
+    MI_Boolean pooledSession; /* miSession came from the pool and has not been answered on yet */
     MI_Boolean didCreate;
+    MI_Boolean isCompressed; /* Server accepted xpress compression of stream data */
+
+    /* Options every Send and Receive on this shell use, built once the shell has been created
+     * so each operation only needs to clone them.
+     */
+    MI_OperationOptions sendOptions;
+    MI_OperationOptions receiveOptions;
+
+    /* Finished operations kept for reuse, indexed by WSMAN_OPERATION_TYPE and protected by operationPoolLock */
+    Lock operationPoolLock;
+    WSMAN_OPERATION_HANDLE operationPool[4];
+    MI_Uint32 operationPoolCount[4];
+
+    /* One for the shell and one for each Send or Receive operation out of the pool. The pool
+     * and templates go with the last one, so an operation the caller has not closed yet keeps
+     * them past the shell closing.
+     */
+    volatile ptrdiff_t operationRefs;
+
+    /* Stream names seen in Receive responses along with their UTF-16 form, protected by
+     * streamNameLock. They have a batch of their own as the callbacks that allocate from
+     * batch do not take the lock. A shell only ever sees a handful of them.
+     */
+    Lock streamNameLock;
+    Batch streamNameBatch;
+    WSMAN_STREAM_NAME streamNames[WSMAN_STREAM_NAME_CACHE_MAX];
+    MI_Uint32 streamNameCount;
+
+    /* Disconnect, Reconnect and Connect, one at a time. Their options are built on first use
+     * and, like sendOptions, receiveOptions and the operation pool, are kept while the shell
+     * is disconnected so a reconnected shell carries on with what it already had.
+     * controlBusy is 1 while one of them owns the fields below it, another is refused.
+     */
+    WSMAN_SHELL_ASYNC controlCallback;
+    MI_OperationCallbacks controlCallbacks;
+    MI_Operation miControlOperation;
+    MI_OperationOptions controlOptions[3];
+    MI_Instance *controlProperties;
+    WSMAN_SHELL_CONTROL control;
+    volatile ptrdiff_t controlBusy;
+
+    /* Set by the control completion on an MI callback thread and read by the client's calls,
+     * so only read and written with Atomic_*.
+     */
+    volatile ptrdiff_t isDisconnected;
 };
 
 struct WSMAN_COMMAND
@@ -97,6 +256,7 @@ struct WSMAN_COMMAND
     WSMAN_SHELL_ASYNC asyncCallback;
     MI_OperationCallbacks callbacks;
     MI_Operation miOperation;
+    WSMAN_CANCELLABLE run;
     MI_OperationOptions miOptions;
     MI_Instance *commandProperties;
     MI_Instance *commandClose;
@@ -109,6 +269,38 @@ typedef enum
         WSMAN_OPERATION_RECEIVE = 2,
         WSMAN_OPERATION_SIGNAL = 3
 } WSMAN_OPERATION_TYPE;
+/* One outstanding Receive request of a receive operation. A slot is busy from the time a
+ * request is issued into it until its own callback has had the final result and closed the
+ * MI operation, so nothing else ever closes or reuses an operation whose callback may still
+ * run. Apart from miOperation, which belongs to whoever is issuing or to the callback, all
+ * of it is protected by the operation's receiveLock.
+ */
+typedef struct _WSMAN_RECEIVE_SLOT
+{
+    WSMAN_OPERATION_HANDLE operation;
+    MI_OperationCallbacks callbacks;
+    MI_Operation miOperation;
+    MI_Uint32 sequence;
+    MI_Boolean busy;
+    MI_Boolean issuing;             /* MI_Session_Invoke has not returned yet */
+    MI_Boolean closing;             /* Final result seen or slot idle, so it must not be cancelled */
+    MI_Boolean cancelAfterIssue;    /* Cancel was wanted while the request was being issued */
+    volatile ptrdiff_t cancelling;  /* Cancels in progress, the callback waits for them before closing */
+} WSMAN_RECEIVE_SLOT;
+
+/* A Receive response that has to wait for the responses to earlier requests, held in
+ * sequence order. A request can have more than one response if it has more results.
+ */
+typedef struct _WSMAN_RECEIVE_RESPONSE
+{
+    struct _WSMAN_RECEIVE_RESPONSE *next;
+    MI_Uint32 sequence;
+    MI_Boolean final;
+    MI_Result resultCode;
+    MI_Instance *result;
+    MI_Char *errorString;
+} WSMAN_RECEIVE_RESPONSE;
+
 struct WSMAN_OPERATION
 {
     WSMAN_OPERATION_TYPE type;
@@ -120,1222 +312,3536 @@ struct WSMAN_OPERATION
     MI_Operation miOperation;
     MI_OperationOptions miOptions;
     MI_Instance *operationProperties;
-};
+    MI_Instance *streamProperties; /* Borrowed by operationProperties so deleted along with it */
+    MI_Char *sendData; /* Encoded Send payload borrowed by streamProperties */
 
+    /* Pooled operations own their batch and keep miOptions between uses */
+    Batch batchStorage;
+    WSMAN_OPERATION_HANDLE nextFree;
 
-MI_EXPORT MI_Uint32 WINAPI WSManInitialize(
-    MI_Uint32 flags,
-    _Out_ WSMAN_API_HANDLE *apiHandle
-    )
-{
-    MI_Result miResult;
+    /* One for the caller's handle, dropped by WSManCloseOperation, and one while the Send
+     * request or Receive pipeline is still running. The operation is released with the last.
+     */
+    volatile ptrdiff_t refs;
 
-    _GetLogOptionsFromConfigFile(SHELL_LOGGING_FILE);
+    /* Receive pipeline, protected by receiveLock. Requests are numbered and issued in order
+     * by whichever thread owns receiveIssuing, and responses are handed to the caller in
+     * that same order by whichever thread owns receiveDelivering.
+     */
+    Lock receiveLock;
+    WSMAN_RECEIVE_SLOT *receiveSlots;
+    MI_Uint32 receiveDepth;
+    MI_Uint32 receiveBusy;
+    MI_Uint32 nextIssueSequence;
+    MI_Uint32 nextDeliverSequence;
+    WSMAN_RECEIVE_RESPONSE *receiveHeld;
+    WSMAN_RECEIVE_RESPONSE receiveOutOfMemory; /* Held in place of a response that could not be copied */
+    MI_Boolean receiveIssuing;
+    MI_Boolean receiveDelivering;
+    MI_Boolean receiveFinished;
+    MI_Boolean receiveReleased;     /* The pipeline has dropped its reference */
+
+    /* Caller owned buffer Receive decodes into, if WSManReceiveShellOutputEx was given one.
+     * On a compressed shell the base64 decoded data goes through receiveScratch first and
+     * both it and the decompression workspace are kept for the life of the operation.
+     */
+    WSMAN_RECEIVE_BUFFER receiveBuffer;
+    DecodeBuffer receiveScratch;
+    void *decompressWorkspace;
+};
 
-    LogFunctionStart("WSManInitialize");
+static void ReceiveCancelSlots(WSMAN_OPERATION_HANDLE operation);
+static MI_Boolean ReceiveReleaseIfDone(WSMAN_OPERATION_HANDLE operation);
+static void ShellOperationDereference(WSMAN_SHELL_HANDLE shell);
 
-    (*apiHandle) = calloc(1, sizeof(struct WSMAN_API));
-    if (*apiHandle == NULL)
-        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
 
-    miResult = MI_Application_InitializeV1(0, NULL, NULL, &(*apiHandle)->application);
-    if (miResult != MI_RESULT_OK)
+static MI_Result CreateShellOperationOptions(WSMAN_SHELL_HANDLE shell, const MI_Char *resourceUri, const MI_Char *action, MI_OperationOptions *options)
+{
+    if ((MI_Application_NewOperationOptions(&shell->session->api->application, MI_TRUE, options) != MI_RESULT_OK) ||
+        (MI_OperationOptions_SetResourceUri(options, resourceUri) != MI_RESULT_OK) ||
+        (MI_OperationOptions_SetNumber(options, "__MI_OPERATIONOPTIONS_ISSHELL", 1, 0) != MI_RESULT_OK) ||
+        (MI_OperationOptions_SetString(options, "__MI_OPERATIONOPTIONS_ACTION", action, 0) != MI_RESULT_OK))
     {
-        free(*apiHandle);
-        *apiHandle = NULL;
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
     }
-    LogFunctionEnd("WSManInitialize", miResult);
-    return miResult;
+    return MI_RESULT_OK;
 }
 
-
-MI_EXPORT MI_Uint32 WINAPI WSManDeinitialize(
-    _Inout_opt_ WSMAN_API_HANDLE apiHandle,
-    MI_Uint32 flags
-    )
+/* ShellCreateOperationTemplates
+ * Build the operation options shared by every Send and Receive on the shell. The resource URI
+ * is the one the server handed back on create, so this is called once that is known.
+ */
+static MI_Result ShellCreateOperationTemplates(WSMAN_SHELL_HANDLE shell, const MI_Char *resourceUri)
 {
-    LogFunctionStart("WSManDeinitialize");
-    if (apiHandle)
-    {
-        MI_Application_Close(&apiHandle->application);
-        free(apiHandle);
-    }
-    LogFunctionEnd("WSManDeinitialize", MI_RESULT_OK);
+    MI_Result miResult;
 
-    Log_Close();
-    return MI_RESULT_OK;
+    Lock_Init(&shell->operationPoolLock);
+    shell->operationRefs = 1;
+
+    miResult = CreateShellOperationOptions(shell, resourceUri, "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Send", &shell->sendOptions);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    return CreateShellOperationOptions(shell, resourceUri, "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Receive", &shell->receiveOptions);
 }
 
-MI_EXPORT MI_Uint32 WINAPI WSManGetErrorMessage(
-    _In_ WSMAN_API_HANDLE apiHandle,
-    MI_Uint32 flags,            // reserved for future use; must be 0
-    _In_opt_ const MI_Char16* languageCode,    // the RFC 3066 language code; it can be NULL
-    MI_Uint32 errorCode,        // error code for the requested error message
-    MI_Uint32 messageLength,    // message length, including NULL terminator
-    _Out_writes_to_opt_(messageLength, *messageLengthUsed) MI_Char16*  message,
-    _Out_ MI_Uint32* messageLengthUsed  // effective message length, including NULL terminator
-    )
+/* OperationAlloc
+ * Get a cleared operation object for the shell, reusing a finished one of the same type if
+ * there is one. Reused objects keep the options cloned from the shell template. The object
+ * starts with the reference for the caller's handle.
+ */
+static WSMAN_OPERATION_HANDLE OperationAlloc(WSMAN_SHELL_HANDLE shell, WSMAN_OPERATION_TYPE type)
 {
-    const char *resultString = Result_ToString(errorCode);
-    size_t resultStringLenth = Tcslen(resultString)+1; /* Includes null terminator */
-    MI_Result miResult = MI_RESULT_OK;
-    size_t tmpMessageLen;
-    char *errorMessage = NULL;
-    size_t iconv_return;
-    iconv_t iconvData;
+    WSMAN_OPERATION_HANDLE operation;
+    const MI_OperationOptions *templateOptions = (type == WSMAN_OPERATION_SEND) ? &shell->sendOptions : &shell->receiveOptions;
 
-    //MI_Char16 *convertedString;
-    //Utf8ToUtf16Le(batch, resultString, &convertedString);
-    __LOGD(("%s: START, errorCode=%u, messageLength=%u", "WSManGetErrorMessage", errorCode, messageLength));
-    if ((messageLength == 0) || (message == NULL))
+    Lock_Acquire(&shell->operationPoolLock);
+    operation = shell->operationPool[type];
+    if (operation)
     {
-        *messageLengthUsed = (MI_Uint32) resultStringLenth;
-        return ERROR_INSUFFICIENT_BUFFER;
+        shell->operationPool[type] = operation->nextFree;
+        shell->operationPoolCount[type]--;
     }
+    Lock_Release(&shell->operationPoolLock);
 
-    iconvData = iconv_open("UTF-16LE", "UTF-8" );
-    if (iconvData == (iconv_t)-1)
+    if (operation == NULL)
     {
-        GOTO_ERROR("Failed to convert stream", MI_RESULT_FAILED);
-    }
-
+        if (templateOptions->ft == NULL)
+            return NULL; /* Shell was never created */
 
-    tmpMessageLen = messageLength*2; /* Convert to bytes */
+        operation = calloc(1, sizeof(struct WSMAN_OPERATION));
+        if (operation == NULL)
+            return NULL;
 
-    iconv_return = iconv(iconvData,
-            (char**)&resultString, &resultStringLenth,
-            (char**)&message, &tmpMessageLen);
-    if (iconv_return == (size_t) -1)
-    {
-        iconv_close(iconvData);
-        GOTO_ERROR("Failed to convert stream", MI_RESULT_FAILED);
+        if (MI_OperationOptions_Clone(templateOptions, &operation->miOptions) != MI_RESULT_OK)
+        {
+            free(operation);
+            return NULL;
+        }
     }
 
-    iconv_close(iconvData);
-
+    operation->nextFree = NULL;
+    operation->type = type;
+    operation->shell = shell;
+    operation->refs = 1;
+    Batch_Init(&operation->batchStorage, BATCH_MAX_PAGES);
+    operation->batch = &operation->batchStorage;
+    Atomic_Inc(&shell->operationRefs);
 
-    *messageLengthUsed = messageLength - (tmpMessageLen / 2);
-
-error:
-    LogFunctionEnd("WSManGetErrorMessage", miResult);
-    return miResult;
+    return operation;
 }
 
-MI_EXPORT MI_Uint32 WINAPI WSManCreateSession(
-    _In_ WSMAN_API_HANDLE apiHandle,
-    _In_opt_ const MI_Char16* _connection,         // if NULL, then connection will default to localhost
-    MI_Uint32 flags,
-    _In_opt_ WSMAN_AUTHENTICATION_CREDENTIALS *serverAuthenticationCredentials,
-    _In_opt_ WSMAN_PROXY_INFO *proxyInfo,
-    _Out_ WSMAN_SESSION_HANDLE *session
-    )
+/* ReceiveResponseDelete
+ * Free a held response and the copies it owns.
+ */
+static void ReceiveResponseDelete(WSMAN_OPERATION_HANDLE operation, WSMAN_RECEIVE_RESPONSE *response)
 {
-    MI_Result miResult;
-    char *errorMessage = NULL;
-    Batch *batch = NULL;
-    char *connection = NULL;
-    char *portNumber = NULL;
-    char *httpUrl = NULL;
-    char *username = NULL;
-    char *password = NULL;
-    MI_UserCredentials userCredentials;
-
-    LogFunctionStart("WSManCreateSession");
-    *session = NULL;
+    if (response == &operation->receiveOutOfMemory)
+        return;
 
-    if (serverAuthenticationCredentials == NULL)
-    {
-        GOTO_ERROR("No authentication credentials given", MI_RESULT_ACCESS_DENIED);
-    }
-    if (proxyInfo)
+    if (response->result)
     {
-        GOTO_ERROR("Don't support proxy information", MI_RESULT_INVALID_PARAMETER);
+        MI_Instance_Delete(response->result);
     }
+    free(response->errorString);
+    free(response);
+}
 
-    switch (serverAuthenticationCredentials->authenticationMechanism)
-    {
-        case WSMAN_FLAG_AUTH_BASIC:
-            userCredentials.authenticationType = MI_AUTH_TYPE_BASIC;
-            break;
-        case WSMAN_FLAG_AUTH_NEGOTIATE:
-            userCredentials.authenticationType = MI_AUTH_TYPE_NEGO_WITH_CREDS;
-            break;
-        case WSMAN_FLAG_AUTH_KERBEROS:
-            userCredentials.authenticationType = MI_AUTH_TYPE_KERBEROS;
-            break;
-        default:
-            GOTO_ERROR("Unsupported authentication type", MI_RESULT_ACCESS_DENIED);
-            break;
-
-    }
+/* OperationRelease
+ * Free everything the operation picked up while it ran and hand it back to the shell's pool.
+ * Only called once nothing refers to the operation any more, see OperationDereference.
+ */
+static void OperationRelease(WSMAN_OPERATION_HANDLE operation)
+{
+    WSMAN_SHELL_HANDLE shell = operation->shell;
+    WSMAN_OPERATION_TYPE type = operation->type;
+    MI_OperationOptions miOptions = operation->miOptions;
+    MI_Boolean pooled = MI_FALSE;
 
-    batch = Batch_New(BATCH_MAX_PAGES);
-    if (batch == NULL)
+    if (operation->operationProperties)
     {
-        GOTO_ERROR("Out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        MI_Instance_Delete(operation->operationProperties);
     }
-
-    (*session) = Batch_GetClear(batch, sizeof(struct WSMAN_SESSION));
-    if (*session == NULL)
+    if (operation->streamProperties)
     {
-        GOTO_ERROR("Out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        MI_Instance_Delete(operation->streamProperties);
     }
-    (*session)->batch = batch;
-
-    miResult = MI_Application_NewDestinationOptions(&apiHandle->application, &(*session)->destinationOptions);
-    if (miResult != MI_RESULT_OK)
+    while (operation->receiveHeld)
     {
-        GOTO_ERROR("Destination options creation failed", miResult);
+        WSMAN_RECEIVE_RESPONSE *response = operation->receiveHeld;
+        operation->receiveHeld = response->next;
+        ReceiveResponseDelete(operation, response);
     }
+    free(operation->sendData);
+    free(operation->receiveScratch.buffer);
+    free(operation->decompressWorkspace);
+    Batch_Destroy(&operation->batchStorage);
 
-    /* powershell uses HTTP unless otherwise stated */
-    miResult = MI_DestinationOptions_SetTransport(&(*session)->destinationOptions, MI_DESTINATIONOPTIONS_TRANSPORT_HTTP);
-    if (miResult != MI_RESULT_OK)
-    {
-        GOTO_ERROR("Failed to default http transport", miResult);
-    }
-    /* Packet privacy over HTTP by default unless otherwise stated */
-    miResult = MI_DestinationOptions_SetPacketPrivacy(&(*session)->destinationOptions, MI_TRUE);
-    if (miResult != MI_RESULT_OK)
-    {
-        GOTO_ERROR("Failed to set packet privacy", miResult);
-    }
+    memset(operation, 0, sizeof(*operation));
+    operation->miOptions = miOptions;
 
-    if (_connection && !Utf16LeToUtf8(batch, _connection, &connection))
-    {
-        GOTO_ERROR("Failed to convert connection name", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-    }
-    else if (_connection == NULL)
+    Lock_Acquire(&shell->operationPoolLock);
+    if (shell->operationPoolCount[type] < WSMAN_OPERATION_POOL_MAX)
     {
-        connection = "localhost";
+        operation->nextFree = shell->operationPool[type];
+        shell->operationPool[type] = operation;
+        shell->operationPoolCount[type]++;
+        pooled = MI_TRUE;
     }
+    Lock_Release(&shell->operationPoolLock);
 
-    /* Full format may be:
-     *      <transport>://<computerName>:<port><httpUrl>
-     * where:
-     *      <transport>:// = http:// or https://, if <transport>:// is missing it defaults
-     *      :<port> = port to use based on transport specified, if missing uses defaults
-     *      <httpUrl> = http URL to post to, if missing defaults to /wsman/
-     *
-     * For now, assume there is a http url at the end copy if off and remove so we just have the machine name in the connection string
-     *
-     */
-    if (strncmp(connection, "http://", 7) == 0)
+    if (!pooled)
     {
-        miResult = MI_DestinationOptions_SetTransport(&(*session)->destinationOptions, MI_DESTINATIONOPTIONS_TRANSPORT_HTTP);
-        if (miResult != MI_RESULT_OK)
+        if (operation->miOptions.ft)
         {
-            GOTO_ERROR("Failed to set transport to http", miResult);
-        }
-        /* If http:// connection string is used we need to default to port 80, rather than default wsman http port */
-        miResult = MI_DestinationOptions_SetDestinationPort(&(*session)->destinationOptions, 80);
-        if (miResult != MI_RESULT_OK)
-        {
-            GOTO_ERROR("Failed to set transport to http", miResult);
+            MI_OperationOptions_Delete(&operation->miOptions);
         }
-        connection += 7;
-     }
-    else if (strncmp(connection, "https://", 8) == 0)
+        free(operation);
+    }
+
+    ShellOperationDereference(shell);
+}
+
+/* OperationDereference
+ * Drop one reference to a Send, Receive or Signal operation and free it with the last one,
+ * which is never before the caller has closed its handle.
+ */
+static void OperationDereference(WSMAN_OPERATION_HANDLE operation)
+{
+    if (Atomic_Dec(&operation->refs) != 0)
+        return;
+
+    if (operation->type == WSMAN_OPERATION_SIGNAL)
     {
-        miResult = MI_DestinationOptions_SetTransport(&(*session)->destinationOptions, MI_DESTINATIONOPTIONS_TRANSPORT_HTTPS);
-        if (miResult != MI_RESULT_OK)
+        /* Not pooled, everything lives in its own batch */
+        if (operation->miOptions.ft)
         {
-            GOTO_ERROR("Failed to set transport to https", miResult);
+            MI_OperationOptions_Delete(&operation->miOptions);
         }
-        /* If https:// connection string is used we need to default to port 443, rather than default wsman https port */
-        miResult = MI_DestinationOptions_SetDestinationPort(&(*session)->destinationOptions, 443);
-        if (miResult != MI_RESULT_OK)
+        if (operation->operationProperties)
         {
-            GOTO_ERROR("Failed to set transport to http", miResult);
+            MI_Instance_Delete(operation->operationProperties);
         }
-        connection += 8;
+        Batch_Delete(operation->batch);
     }
     else
     {
-        /* Assume no prefix and starts with computer name */
+        OperationRelease(operation);
     }
+}
 
-    (*session)->hostname = connection;
-
-    portNumber = strchr(connection, ':');
-    httpUrl = strchr(connection, '/');
+/* ShellDeleteOperationTemplates
+ * Release the templates and every pooled operation once the shell has closed and no
+ * operation is left out of the pool.
+ */
+static void ShellDeleteOperationTemplates(WSMAN_SHELL_HANDLE shell)
+{
+    MI_Uint32 type;
 
-    if (httpUrl == NULL)
-        httpUrl = "/wsman/";
-    else
+    for (type = 0; type != MI_COUNT(shell->operationPool); type++)
     {
-        /* Need to copy because we need the initial slash, but need to terminate the hostname at that location. */
-        char *tmp = Batch_Tcsdup(batch, httpUrl);
-        if (tmp == NULL)
+        while (shell->operationPool[type])
         {
-            GOTO_ERROR("Failed to convert connection name", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            WSMAN_OPERATION_HANDLE operation = shell->operationPool[type];
+            shell->operationPool[type] = operation->nextFree;
+            if (operation->miOptions.ft)
+            {
+                MI_OperationOptions_Delete(&operation->miOptions);
+            }
+            free(operation);
         }
-        *httpUrl = '\0'; /* terminate hostname or port number string properly */
-        httpUrl = tmp;
+        shell->operationPoolCount[type] = 0;
     }
-    miResult = MI_DestinationOptions_SetHttpUrlPrefix(&(*session)->destinationOptions, httpUrl);
-    if (miResult != MI_RESULT_OK)
+    if (shell->sendOptions.ft)
     {
-        GOTO_ERROR("Failed to add http prefix to destination options", miResult);
+        MI_OperationOptions_Delete(&shell->sendOptions);
     }
-
-
-    if ((portNumber && !httpUrl) || (portNumber && httpUrl && portNumber < httpUrl))
+    if (shell->receiveOptions.ft)
     {
-        MI_Uint32 portNumberValue = 0;
-        *portNumber = '\0'; /* null terminate hostname in correct place */
-        portNumber ++;  /* move past : */
-        if (StrToUint32(portNumber, &portNumberValue) != 0)
-        {
-            GOTO_ERROR("Failed to parse port number in connection uri", MI_RESULT_INVALID_PARAMETER);
-        }
-        miResult = MI_DestinationOptions_SetDestinationPort(&(*session)->destinationOptions, portNumberValue);
-        if (miResult != MI_RESULT_OK)
+        MI_OperationOptions_Delete(&shell->receiveOptions);
+    }
+    for (type = 0; type != MI_COUNT(shell->controlOptions); type++)
+    {
+        if (shell->controlOptions[type].ft)
         {
-            GOTO_ERROR("Failed to set transport to http", miResult);
+            MI_OperationOptions_Delete(&shell->controlOptions[type]);
         }
     }
+}
 
-    if (serverAuthenticationCredentials->userAccount.username && !Utf16LeToUtf8(batch, serverAuthenticationCredentials->userAccount.username, &username))
+/* ShellOperationDereference
+ * Drop one of the shell's operation references. The last one frees the pool and templates.
+ */
+static void ShellOperationDereference(WSMAN_SHELL_HANDLE shell)
+{
+    if (Atomic_Dec(&shell->operationRefs) == 0)
     {
-        GOTO_ERROR("Username missing or failed to convert", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        ShellDeleteOperationTemplates(shell);
     }
+}
 
-    if (serverAuthenticationCredentials->userAccount.password && !Utf16LeToUtf8(batch, serverAuthenticationCredentials->userAccount.password, &password))
-    {
-        GOTO_ERROR("password missing or failed to convert", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-    }
+static void CancellableIssuing(WSMAN_CANCELLABLE *request)
+{
+    Lock_Acquire(&request->lock);
+    request->inFlight = MI_TRUE;
+    request->issuing = MI_TRUE;
+    request->cancelled = MI_FALSE;
+    Lock_Release(&request->lock);
+}
 
-    userCredentials.credentials.usernamePassword.domain = NULL; /* Assume for now no domain. At some point we may need to split username */
-    userCredentials.credentials.usernamePassword.username = username;
-    userCredentials.credentials.usernamePassword.password = password;
+/* CancellableCancelNow
+ * The caller has counted itself in request->cancelling, which keeps the callback from
+ * closing the operation until this is done.
+ */
+static void CancellableCancelNow(WSMAN_CANCELLABLE *request, MI_Operation *miOperation)
+{
+    MI_Operation_Cancel(miOperation, MI_REASON_NONE);
+    Atomic_Dec(&request->cancelling);
+    CondLock_Broadcast((ptrdiff_t) &request->cancelling);
+}
 
-    if (MI_DestinationOptions_SetMaxEnvelopeSize(&(*session)->destinationOptions, 500))
+/* CancellableIssued
+ * The MI_Session call sending the request has returned, pass on a cancel that came meanwhile.
+ */
+static void CancellableIssued(WSMAN_CANCELLABLE *request, MI_Operation *miOperation)
+{
+    MI_Boolean cancel;
+
+    Lock_Acquire(&request->lock);
+    request->issuing = MI_FALSE;
+    cancel = request->inFlight && request->cancelled;
+    if (cancel)
+        Atomic_Inc(&request->cancelling);
+    Lock_Release(&request->lock);
+
+    if (cancel)
+        CancellableCancelNow(request, miOperation);
+}
+
+/* CancellableCancel
+ * Cancel the request if it is still in flight. Only the first cancel does anything.
+ */
+static void CancellableCancel(WSMAN_CANCELLABLE *request, MI_Operation *miOperation)
+{
+    MI_Boolean cancel;
+
+    Lock_Acquire(&request->lock);
+    cancel = request->inFlight && !request->cancelled && !request->issuing;
+    if (request->inFlight)
+        request->cancelled = MI_TRUE;
+    if (cancel)
+        Atomic_Inc(&request->cancelling);
+    Lock_Release(&request->lock);
+
+    if (cancel)
+        CancellableCancelNow(request, miOperation);
+}
+
+/* CancellableFinished
+ * Called by the request's callback with the final result, before it closes the operation.
+ * Returns whether the request was cancelled once no cancel is still running.
+ */
+static MI_Boolean CancellableFinished(WSMAN_CANCELLABLE *request)
+{
+    MI_Boolean cancelled;
+    ptrdiff_t cancelling;
+
+    Lock_Acquire(&request->lock);
+    request->inFlight = MI_FALSE;
+    cancelled = request->cancelled;
+    Lock_Release(&request->lock);
+
+    while ((cancelling = Atomic_Read(&request->cancelling)) != 0)
     {
-        GOTO_ERROR("Failed to add credentials to destination options", miResult);
+        CondLock_Wait((ptrdiff_t) &request->cancelling, &request->cancelling, cancelling, CONDLOCK_DEFAULT_SPINCOUNT);
     }
+    return cancelled;
+}
 
-    miResult = MI_DestinationOptions_AddDestinationCredentials(&(*session)->destinationOptions, &userCredentials);
-    if (miResult != MI_RESULT_OK)
+/* ShellControlOptions
+ * Options for one of the shell's Disconnect, Reconnect or Connect calls, built the first
+ * time it is made and reused after that.
+ */
+static MI_Result ShellControlOptions(WSMAN_SHELL_HANDLE shell, WSMAN_SHELL_CONTROL control, MI_OperationOptions **options)
+{
+    if (shell->controlOptions[control].ft == NULL)
     {
-        GOTO_ERROR("Failed to add credentials to destination options", miResult);
-    }
-    (*session)->api = apiHandle;
+        MI_Value value;
+        MI_Type type;
+        MI_Result miResult;
 
-    LogFunctionEnd("WSManCreateSession", miResult);
-    return miResult;
+        if ((__MI_Instance_GetElement(&shell->shellInstance->__instance, "ResourceUri", &value, &type, NULL, NULL) != MI_RESULT_OK) ||
+                (type != MI_STRING) ||
+                (value.string == NULL))
+        {
+            return MI_RESULT_FAILED;
+        }
 
-error:
-    if (batch)
-        Batch_Delete(batch);
+        miResult = CreateShellOperationOptions(shell, value.string, _shellControlActions[control], &shell->controlOptions[control]);
+        if (miResult != MI_RESULT_OK)
+        {
+            if (shell->controlOptions[control].ft)
+            {
+                MI_OperationOptions_Delete(&shell->controlOptions[control]);
+            }
+            memset(&shell->controlOptions[control], 0, sizeof(shell->controlOptions[control]));
+            return miResult;
+        }
+    }
 
-    *session = NULL;
+    *options = &shell->controlOptions[control];
+    return MI_RESULT_OK;
+}
 
-    LogFunctionEnd("WSManCreateSession", miResult);
-    return miResult;
+/* Monotonic time in microseconds */
+static MI_Uint64 ClientNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((MI_Uint64) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
 }
 
-MI_EXPORT MI_Uint32 WINAPI WSManCloseSession(
-    _Inout_opt_ WSMAN_SESSION_HANDLE session,
-    MI_Uint32 flags)
+/* SecretWipe
+ * Clear memory that held a password. The stores go through a volatile pointer so the compiler
+ * cannot drop them as dead, which it may do to a memset of memory about to be freed.
+ */
+static void SecretWipe(void *secret, size_t length)
 {
-    MI_Result miResult = MI_RESULT_OK;
+    volatile unsigned char *bytes = (volatile unsigned char *) secret;
 
-    LogFunctionStart("WSManCloseSession");
-    if (session->destinationOptions.ft)
-        MI_DestinationOptions_Delete(&session->destinationOptions);
+    while (length--)
+        *bytes++ = 0;
+}
 
-    Batch_Delete(session->batch);
+/* SecretEquals
+ * Compare two passwords in a time that depends only on their lengths, not on where they differ.
+ */
+static MI_Boolean SecretEquals(const char *left, const char *right)
+{
+    size_t leftLength = strlen(left);
+    size_t rightLength = strlen(right);
+    size_t length = (leftLength > rightLength) ? leftLength : rightLength;
+    unsigned char difference = (leftLength != rightLength);
+    size_t index;
 
-    LogFunctionEnd("WSManCloseSession", miResult);
-    return miResult;
+    for (index = 0; index != length; index++)
+    {
+        unsigned char leftByte = (index < leftLength) ? (unsigned char) left[index] : 0;
+        unsigned char rightByte = (index < rightLength) ? (unsigned char) right[index] : 0;
+        difference |= leftByte ^ rightByte;
+    }
+    return difference == 0;
 }
 
-MI_EXPORT MI_Uint32 WINAPI WSManSetSessionOption(
-    _In_ WSMAN_SESSION_HANDLE session,
-    WSManSessionOption option,
-    _In_ WSMAN_DATA *data)
+static MI_Result SessionKeyBuild(WSMAN_SESSION_HANDLE session, Batch *batch, WSMAN_SESSION_KEY *key)
 {
-    MI_Result miResult;
-    char *errorMessage = NULL;
+    const char *uiLocale = session->uiLocale ? session->uiLocale : "";
+    const char *dataLocale = session->dataLocale ? session->dataLocale : "";
+    size_t length;
 
-    LogFunctionStart("WSManSetSessionOption");
-    switch (option)
+    length = strlen(session->hostname) + strlen(session->httpUrl) + 32;
+    key->destination = Batch_Get(batch, length);
+    if (key->destination == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    snprintf(key->destination, length, "%s://%s:%u%s", session->useSsl ? "https" : "http", session->hostname, session->port, session->httpUrl);
+
+    length = strlen(uiLocale) + strlen(dataLocale) + 48;
+    key->settings = Batch_Get(batch, length);
+    if (key->settings == NULL)
     {
-        case WSMAN_OPTION_USE_SSL:
-            __LOGD(("WSMAN_OPTION_USE_SSL"));
-            if (data->type != WSMAN_DATA_TYPE_DWORD)
-                GOTO_ERROR("SSL option should be DWORD", MI_RESULT_INVALID_PARAMETER);
-            if (data->number == 0)
-            {
-                miResult = MI_DestinationOptions_SetTransport(&session->destinationOptions, MI_DESTINATIONOPTIONS_TRANSPORT_HTTP);
-            }
-            else
-            {
-                miResult = MI_DestinationOptions_SetTransport(&session->destinationOptions, MI_DESTINATIONOPTIONS_TRANSPORT_HTTPS);
-            }
-            break;
+        key->destination = NULL;
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    }
+    snprintf(key->settings, length, "%u|%u|%u|%s|%s", session->packetPrivacy, session->maxEnvelopeSize, session->timeoutMs, uiLocale, dataLocale);
 
-        case WSMAN_OPTION_UI_LANGUAGE:
-        {
-            /* String, convert utf16->utf8, locale */
-            MI_Char *tmpStr;
-            __LOGD(("WSMAN_OPTION_UI_LANGUAGE"));
-            if ((data->type != WSMAN_DATA_TYPE_TEXT) ||
-                    data->text.buffer == NULL)
-            {
-                GOTO_ERROR("UI language option is wrong type or NULL", MI_RESULT_INVALID_PARAMETER);
-            }
-            if (!Utf16LeToUtf8(session->batch, data->text.buffer, &tmpStr))
-                GOTO_ERROR("Failed to convert UI language", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-            if (MI_DestinationOptions_SetUILocale(&session->destinationOptions, tmpStr) != MI_RESULT_OK)
-            {
-                GOTO_ERROR("Failed to set UI language option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-            }
-            miResult = MI_RESULT_OK;
-            break;
-        }
-        case WSMAN_OPTION_LOCALE:
+    key->authenticationMechanism = session->authenticationMechanism;
+    key->username = Batch_Tcsdup(batch, session->username ? session->username : "");
+    key->password = Batch_Tcsdup(batch, session->password ? session->password : "");
+    if ((key->username == NULL) || (key->password == NULL))
+    {
+        key->destination = NULL;
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    }
+    return MI_RESULT_OK;
+}
+
+static MI_Boolean SessionKeyMatch(const WSMAN_SESSION_KEY *left, const WSMAN_SESSION_KEY *right)
+{
+    return (left->authenticationMechanism == right->authenticationMechanism) &&
+           (strcmp(left->destination, right->destination) == 0) &&
+           (strcmp(left->settings, right->settings) == 0) &&
+           (strcmp(left->username, right->username) == 0) &&
+           SecretEquals(left->password, right->password);
+}
+
+/* SessionPoolFree
+ * Free an entry that has been unlinked from the pool, clearing the password it holds first.
+ */
+static void SessionPoolFree(WSMAN_POOLED_SESSION *entry)
+{
+    SecretWipe(entry->key.password, strlen(entry->key.password));
+    free(entry);
+}
+
+/* SessionPoolUnlinkExpired
+ * Move the sessions that have been idle too long from the pool onto expired. Called with
+ * sessionPoolLock held, the caller closes them once it has let go of it.
+ */
+static void SessionPoolUnlinkExpired(WSMAN_API_HANDLE api, MI_Uint64 now, WSMAN_POOLED_SESSION **expired)
+{
+    WSMAN_POOLED_SESSION **link = &api->sessionPool;
+    WSMAN_POOLED_SESSION *entry;
+
+    while ((entry = *link) != NULL)
+    {
+        if ((now - entry->idleSince) >= api->sessionPoolMaxIdle)
         {
-            /* String, convert utf16->utf8, locale */
-            MI_Char *tmpStr;
-            __LOGD(("WSMAN_OPTION_LOCALE"));
-            if ((data->type != WSMAN_DATA_TYPE_TEXT) ||
-                    data->text.buffer == NULL)
-            {
-                GOTO_ERROR("Data locale option is wrong type or NULL", MI_RESULT_INVALID_PARAMETER);
-            }
-            if (!Utf16LeToUtf8(session->batch, data->text.buffer, &tmpStr))
-                GOTO_ERROR("Failed to convert Data locale", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-            if (MI_DestinationOptions_SetDataLocale(&session->destinationOptions, tmpStr) != MI_RESULT_OK)
-            {
-                GOTO_ERROR("Failed to set Data locale option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-            }
-            miResult = MI_RESULT_OK;
-            break;
+            *link = entry->next;
+            entry->next = *expired;
+            *expired = entry;
+            api->sessionPoolStatistics.expired++;
+            api->sessionPoolStatistics.idleSessions--;
         }
-        case WSMAN_OPTION_DEFAULT_OPERATION_TIMEOUTMS:
+        else
         {
-            MI_Uint64 microsec = data->number * 1000;
-            MI_Datetime datetime;
-            __LOGD(("WSMAN_OPTION_DEFAULT_OPERATION_TIMEOUTMS=%u",data->number));
-            UsecToDatetime(microsec, &datetime);
-            MI_DestinationOptions_SetTimeout(&session->destinationOptions, &datetime.u.interval);
-            /* dword, operation timeout when not the others */
-            miResult = MI_RESULT_OK;
-            break;
+            link = &entry->next;
         }
-        case WSMAN_OPTION_TIMEOUTMS_CREATE_SHELL:
-            __LOGD(("WSMAN_OPTION_TIMEOUTMS_CREATE_SHELL=%u (not implemented yet)", data->number));
-            /* dword */
-            miResult = MI_RESULT_OK;
-            break;
-        case WSMAN_OPTION_TIMEOUTMS_CLOSE_SHELL:
-            __LOGD(("WSMAN_OPTION_TIMEOUTMS_CLOSE_SHELL=%u (not implemented yet)", data->number));
-            /* dword */
-            miResult = MI_RESULT_OK;
-            break;
-        case WSMAN_OPTION_TIMEOUTMS_SIGNAL_SHELL:
-            __LOGD(("WSMAN_OPTION_TIMEOUTMS_SIGNAL_SHELL=%u (not implemented yet)", data->number));
-            /* dword */
-            miResult = MI_RESULT_OK;
-            break;
-        case WSMAN_OPTION_SHELL_MAX_DATA_SIZE_PER_MESSAGE_KB:
-            __LOGD(("WSMAN_OPTION_SHELL_MAX_DATA_SIZE_PER_MESSAGE_KB=%u", data->number));
-            /* dword */
-            if ((data->type != WSMAN_DATA_TYPE_DWORD) ||
-               (MI_DestinationOptions_SetMaxEnvelopeSize(&session->destinationOptions, data->number) != MI_RESULT_OK))
-            {
-                GOTO_ERROR("Failed to add credentials to destination options", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-            }
-            miResult = MI_RESULT_OK;
-            break;
-        case WSMAN_OPTION_UNENCRYPTED_MESSAGES:
-            __LOGD(("WSMAN_OPTION_UNENCRYPTED_MESSAGES=%u", data->number));
-            /* dword */
-            if (data->type == WSMAN_DATA_TYPE_DWORD)
-            {
-                if (data->number)
-                {
-                    if (MI_DestinationOptions_SetPacketPrivacy(&session->destinationOptions, MI_FALSE) != MI_RESULT_OK)
-                    {
-                        GOTO_ERROR("Failed to turn packet privacy off", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-                    }
-                }
-                else
-                {
-                    if (MI_DestinationOptions_SetPacketPrivacy(&session->destinationOptions, MI_TRUE) != MI_RESULT_OK)
-                    {
-                        GOTO_ERROR("Failed to turn packet privacy on", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-                    }
-                }
-            }
-            else
-            {
-                GOTO_ERROR("Failed to set packet privacy, invalid parameter", MI_RESULT_INVALID_PARAMETER);
-            }
-            miResult = MI_RESULT_OK;
-            break;
-        default:
-            __LOGD(("ignored option %u", option));
-            miResult = MI_RESULT_OK;    /* Assume we can ignore it */
     }
+}
 
-error:
-    LogFunctionEnd("WSManSetSessionOption", miResult);
-    return miResult;
+static void SessionPoolClose(WSMAN_POOLED_SESSION *entry, MI_Boolean wait)
+{
+    while (entry)
+    {
+        WSMAN_POOLED_SESSION *next = entry->next;
+        __LOGD(("Closing pooled session to %s", entry->key.destination));
+        MI_Session_Close(&entry->miSession, NULL, wait ? NULL : CloseSessionComplete);
+        SessionPoolFree(entry);
+        entry = next;
+    }
 }
 
-MI_EXPORT MI_Uint32 WINAPI WSManGetSessionOptionAsDword(
-    _In_ WSMAN_SESSION_HANDLE session, /* NOTE: This may be an application handle */
-    WSManSessionOption option,
-    _Inout_ MI_Uint32 *value)
+/* SessionPoolTake
+ * Hand out an idle session opened with the same key, if there is one.
+ */
+static MI_Boolean SessionPoolTake(WSMAN_API_HANDLE api, const WSMAN_SESSION_KEY *key, MI_Session *miSession)
 {
-    MI_Uint32 miResult = MI_RESULT_OK;
+    WSMAN_POOLED_SESSION **link;
+    WSMAN_POOLED_SESSION *entry;
+    WSMAN_POOLED_SESSION *expired = NULL;
 
-    LogFunctionStart("WSManGetSessionOptionAsDword");
-    switch (option)
+    Lock_Acquire(&api->sessionPoolLock);
+    SessionPoolUnlinkExpired(api, ClientNow(), &expired);
+    api->sessionPoolStatistics.requests++;
+    for (link = &api->sessionPool; (entry = *link) != NULL; link = &entry->next)
     {
-        case WSMAN_OPTION_SHELL_MAX_DATA_SIZE_PER_MESSAGE_KB:
-            *value = 500; /* TODO: Proper value? */
-            __LOGD(("WSMAN_OPTION_SHELL_MAX_DATA_SIZE_PER_MESSAGE_KB returning 500"));
+        if (SessionKeyMatch(&entry->key, key))
+        {
+            *link = entry->next;
+            api->sessionPoolStatistics.idleSessions--;
+            api->sessionPoolStatistics.hits++;
             break;
+        }
+    }
+    Lock_Release(&api->sessionPoolLock);
 
-        case WSMAN_OPTION_MAX_RETRY_TIME:
-            *value = 60; /* TODO: Proper value? */
-            __LOGD(("WSMAN_OPTION_SHELL_MAX_DATA_SIZE_PER_MESSAGE_KB returning 60"));
-            break;
+    SessionPoolClose(expired, MI_FALSE);
 
-        default:
-            miResult = MI_RESULT_NOT_SUPPORTED;
-            __LOGD(("unknown option %u", option));
-    }
-    LogFunctionEnd("WSManGetSessionOptionAsDword", miResult);
-    return miResult;
+    if (entry == NULL)
+        return MI_FALSE;
+
+    *miSession = entry->miSession;
+    SessionPoolFree(entry);
+    return MI_TRUE;
 }
 
-MI_EXPORT MI_Uint32 WINAPI WSManGetSessionOptionAsString(
-    _In_ WSMAN_SESSION_HANDLE session,
-    WSManSessionOption option,
-    MI_Uint32 stringLength,
-    _Out_writes_to_opt_(stringLength, *stringLengthUsed) MI_Char16* string,
-    _Out_ MI_Uint32* stringLengthUsed)
+/* SessionPoolReturn
+ * Keep a session the shell has finished with for the next shell with the same key, or close
+ * it if pooling is off or its destination already has as many idle sessions as it may keep.
+ */
+static void SessionPoolReturn(WSMAN_API_HANDLE api, const WSMAN_SESSION_KEY *key, MI_Session *miSession)
 {
-    MI_Uint32 miResult = MI_RESULT_OK;
+    WSMAN_POOLED_SESSION *entry = NULL;
+    WSMAN_POOLED_SESSION *expired = NULL;
 
-    LogFunctionStart("WSManGetSessionOptionAsString");
-    switch (option)
+    if (api->sessionPoolMaxPerHost && key->destination)
     {
-        case WSMAN_OPTION_REDIRECT_LOCATION:
+        size_t destinationLength = strlen(key->destination) + 1;
+        size_t settingsLength = strlen(key->settings) + 1;
+        size_t usernameLength = strlen(key->username) + 1;
+        size_t passwordLength = strlen(key->password) + 1;
+
+        entry = malloc(sizeof(WSMAN_POOLED_SESSION) + destinationLength + settingsLength + usernameLength + passwordLength);
+        if (entry)
         {
-            if ((string == NULL) && (session->redirectLocation) && (stringLengthUsed))
-            {
-                *stringLengthUsed = Tcslen(session->redirectLocation) + 1;
-                __LOGD(("Redirect location: returning string length of %u", *stringLengthUsed));
-                miResult = ERROR_INSUFFICIENT_BUFFER;
-            }
-            else if (string && stringLengthUsed && (session->redirectLocation) && (stringLength > Tcslen(session->redirectLocation)))
-            {
-                size_t iconv_return;
-                iconv_t iconvData;
-                size_t tmpToStringLen;
-                size_t tmpFromStringLen;
-                char *tmpFromString = session->redirectLocation;
-                char *tmpToString = (char *)string;
+            entry->key = *key;
+            entry->key.destination = (char *) (entry + 1);
+            memcpy(entry->key.destination, key->destination, destinationLength);
+            entry->key.settings = entry->key.destination + destinationLength;
+            memcpy(entry->key.settings, key->settings, settingsLength);
+            entry->key.username = entry->key.settings + settingsLength;
+            memcpy(entry->key.username, key->username, usernameLength);
+            entry->key.password = entry->key.username + usernameLength;
+            memcpy(entry->key.password, key->password, passwordLength);
+        }
+    }
+    if (entry)
+    {
+        WSMAN_POOLED_SESSION *idle;
+        MI_Uint32 count = 0;
 
-                iconvData = iconv_open("UTF-16LE", "UTF-8" );
-                if (iconvData == (iconv_t)-1)
-                {
-                    miResult = MI_RESULT_FAILED;
-                }
-                else
-                {
-                    tmpFromStringLen = (Tcslen(session->redirectLocation) + 1);
-                    tmpToStringLen = stringLength * 2;
+        entry->miSession = *miSession;
+        entry->idleSince = ClientNow();
 
-                    iconv_return = iconv(iconvData,
-                            &tmpFromString, &tmpFromStringLen,
-                            &tmpToString, &tmpToStringLen);
-                    if (iconv_return == (size_t) -1)
-                    {
-                        miResult = MI_RESULT_FAILED;
-                    }
-                    else
-                    {
-                        *stringLengthUsed = (MI_Uint32) Tcslen(session->redirectLocation) + 1;
-                        __LOGE(("Redirect location: returning location: %s (length %u)",session->redirectLocation,  Tcslen(session->redirectLocation) + 1));
-                    }
+        Lock_Acquire(&api->sessionPoolLock);
+        SessionPoolUnlinkExpired(api, entry->idleSince, &expired);
+        for (idle = api->sessionPool; idle; idle = idle->next)
+        {
+            if (strcmp(idle->key.destination, key->destination) == 0)
+                count++;
+        }
+        if (count < api->sessionPoolMaxPerHost)
+        {
+            entry->next = api->sessionPool;
+            api->sessionPool = entry;
+            api->sessionPoolStatistics.idleSessions++;
+            entry = NULL;
+        }
+        Lock_Release(&api->sessionPoolLock);
 
-                    iconv_close(iconvData);
-                }
-            }
-            else
-            {
-                /* invalid parameter */
-                miResult = MI_RESULT_INVALID_PARAMETER;
-                __LOGE(("Redirect location: Parameters not correct for retrieving string"));
-            }
-            break;
+        SessionPoolClose(expired, MI_FALSE);
+
+        if (entry == NULL)
+        {
+            __LOGD(("Pooled session to %s", key->destination));
+            return;
         }
-        default:
-            miResult = MI_RESULT_NOT_SUPPORTED;
-            __LOGD(("unknown option %u", option));
+        __LOGD(("Session pool for %s is full", key->destination));
+        SessionPoolFree(entry);
     }
-    LogFunctionEnd("WSManGetSessionOptionAsString", miResult);
-    return miResult;
+
+    MI_Session_Close(miSession, NULL, CloseSessionComplete);
 }
-MI_EXPORT MI_Uint32 WINAPI WSManCloseOperation(
-    _Inout_opt_ WSMAN_OPERATION_HANDLE operationHandle,
-    MI_Uint32 flags)
+
+/* ShellOpenSession
+ * Session for a new shell to talk to the server with, reusing an idle one if it can.
+ */
+static MI_Result ShellOpenSession(WSMAN_SHELL_HANDLE shell)
 {
-    LogFunctionStart("WSManCloseOperation");
-    if (operationHandle->type == WSMAN_OPERATION_RECEIVE && operationHandle->miOperation.ft)
+    WSMAN_SESSION_HANDLE session = shell->session;
+
+    if (session->api->sessionPoolMaxPerHost &&
+        (SessionKeyBuild(session, shell->batch, &shell->sessionKey) == MI_RESULT_OK) &&
+        SessionPoolTake(session->api, &shell->sessionKey, &shell->miSession))
     {
-        MI_Operation_Cancel(&operationHandle->miOperation, MI_REASON_NONE);
+        __LOGD(("Reusing pooled session to %s", shell->sessionKey.destination));
+        shell->pooledSession = MI_TRUE;
+        return MI_RESULT_OK;
     }
 
-    /* Wait for operation to complete and delete memory */
-
-    LogFunctionEnd("WSManCloseOperation", MI_RESULT_NOT_SUPPORTED);
-    return MI_RESULT_OK;
-}
-
-/*
-typedef struct _Shell
-{
-    MI_Instance __instance;
-    MI_ConstStringField ShellId;
-    MI_ConstStringField Name;
-    MI_ConstStringField ResourceUri;
-    MI_ConstStringField Owner;
-    MI_ConstStringField ClientIP;
-    MI_ConstUint32Field ProcessId;
-    MI_ConstDatetimeField IdleTimeout;
-    MI_ConstStringField InputStreams;
-    MI_ConstStringField OutputStreams;
-    MI_ConstDatetimeField MaxIdleTimeout;
-    MI_ConstStringField Locale;
-    MI_ConstStringField DataLocale;
-    MI_ConstStringField CompressionMode;
-    MI_ConstStringField ProfileLoaded;
-    MI_ConstStringField Encoding;
-    MI_ConstStringField BufferMode;
-    MI_ConstStringField State;
-    MI_ConstDatetimeField ShellRunTime;
-    MI_ConstDatetimeField ShellInactivity;
-    MI_ConstStringField CreationXml;
+    shell->pooledSession = MI_FALSE;
+    return MI_Application_NewSession(&session->api->application, NULL, session->hostname, &session->destinationOptions, NULL, NULL, &shell->miSession);
 }
-Shell;
-*/
 
-void MI_CALL CreateShellComplete(
-    _In_opt_     MI_Operation *operation,
-    _In_     void *callbackContext,
-    _In_opt_ const MI_Instance *instance,
-             MI_Boolean moreResults,
-    _In_     MI_Result resultCode,
-    _In_opt_z_ const MI_Char *errorString,
-    _In_opt_ const MI_Instance *errorDetails,
-    _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
+static void SessionPoolInitialize(WSMAN_API_HANDLE api)
 {
-    struct WSMAN_SHELL *shell = (struct WSMAN_SHELL *) callbackContext;
-    WSMAN_ERROR error = {0};
+    char value[16];
 
-    __LOGD(("%s: START, errorCode=%u", "CreateShellComplete", resultCode));
+    Lock_Init(&api->sessionPoolLock);
 
-    /* Copy off the resource URI that all future shell operations should use */
-    if ((resultCode == MI_RESULT_OK) && instance)
+    api->sessionPoolMaxIdle = (MI_Uint64) SESSION_POOL_MAX_IDLE_DEFAULT * 1000000;
+    if (_GetConfigValueFromConfigFile("sessionpoolmaxidle", value, sizeof(value)) == MI_RESULT_OK)
     {
-        MI_Value value;
-        MI_Type type;
-
-        if ((__MI_Instance_GetElement(instance, "ResourceUri", &value, &type, NULL, NULL) == MI_RESULT_OK) &&
-                (type == MI_STRING) &&
-                (Shell_Set_ResourceUri(shell->shellInstance, value.string) == MI_RESULT_OK) &&
-                (MI_OperationOptions_SetResourceUri(&shell->operationOptions, value.string) == MI_RESULT_OK))
-        {
-            __LOGD(("Create shell returned resource URI = %s", value.string));
-        }
-        else
-        {
-            resultCode = MI_RESULT_FAILED;
-        }
-        if ((__MI_Instance_GetElement(instance, "ShellId", &value, &type, NULL, NULL) == MI_RESULT_OK) &&
-                (type == MI_STRING) &&
-                (Shell_Set_ShellId(shell->shellInstance, value.string) == MI_RESULT_OK))
+        api->sessionPoolMaxIdle = (MI_Uint64) strtoul(value, NULL, 10) * 1000000;
+    }
+    if (_GetConfigValueFromConfigFile("sessionpoolmaxperhost", value, sizeof(value)) == MI_RESULT_OK)
+    {
+        unsigned long maxPerHost = strtoul(value, NULL, 10);
+        if (maxPerHost <= SESSION_POOL_MAX_PER_HOST)
         {
-            __LOGD(("Create shell returned Shell ID = %s", value.string));
+            api->sessionPoolMaxPerHost = (MI_Uint32) maxPerHost;
         }
         else
         {
-            resultCode = MI_RESULT_FAILED;
+            __LOGE(("Ignoring sessionpoolmaxperhost=%s, must be 0 to %u", value, SESSION_POOL_MAX_PER_HOST));
         }
     }
-    else if ((resultCode == MI_RESULT_NOT_SUPPORTED) && (errorDetails))
+    if (api->sessionPoolMaxIdle == 0)
     {
-        /* Check to see if this is a redirect error */
-        MI_Value value;
-        MI_Type type;
-        MI_Uint32 flags, index;
-        if ((MI_Instance_GetElement(errorDetails, MI_T("ProbableCauseDescription"),  &value, &type, &flags, &index) == MI_RESULT_OK) &&
-                (type == MI_STRING) &&
-                (value.string))
+        api->sessionPoolMaxPerHost = 0;
+    }
+    __LOGD(("Session pool keeps %u idle sessions per host for %llu seconds", api->sessionPoolMaxPerHost, (unsigned long long) (api->sessionPoolMaxIdle / 1000000)));
+}
+
+MI_EXPORT MI_Uint32 WINAPI WSManInitialize(
+    MI_Uint32 flags,
+    _Out_ WSMAN_API_HANDLE *apiHandle
+    )
+{
+    MI_Result miResult;
+
+    _GetLogOptionsFromConfigFile(SHELL_LOGGING_FILE);
+
+    LogFunctionStart("WSManInitialize");
+
+    (*apiHandle) = calloc(1, sizeof(struct WSMAN_API));
+    if (*apiHandle == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    miResult = MI_Application_InitializeV1(0, NULL, NULL, &(*apiHandle)->application);
+    if (miResult != MI_RESULT_OK)
+    {
+        free(*apiHandle);
+        *apiHandle = NULL;
+        LogFunctionEnd("WSManInitialize", miResult);
+        return miResult;
+    }
+
+    (*apiHandle)->receivePipelineDepth = RECEIVE_PIPELINE_DEPTH_DEFAULT;
+    {
+        char depthString[16];
+        if (_GetConfigValueFromConfigFile("receivepipelinedepth", depthString, sizeof(depthString)) == MI_RESULT_OK)
         {
-            #define REDIRECT_LOCATION MI_T("REDIRECT_LOCATION: ")
-            if (Tcsncmp(REDIRECT_LOCATION, value.string, MI_COUNT(REDIRECT_LOCATION)-1) == 0)
+            unsigned long depth = strtoul(depthString, NULL, 10);
+            if ((depth >= 1) && (depth <= RECEIVE_PIPELINE_DEPTH_MAX))
             {
-                shell->session->redirectLocation = Batch_Tcsdup(shell->session->batch, value.string + (MI_COUNT(REDIRECT_LOCATION)-1));
-                if (shell->session->redirectLocation == NULL)
-                {
-                    resultCode = MI_RESULT_SERVER_LIMITS_EXCEEDED;
-                    errorString = NULL;
-                }
-                else
-                {
-                    resultCode = ERROR_WSMAN_REDIRECT_REQUESTED;
-                }
+                (*apiHandle)->receivePipelineDepth = (MI_Uint32) depth;
+            }
+            else
+            {
+                __LOGE(("Ignoring receivepipelinedepth=%s, must be 1 to %u", depthString, RECEIVE_PIPELINE_DEPTH_MAX));
             }
         }
+        __LOGD(("Receive pipeline depth = %u", (*apiHandle)->receivePipelineDepth));
     }
-
-    error.code = resultCode;
-    if (errorString)
-    {
-        Utf8ToUtf16Le(shell->batch, errorString, (MI_Char16**) &error.errorDetail);
-    }
-    else if (resultCode != MI_RESULT_OK)
+    (*apiHandle)->compression = CLIENT_COMPRESSION_DEFAULT;
     {
-        Utf8ToUtf16Le(shell->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
+        char compressionString[16];
+        if (_GetConfigValueFromConfigFile("clientcompression", compressionString, sizeof(compressionString)) == MI_RESULT_OK)
+        {
+            (*apiHandle)->compression = (Tcscasecmp(compressionString, "true") == 0) ? MI_TRUE : MI_FALSE;
+        }
+        __LOGD(("Client compression = %s", (*apiHandle)->compression ? "true" : "false"));
     }
+    SessionPoolInitialize(*apiHandle);
+    LogFunctionEnd("WSManInitialize", miResult);
+    return miResult;
+}
 
-    MI_Operation_Close(&shell->miCreateShellOperation);
 
-    if (resultCode == MI_RESULT_OK)
-    {
-        shell->didCreate = MI_TRUE;
-        shell->asyncCallback.completionFunction(
-                shell->asyncCallback.operationContext,
-                0,
-                &error,
-                shell,
-                NULL,
-                NULL,
-                NULL);
-     }
-    else
+MI_EXPORT MI_Uint32 WINAPI WSManDeinitialize(
+    _Inout_opt_ WSMAN_API_HANDLE apiHandle,
+    MI_Uint32 flags
+    )
+{
+    LogFunctionStart("WSManDeinitialize");
+    if (apiHandle)
     {
-        shell->asyncCallback.completionFunction(
-                shell->asyncCallback.operationContext,
-                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-                &error,
-                shell,
-                NULL,
-                NULL,
-                NULL);
+        __LOGD(("Session pool: %llu of %llu shells reused a session, %llu pooled sessions failed",
+            (unsigned long long) apiHandle->sessionPoolStatistics.hits,
+            (unsigned long long) apiHandle->sessionPoolStatistics.requests,
+            (unsigned long long) apiHandle->sessionPoolStatistics.failed));
+        SessionPoolClose(apiHandle->sessionPool, MI_TRUE);
+        apiHandle->sessionPool = NULL;
+        MI_Application_Close(&apiHandle->application);
+        free(apiHandle);
     }
-    LogFunctionEnd("CreateShellComplete", resultCode);
+    LogFunctionEnd("WSManDeinitialize", MI_RESULT_OK);
+
+    Log_Close();
+    return MI_RESULT_OK;
 }
 
-static MI_Result ExtractStreamSet(WSMAN_STREAM_ID_SET *streamSet, Batch *batch, char **streamSetString)
+MI_EXPORT MI_Uint32 WINAPI WSManGetSessionPoolStatistics(
+    _In_ WSMAN_API_HANDLE apiHandle,
+    _Out_ WSMAN_SESSION_POOL_STATISTICS *statistics)
 {
-    MI_Result miResult = MI_RESULT_OK;
-    char *errorMessage = NULL;
-    size_t stringLength = 1;
-    MI_Uint32 count;
-    char *tmpStr;
-    char *cursor;
+    if ((apiHandle == NULL) || (statistics == NULL))
+        return MI_RESULT_INVALID_PARAMETER;
 
-    *streamSetString = NULL;
+    Lock_Acquire(&apiHandle->sessionPoolLock);
+    *statistics = apiHandle->sessionPoolStatistics;
+    Lock_Release(&apiHandle->sessionPoolLock);
+    return MI_RESULT_OK;
+}
 
-    /* Allocate a buffer that is as big as all strings with spaces in-between  */
-    for (count = 0; count != streamSet->streamIDsCount; count++)
-    {
-        stringLength += Utf16LeStrLenBytes(streamSet->streamIDs[count]);
-        stringLength ++; /* for space between strings, extra one not a big issue */
-    }
-    tmpStr = Batch_Get(batch, stringLength);
-    if (tmpStr == NULL)
-        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
-
-    cursor = tmpStr;
+MI_EXPORT MI_Uint32 WINAPI WSManGetErrorMessage(
+    _In_ WSMAN_API_HANDLE apiHandle,
+    MI_Uint32 flags,            // reserved for future use; must be 0
+    _In_opt_ const MI_Char16* languageCode,    // the RFC 3066 language code; it can be NULL
+    MI_Uint32 errorCode,        // error code for the requested error message
+    MI_Uint32 messageLength,    // message length, including NULL terminator
+    _Out_writes_to_opt_(messageLength, *messageLengthUsed) MI_Char16*  message,
+    _Out_ MI_Uint32* messageLengthUsed  // effective message length, including NULL terminator
+    )
+{
+    const char *resultString = Result_ToString(errorCode);
+    size_t resultStringLenth = Tcslen(resultString)+1; /* Includes null terminator */
+    MI_Result miResult = MI_RESULT_OK;
+    size_t tmpMessageLen;
+    char *errorMessage = NULL;
+    size_t iconv_return;
+    iconv_t iconvData;
 
-    if (streamSet->streamIDsCount > 0)
+    //MI_Char16 *convertedString;
+    //Utf8ToUtf16Le(batch, resultString, &convertedString);
+    __LOGD(("%s: START, errorCode=%u, messageLength=%u", "WSManGetErrorMessage", errorCode, messageLength));
+    if ((messageLength == 0) || (message == NULL))
     {
-        size_t iconv_return;
-        iconv_t iconvData;
-
-        iconvData = iconv_open("UTF-8", "UTF-16LE");
-        if (iconvData == (iconv_t)-1)
-        {
-            GOTO_ERROR("Failed to convert stream", MI_RESULT_FAILED);
-        }
+        *messageLengthUsed = (MI_Uint32) resultStringLenth;
+        return ERROR_INSUFFICIENT_BUFFER;
+    }
 
+    iconvData = iconv_open("UTF-16LE", "UTF-8" );
+    if (iconvData == (iconv_t)-1)
+    {
+        GOTO_ERROR("Failed to convert stream", MI_RESULT_FAILED);
+    }
 
-        for (count = 0; count != streamSet->streamIDsCount; count++)
-        {
-            size_t thisStringLen = Utf16LeStrLenBytes(streamSet->streamIDs[count]);
-            const MI_Char16 *strID = streamSet->streamIDs[count];
 
-            iconv_return = iconv(iconvData,
-                    (char**) &strID, &thisStringLen,
-                    &cursor, &stringLength);
-            if (iconv_return == (size_t) -1)
-            {
-                iconv_close(iconvData);
-                GOTO_ERROR("Failed to convert stream", MI_RESULT_FAILED);
-            }
+    tmpMessageLen = messageLength*2; /* Convert to bytes */
 
-            /* Append space on end */
-            *(cursor-1) = ' ';
-        }
+    iconv_return = iconv(iconvData,
+            (char**)&resultString, &resultStringLenth,
+            (char**)&message, &tmpMessageLen);
+    if (iconv_return == (size_t) -1)
+    {
         iconv_close(iconvData);
+        GOTO_ERROR("Failed to convert stream", MI_RESULT_FAILED);
     }
 
-    /* Null terminate */
-    *(cursor-1) = '\0';
+    iconv_close(iconvData);
+
+
+    *messageLengthUsed = messageLength - (tmpMessageLen / 2);
 
-    *streamSetString = tmpStr;
 error:
+    LogFunctionEnd("WSManGetErrorMessage", miResult);
     return miResult;
 }
 
-MI_Result ExtractOptions(_In_opt_ WSMAN_OPTION_SET *wsmanOptions, Batch *batch, MI_OperationOptions *miOptions)
+MI_EXPORT MI_Uint32 WINAPI WSManCreateSession(
+    _In_ WSMAN_API_HANDLE apiHandle,
+    _In_opt_ const MI_Char16* _connection,         // if NULL, then connection will default to localhost
+    MI_Uint32 flags,
+    _In_opt_ WSMAN_AUTHENTICATION_CREDENTIALS *serverAuthenticationCredentials,
+    _In_opt_ WSMAN_PROXY_INFO *proxyInfo,
+    _Out_ WSMAN_SESSION_HANDLE *session
+    )
 {
-    MI_Uint32 i;
-    MI_Result miResult = MI_RESULT_OK;
+    MI_Result miResult;
     char *errorMessage = NULL;
+    Batch *batch = NULL;
+    char *connection = NULL;
+    char *portNumber = NULL;
+    char *httpUrl = NULL;
+    char *username = NULL;
+    char *password = NULL;
+    MI_UserCredentials userCredentials;
 
+    LogFunctionStart("WSManCreateSession");
+    *session = NULL;
 
-    if (wsmanOptions == NULL)
-        return MI_RESULT_OK;
-
-    for (i = 0; i != wsmanOptions->optionsCount; i++)
+    if (serverAuthenticationCredentials == NULL)
     {
-        char *name;
-        char *value;
-
-        if (!Utf16LeToUtf8(batch, wsmanOptions->options[i].name, &name))
-            GOTO_ERROR("Failed to convert option name", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-
-        if (!Utf16LeToUtf8(batch, wsmanOptions->options[i].value, &value))
-            GOTO_ERROR("Failed to convert option value", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-        __LOGD(("%s: %s=%s", "ExtractOptions", name, value));
-        miResult = MI_OperationOptions_SetString(miOptions, name, value, 0);
-        if (miResult != MI_RESULT_OK)
-            GOTO_ERROR("Failed to set shell option", miResult);
+        GOTO_ERROR("No authentication credentials given", MI_RESULT_ACCESS_DENIED);
+    }
+    if (proxyInfo)
+    {
+        GOTO_ERROR("Don't support proxy information", MI_RESULT_INVALID_PARAMETER);
     }
-error:
-    return miResult;
-}
 
-MI_EXPORT void WINAPI WSManCreateShellEx(
-    _Inout_ WSMAN_SESSION_HANDLE session,
-    MI_Uint32 flags,
-    _In_ const MI_Char16* resourceUri,           // shell resource URI
-    _In_ const MI_Char16* shellId,
-    _In_opt_ WSMAN_SHELL_STARTUP_INFO *startupInfo,
-    _In_opt_ WSMAN_OPTION_SET *options,
-    _In_opt_ WSMAN_DATA *createXml,                     // open content for create shell
-    _In_ WSMAN_SHELL_ASYNC *async,
-    _Out_ WSMAN_SHELL_HANDLE *_shell) // should be closed using WSManCloseShell
-{
-    Batch *batch = NULL;
-    MI_Instance *_shellInstance;
-    MI_Result miResult;
-    char *errorMessage = NULL;
-    struct WSMAN_SHELL *shell = NULL;
-    char *tmpStr = NULL;
+    switch (serverAuthenticationCredentials->authenticationMechanism)
+    {
+        case WSMAN_FLAG_AUTH_BASIC:
+            userCredentials.authenticationType = MI_AUTH_TYPE_BASIC;
+            break;
+        case WSMAN_FLAG_AUTH_NEGOTIATE:
+            userCredentials.authenticationType = MI_AUTH_TYPE_NEGO_WITH_CREDS;
+            break;
+        case WSMAN_FLAG_AUTH_KERBEROS:
+            userCredentials.authenticationType = MI_AUTH_TYPE_KERBEROS;
+            break;
+        default:
+            GOTO_ERROR("Unsupported authentication type", MI_RESULT_ACCESS_DENIED);
+            break;
 
-    LogFunctionStart("WSManCreateShellEx");
+    }
 
     batch = Batch_New(BATCH_MAX_PAGES);
     if (batch == NULL)
     {
-        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        GOTO_ERROR("Out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
 
-    shell = Batch_GetClear(batch, sizeof(struct WSMAN_SHELL));
-    if (shell == NULL)
+    (*session) = Batch_GetClear(batch, sizeof(struct WSMAN_SESSION));
+    if (*session == NULL)
     {
-        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        GOTO_ERROR("Out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
+    (*session)->batch = batch;
+    (*session)->packetPrivacy = MI_TRUE;
+    (*session)->maxEnvelopeSize = 500;
 
-    shell->batch = batch;
-    shell->session = session;
-
-    miResult = MI_Application_NewOperationOptions(&session->api->application, MI_TRUE, &shell->operationOptions);
+    miResult = MI_Application_NewDestinationOptions(&apiHandle->application, &(*session)->destinationOptions);
     if (miResult != MI_RESULT_OK)
     {
-        GOTO_ERROR("Failed to create operation options", miResult);
+        GOTO_ERROR("Destination options creation failed", miResult);
     }
 
-    /* Stash the async callback information for when we get the wsman response and need
-     * to call back into the client
-     */
-    shell->asyncCallback = *async;
-
-    miResult = Instance_New(&_shellInstance, &Shell_rtti, batch);
+    /* powershell uses HTTP unless otherwise stated */
+    miResult = MI_DestinationOptions_SetTransport(&(*session)->destinationOptions, MI_DESTINATIONOPTIONS_TRANSPORT_HTTP);
     if (miResult != MI_RESULT_OK)
     {
-        GOTO_ERROR("Failed to create instance", miResult);
+        GOTO_ERROR("Failed to default http transport", miResult);
+    }
+    /* Packet privacy over HTTP by default unless otherwise stated */
+    miResult = MI_DestinationOptions_SetPacketPrivacy(&(*session)->destinationOptions, MI_TRUE);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to set packet privacy", miResult);
     }
-    shell->shellInstance = (Shell*) _shellInstance;
 
+    if (_connection && !Utf16LeToUtf8(batch, _connection, &connection))
+    {
+        GOTO_ERROR("Failed to convert connection name", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    else if (_connection == NULL)
+    {
+        connection = "localhost";
+    }
 
-    if (shellId)
+    /* Full format may be:
+     *      <transport>://<computerName>:<port><httpUrl>
+     * where:
+     *      <transport>:// = http:// or https://, if <transport>:// is missing it defaults
+     *      :<port> = port to use based on transport specified, if missing uses defaults
+     *      <httpUrl> = http URL to post to, if missing defaults to /wsman/
+     *
+     * For now, assume there is a http url at the end copy if off and remove so we just have the machine name in the connection string
+     *
+     */
+    if (strncmp(connection, "http://", 7) == 0)
     {
-        if (!Utf16LeToUtf8(batch, shellId, &tmpStr))
+        miResult = MI_DestinationOptions_SetTransport(&(*session)->destinationOptions, MI_DESTINATIONOPTIONS_TRANSPORT_HTTP);
+        if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            GOTO_ERROR("Failed to set transport to http", miResult);
         }
-        if (Shell_Set_ShellId(shell->shellInstance, tmpStr) != MI_RESULT_OK)
+        /* If http:// connection string is used we need to default to port 80, rather than default wsman http port */
+        miResult = MI_DestinationOptions_SetDestinationPort(&(*session)->destinationOptions, 80);
+        if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            GOTO_ERROR("Failed to set transport to http", miResult);
         }
-        __LOGD(("ShellID = %s", tmpStr));
-    }
-
-    if (resourceUri)
+        (*session)->port = 80;
+        connection += 7;
+     }
+    else if (strncmp(connection, "https://", 8) == 0)
     {
-        if (!Utf16LeToUtf8(batch, resourceUri, &tmpStr))
-        {
-            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-        }
-        if (Shell_Set_ResourceUri(shell->shellInstance, tmpStr) != MI_RESULT_OK)
+        miResult = MI_DestinationOptions_SetTransport(&(*session)->destinationOptions, MI_DESTINATIONOPTIONS_TRANSPORT_HTTPS);
+        if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            GOTO_ERROR("Failed to set transport to https", miResult);
         }
-        if (MI_OperationOptions_SetResourceUri(&shell->operationOptions, tmpStr) != MI_RESULT_OK)
+        /* If https:// connection string is used we need to default to port 443, rather than default wsman https port */
+        miResult = MI_DestinationOptions_SetDestinationPort(&(*session)->destinationOptions, 443);
+        if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR("Failed to set resource URI in options", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            GOTO_ERROR("Failed to set transport to http", miResult);
         }
-        __LOGD(("Resource URI = %s", tmpStr));
+        (*session)->useSsl = MI_TRUE;
+        (*session)->port = 443;
+        connection += 8;
     }
-
-    if (MI_OperationOptions_SetNumber(&shell->operationOptions, "__MI_OPERATIONOPTIONS_ISSHELL", 1, 0) != MI_RESULT_OK)
+    else
     {
-        GOTO_ERROR("Failed to set IsShell option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        /* Assume no prefix and starts with computer name */
     }
 
-    if (startupInfo)
+    (*session)->hostname = connection;
+
+    portNumber = strchr(connection, ':');
+    httpUrl = strchr(connection, '/');
+
+    if (httpUrl == NULL)
+        httpUrl = "/wsman/";
+    else
     {
-        if (startupInfo->inputStreamSet && startupInfo->inputStreamSet->streamIDsCount)
+        /* Need to copy because we need the initial slash, but need to terminate the hostname at that location. */
+        char *tmp = Batch_Tcsdup(batch, httpUrl);
+        if (tmp == NULL)
         {
-            miResult = ExtractStreamSet(startupInfo->inputStreamSet, batch, &tmpStr);
-            if (miResult != MI_RESULT_OK)
-            {
-                GOTO_ERROR("Extract input stream failed", miResult);
-            }
-            Shell_Set_InputStreams(shell->shellInstance, tmpStr);
-            __LOGD(("Inbound streams = %s", tmpStr));
-        }
-        if (startupInfo->outputStreamSet && startupInfo->outputStreamSet->streamIDsCount)
-        {
-            miResult = ExtractStreamSet(startupInfo->outputStreamSet, batch, &tmpStr);
-            if (miResult != MI_RESULT_OK)
-            {
-                GOTO_ERROR("Extract output stream failed", miResult);
-            }
-            if (Shell_Set_OutputStreams(shell->shellInstance, tmpStr) != MI_RESULT_OK)
-            {
-                GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-            }
-            __LOGD(("Output streams = %s", tmpStr));
+            GOTO_ERROR("Failed to convert connection name", MI_RESULT_SERVER_LIMITS_EXCEEDED);
         }
-
-        if (startupInfo->name)
-        {
-            if (!Utf16LeToUtf8(batch, startupInfo->name, &tmpStr))
-            {
-                GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-            }
-            if (Shell_Set_Name(shell->shellInstance, tmpStr) != MI_RESULT_OK)
-            {
-                GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-            }
-            __LOGD(("Session name = %s", tmpStr));
-         }
+        *httpUrl = '\0'; /* terminate hostname or port number string properly */
+        httpUrl = tmp;
     }
-
-    miResult = ExtractOptions(options, batch, &shell->operationOptions);
+    (*session)->httpUrl = httpUrl;
+    miResult = MI_DestinationOptions_SetHttpUrlPrefix(&(*session)->destinationOptions, httpUrl);
     if (miResult != MI_RESULT_OK)
-        GOTO_ERROR("Failed to convert wsman options", miResult);
-
-    if (createXml && (createXml->type == WSMAN_DATA_TYPE_TEXT))
     {
-        if (!Utf16LeToUtf8(batch, createXml->text.buffer, &tmpStr))
-        {
-            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-        }
-        if (Shell_Set_CreationXml(shell->shellInstance, tmpStr) != MI_RESULT_OK)
-        {
-            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-        }
-        __LOGD(("Creation XML = %s", tmpStr));
+        GOTO_ERROR("Failed to add http prefix to destination options", miResult);
     }
 
-    {
-        memset(&shell->callbacks, 0, sizeof(shell->callbacks));
-
-        shell->callbacks.instanceResult = CreateShellComplete;
-        shell->callbacks.callbackContext = shell;
 
-        miResult = MI_Application_NewSession(&session->api->application, NULL, session->hostname, &session->destinationOptions, NULL, NULL, &shell->miSession);
+    if ((portNumber && !httpUrl) || (portNumber && httpUrl && portNumber < httpUrl))
+    {
+        MI_Uint32 portNumberValue = 0;
+        *portNumber = '\0'; /* null terminate hostname in correct place */
+        portNumber ++;  /* move past : */
+        if (StrToUint32(portNumber, &portNumberValue) != 0)
+        {
+            GOTO_ERROR("Failed to parse port number in connection uri", MI_RESULT_INVALID_PARAMETER);
+        }
+        miResult = MI_DestinationOptions_SetDestinationPort(&(*session)->destinationOptions, portNumberValue);
         if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR("MI_Application_NewSession failed", miResult);
+            GOTO_ERROR("Failed to set transport to http", miResult);
         }
-
-        MI_Session_CreateInstance(&shell->miSession,
-                0, /* flags */
-                &shell->operationOptions, /*options*/
-                NULL, /* namespace */
-                &shell->shellInstance->__instance,
-                &shell->callbacks, &shell->miCreateShellOperation);
+        (*session)->port = portNumberValue;
     }
 
-    *_shell = shell;
-    LogFunctionEnd("WSManCreateShellEx", miResult);
-    return;
-
-error:
-    {
-        WSMAN_ERROR error = { 0 };
-        error.code = miResult;
-        Utf8ToUtf16Le(batch, errorMessage, (MI_Char16**) &error.errorDetail);
-        async->completionFunction(
-                async->operationContext,
-                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-                &error,
-                shell,
-                NULL,
-                NULL,
-                NULL);
-     }
-
-    if (batch)
+    if (serverAuthenticationCredentials->userAccount.username && !Utf16LeToUtf8(batch, serverAuthenticationCredentials->userAccount.username, &username))
     {
-        Batch_Delete(batch);
+        GOTO_ERROR("Username missing or failed to convert", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
 
-    if (shell->operationOptions.ft)
+    if (serverAuthenticationCredentials->userAccount.password && !Utf16LeToUtf8(batch, serverAuthenticationCredentials->userAccount.password, &password))
     {
-        MI_OperationOptions_Delete(&shell->operationOptions);
+        GOTO_ERROR("password missing or failed to convert", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
 
-    *_shell = NULL;
-    LogFunctionEnd("WSManCreateShellEx", miResult);
-}
+    userCredentials.credentials.usernamePassword.domain = NULL; /* Assume for now no domain. At some point we may need to split username */
+    userCredentials.credentials.usernamePassword.username = username;
+    userCredentials.credentials.usernamePassword.password = password;
+    (*session)->authenticationMechanism = serverAuthenticationCredentials->authenticationMechanism;
+    (*session)->username = username;
+    (*session)->password = password;
 
-void MI_CALL CommandShellComplete(
-    _In_opt_     MI_Operation *miOperation,
-    _In_     void *callbackContext,
-    _In_opt_ const MI_Instance *instance,
-             MI_Boolean moreResults,
-    _In_     MI_Result resultCode,
-    _In_opt_z_ const MI_Char *errorString,
-    _In_opt_ const MI_Instance *errorDetails,
-    _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
-{
-    WSMAN_COMMAND_HANDLE operation = ( WSMAN_COMMAND_HANDLE ) callbackContext;
-    WSMAN_ERROR error = {0};
-    __LOGD(("%s: START, errorCode=%u", "CommandShellComplete", resultCode));
-    error.code = resultCode;
-    if (resultCode != 0)
+    if (MI_DestinationOptions_SetMaxEnvelopeSize(&(*session)->destinationOptions, 500))
     {
-        if (errorString)
-        {
-            Utf8ToUtf16Le(operation->batch, errorString, (MI_Char16**) &error.errorDetail);
-        }
-        else
-        {
-            Utf8ToUtf16Le(operation->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
-        }
+        GOTO_ERROR("Failed to add credentials to destination options", miResult);
     }
-    else if (instance)
+
+    miResult = MI_DestinationOptions_AddDestinationCredentials(&(*session)->destinationOptions, &userCredentials);
+    if (miResult != MI_RESULT_OK)
     {
-        MI_Value value;
-        MI_Type type;
+        GOTO_ERROR("Failed to add credentials to destination options", miResult);
+    }
+    (*session)->api = apiHandle;
 
-        if ((__MI_Instance_GetElement(instance, "CommandId", &value, &type, NULL, NULL) == MI_RESULT_OK) &&
-                (type == MI_STRING) &&
-                (__MI_Instance_SetElement(operation->commandProperties, "CommandId", &value, MI_STRING, 0) == MI_RESULT_OK) &&
-                (__MI_Instance_GetElement(operation->commandProperties, "CommandId", &value, &type, NULL, NULL) == MI_RESULT_OK))
-        {
-            __LOGD(("Command returned Command ID = %s", value.string));
+    LogFunctionEnd("WSManCreateSession", miResult);
+    return miResult;
 
-            /* Replace this with a pointer to the command ID from the instance owned by the command object, rather than the one that will
-             * go out of scope after this call finishes */
-            operation->commandId = value.string;
-        }
-        else
-        {
-            resultCode = MI_RESULT_FAILED;
-        }
-    }
+error:
+    if (batch)
+        Batch_Delete(batch);
 
-    operation->asyncCallback.completionFunction(
-                operation->asyncCallback.operationContext,
-                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-                &error,
-                operation->shell,
-                operation,
-                NULL,
-                NULL);
-    MI_Operation_Close(&operation->miOperation);
-//    Batch_Delete(operation->batch);
+    *session = NULL;
 
-    LogFunctionEnd("CommandShellComplete", resultCode);
+    LogFunctionEnd("WSManCreateSession", miResult);
+    return miResult;
 }
 
-/* Adds an Arguments property that is a string array */
-MI_Result  ExtractCommandArgs(WSMAN_COMMAND_ARG_SET *args, Batch *batch, MI_Instance *commandProperties)
+MI_EXPORT MI_Uint32 WINAPI WSManCloseSession(
+    _Inout_opt_ WSMAN_SESSION_HANDLE session,
+    MI_Uint32 flags)
 {
-    MI_Value stringArr;
-    MI_Uint32 index;
-
-    memset(&stringArr, 0, sizeof(stringArr));
+    MI_Result miResult = MI_RESULT_OK;
 
-    stringArr.stringa.size = args->argsCount;
-    stringArr.stringa.data = Batch_Get(batch, sizeof(MI_Char*)*stringArr.stringa.size);
-    if (stringArr.stringa.data == NULL)
-        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    LogFunctionStart("WSManCloseSession");
+    if (session->destinationOptions.ft)
+        MI_DestinationOptions_Delete(&session->destinationOptions);
+    if (session->password)
+        SecretWipe(session->password, strlen(session->password));
 
-    for (index = 0; index != stringArr.stringa.size; index++)
-    {
-        if (!Utf16LeToUtf8(batch, args->args[index], &stringArr.stringa.data[index]))
-        {
-            return MI_RESULT_SERVER_LIMITS_EXCEEDED;
-        }
-        __LOGD(("Command argument %u = %s", index, stringArr.stringa.data[index]));
-    }
+    Batch_Delete(session->batch);
 
-    return MI_Instance_AddElement(commandProperties, "Arguments", &stringArr, MI_STRINGA, 0);
+    LogFunctionEnd("WSManCloseSession", miResult);
+    return miResult;
 }
 
-MI_EXPORT void WINAPI WSManRunShellCommandEx(
-    _Inout_ WSMAN_SHELL_HANDLE shell,
-    MI_Uint32 flags,
-    _In_ const MI_Char16* commandId,
-    _In_ const MI_Char16* commandLine,
-    _In_opt_ WSMAN_COMMAND_ARG_SET *args,
-    _In_opt_ WSMAN_OPTION_SET *options,
-    _In_ WSMAN_SHELL_ASYNC *async,
-    _Out_ WSMAN_COMMAND_HANDLE *command) // should be closed using WSManCloseCommand
+MI_EXPORT MI_Uint32 WINAPI WSManSetSessionOption(
+    _In_ WSMAN_SESSION_HANDLE session,
+    WSManSessionOption option,
+    _In_ WSMAN_DATA *data)
 {
     MI_Result miResult;
     char *errorMessage = NULL;
-    Batch *batch = NULL;
-    MI_Value value;
-    char *tmpStr;
-
-    LogFunctionStart("WSManRunShellCommandEx");
-
-    batch = Batch_New(BATCH_MAX_PAGES);
-    if (batch == NULL)
-    {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-    }
-
-    (*command) = Batch_GetClear(batch, sizeof(struct WSMAN_COMMAND));
-    if (*command == NULL)
-    {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-    }
-    (*command)->shell = shell;
-    (*command)->asyncCallback = *async;
-    (*command)->batch = batch;
 
-    miResult = MI_Application_NewOperationOptions(&shell->session->api->application, MI_TRUE, &(*command)->miOptions);
-    if (miResult != MI_RESULT_OK)
-    {
-        GOTO_ERROR("Failed to create operation options", miResult);
-    }
-
-    miResult = MI_Application_NewInstance(&shell->session->api->application, "CommandLine", NULL, &(*command)->commandProperties);
-    if (miResult != MI_RESULT_OK)
+    LogFunctionStart("WSManSetSessionOption");
+    switch (option)
     {
-        GOTO_ERROR("Failed to allocate receive properties instance", miResult);
-    }
+        case WSMAN_OPTION_USE_SSL:
+            __LOGD(("WSMAN_OPTION_USE_SSL"));
+            if (data->type != WSMAN_DATA_TYPE_DWORD)
+                GOTO_ERROR("SSL option should be DWORD", MI_RESULT_INVALID_PARAMETER);
+            if (data->number == 0)
+            {
+                miResult = MI_DestinationOptions_SetTransport(&session->destinationOptions, MI_DESTINATIONOPTIONS_TRANSPORT_HTTP);
+            }
+            else
+            {
+                miResult = MI_DestinationOptions_SetTransport(&session->destinationOptions, MI_DESTINATIONOPTIONS_TRANSPORT_HTTPS);
+            }
+            session->useSsl = (data->number != 0);
+            break;
 
-    if (commandId)
-    {
-        if (!Utf16LeToUtf8(batch, commandId, &tmpStr))
+        case WSMAN_OPTION_UI_LANGUAGE:
         {
-            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-        }
-        value.string = tmpStr;
+            /* String, convert utf16->utf8, locale */
+            MI_Char *tmpStr;
+            __LOGD(("WSMAN_OPTION_UI_LANGUAGE"));
+            if ((data->type != WSMAN_DATA_TYPE_TEXT) ||
+                    data->text.buffer == NULL)
+            {
+                GOTO_ERROR("UI language option is wrong type or NULL", MI_RESULT_INVALID_PARAMETER);
+            }
+            if (!Utf16LeToUtf8(session->batch, data->text.buffer, &tmpStr))
+                GOTO_ERROR("Failed to convert UI language", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            if (MI_DestinationOptions_SetUILocale(&session->destinationOptions, tmpStr) != MI_RESULT_OK)
+            {
+                GOTO_ERROR("Failed to set UI language option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            }
+            session->uiLocale = tmpStr;
+            miResult = MI_RESULT_OK;
+            break;
+        }
+        case WSMAN_OPTION_LOCALE:
+        {
+            /* String, convert utf16->utf8, locale */
+            MI_Char *tmpStr;
+            __LOGD(("WSMAN_OPTION_LOCALE"));
+            if ((data->type != WSMAN_DATA_TYPE_TEXT) ||
+                    data->text.buffer == NULL)
+            {
+                GOTO_ERROR("Data locale option is wrong type or NULL", MI_RESULT_INVALID_PARAMETER);
+            }
+            if (!Utf16LeToUtf8(session->batch, data->text.buffer, &tmpStr))
+                GOTO_ERROR("Failed to convert Data locale", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            if (MI_DestinationOptions_SetDataLocale(&session->destinationOptions, tmpStr) != MI_RESULT_OK)
+            {
+                GOTO_ERROR("Failed to set Data locale option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            }
+            session->dataLocale = tmpStr;
+            miResult = MI_RESULT_OK;
+            break;
+        }
+        case WSMAN_OPTION_DEFAULT_OPERATION_TIMEOUTMS:
+        {
+            MI_Uint64 microsec = data->number * 1000;
+            MI_Datetime datetime;
+            __LOGD(("WSMAN_OPTION_DEFAULT_OPERATION_TIMEOUTMS=%u",data->number));
+            UsecToDatetime(microsec, &datetime);
+            MI_DestinationOptions_SetTimeout(&session->destinationOptions, &datetime.u.interval);
+            session->timeoutMs = data->number;
+            /* dword, operation timeout when not the others */
+            miResult = MI_RESULT_OK;
+            break;
+        }
+        case WSMAN_OPTION_TIMEOUTMS_CREATE_SHELL:
+            __LOGD(("WSMAN_OPTION_TIMEOUTMS_CREATE_SHELL=%u (not implemented yet)", data->number));
+            /* dword */
+            miResult = MI_RESULT_OK;
+            break;
+        case WSMAN_OPTION_TIMEOUTMS_CLOSE_SHELL:
+            __LOGD(("WSMAN_OPTION_TIMEOUTMS_CLOSE_SHELL=%u (not implemented yet)", data->number));
+            /* dword */
+            miResult = MI_RESULT_OK;
+            break;
+        case WSMAN_OPTION_TIMEOUTMS_SIGNAL_SHELL:
+            __LOGD(("WSMAN_OPTION_TIMEOUTMS_SIGNAL_SHELL=%u (not implemented yet)", data->number));
+            /* dword */
+            miResult = MI_RESULT_OK;
+            break;
+        case WSMAN_OPTION_SHELL_MAX_DATA_SIZE_PER_MESSAGE_KB:
+            __LOGD(("WSMAN_OPTION_SHELL_MAX_DATA_SIZE_PER_MESSAGE_KB=%u", data->number));
+            /* dword */
+            if ((data->type != WSMAN_DATA_TYPE_DWORD) ||
+               (MI_DestinationOptions_SetMaxEnvelopeSize(&session->destinationOptions, data->number) != MI_RESULT_OK))
+            {
+                GOTO_ERROR("Failed to add credentials to destination options", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            }
+            session->maxEnvelopeSize = data->number;
+            miResult = MI_RESULT_OK;
+            break;
+        case WSMAN_OPTION_UNENCRYPTED_MESSAGES:
+            __LOGD(("WSMAN_OPTION_UNENCRYPTED_MESSAGES=%u", data->number));
+            /* dword */
+            if (data->type == WSMAN_DATA_TYPE_DWORD)
+            {
+                if (data->number)
+                {
+                    if (MI_DestinationOptions_SetPacketPrivacy(&session->destinationOptions, MI_FALSE) != MI_RESULT_OK)
+                    {
+                        GOTO_ERROR("Failed to turn packet privacy off", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+                    }
+                    session->packetPrivacy = MI_FALSE;
+                }
+                else
+                {
+                    if (MI_DestinationOptions_SetPacketPrivacy(&session->destinationOptions, MI_TRUE) != MI_RESULT_OK)
+                    {
+                        GOTO_ERROR("Failed to turn packet privacy on", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+                    }
+                    session->packetPrivacy = MI_TRUE;
+                }
+            }
+            else
+            {
+                GOTO_ERROR("Failed to set packet privacy, invalid parameter", MI_RESULT_INVALID_PARAMETER);
+            }
+            miResult = MI_RESULT_OK;
+            break;
+        default:
+            __LOGD(("ignored option %u", option));
+            miResult = MI_RESULT_OK;    /* Assume we can ignore it */
+    }
+
+error:
+    LogFunctionEnd("WSManSetSessionOption", miResult);
+    return miResult;
+}
+
+MI_EXPORT MI_Uint32 WINAPI WSManGetSessionOptionAsDword(
+    _In_ WSMAN_SESSION_HANDLE session, /* NOTE: This may be an application handle */
+    WSManSessionOption option,
+    _Inout_ MI_Uint32 *value)
+{
+    MI_Uint32 miResult = MI_RESULT_OK;
+
+    LogFunctionStart("WSManGetSessionOptionAsDword");
+    switch (option)
+    {
+        case WSMAN_OPTION_SHELL_MAX_DATA_SIZE_PER_MESSAGE_KB:
+            *value = 500; /* TODO: Proper value? */
+            __LOGD(("WSMAN_OPTION_SHELL_MAX_DATA_SIZE_PER_MESSAGE_KB returning 500"));
+            break;
+
+        case WSMAN_OPTION_MAX_RETRY_TIME:
+            *value = 60; /* TODO: Proper value? */
+            __LOGD(("WSMAN_OPTION_SHELL_MAX_DATA_SIZE_PER_MESSAGE_KB returning 60"));
+            break;
+
+        default:
+            miResult = MI_RESULT_NOT_SUPPORTED;
+            __LOGD(("unknown option %u", option));
+    }
+    LogFunctionEnd("WSManGetSessionOptionAsDword", miResult);
+    return miResult;
+}
+
+MI_EXPORT MI_Uint32 WINAPI WSManGetSessionOptionAsString(
+    _In_ WSMAN_SESSION_HANDLE session,
+    WSManSessionOption option,
+    MI_Uint32 stringLength,
+    _Out_writes_to_opt_(stringLength, *stringLengthUsed) MI_Char16* string,
+    _Out_ MI_Uint32* stringLengthUsed)
+{
+    MI_Uint32 miResult = MI_RESULT_OK;
+
+    LogFunctionStart("WSManGetSessionOptionAsString");
+    switch (option)
+    {
+        case WSMAN_OPTION_REDIRECT_LOCATION:
+        {
+            if ((string == NULL) && (session->redirectLocation) && (stringLengthUsed))
+            {
+                *stringLengthUsed = Tcslen(session->redirectLocation) + 1;
+                __LOGD(("Redirect location: returning string length of %u", *stringLengthUsed));
+                miResult = ERROR_INSUFFICIENT_BUFFER;
+            }
+            else if (string && stringLengthUsed && (session->redirectLocation) && (stringLength > Tcslen(session->redirectLocation)))
+            {
+                size_t iconv_return;
+                iconv_t iconvData;
+                size_t tmpToStringLen;
+                size_t tmpFromStringLen;
+                char *tmpFromString = session->redirectLocation;
+                char *tmpToString = (char *)string;
+
+                iconvData = iconv_open("UTF-16LE", "UTF-8" );
+                if (iconvData == (iconv_t)-1)
+                {
+                    miResult = MI_RESULT_FAILED;
+                }
+                else
+                {
+                    tmpFromStringLen = (Tcslen(session->redirectLocation) + 1);
+                    tmpToStringLen = stringLength * 2;
+
+                    iconv_return = iconv(iconvData,
+                            &tmpFromString, &tmpFromStringLen,
+                            &tmpToString, &tmpToStringLen);
+                    if (iconv_return == (size_t) -1)
+                    {
+                        miResult = MI_RESULT_FAILED;
+                    }
+                    else
+                    {
+                        *stringLengthUsed = (MI_Uint32) Tcslen(session->redirectLocation) + 1;
+                        __LOGE(("Redirect location: returning location: %s (length %u)",session->redirectLocation,  Tcslen(session->redirectLocation) + 1));
+                    }
+
+                    iconv_close(iconvData);
+                }
+            }
+            else
+            {
+                /* invalid parameter */
+                miResult = MI_RESULT_INVALID_PARAMETER;
+                __LOGE(("Redirect location: Parameters not correct for retrieving string"));
+            }
+            break;
+        }
+        default:
+            miResult = MI_RESULT_NOT_SUPPORTED;
+            __LOGD(("unknown option %u", option));
+    }
+    LogFunctionEnd("WSManGetSessionOptionAsString", miResult);
+    return miResult;
+}
+MI_EXPORT MI_Uint32 WINAPI WSManCloseOperation(
+    _Inout_opt_ WSMAN_OPERATION_HANDLE operationHandle,
+    MI_Uint32 flags)
+{
+    LogFunctionStart("WSManCloseOperation");
+    if (operationHandle == NULL)
+    {
+        LogFunctionEnd("WSManCloseOperation", MI_RESULT_OK);
+        return MI_RESULT_OK;
+    }
+    if (operationHandle->type == WSMAN_OPERATION_RECEIVE && operationHandle->receiveSlots)
+    {
+        MI_Boolean release;
+
+        Lock_Acquire(&operationHandle->receiveLock);
+        operationHandle->receiveFinished = MI_TRUE;
+        release = ReceiveReleaseIfDone(operationHandle);
+        Lock_Release(&operationHandle->receiveLock);
+
+        ReceiveCancelSlots(operationHandle);
+        if (release)
+        {
+            /* Nothing was outstanding, so the pipeline's reference is dropped here */
+            OperationDereference(operationHandle);
+        }
+    }
+
+    /* Whatever is still running holds its own reference and frees the operation when done */
+    OperationDereference(operationHandle);
+
+    LogFunctionEnd("WSManCloseOperation", MI_RESULT_OK);
+    return MI_RESULT_OK;
+}
+
+/*
+typedef struct _Shell
+{
+    MI_Instance __instance;
+    MI_ConstStringField ShellId;
+    MI_ConstStringField Name;
+    MI_ConstStringField ResourceUri;
+    MI_ConstStringField Owner;
+    MI_ConstStringField ClientIP;
+    MI_ConstUint32Field ProcessId;
+    MI_ConstDatetimeField IdleTimeout;
+    MI_ConstStringField InputStreams;
+    MI_ConstStringField OutputStreams;
+    MI_ConstDatetimeField MaxIdleTimeout;
+    MI_ConstStringField Locale;
+    MI_ConstStringField DataLocale;
+    MI_ConstStringField CompressionMode;
+    MI_ConstStringField ProfileLoaded;
+    MI_ConstStringField Encoding;
+    MI_ConstStringField BufferMode;
+    MI_ConstStringField State;
+    MI_ConstDatetimeField ShellRunTime;
+    MI_ConstDatetimeField ShellInactivity;
+    MI_ConstStringField CreationXml;
+}
+Shell;
+*/
+
+/* ShellRetryCreate
+ * The server may have dropped the connection of a pooled session while it sat idle, so a
+ * create that fails on one is sent again on a new session rather than failed. The pooled
+ * session is closed and counted as failed. Nothing is changed if the new session cannot be
+ * opened, so the caller reports the original failure.
+ */
+static MI_Result ShellRetryCreate(WSMAN_SHELL_HANDLE shell)
+{
+    WSMAN_SESSION_HANDLE session = shell->session;
+    MI_Session miSession;
+    MI_Result miResult;
+
+    shell->pooledSession = MI_FALSE;
+
+    miResult = MI_Application_NewSession(&session->api->application, NULL, session->hostname, &session->destinationOptions, NULL, NULL, &miSession);
+    if (miResult != MI_RESULT_OK)
+    {
+        __LOGE(("MI_Application_NewSession failed (result=%u)", miResult));
+        return miResult;
+    }
+
+    __LOGD(("Pooled session to %s failed, creating the shell on a new one", shell->sessionKey.destination));
+    Lock_Acquire(&session->api->sessionPoolLock);
+    session->api->sessionPoolStatistics.failed++;
+    Lock_Release(&session->api->sessionPoolLock);
+
+    MI_Operation_Close(&shell->miCreateShellOperation);
+    MI_Session_Close(&shell->miSession, NULL, CloseSessionComplete);
+    shell->miSession = miSession;
+
+    CancellableIssuing(&shell->create);
+    MI_Session_CreateInstance(&shell->miSession,
+            0, /* flags */
+            &shell->operationOptions, /*options*/
+            NULL, /* namespace */
+            &shell->shellInstance->__instance,
+            &shell->callbacks, &shell->miCreateShellOperation);
+    CancellableIssued(&shell->create, &shell->miCreateShellOperation);
+    return MI_RESULT_OK;
+}
+
+void MI_CALL CreateShellComplete(
+    _In_opt_     MI_Operation *operation,
+    _In_     void *callbackContext,
+    _In_opt_ const MI_Instance *instance,
+             MI_Boolean moreResults,
+    _In_     MI_Result resultCode,
+    _In_opt_z_ const MI_Char *errorString,
+    _In_opt_ const MI_Instance *errorDetails,
+    _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
+{
+    struct WSMAN_SHELL *shell = (struct WSMAN_SHELL *) callbackContext;
+    WSMAN_ERROR error = {0};
+    MI_Boolean cancelled;
+
+    __LOGD(("%s: START, errorCode=%u", "CreateShellComplete", resultCode));
+
+    cancelled = CancellableFinished(&shell->create);
+    if ((resultCode != MI_RESULT_OK) && shell->pooledSession && !cancelled && (ShellRetryCreate(shell) == MI_RESULT_OK))
+    {
+        LogFunctionEnd("CreateShellComplete", resultCode);
+        return;
+    }
+
+    /* Copy off the resource URI that all future shell operations should use */
+    if ((resultCode == MI_RESULT_OK) && instance)
+    {
+        MI_Value value;
+        MI_Type type;
+
+        if ((__MI_Instance_GetElement(instance, "ResourceUri", &value, &type, NULL, NULL) == MI_RESULT_OK) &&
+                (type == MI_STRING) &&
+                (Shell_Set_ResourceUri(shell->shellInstance, value.string) == MI_RESULT_OK) &&
+                (MI_OperationOptions_SetResourceUri(&shell->operationOptions, value.string) == MI_RESULT_OK) &&
+                (ShellCreateOperationTemplates(shell, value.string) == MI_RESULT_OK))
+        {
+            __LOGD(("Create shell returned resource URI = %s", value.string));
+        }
+        else
+        {
+            resultCode = MI_RESULT_FAILED;
+        }
+        if ((__MI_Instance_GetElement(instance, "ShellId", &value, &type, NULL, NULL) == MI_RESULT_OK) &&
+                (type == MI_STRING) &&
+                (Shell_Set_ShellId(shell->shellInstance, value.string) == MI_RESULT_OK))
+        {
+            __LOGD(("Create shell returned Shell ID = %s", value.string));
+        }
+        else
+        {
+            resultCode = MI_RESULT_FAILED;
+        }
+
+        /* Stream data is only compressed if the server echoed back the compression mode we asked for */
+        if ((__MI_Instance_GetElement(instance, "CompressionMode", &value, &type, NULL, NULL) == MI_RESULT_OK) &&
+                (type == MI_STRING) &&
+                value.string)
+        {
+            shell->isCompressed = MI_TRUE;
+            __LOGD(("Create shell negotiated compression mode = %s", value.string));
+        }
+    }
+    else if ((resultCode == MI_RESULT_NOT_SUPPORTED) && (errorDetails))
+    {
+        /* Check to see if this is a redirect error */
+        MI_Value value;
+        MI_Type type;
+        MI_Uint32 flags, index;
+        if ((MI_Instance_GetElement(errorDetails, MI_T("ProbableCauseDescription"),  &value, &type, &flags, &index) == MI_RESULT_OK) &&
+                (type == MI_STRING) &&
+                (value.string))
+        {
+            #define REDIRECT_LOCATION MI_T("REDIRECT_LOCATION: ")
+            if (Tcsncmp(REDIRECT_LOCATION, value.string, MI_COUNT(REDIRECT_LOCATION)-1) == 0)
+            {
+                shell->session->redirectLocation = Batch_Tcsdup(shell->session->batch, value.string + (MI_COUNT(REDIRECT_LOCATION)-1));
+                if (shell->session->redirectLocation == NULL)
+                {
+                    resultCode = MI_RESULT_SERVER_LIMITS_EXCEEDED;
+                    errorString = NULL;
+                }
+                else
+                {
+                    resultCode = ERROR_WSMAN_REDIRECT_REQUESTED;
+                }
+            }
+        }
+    }
+
+    error.code = resultCode;
+    if (errorString)
+    {
+        Utf8ToUtf16Le(shell->batch, errorString, (MI_Char16**) &error.errorDetail);
+    }
+    else if (resultCode != MI_RESULT_OK)
+    {
+        Utf8ToUtf16Le(shell->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
+    }
+
+    MI_Operation_Close(&shell->miCreateShellOperation);
+
+    if (resultCode == MI_RESULT_OK)
+    {
+        shell->didCreate = MI_TRUE;
+        shell->asyncCallback.completionFunction(
+                shell->asyncCallback.operationContext,
+                0,
+                &error,
+                shell,
+                NULL,
+                NULL,
+                NULL);
+     }
+    else
+    {
+        shell->asyncCallback.completionFunction(
+                shell->asyncCallback.operationContext,
+                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                &error,
+                shell,
+                NULL,
+                NULL,
+                NULL);
+    }
+    LogFunctionEnd("CreateShellComplete", resultCode);
+}
+
+static MI_Result ExtractStreamSet(WSMAN_STREAM_ID_SET *streamSet, Batch *batch, char **streamSetString)
+{
+    MI_Result miResult = MI_RESULT_OK;
+    char *errorMessage = NULL;
+    size_t stringLength = 1;
+    MI_Uint32 count;
+    char *tmpStr;
+    char *cursor;
+
+    *streamSetString = NULL;
+
+    /* Allocate a buffer that is as big as all strings with spaces in-between  */
+    for (count = 0; count != streamSet->streamIDsCount; count++)
+    {
+        stringLength += Utf16LeStrLenBytes(streamSet->streamIDs[count]);
+        stringLength ++; /* for space between strings, extra one not a big issue */
+    }
+    tmpStr = Batch_Get(batch, stringLength);
+    if (tmpStr == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    cursor = tmpStr;
+
+    if (streamSet->streamIDsCount > 0)
+    {
+        size_t iconv_return;
+        iconv_t iconvData;
+
+        iconvData = iconv_open("UTF-8", "UTF-16LE");
+        if (iconvData == (iconv_t)-1)
+        {
+            GOTO_ERROR("Failed to convert stream", MI_RESULT_FAILED);
+        }
+
+
+        for (count = 0; count != streamSet->streamIDsCount; count++)
+        {
+            size_t thisStringLen = Utf16LeStrLenBytes(streamSet->streamIDs[count]);
+            const MI_Char16 *strID = streamSet->streamIDs[count];
+
+            iconv_return = iconv(iconvData,
+                    (char**) &strID, &thisStringLen,
+                    &cursor, &stringLength);
+            if (iconv_return == (size_t) -1)
+            {
+                iconv_close(iconvData);
+                GOTO_ERROR("Failed to convert stream", MI_RESULT_FAILED);
+            }
+
+            /* Append space on end */
+            *(cursor-1) = ' ';
+        }
+        iconv_close(iconvData);
+    }
+
+    /* Null terminate */
+    *(cursor-1) = '\0';
+
+    *streamSetString = tmpStr;
+error:
+    return miResult;
+}
+
+MI_Result ExtractOptions(_In_opt_ WSMAN_OPTION_SET *wsmanOptions, Batch *batch, MI_OperationOptions *miOptions)
+{
+    MI_Uint32 i;
+    MI_Result miResult = MI_RESULT_OK;
+    char *errorMessage = NULL;
+
+
+    if (wsmanOptions == NULL)
+        return MI_RESULT_OK;
+
+    for (i = 0; i != wsmanOptions->optionsCount; i++)
+    {
+        char *name;
+        char *value;
+
+        if (!Utf16LeToUtf8(batch, wsmanOptions->options[i].name, &name))
+            GOTO_ERROR("Failed to convert option name", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+
+        if (!Utf16LeToUtf8(batch, wsmanOptions->options[i].value, &value))
+            GOTO_ERROR("Failed to convert option value", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        __LOGD(("%s: %s=%s", "ExtractOptions", name, value));
+        miResult = MI_OperationOptions_SetString(miOptions, name, value, 0);
+        if (miResult != MI_RESULT_OK)
+            GOTO_ERROR("Failed to set shell option", miResult);
+    }
+error:
+    return miResult;
+}
+
+/* ShellFlags
+ * The shell flags a request is made with, with compression turned off unless the
+ * configuration turned it on.
+ */
+static MI_Uint32 ShellFlags(WSMAN_API_HANDLE api, MI_Uint32 flags)
+{
+    if (!api->compression)
+        flags |= WSMAN_FLAG_NO_COMPRESSION;
+    return flags;
+}
+
+/* ShellFillTemplate
+ * Everything a create shell request says, converted into the shell instance and the options
+ * it is created with. The fan-out does this once and clones the result for every host.
+ */
+static MI_Result ShellFillTemplate(
+    Batch *batch,
+    MI_Uint32 flags,
+    const MI_Char16* resourceUri,
+    const MI_Char16* shellId,
+    WSMAN_SHELL_STARTUP_INFO *startupInfo,
+    WSMAN_OPTION_SET *options,
+    WSMAN_DATA *createXml,
+    Shell *shellInstance,
+    MI_OperationOptions *operationOptions,
+    char **_errorMessage)
+{
+    MI_Result miResult = MI_RESULT_OK;
+    char *errorMessage = NULL;
+    char *tmpStr = NULL;
+
+    if (shellId)
+    {
+        if (!Utf16LeToUtf8(batch, shellId, &tmpStr))
+        {
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        if (Shell_Set_ShellId(shellInstance, tmpStr) != MI_RESULT_OK)
+        {
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        __LOGD(("ShellID = %s", tmpStr));
+    }
+
+    if (resourceUri)
+    {
+        if (!Utf16LeToUtf8(batch, resourceUri, &tmpStr))
+        {
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        if (Shell_Set_ResourceUri(shellInstance, tmpStr) != MI_RESULT_OK)
+        {
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        if (MI_OperationOptions_SetResourceUri(operationOptions, tmpStr) != MI_RESULT_OK)
+        {
+            GOTO_ERROR("Failed to set resource URI in options", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        __LOGD(("Resource URI = %s", tmpStr));
+    }
+
+    if (MI_OperationOptions_SetNumber(operationOptions, "__MI_OPERATIONOPTIONS_ISSHELL", 1, 0) != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to set IsShell option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+
+    if (startupInfo)
+    {
+        if (startupInfo->inputStreamSet && startupInfo->inputStreamSet->streamIDsCount)
+        {
+            miResult = ExtractStreamSet(startupInfo->inputStreamSet, batch, &tmpStr);
+            if (miResult != MI_RESULT_OK)
+            {
+                GOTO_ERROR("Extract input stream failed", miResult);
+            }
+            Shell_Set_InputStreams(shellInstance, tmpStr);
+            __LOGD(("Inbound streams = %s", tmpStr));
+        }
+        if (startupInfo->outputStreamSet && startupInfo->outputStreamSet->streamIDsCount)
+        {
+            miResult = ExtractStreamSet(startupInfo->outputStreamSet, batch, &tmpStr);
+            if (miResult != MI_RESULT_OK)
+            {
+                GOTO_ERROR("Extract output stream failed", miResult);
+            }
+            if (Shell_Set_OutputStreams(shellInstance, tmpStr) != MI_RESULT_OK)
+            {
+                GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            }
+            __LOGD(("Output streams = %s", tmpStr));
+        }
+
+        if (startupInfo->name)
+        {
+            if (!Utf16LeToUtf8(batch, startupInfo->name, &tmpStr))
+            {
+                GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            }
+            if (Shell_Set_Name(shellInstance, tmpStr) != MI_RESULT_OK)
+            {
+                GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            }
+            __LOGD(("Session name = %s", tmpStr));
+         }
+    }
+
+    miResult = ExtractOptions(options, batch, operationOptions);
+    if (miResult != MI_RESULT_OK)
+        GOTO_ERROR("Failed to convert wsman options", miResult);
+
+    /* Compression is requested unless the caller or the configuration turned it off */
+    if ((flags & WSMAN_FLAG_NO_COMPRESSION) == 0)
+    {
+        if (Shell_Set_CompressionMode(shellInstance, "xpress") != MI_RESULT_OK)
+        {
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        __LOGD(("Requesting xpress compression"));
+    }
+
+    if (createXml && (createXml->type == WSMAN_DATA_TYPE_TEXT))
+    {
+        if (!Utf16LeToUtf8(batch, createXml->text.buffer, &tmpStr))
+        {
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        if (Shell_Set_CreationXml(shellInstance, tmpStr) != MI_RESULT_OK)
+        {
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        __LOGD(("Creation XML = %s", tmpStr));
+    }
+
+error:
+    *_errorMessage = errorMessage;
+    return miResult;
+}
+
+/* ShellStart
+ * Send the create request for a shell whose instance and options are filled in.
+ */
+static MI_Result ShellStart(WSMAN_SHELL_HANDLE shell)
+{
+    MI_Result miResult;
+
+    memset(&shell->callbacks, 0, sizeof(shell->callbacks));
+
+    shell->callbacks.instanceResult = CreateShellComplete;
+    shell->callbacks.callbackContext = shell;
+
+    miResult = ShellOpenSession(shell);
+    if (miResult != MI_RESULT_OK)
+    {
+        __LOGE(("MI_Application_NewSession failed (result=%u)", miResult));
+        return miResult;
+    }
+
+    CancellableIssuing(&shell->create);
+    MI_Session_CreateInstance(&shell->miSession,
+            0, /* flags */
+            &shell->operationOptions, /*options*/
+            NULL, /* namespace */
+            &shell->shellInstance->__instance,
+            &shell->callbacks, &shell->miCreateShellOperation);
+    CancellableIssued(&shell->create, &shell->miCreateShellOperation);
+    return MI_RESULT_OK;
+}
+
+/* ShellCancelCreate
+ * Cancel the shell's create request if it has not finished. CreateShellComplete reports it.
+ */
+static void ShellCancelCreate(WSMAN_SHELL_HANDLE shell)
+{
+    CancellableCancel(&shell->create, &shell->miCreateShellOperation);
+}
+
+/* CommandCancelRun
+ * Cancel the command's run request if it has not finished. CommandShellComplete reports it.
+ */
+static void CommandCancelRun(WSMAN_COMMAND_HANDLE command)
+{
+    CancellableCancel(&command->run, &command->miOperation);
+}
+
+/* ShellCreateFromTemplate
+ * Create a shell from an instance and options ShellFillTemplate has already built. Unlike
+ * WSManCreateShellEx a failure to send the request is only returned, async is not called.
+ */
+static MI_Result ShellCreateFromTemplate(
+    WSMAN_SESSION_HANDLE session,
+    const Shell *shellTemplate,
+    const MI_OperationOptions *optionsTemplate,
+    WSMAN_SHELL_ASYNC *async,
+    WSMAN_SHELL_HANDLE *_shell)
+{
+    Batch *batch;
+    MI_Instance *_shellInstance;
+    struct WSMAN_SHELL *shell;
+    MI_Result miResult;
+
+    *_shell = NULL;
+
+    batch = Batch_New(BATCH_MAX_PAGES);
+    if (batch == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    shell = Batch_GetClear(batch, sizeof(struct WSMAN_SHELL));
+    if (shell == NULL)
+    {
+        Batch_Delete(batch);
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    }
+    shell->batch = batch;
+    shell->session = session;
+    shell->asyncCallback = *async;
+    Lock_Init(&shell->streamNameLock);
+    Lock_Init(&shell->create.lock);
+    Batch_Init(&shell->streamNameBatch, 1);
+
+    miResult = Instance_Clone(&shellTemplate->__instance, &_shellInstance, batch);
+    if (miResult == MI_RESULT_OK)
+    {
+        shell->shellInstance = (Shell*) _shellInstance;
+        miResult = MI_OperationOptions_Clone(optionsTemplate, &shell->operationOptions);
+    }
+    if (miResult == MI_RESULT_OK)
+    {
+        /* The create may complete before ShellStart returns */
+        *_shell = shell;
+        miResult = ShellStart(shell);
+    }
+    if (miResult != MI_RESULT_OK)
+    {
+        if (shell->operationOptions.ft)
+        {
+            MI_OperationOptions_Delete(&shell->operationOptions);
+        }
+        Batch_Delete(batch);
+        *_shell = NULL;
+    }
+    return miResult;
+}
+
+MI_EXPORT void WINAPI WSManCreateShellEx(
+    _Inout_ WSMAN_SESSION_HANDLE session,
+    MI_Uint32 flags,
+    _In_ const MI_Char16* resourceUri,           // shell resource URI
+    _In_ const MI_Char16* shellId,
+    _In_opt_ WSMAN_SHELL_STARTUP_INFO *startupInfo,
+    _In_opt_ WSMAN_OPTION_SET *options,
+    _In_opt_ WSMAN_DATA *createXml,                     // open content for create shell
+    _In_ WSMAN_SHELL_ASYNC *async,
+    _Out_ WSMAN_SHELL_HANDLE *_shell) // should be closed using WSManCloseShell
+{
+    Batch *batch = NULL;
+    MI_Instance *_shellInstance;
+    MI_Result miResult;
+    char *errorMessage = NULL;
+    struct WSMAN_SHELL *shell = NULL;
+
+    LogFunctionStart("WSManCreateShellEx");
+
+    batch = Batch_New(BATCH_MAX_PAGES);
+    if (batch == NULL)
+    {
+        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+
+    shell = Batch_GetClear(batch, sizeof(struct WSMAN_SHELL));
+    if (shell == NULL)
+    {
+        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+
+    shell->batch = batch;
+    shell->session = session;
+    Lock_Init(&shell->streamNameLock);
+    Lock_Init(&shell->create.lock);
+    Batch_Init(&shell->streamNameBatch, 1);
+
+    miResult = MI_Application_NewOperationOptions(&session->api->application, MI_TRUE, &shell->operationOptions);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to create operation options", miResult);
+    }
+
+    /* Stash the async callback information for when we get the wsman response and need
+     * to call back into the client
+     */
+    shell->asyncCallback = *async;
+
+    miResult = Instance_New(&_shellInstance, &Shell_rtti, batch);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to create instance", miResult);
+    }
+    shell->shellInstance = (Shell*) _shellInstance;
+
+
+    miResult = ShellFillTemplate(batch, ShellFlags(session->api, flags), resourceUri, shellId, startupInfo, options, createXml, shell->shellInstance, &shell->operationOptions, &errorMessage);
+    if (miResult != MI_RESULT_OK)
+    {
+        goto error;
+    }
+
+    miResult = ShellStart(shell);
+    if (miResult != MI_RESULT_OK)
+    {
+        errorMessage = "MI_Application_NewSession failed";
+        goto error;
+    }
+
+    *_shell = shell;
+    LogFunctionEnd("WSManCreateShellEx", miResult);
+    return;
+
+error:
+    {
+        WSMAN_ERROR error = { 0 };
+        error.code = miResult;
+        Utf8ToUtf16Le(batch, errorMessage, (MI_Char16**) &error.errorDetail);
+        async->completionFunction(
+                async->operationContext,
+                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                &error,
+                shell,
+                NULL,
+                NULL,
+                NULL);
+     }
+
+    if (batch)
+    {
+        Batch_Delete(batch);
+    }
+
+    if (shell->operationOptions.ft)
+    {
+        MI_OperationOptions_Delete(&shell->operationOptions);
+    }
+
+    *_shell = NULL;
+    LogFunctionEnd("WSManCreateShellEx", miResult);
+}
+
+void MI_CALL CommandShellComplete(
+    _In_opt_     MI_Operation *miOperation,
+    _In_     void *callbackContext,
+    _In_opt_ const MI_Instance *instance,
+             MI_Boolean moreResults,
+    _In_     MI_Result resultCode,
+    _In_opt_z_ const MI_Char *errorString,
+    _In_opt_ const MI_Instance *errorDetails,
+    _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
+{
+    WSMAN_COMMAND_HANDLE operation = ( WSMAN_COMMAND_HANDLE ) callbackContext;
+    WSMAN_ERROR error = {0};
+    __LOGD(("%s: START, errorCode=%u", "CommandShellComplete", resultCode));
+    CancellableFinished(&operation->run);
+    error.code = resultCode;
+    if (resultCode != 0)
+    {
+        if (errorString)
+        {
+            Utf8ToUtf16Le(operation->batch, errorString, (MI_Char16**) &error.errorDetail);
+        }
+        else
+        {
+            Utf8ToUtf16Le(operation->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
+        }
+    }
+    else if (instance)
+    {
+        MI_Value value;
+        MI_Type type;
+
+        if ((__MI_Instance_GetElement(instance, "CommandId", &value, &type, NULL, NULL) == MI_RESULT_OK) &&
+                (type == MI_STRING) &&
+                (__MI_Instance_SetElement(operation->commandProperties, "CommandId", &value, MI_STRING, 0) == MI_RESULT_OK) &&
+                (__MI_Instance_GetElement(operation->commandProperties, "CommandId", &value, &type, NULL, NULL) == MI_RESULT_OK))
+        {
+            __LOGD(("Command returned Command ID = %s", value.string));
+
+            /* Replace this with a pointer to the command ID from the instance owned by the command object, rather than the one that will
+             * go out of scope after this call finishes */
+            operation->commandId = value.string;
+        }
+        else
+        {
+            resultCode = MI_RESULT_FAILED;
+        }
+    }
+
+    operation->asyncCallback.completionFunction(
+                operation->asyncCallback.operationContext,
+                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                &error,
+                operation->shell,
+                operation,
+                NULL,
+                NULL);
+    MI_Operation_Close(&operation->miOperation);
+//    Batch_Delete(operation->batch);
+
+    LogFunctionEnd("CommandShellComplete", resultCode);
+}
+
+/* Adds an Arguments property that is a string array */
+MI_Result  ExtractCommandArgs(WSMAN_COMMAND_ARG_SET *args, Batch *batch, MI_Instance *commandProperties)
+{
+    MI_Value stringArr;
+    MI_Uint32 index;
+
+    memset(&stringArr, 0, sizeof(stringArr));
+
+    stringArr.stringa.size = args->argsCount;
+    stringArr.stringa.data = Batch_Get(batch, sizeof(MI_Char*)*stringArr.stringa.size);
+    if (stringArr.stringa.data == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    for (index = 0; index != stringArr.stringa.size; index++)
+    {
+        if (!Utf16LeToUtf8(batch, args->args[index], &stringArr.stringa.data[index]))
+        {
+            return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+        }
+        __LOGD(("Command argument %u = %s", index, stringArr.stringa.data[index]));
+    }
+
+    return MI_Instance_AddElement(commandProperties, "Arguments", &stringArr, MI_STRINGA, 0);
+}
+
+MI_EXPORT void WINAPI WSManRunShellCommandEx(
+    _Inout_ WSMAN_SHELL_HANDLE shell,
+    MI_Uint32 flags,
+    _In_ const MI_Char16* commandId,
+    _In_ const MI_Char16* commandLine,
+    _In_opt_ WSMAN_COMMAND_ARG_SET *args,
+    _In_opt_ WSMAN_OPTION_SET *options,
+    _In_ WSMAN_SHELL_ASYNC *async,
+    _Out_ WSMAN_COMMAND_HANDLE *command) // should be closed using WSManCloseCommand
+{
+    MI_Result miResult;
+    char *errorMessage = NULL;
+    Batch *batch = NULL;
+    MI_Value value;
+    char *tmpStr;
+
+    LogFunctionStart("WSManRunShellCommandEx");
+
+    batch = Batch_New(BATCH_MAX_PAGES);
+    if (batch == NULL)
+    {
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+
+    (*command) = Batch_GetClear(batch, sizeof(struct WSMAN_COMMAND));
+    if (*command == NULL)
+    {
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    (*command)->shell = shell;
+    (*command)->asyncCallback = *async;
+    (*command)->batch = batch;
+    Lock_Init(&(*command)->run.lock);
+
+    miResult = MI_Application_NewOperationOptions(&shell->session->api->application, MI_TRUE, &(*command)->miOptions);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to create operation options", miResult);
+    }
+
+    miResult = MI_Application_NewInstance(&shell->session->api->application, "CommandLine", NULL, &(*command)->commandProperties);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to allocate receive properties instance", miResult);
+    }
+
+    if (commandId)
+    {
+        if (!Utf16LeToUtf8(batch, commandId, &tmpStr))
+        {
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        value.string = tmpStr;
         if (MI_Instance_AddElement((*command)->commandProperties, "CommandId", &value, MI_STRING, 0) != MI_RESULT_OK)
         {
-            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        (*command)->commandId = tmpStr;
+        __LOGD(("command ID = %s", tmpStr));
+    }
+
+    if (commandLine)
+    {
+        if (!Utf16LeToUtf8(batch, commandLine, &tmpStr))
+        {
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        value.string = tmpStr;
+        if (MI_Instance_AddElement((*command)->commandProperties, "Command", &value, MI_STRING, 0) != MI_RESULT_OK)
+        {
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        __LOGD(("command line = %s", tmpStr));
+    }
+
+    if (args )
+    {
+        miResult = ExtractCommandArgs(args, batch, (*command)->commandProperties);
+        if (miResult != MI_RESULT_OK)
+        {
+            GOTO_ERROR("Failed to extract command args", miResult);
+        }
+    }
+
+    {
+        MI_Value value;
+        MI_Type type;
+        if (__MI_Instance_GetElement(&shell->shellInstance->__instance, "ResourceUri", &value, &type, NULL, NULL) != MI_RESULT_OK)
+        {
+            GOTO_ERROR("Failed to get resource URI", MI_RESULT_FAILED);
+        }
+        if (MI_OperationOptions_SetResourceUri(&(*command)->miOptions, value.string) != MI_RESULT_OK)
+        {
+            GOTO_ERROR("Failed to set resource URI in options", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+    }
+    if (MI_OperationOptions_SetNumber(&(*command)->miOptions, "__MI_OPERATIONOPTIONS_ISSHELL", 1, 0) != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to set IsShell option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+
+
+    if (MI_OperationOptions_SetString(&(*command)->miOptions, "__MI_OPERATIONOPTIONS_ACTION", "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Command", 0) != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to set action option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    {
+
+        WSMAN_COMMAND_HANDLE newCommand = *command;
+
+        newCommand->callbacks.instanceResult = CommandShellComplete;
+        newCommand->callbacks.callbackContext = newCommand;
+
+        CancellableIssuing(&newCommand->run);
+        MI_Session_Invoke(&shell->miSession,
+                0, /* flags */
+                &newCommand->miOptions, /*options*/
+                NULL, /* namespace */
+                "Shell",
+                "Command",
+                &shell->shellInstance->__instance,
+                newCommand->commandProperties,
+                &newCommand->callbacks, &newCommand->miOperation);
+        CancellableIssued(&newCommand->run, &newCommand->miOperation);
+    }
+
+    __LOGD(("New command handle = %p", *command));
+    LogFunctionEnd("WSManRunShellCommandEx", MI_RESULT_OK);
+    return;
+
+
+error:
+    {
+        WSMAN_ERROR error = { 0 };
+        error.code = miResult;
+        Utf8ToUtf16Le(batch, errorMessage, (MI_Char16**) &error.errorDetail);
+        async->completionFunction(
+                async->operationContext,
+                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                &error,
+                shell,
+                NULL,
+                NULL,
+                NULL);
+     }
+
+    if ((*command)->miOptions.ft)
+    {
+        MI_OperationOptions_Delete(&(*command)->miOptions);
+    }
+    if ((*command)->commandProperties)
+    {
+        MI_Instance_Delete((*command)->commandProperties);
+    }
+    Batch_Delete(batch);
+    LogFunctionEnd("WSManRunShellCommandEx", miResult);
+}
+void MI_CALL SignalShellComplete(
+    _In_opt_     MI_Operation *miOperation,
+    _In_     void *callbackContext,
+    _In_opt_ const MI_Instance *instance,
+             MI_Boolean moreResults,
+    _In_     MI_Result resultCode,
+    _In_opt_z_ const MI_Char *errorString,
+    _In_opt_ const MI_Instance *errorDetails,
+    _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
+{
+    WSMAN_OPERATION_HANDLE operation = ( WSMAN_OPERATION_HANDLE ) callbackContext;
+    WSMAN_ERROR error = {0};
+    __LOGD(("%s: START, errorCode=%u", "SignalShellComplete", resultCode));
+    error.code = resultCode;
+    if (resultCode != 0)
+    {
+        if (errorString)
+        {
+            Utf8ToUtf16Le(operation->batch, errorString, (MI_Char16**) &error.errorDetail);
+        }
+        else
+        {
+            Utf8ToUtf16Le(operation->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
+        }
+    }
+    operation->asyncCallback.completionFunction(
+                operation->asyncCallback.operationContext,
+                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                &error,
+                operation->shell,
+                operation->command,
+                operation,
+                NULL);
+    MI_Operation_Close(&operation->miOperation);
+    OperationDereference(operation);
+
+    LogFunctionEnd("SignalShellComplete", resultCode);
+}
+
+MI_EXPORT void WINAPI WSManSignalShell(
+    _In_ WSMAN_SHELL_HANDLE shell,
+    _In_opt_ WSMAN_COMMAND_HANDLE command,         // if NULL, the Signal will be sent to the shell
+    MI_Uint32 flags,
+    _In_ const MI_Char16* code,             // signal code
+    _In_ WSMAN_SHELL_ASYNC *async,
+    _Out_ WSMAN_OPERATION_HANDLE *signalOperation)  // should be closed using WSManCloseOperation
+{
+    MI_Result miResult;
+    char *errorMessage = NULL;
+    //MI_Instance *desiredStream = NULL;
+    Batch *batch = NULL;
+//    char *streamSetString = NULL;
+    MI_Value value;
+
+    LogFunctionStart("WSManSignalShell");
+
+    batch = Batch_New(BATCH_MAX_PAGES);
+    if (batch == NULL)
+    {
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+
+    (*signalOperation) = Batch_GetClear(batch, sizeof(struct WSMAN_OPERATION));
+    if (*signalOperation == NULL)
+    {
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    (*signalOperation)->type = WSMAN_OPERATION_SIGNAL;
+    (*signalOperation)->shell = shell;
+    (*signalOperation)->command = command;
+    (*signalOperation)->asyncCallback = *async;
+    (*signalOperation)->batch = batch;
+
+    miResult = MI_Application_NewOperationOptions(&shell->session->api->application, MI_TRUE, &(*signalOperation)->miOptions);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to create operation options", miResult);
+    }
+
+    miResult = MI_Application_NewInstance(&shell->session->api->application, "Signal", NULL, &(*signalOperation)->operationProperties);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to allocate receive properties instance", miResult);
+    }
+
+    if (!Utf16LeToUtf8(batch, code, &value.string))
+    {
+        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+     miResult = MI_Instance_AddElement((*signalOperation)->operationProperties, "Code", &value, MI_STRING, 0);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("out of memory", miResult);
+    }
+    __LOGD(("Signal Code = %s", value.string));
+
+    if (command)
+    {
+        value.string = command->commandId;
+        miResult = MI_Instance_AddElement((*signalOperation)->operationProperties, "CommandId", &value, MI_STRING, 0);
+        if (miResult != MI_RESULT_OK)
+        {
+            GOTO_ERROR("out of memory", miResult);
+        }
+        __LOGD(("Signal for command %s", command->commandId));
+    }
+
+    {
+        MI_Value value;
+        MI_Type type;
+        if (__MI_Instance_GetElement(&shell->shellInstance->__instance, "ResourceUri", &value, &type, NULL, NULL) != MI_RESULT_OK)
+        {
+            GOTO_ERROR("Failed to get resource URI", MI_RESULT_FAILED);
+        }
+        if (MI_OperationOptions_SetResourceUri(&(*signalOperation)->miOptions, value.string) != MI_RESULT_OK)
+        {
+            GOTO_ERROR("Failed to set resource URI in options", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+    }
+    if (MI_OperationOptions_SetNumber(&(*signalOperation)->miOptions, "__MI_OPERATIONOPTIONS_ISSHELL", 1, 0) != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to set IsShell option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+
+
+    if (MI_OperationOptions_SetString(&(*signalOperation)->miOptions, "__MI_OPERATIONOPTIONS_ACTION", "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Signal", 0) != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to set action option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+
+    {
+
+        (*signalOperation)->callbacks.instanceResult = SignalShellComplete;
+        (*signalOperation)->callbacks.callbackContext = *signalOperation;
+        (*signalOperation)->refs = 2; /* The caller's handle and the request */
+
+        MI_Session_Invoke(&shell->miSession,
+                0, /* flags */
+                &(*signalOperation)->miOptions, /*options*/
+                NULL, /* namespace */
+                "Shell",
+                "Signal",
+                &shell->shellInstance->__instance,
+                (*signalOperation)->operationProperties,
+                &((*signalOperation)->callbacks), &(*signalOperation)->miOperation);
+    }
+
+    LogFunctionEnd("WSManSignalShell", MI_RESULT_OK);
+    return;
+
+
+error:
+    {
+        WSMAN_ERROR error = { 0 };
+        error.code = miResult;
+        Utf8ToUtf16Le(batch, errorMessage, (MI_Char16**) &error.errorDetail);
+        async->completionFunction(
+                async->operationContext,
+                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                &error,
+                shell,
+                NULL,
+                NULL,
+                NULL);
+     }
+
+    if ((*signalOperation)->miOptions.ft)
+    {
+        MI_OperationOptions_Delete(&(*signalOperation)->miOptions);
+    }
+    if ((*signalOperation)->operationProperties)
+    {
+        MI_Instance_Delete((*signalOperation)->operationProperties);
+    }
+    LogFunctionEnd("WSManSignalShell", MI_RESULT_NOT_SUPPORTED);
+}
+
+/* ShellStreamName
+ * UTF-16 form of a Receive stream name, converted once per shell and then reused. Returns
+ * NULL if the name is not cached and there is no room to add it.
+ */
+static const MI_Char16 *ShellStreamName(WSMAN_SHELL_HANDLE shell, const char *streamName)
+{
+    const MI_Char16 *name16 = NULL;
+    MI_Uint32 i;
+
+    Lock_Acquire(&shell->streamNameLock);
+    for (i = 0; i != shell->streamNameCount; i++)
+    {
+        if (Tcscmp(shell->streamNames[i].name, streamName) == 0)
+        {
+            name16 = shell->streamNames[i].name16;
+            break;
+        }
+    }
+    if ((name16 == NULL) && (shell->streamNameCount < WSMAN_STREAM_NAME_CACHE_MAX))
+    {
+        WSMAN_STREAM_NAME *entry = &shell->streamNames[shell->streamNameCount];
+
+        entry->name = Batch_Tcsdup(&shell->streamNameBatch, streamName);
+        if (entry->name && Utf8ToUtf16Le(&shell->streamNameBatch, streamName, &entry->name16))
+        {
+            name16 = entry->name16;
+            shell->streamNameCount++;
+        }
+    }
+    Lock_Release(&shell->streamNameLock);
+
+    return name16;
+}
+
+/* DecodeReceiveData
+ * Base64 decode, and decompress if the shell is compressed, one block of Receive data.
+ * The result lands in the caller's receive buffer when there is one and it is big enough.
+ * Otherwise it is allocated and *allocated is set so the caller frees it.
+ */
+static MI_Result DecodeReceiveData(WSMAN_OPERATION_HANDLE operation, const char *streamData, DecodeBuffer *decodedBuffer, MI_Boolean *allocated)
+{
+    DecodeBuffer encodedBuffer;
+    DecodeBuffer compressedBuffer;
+    MI_Result miResult;
+
+    encodedBuffer.buffer = (char*)streamData;
+    encodedBuffer.bufferLength = Tcslen(streamData);
+    encodedBuffer.bufferUsed = encodedBuffer.bufferLength;
+
+    memset(decodedBuffer, 0, sizeof(*decodedBuffer));
+    *allocated = MI_FALSE;
+
+    if (operation->receiveBuffer.buffer == NULL)
+    {
+        miResult = Base64DecodeBuffer(&encodedBuffer, decodedBuffer);
+        if (miResult != MI_RESULT_OK)
+            return miResult;
+
+        if (operation->shell->isCompressed)
+        {
+            compressedBuffer = *decodedBuffer;
+            miResult = DecompressBuffer(&compressedBuffer, decodedBuffer);
+            free(compressedBuffer.buffer);
+            if (miResult != MI_RESULT_OK)
+                return miResult;
+        }
+        *allocated = MI_TRUE;
+        return MI_RESULT_OK;
+    }
+
+    if (operation->shell->isCompressed)
+    {
+        /* The decoded data is never bigger than the encoded text */
+        if (operation->receiveScratch.bufferLength < encodedBuffer.bufferUsed)
+        {
+            MI_Char *scratch = realloc(operation->receiveScratch.buffer, encodedBuffer.bufferUsed);
+            if (scratch == NULL)
+                return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+            operation->receiveScratch.buffer = scratch;
+            operation->receiveScratch.bufferLength = encodedBuffer.bufferUsed;
+        }
+        compressedBuffer = operation->receiveScratch;
+
+        miResult = Base64DecodeBufferInto(&encodedBuffer, &compressedBuffer);
+        if (miResult != MI_RESULT_OK)
+            return miResult;
+
+        decodedBuffer->buffer = (MI_Char*)operation->receiveBuffer.buffer;
+        decodedBuffer->bufferLength = operation->receiveBuffer.bufferLength;
+        miResult = DecompressBufferInto(&compressedBuffer, decodedBuffer, &operation->decompressWorkspace);
+        if (miResult == MI_RESULT_SERVER_LIMITS_EXCEEDED)
+        {
+            miResult = DecompressBuffer(&compressedBuffer, decodedBuffer);
+            *allocated = (miResult == MI_RESULT_OK);
+        }
+        return miResult;
+    }
+
+    decodedBuffer->buffer = (MI_Char*)operation->receiveBuffer.buffer;
+    decodedBuffer->bufferLength = operation->receiveBuffer.bufferLength;
+    miResult = Base64DecodeBufferInto(&encodedBuffer, decodedBuffer);
+    if (miResult == MI_RESULT_SERVER_LIMITS_EXCEEDED)
+    {
+        miResult = Base64DecodeBuffer(&encodedBuffer, decodedBuffer);
+        *allocated = (miResult == MI_RESULT_OK);
+    }
+    return miResult;
+}
+
+MI_Result DecodeReceiveStream(WSMAN_OPERATION_HANDLE operation, const MI_Instance *streamInstance)
+{
+    DecodeBuffer decodedBuffer;
+    MI_Boolean decodedAllocated = MI_FALSE;
+    Batch *batch = NULL;
+    WSMAN_RESPONSE_DATA responseData;
+    WSMAN_ERROR error = {0};
+    const char *commandId = NULL;
+    const char *streamName = NULL;
+    const char *streamData = NULL;
+    MI_Boolean streamComplete = MI_FALSE;
+    MI_Value value;
+    MI_Type type;
+    MI_Uint32 flags;
+
+    memset (&responseData, 0, sizeof(responseData));
+    memset(&decodedBuffer, 0, sizeof(decodedBuffer));
+
+    if (__MI_Instance_GetElement(streamInstance, "CommandId", &value, &type, &flags, NULL) == MI_RESULT_OK)
+    {
+        commandId = value.string;
+        __LOGD(("Command ID = %s", commandId));
+    }
+
+    if (__MI_Instance_GetElement(streamInstance, "streamName", &value, &type, &flags, NULL) == MI_RESULT_OK)
+    {
+        streamName = value.string;
+        __LOGD(("Stream Name = %s", streamName));
+    }
+
+    if (__MI_Instance_GetElement(streamInstance, "endOfStream", &value, &type, &flags, NULL) == MI_RESULT_OK)
+    {
+        streamComplete = value.boolean;
+        __LOGD(("End of stream = %d", streamComplete));
+    }
+
+    if (__MI_Instance_GetElement(streamInstance, "data", &value, &type, &flags, NULL) == MI_RESULT_OK)
+    {
+        streamData = value.string;
+        if (DEBUG_LOG_ENABLED() && streamData)
+        {
+            size_t dataLength = strlen(streamData);
+            __LOGD(("Data length=%u, hash=%08x, data=%.*s%s", (MI_Uint32) dataLength, DebugLog_Hash(streamData, dataLength),
+                DEBUG_LOG_PAYLOAD_PREFIX, streamData, (dataLength > DEBUG_LOG_PAYLOAD_PREFIX) ? "..." : ""));
+        }
+    }
+
+    if (DecodeReceiveData(operation, streamData, &decodedBuffer, &decodedAllocated) != MI_RESULT_OK)
+    {
+        error.code = MI_RESULT_FAILED;
+        Utf8ToUtf16Le(operation->batch, "Receive failed to decode stream data", (MI_Char16**) &error.errorDetail);
+        goto error;
+    }
+
+    /* TODO!! */
+    responseData.receiveData.commandState = NULL;
+
+    responseData.receiveData.streamId = ShellStreamName(operation->shell, streamName);
+    if (responseData.receiveData.streamId == NULL)
+    {
+        batch = Batch_New(BATCH_MAX_PAGES);
+        if ((batch == NULL) ||
+            !Utf8ToUtf16Le(batch, streamName, (MI_Char16**) &responseData.receiveData.streamId))
+        {
+            if (decodedAllocated)
+                free(decodedBuffer.buffer);
+            if (batch)
+                Batch_Delete(batch);
+            error.code = MI_RESULT_FAILED;
+            Utf8ToUtf16Le(operation->batch, "Receive failed to convert stream name", (MI_Char16**) &error.errorDetail);
+            goto error;
+        }
+    }
+
+    responseData.receiveData.exitCode = 0;
+    responseData.receiveData.streamData.type = WSMAN_DATA_TYPE_BINARY;
+    responseData.receiveData.streamData.binaryData.data = (MI_Uint8*) decodedBuffer.buffer;
+    responseData.receiveData.streamData.binaryData.dataLength = decodedBuffer.bufferUsed;
+
+    flags = 0;
+    if (streamComplete)
+        flags = WSMAN_FLAG_CALLBACK_END_OF_STREAM;
+
+    operation->asyncCallback.completionFunction(
+            operation->asyncCallback.operationContext,
+            flags,
+            &error,
+            operation->shell,
+            operation->command,
+            operation,
+            &responseData);
+
+    if (decodedAllocated)
+        free(decodedBuffer.buffer);
+
+    if (batch)
+        Batch_Delete(batch);
+    return MI_RESULT_OK;
+
+error:
+    operation->asyncCallback.completionFunction(
+                operation->asyncCallback.operationContext,
+                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                &error,
+                operation->shell,
+                operation->command,
+                operation,
+                NULL);
+
+    return error.code;
+}
+
+MI_Result DecodeReceiveCommandState(WSMAN_OPERATION_HANDLE operation, const MI_Instance *commandStateInstance, MI_Boolean *done)
+{
+    Batch *batch;
+    WSMAN_RESPONSE_DATA responseData = {{0}};
+    WSMAN_ERROR error = {0};
+    const char *commandId = NULL;
+    const char *state = NULL;
+    MI_Value value;
+    MI_Type type;
+    MI_Uint32 flags;
+
+    if (__MI_Instance_GetElement(commandStateInstance, "CommandId", &value, &type, &flags, NULL) == MI_RESULT_OK)
+    {
+        commandId = value.string;
+        __LOGD(("CommandID = %s", commandId));
+    }
+
+    if (__MI_Instance_GetElement(commandStateInstance, "state", &value, &type, &flags, NULL) == MI_RESULT_OK)
+    {
+        state = value.string;
+        __LOGD(("Command state = %s", state));
+    }
+
+
+    batch = Batch_New(BATCH_MAX_PAGES);
+    if (!Utf8ToUtf16Le(batch, state, (MI_Char16**) &responseData.receiveData.commandState))
+    {
+        error.code = MI_RESULT_FAILED;
+        Utf8ToUtf16Le(operation->batch, "Receive failed to convert commandState", (MI_Char16**) &error.errorDetail);
+        goto error;
+    }
+
+    if (strcmp(state, WSMAN_COMMAND_STATE_DONE) == 0)
+    {
+        flags = WSMAN_FLAG_CALLBACK_END_OF_OPERATION;
+        *done = MI_TRUE;
+    }
+
+    operation->asyncCallback.completionFunction(
+            operation->asyncCallback.operationContext,
+            0,
+            &error,
+            operation->shell,
+            operation->command,
+            operation,
+            &responseData);
+
+    Batch_Delete(batch);
+    return MI_RESULT_OK;
+
+error:
+    operation->asyncCallback.completionFunction(
+                operation->asyncCallback.operationContext,
+                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                &error,
+                operation->shell,
+                operation->command,
+                operation,
+                NULL);
+
+    return error.code;
+}
+
+/* ReceiveDeliverResult
+ * Hand one Receive response to the caller. Returns MI_TRUE if another Receive request
+ * should be issued in its place.
+ */
+static MI_Boolean ReceiveDeliverResult(
+    WSMAN_OPERATION_HANDLE operation,
+    const MI_Instance *instance,
+    MI_Result resultCode,
+    const MI_Char *errorString)
+{
+    MI_Boolean done = MI_FALSE;
+    WSMAN_ERROR error = {0};
+
+    error.code = resultCode;
+    if (resultCode != 0)
+    {
+        if (errorString)
+        {
+            Utf8ToUtf16Le(operation->batch, errorString, (MI_Char16**) &error.errorDetail);
+        }
+        else
+        {
+            Utf8ToUtf16Le(operation->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
+        }
+        goto error;
+    }
+
+    if (instance)
+    {
+        MI_Value value;
+        MI_Uint32 type;
+
+        if (__MI_Instance_GetElement(instance, "CommandId", &value, &type, NULL, NULL) == MI_RESULT_OK)
+        {
+            __LOGD(("Receive result for CommandId=%s", value.string));
+        }
+        __LOGD(("Got an instance"));
+        if (__MI_Instance_GetElement(instance, "Stream", &value, &type, NULL, NULL) == MI_RESULT_OK)
+        {
+            __LOGD(("Got a stream, type = %u", type));
+
+            if (type & MI_INSTANCE)
+            {
+                MI_Result miResult = MI_RESULT_OK;
+
+                if (type & MI_ARRAY)
+                {
+                    int i;
+                    MI_InstanceA *instArray = (MI_InstanceA*) &value;
+
+                    for (i = 0; i != instArray->size; i++)
+                    {
+                        __LOGD(("Entry %u = %p", i, instArray->data[i]));
+                        miResult = DecodeReceiveStream(operation, instArray->data[i]);
+                    }
+
+                }
+                else
+                {
+                    __LOGD(("Entry %u = %p", 0, value.string));
+                    miResult = DecodeReceiveStream(operation, value.instance);
+                }
+                if (miResult != MI_RESULT_OK)
+                {
+                    error.code = MI_RESULT_FAILED;
+                    Utf8ToUtf16Le(operation->batch, "Receive failed to get stream data", (MI_Char16**) &error.errorDetail);
+                    goto error;
+                }
+            }
+            else
+            {
+                __LOGD(("It is an unsupported type"));
+                error.code = MI_RESULT_FAILED;
+                Utf8ToUtf16Le(operation->batch, "Receive data has unsupported type", (MI_Char16**) &error.errorDetail);
+                goto error;
+            }
+        }
+        else if (__MI_Instance_GetElement(instance, "CommandState", &value, &type, NULL, NULL) == MI_RESULT_OK)
+        {
+            MI_Result miResult = DecodeReceiveCommandState(operation, value.instance, &done);
+            if (miResult != MI_RESULT_OK)
+            {
+                error.code = MI_RESULT_FAILED;
+                Utf8ToUtf16Le(operation->batch, "Receive failed to get stream data", (MI_Char16**) &error.errorDetail);
+                goto error;
+            }
+         }
+    }
+
+    return !done;
+
+error:
+    operation->asyncCallback.completionFunction(
+                operation->asyncCallback.operationContext,
+                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                &error,
+                operation->shell,
+                operation->command,
+                operation,
+                NULL);
+    return MI_FALSE;
+}
+
+/* ReceiveIssue
+ * Send the Receive request for a slot that has been claimed for it. Called by the thread
+ * that owns receiveIssuing so requests reach the session in sequence order.
+ */
+static void ReceiveIssue(WSMAN_RECEIVE_SLOT *slot)
+{
+    WSMAN_OPERATION_HANDLE operation = slot->operation;
+
+    __LOGD(("Sending receive request %u", slot->sequence));
+    MI_Session_Invoke(&operation->shell->miSession,
+            0, /* flags */
+            &operation->miOptions, /*options*/
+            NULL, /* namespace */
+            "Shell",
+            "Receive",
+            &operation->shell->shellInstance->__instance,
+            operation->operationProperties,
+            &slot->callbacks, &slot->miOperation);
+}
+
+/* ReceiveCancelSlot
+ * Cancel a slot's request. The caller has counted itself in slot->cancelling under
+ * receiveLock, which keeps the slot's callback from closing the operation until this is done.
+ */
+static void ReceiveCancelSlot(WSMAN_RECEIVE_SLOT *slot)
+{
+    MI_Operation_Cancel(&slot->miOperation, MI_REASON_NONE);
+    Atomic_Dec(&slot->cancelling);
+    CondLock_Broadcast((ptrdiff_t) &slot->cancelling);
+}
+
+/* ReceiveCancelSlots
+ * Cancel every request still outstanding once the operation is finished. A request that
+ * is still being issued is cancelled by the issuing thread as soon as MI_Session_Invoke returns.
+ */
+static void ReceiveCancelSlots(WSMAN_OPERATION_HANDLE operation)
+{
+    WSMAN_RECEIVE_SLOT *cancel[RECEIVE_PIPELINE_DEPTH_MAX];
+    MI_Uint32 count = 0;
+    MI_Uint32 i;
+
+    Lock_Acquire(&operation->receiveLock);
+    for (i = 0; i != operation->receiveDepth; i++)
+    {
+        WSMAN_RECEIVE_SLOT *slot = &operation->receiveSlots[i];
+
+        if (!slot->busy || slot->closing)
+            continue;
+
+        if (slot->issuing)
+        {
+            slot->cancelAfterIssue = MI_TRUE;
+            continue;
+        }
+        Atomic_Inc(&slot->cancelling);
+        cancel[count++] = slot;
+    }
+    Lock_Release(&operation->receiveLock);
+
+    for (i = 0; i != count; i++)
+    {
+        ReceiveCancelSlot(cancel[i]);
+    }
+}
+
+/* ReceiveReleaseIfDone
+ * Called with receiveLock held by a thread that has just stopped issuing, delivering or
+ * waiting on a request, or by WSManCloseOperation. Returns MI_TRUE to exactly one caller
+ * once the pipeline has finished and none of those is left, and that caller drops the
+ * pipeline's reference to the operation after dropping the lock.
+ */
+static MI_Boolean ReceiveReleaseIfDone(WSMAN_OPERATION_HANDLE operation)
+{
+    if (operation->receiveFinished &&
+        !operation->receiveReleased &&
+        (operation->receiveBusy == 0) &&
+        !operation->receiveIssuing &&
+        !operation->receiveDelivering)
+    {
+        operation->receiveReleased = MI_TRUE;
+        return MI_TRUE;
+    }
+    return MI_FALSE;
+}
+
+/* ReceiveIssueSlots
+ * Issue a request into every idle slot until the command is finished. Only one thread
+ * issues at a time; a thread that finds another one issuing leaves the work to it. A slot
+ * is only idle once its own callback has closed its last request, so no callback can still
+ * be using it. At most two pipelines' worth of requests are outstanding or held for delivery.
+ */
+static void ReceiveIssueSlots(WSMAN_OPERATION_HANDLE operation)
+{
+    MI_Boolean release;
+
+    Lock_Acquire(&operation->receiveLock);
+    if (operation->receiveIssuing)
+    {
+        Lock_Release(&operation->receiveLock);
+        return;
+    }
+    operation->receiveIssuing = MI_TRUE;
+
+    for (;;)
+    {
+        WSMAN_RECEIVE_SLOT *slot = NULL;
+        MI_Boolean cancel = MI_FALSE;
+        MI_Uint32 i;
+
+        if (!operation->receiveFinished &&
+            ((operation->nextIssueSequence - operation->nextDeliverSequence) < (operation->receiveDepth * 2)))
+        {
+            for (i = 0; i != operation->receiveDepth; i++)
+            {
+                if (!operation->receiveSlots[i].busy)
+                {
+                    slot = &operation->receiveSlots[i];
+                    break;
+                }
+            }
+        }
+        if (slot == NULL)
+            break;
+
+        slot->busy = MI_TRUE;
+        slot->issuing = MI_TRUE;
+        slot->closing = MI_FALSE;
+        slot->cancelAfterIssue = MI_FALSE;
+        slot->sequence = operation->nextIssueSequence++;
+        operation->receiveBusy++;
+        Lock_Release(&operation->receiveLock);
+
+        ReceiveIssue(slot);
+
+        Lock_Acquire(&operation->receiveLock);
+        slot->issuing = MI_FALSE;
+        if (slot->cancelAfterIssue && !slot->closing)
+        {
+            Atomic_Inc(&slot->cancelling);
+            cancel = MI_TRUE;
+        }
+        if (cancel)
+        {
+            Lock_Release(&operation->receiveLock);
+            ReceiveCancelSlot(slot);
+            Lock_Acquire(&operation->receiveLock);
+        }
+    }
+
+    operation->receiveIssuing = MI_FALSE;
+    release = ReceiveReleaseIfDone(operation);
+    Lock_Release(&operation->receiveLock);
+
+    if (release)
+    {
+        OperationDereference(operation);
+    }
+}
+
+/* ReceiveHold
+ * Copy a response that cannot be delivered straight away and queue it behind the
+ * responses to earlier requests and any earlier response to the same request.
+ */
+static void ReceiveHold(WSMAN_OPERATION_HANDLE operation, const WSMAN_RECEIVE_RESPONSE *live)
+{
+    WSMAN_RECEIVE_RESPONSE *response = calloc(1, sizeof(*response));
+    WSMAN_RECEIVE_RESPONSE **link;
+
+    if (response)
+    {
+        response->sequence = live->sequence;
+        response->final = live->final;
+        response->resultCode = live->resultCode;
+        if (live->result && (MI_Instance_Clone(live->result, &response->result) != MI_RESULT_OK))
+        {
+            response->result = NULL;
+            response->resultCode = MI_RESULT_SERVER_LIMITS_EXCEEDED;
+        }
+        if (live->errorString)
+        {
+            response->errorString = strdup(live->errorString);
+        }
+    }
+
+    Lock_Acquire(&operation->receiveLock);
+    if (operation->receiveFinished)
+    {
+        /* Nothing more is delivered */
+        Lock_Release(&operation->receiveLock);
+        if (response)
+        {
+            ReceiveResponseDelete(operation, response);
+        }
+        return;
+    }
+    if (response == NULL)
+    {
+        /* Fail the stream at this point rather than leave a gap in it. Only the earliest
+         * failure matters as delivering it finishes the operation.
+         */
+        response = &operation->receiveOutOfMemory;
+        if (response->resultCode != MI_RESULT_OK)
+        {
+            if (response->sequence <= live->sequence)
+            {
+                Lock_Release(&operation->receiveLock);
+                return;
+            }
+            for (link = &operation->receiveHeld; *link != response; link = &(*link)->next)
+            {
+            }
+            *link = response->next;
+        }
+        response->sequence = live->sequence;
+        response->final = MI_TRUE;
+        response->resultCode = MI_RESULT_SERVER_LIMITS_EXCEEDED;
+        __LOGE(("Receive ran out of memory holding response %u", live->sequence));
+    }
+
+    link = &operation->receiveHeld;
+    while (*link && ((*link)->sequence <= response->sequence))
+    {
+        link = &(*link)->next;
+    }
+    response->next = *link;
+    *link = response;
+    Lock_Release(&operation->receiveLock);
+}
+
+/* ReceivePipelineDeliver
+ * Run by the thread that owns receiveDelivering. Hands responses to the caller in the order
+ * the requests were issued, starting with this thread's own response if it is given, until
+ * the next one has not arrived yet. Once a response says the command is done or failed the
+ * requests still outstanding are cancelled and later responses are dropped.
+ */
+static void ReceivePipelineDeliver(WSMAN_OPERATION_HANDLE operation, WSMAN_RECEIVE_RESPONSE *live)
+{
+    WSMAN_RECEIVE_RESPONSE *response = live;
+    MI_Boolean release;
+
+    for (;;)
+    {
+        if (response)
+        {
+            MI_Boolean deliver;
+            MI_Boolean final = response->final;
+            MI_Boolean more = MI_TRUE;
+            MI_Boolean finish = MI_FALSE;
+
+            Lock_Acquire(&operation->receiveLock);
+            deliver = !operation->receiveFinished;
+            Lock_Release(&operation->receiveLock);
+
+            if (deliver)
+            {
+                more = ReceiveDeliverResult(operation, response->result, response->resultCode, response->errorString);
+            }
+
+            Lock_Acquire(&operation->receiveLock);
+            if (final)
+            {
+                operation->nextDeliverSequence++;
+            }
+            if (!more && !operation->receiveFinished)
+            {
+                operation->receiveFinished = MI_TRUE;
+                finish = MI_TRUE;
+            }
+            Lock_Release(&operation->receiveLock);
+
+            if (response != live)
+            {
+                ReceiveResponseDelete(operation, response);
+            }
+
+            if (finish)
+            {
+                /* Done or failed, so the requests still outstanding will not be needed */
+                ReceiveCancelSlots(operation);
+            }
+            else if (final)
+            {
+                /* The pipeline may have been waiting for this one to be delivered */
+                ReceiveIssueSlots(operation);
+            }
+        }
+
+        Lock_Acquire(&operation->receiveLock);
+        response = operation->receiveHeld;
+        if (response && (response->sequence == operation->nextDeliverSequence))
+        {
+            operation->receiveHeld = response->next;
+            Lock_Release(&operation->receiveLock);
+            continue;
+        }
+        break;
+    }
+    operation->receiveDelivering = MI_FALSE;
+    release = ReceiveReleaseIfDone(operation);
+    Lock_Release(&operation->receiveLock);
+
+    if (release)
+    {
+        /* operation may be deleted in here */
+        OperationDereference(operation);
+    }
+}
+
+void MI_CALL ReceiveShellComplete(
+    _In_opt_     MI_Operation *miOperation,
+    _In_     void *callbackContext,
+    _In_opt_ const MI_Instance *instance,
+             MI_Boolean moreResults,
+    _In_     MI_Result resultCode,
+    _In_opt_z_ const MI_Char *errorString,
+    _In_opt_ const MI_Instance *errorDetails,
+    _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
+{
+    WSMAN_RECEIVE_SLOT *slot = (WSMAN_RECEIVE_SLOT *) callbackContext;
+    WSMAN_OPERATION_HANDLE operation = slot->operation;
+    WSMAN_RECEIVE_RESPONSE live;
+    MI_Boolean deliverNow;
+    MI_Boolean release;
+    ptrdiff_t cancelling;
+
+    if (operation->command)
+    {
+        __LOGD(("%s: START, errorCode=%u, shellId=%s, commandId=%s, sequence=%u", "ReceiveShellComplete", resultCode, operation->shell->shellInstance->ShellId.value, operation->command->commandId, slot->sequence));
+    }
+    else
+    {
+        __LOGD(("%s: START, errorCode=%u, shellId=%s, commandId=<null>, sequence=%u", "ReceiveShellComplete", resultCode, operation->shell->shellInstance->ShellId.value, slot->sequence));
+    }
+    if (resultCode != 0)
+    {
+        if (errorDetails)
+        {
+            MI_Value value;
+            MI_Uint32 type;
+            /* We need to check if this is a server-side timeout. If so we need to re-send the request */
+            //ProbableCause == 111 -- timeout
+            if ((MI_Instance_GetElement(errorDetails, "ProbableCause", &value, &type, NULL, NULL) == MI_RESULT_OK) &&
+                    (value.uint32 == 111))
+            {
+                __LOGD(("Timeout from remote machine, re-sending request"));
+                resultCode = 0;
+                instance = NULL;
+                errorString = NULL;
+            }
+        }
+        if (errorString)
+        {
+            __LOGD(("Error string = %s", errorString));
+            if (strncmp("ERROR_WSMAN_OPERATION_TIMEDOUT", errorString, strlen("ERROR_WSMAN_OPERATION_TIMEDOUT")) == 0)
+            {
+                /* We expect this error so lets fall through */
+                __LOGD(("Timeout on receive means no data yet so we just send another request"));
+                resultCode = 0;
+            }
+        }
+    }
+
+    memset(&live, 0, sizeof(live));
+    live.sequence = slot->sequence;
+    live.final = !moreResults;
+    live.resultCode = resultCode;
+    live.result = (MI_Instance*) instance;
+    live.errorString = (MI_Char*) errorString;
+
+    Lock_Acquire(&operation->receiveLock);
+    if (!moreResults)
+    {
+        /* Nothing may start cancelling the request from here on */
+        slot->closing = MI_TRUE;
+    }
+    deliverNow = !operation->receiveDelivering &&
+                 (slot->sequence == operation->nextDeliverSequence) &&
+                 !operation->receiveFinished;
+    if (deliverNow)
+    {
+        /* Next in line, so this thread delivers it before returning and nothing needs copying */
+        operation->receiveDelivering = MI_TRUE;
+    }
+    Lock_Release(&operation->receiveLock);
+
+    if (deliverNow)
+    {
+        ReceivePipelineDeliver(operation, &live);
+    }
+    else
+    {
+        /* Arrived ahead of an earlier request, so keep a copy until that one has been
+         * delivered. The delivering thread may have finished while the copy was made, in
+         * which case this thread takes over delivery.
+         */
+        ReceiveHold(operation, &live);
+
+        Lock_Acquire(&operation->receiveLock);
+        deliverNow = !operation->receiveDelivering;
+        operation->receiveDelivering = MI_TRUE;
+        Lock_Release(&operation->receiveLock);
+
+        if (deliverNow)
+        {
+            ReceivePipelineDeliver(operation, NULL);
+        }
+    }
+
+    if (moreResults)
+    {
+        LogFunctionEnd("ReceiveShellComplete", resultCode);
+        return;
+    }
+
+    /* Last result for this request. Let any cancel still running on it finish, then close
+     * it and put the slot back for the next request.
+     */
+    while ((cancelling = Atomic_Read(&slot->cancelling)) != 0)
+    {
+        CondLock_Wait((ptrdiff_t) &slot->cancelling, &slot->cancelling, cancelling, CONDLOCK_DEFAULT_SPINCOUNT);
+    }
+    MI_Operation_Close(&slot->miOperation);
+
+    Lock_Acquire(&operation->receiveLock);
+    slot->busy = MI_FALSE;
+    operation->receiveBusy--;
+    release = ReceiveReleaseIfDone(operation);
+    Lock_Release(&operation->receiveLock);
+
+    if (release)
+    {
+        /* operation may be deleted in here */
+        OperationDereference(operation);
+    }
+    else
+    {
+        ReceiveIssueSlots(operation);
+    }
+
+    LogFunctionEnd("ReceiveShellComplete", resultCode);
+}
+
+MI_EXPORT void WINAPI WSManReceiveShellOutput(
+    _Inout_ WSMAN_SHELL_HANDLE shell,
+    _In_opt_ WSMAN_COMMAND_HANDLE command,
+    MI_Uint32 flags,
+    _In_opt_ WSMAN_STREAM_ID_SET *desiredStreamSet,  // request output from a particular stream or list of streams
+    _In_ WSMAN_SHELL_ASYNC *async,
+    _Out_ WSMAN_OPERATION_HANDLE *receiveOperation) // should be closed using WSManCloseOperation
+{
+    WSManReceiveShellOutputEx(shell, command, flags, desiredStreamSet, NULL, async, receiveOperation);
+}
+
+MI_EXPORT void WINAPI WSManReceiveShellOutputEx(
+    _Inout_ WSMAN_SHELL_HANDLE shell,
+    _In_opt_ WSMAN_COMMAND_HANDLE command,
+    MI_Uint32 flags,
+    _In_opt_ WSMAN_STREAM_ID_SET *desiredStreamSet,  // request output from a particular stream or list of streams
+    _In_opt_ WSMAN_RECEIVE_BUFFER *receiveBuffer,    // if NULL, behaves as WSManReceiveShellOutput
+    _In_ WSMAN_SHELL_ASYNC *async,
+    _Out_ WSMAN_OPERATION_HANDLE *receiveOperation) // should be closed using WSManCloseOperation
+{
+    MI_Result miResult;
+    char *errorMessage = NULL;
+    //MI_Instance *desiredStream = NULL;
+    Batch *batch = NULL;
+    char *streamSetString = NULL;
+    MI_Value value;
+
+    LogFunctionStart("WSManReceiveShellOutputEx");
+
+    (*receiveOperation) = OperationAlloc(shell, WSMAN_OPERATION_RECEIVE);
+    if (*receiveOperation == NULL)
+    {
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    (*receiveOperation)->command = command;
+    (*receiveOperation)->asyncCallback = *async;
+    if (receiveBuffer)
+    {
+        (*receiveOperation)->receiveBuffer = *receiveBuffer;
+    }
+    batch = (*receiveOperation)->batch;
+
+    miResult = MI_Application_NewInstance(&shell->session->api->application, "Receive", NULL, &(*receiveOperation)->operationProperties);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to allocate receive properties instance", miResult);
+    }
+
+    miResult = ExtractStreamSet(desiredStreamSet, batch, &streamSetString);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to convert receive desiredStreamSet", miResult);
+    }
+
+    value.string = streamSetString;
+    miResult = MI_Instance_AddElement((*receiveOperation)->operationProperties, "DesiredStream", &value, MI_STRING, 0);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("out of memory", miResult);
+    }
+    __LOGD(("Stream set = %s", value.string));
+
+    if (command)
+    {
+        value.string = command->commandId;
+        miResult = MI_Instance_AddElement((*receiveOperation)->operationProperties, "CommandId", &value, MI_STRING, 0);
+        if (miResult != MI_RESULT_OK)
+        {
+            GOTO_ERROR("out of memory", miResult);
+        }
+        __LOGD(("Receive for command %s", command->commandId));
+    }
+
+    {
+        WSMAN_OPERATION_HANDLE operation = *receiveOperation;
+        MI_Uint32 i;
+
+        operation->receiveDepth = shell->session->api->receivePipelineDepth;
+        operation->receiveSlots = Batch_GetClear(batch, sizeof(WSMAN_RECEIVE_SLOT) * operation->receiveDepth);
+        if (operation->receiveSlots == NULL)
+        {
+            GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        Lock_Init(&operation->receiveLock);
+
+        for (i = 0; i != operation->receiveDepth; i++)
+        {
+            operation->receiveSlots[i].operation = operation;
+            operation->receiveSlots[i].callbacks.instanceResult = ReceiveShellComplete;
+            operation->receiveSlots[i].callbacks.callbackContext = &operation->receiveSlots[i];
+            operation->receiveSlots[i].closing = MI_TRUE;
+        }
+
+        /* The pipeline's reference, dropped once it has finished and gone quiet */
+        Atomic_Inc(&operation->refs);
+        ReceiveIssueSlots(operation);
+    }
+
+    LogFunctionEnd("WSManReceiveShellOutputEx", MI_RESULT_OK);
+    return;
+
+
+error:
+    {
+        WSMAN_ERROR error = { 0 };
+        error.code = miResult;
+        if (batch)
+        {
+            Utf8ToUtf16Le(batch, errorMessage, (MI_Char16**) &error.errorDetail);
+        }
+        async->completionFunction(
+                async->operationContext,
+                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                &error,
+                shell,
+                NULL,
+                NULL,
+                NULL);
+     }
+
+    if (*receiveOperation)
+    {
+        OperationRelease(*receiveOperation);
+        *receiveOperation = NULL;
+    }
+    LogFunctionEnd("WSManReceiveShellOutputEx", miResult);
+}
+
+void MI_CALL SendShellComplete(
+    _In_opt_     MI_Operation *miOperation,
+    _In_     void *callbackContext,
+    _In_opt_ const MI_Instance *instance,
+             MI_Boolean moreResults,
+    _In_     MI_Result resultCode,
+    _In_opt_z_ const MI_Char *errorString,
+    _In_opt_ const MI_Instance *errorDetails,
+    _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
+{
+    WSMAN_OPERATION_HANDLE operation = ( WSMAN_OPERATION_HANDLE ) callbackContext;
+    WSMAN_ERROR error = {0};
+    __LOGD(("%s: START, errorCode=%u", "SendShellComplete", resultCode));
+    error.code = resultCode;
+    if (resultCode != 0)
+    {
+        if (errorString)
+        {
+            Utf8ToUtf16Le(operation->batch, errorString, (MI_Char16**) &error.errorDetail);
+        }
+        else
+        {
+            Utf8ToUtf16Le(operation->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
+        }
+    }
+    operation->asyncCallback.completionFunction(
+                operation->asyncCallback.operationContext,
+                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                &error,
+                operation->shell,
+                operation->command,
+                operation,
+                NULL);
+    MI_Operation_Close(&operation->miOperation);
+    OperationDereference(operation);
+
+    LogFunctionEnd("SendShellComplete", resultCode);
+}
+MI_EXPORT void WINAPI WSManSendShellInput(
+    _In_ WSMAN_SHELL_HANDLE shell,
+    _In_opt_ WSMAN_COMMAND_HANDLE command,
+    MI_Uint32 flags,
+    _In_ const MI_Char16* streamId,               // input stream name
+    _In_ WSMAN_DATA *streamData,        // data as binary - that can contain text (ANSI/UNICODE),
+                                        // binary content or objects or partial or full XML
+    BOOL endOfStream,
+    _In_ WSMAN_SHELL_ASYNC *async,
+    _Out_ WSMAN_OPERATION_HANDLE *sendOperation) // should be closed using WSManCloseOperation
+{
+    MI_Result miResult;
+    char *errorMessage = NULL;
+    MI_Instance *stream = NULL;
+    Batch *batch = NULL;
+    MI_Value value;
+
+    LogFunctionStart("WSManSendShellInput");
+
+    (*sendOperation) = OperationAlloc(shell, WSMAN_OPERATION_SEND);
+    if (*sendOperation == NULL)
+    {
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    (*sendOperation)->command = command;
+    (*sendOperation)->asyncCallback = *async;
+    batch = (*sendOperation)->batch;
+
+    miResult = MI_Application_NewInstance(&shell->session->api->application, "Send", NULL, &(*sendOperation)->operationProperties);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to allocate operation properties instance", miResult);
+    }
+
+    miResult = MI_Application_NewInstance(&shell->session->api->application, "Stream", NULL, &(*sendOperation)->streamProperties);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to allocate operation properties instance", miResult);
+    }
+    stream = (*sendOperation)->streamProperties;
+
+    if (command)
+    {
+        value.string = command->commandId;
+        miResult = MI_Instance_AddElement(stream, "CommandId", &value, MI_STRING, 0);
+        if (miResult != MI_RESULT_OK)
+        {
+            GOTO_ERROR("out of memory", miResult);
         }
-        (*command)->commandId = tmpStr;
-        __LOGD(("command ID = %s", tmpStr));
+        __LOGD(("Send for command %s", command->commandId));
     }
 
-    if (commandLine)
+    if (streamId)
     {
-        if (!Utf16LeToUtf8(batch, commandLine, &tmpStr))
+        if (!Utf16LeToUtf8(batch, streamId, &value.string))
         {
             GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
         }
-        value.string = tmpStr;
-        if (MI_Instance_AddElement((*command)->commandProperties, "Command", &value, MI_STRING, 0) != MI_RESULT_OK)
+        miResult = MI_Instance_AddElement(stream, "streamName", &value, MI_STRING, 0);
+        if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            GOTO_ERROR("out of memory", miResult);
         }
-        __LOGD(("command line = %s", tmpStr));
+        __LOGD(("Send stream name = %s", value.string));
     }
 
-    if (args )
+
+    if (streamData && streamData->type == WSMAN_DATA_TYPE_BINARY && streamData->binaryData.data)
     {
-        miResult = ExtractCommandArgs(args, batch, (*command)->commandProperties);
+        DecodeBuffer decodeBuffer, decodedBuffer, compressedBuffer;
+        memset(&decodeBuffer, 0, sizeof(decodeBuffer));
+        memset(&decodedBuffer, 0, sizeof(decodedBuffer));
+        memset(&compressedBuffer, 0, sizeof(compressedBuffer));
+
+        decodeBuffer.buffer = (MI_Char*) streamData->binaryData.data;
+        decodeBuffer.bufferLength = streamData->binaryData.dataLength;
+        decodeBuffer.bufferUsed = decodeBuffer.bufferLength;
+
+        if (shell->isCompressed)
+        {
+            /* Compress into chunks the provider's DecompressBuffer understands, then encode those */
+            miResult = CompressBuffer(&decodeBuffer, &compressedBuffer, 0);
+            if (miResult != MI_RESULT_OK)
+            {
+                GOTO_ERROR("CompressBuffer failed", miResult);
+            }
+            decodeBuffer = compressedBuffer;
+        }
+
+        /* NOTE: Base64EncodeBuffer allocates enough space for a NULL terminator */
+        miResult = Base64EncodeBuffer(&decodeBuffer, &decodedBuffer);
+        free(compressedBuffer.buffer);
         if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR("Failed to extract command args", miResult);
+            GOTO_ERROR("Base64EncodeBuffer failed", miResult);
         }
-    }
 
-    {
-        MI_Value value;
-        MI_Type type;
-        if (__MI_Instance_GetElement(&shell->shellInstance->__instance, "ResourceUri", &value, &type, NULL, NULL) != MI_RESULT_OK)
+        /* Set the null terminator on the end of the buffer as this is supposed to be a string*/
+        memset(decodedBuffer.buffer + decodedBuffer.bufferUsed, 0, sizeof(MI_Char));
+
+        /* The stream instance borrows the encoded buffer rather than copying it. The operation
+         * owns it from here on and it is freed once the Send has completed.
+         */
+        (*sendOperation)->sendData = decodedBuffer.buffer;
+        value.string = decodedBuffer.buffer;
+
+        miResult = MI_Instance_AddElement(stream, "data", &value, MI_STRING, MI_FLAG_BORROW);
+
+        if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR("Failed to get resource URI", MI_RESULT_FAILED);
+            GOTO_ERROR("out of memory", miResult);
         }
-        if (MI_OperationOptions_SetResourceUri(&(*command)->miOptions, value.string) != MI_RESULT_OK)
+
+        if (DEBUG_LOG_ENABLED())
         {
-            GOTO_ERROR("Failed to set resource URI in options", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            size_t dataLength = strlen(value.string);
+            __LOGD(("Send stream data length=%u, hash=%08x, data=%.*s%s", (MI_Uint32) dataLength, DebugLog_Hash(value.string, dataLength),
+                DEBUG_LOG_PAYLOAD_PREFIX, value.string, (dataLength > DEBUG_LOG_PAYLOAD_PREFIX) ? "..." : ""));
         }
     }
-    if (MI_OperationOptions_SetNumber(&(*command)->miOptions, "__MI_OPERATIONOPTIONS_ISSHELL", 1, 0) != MI_RESULT_OK)
+
+    if (endOfStream)
     {
-        GOTO_ERROR("Failed to set IsShell option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        value.boolean = MI_TRUE;
+        miResult = MI_Instance_AddElement(stream, "endOfStream", &value, MI_BOOLEAN, 0);
+        if (miResult != MI_RESULT_OK)
+        {
+            GOTO_ERROR("out of memory", miResult);
+        }
+        __LOGD(("Send stream end-of-stream %s", value.string));
     }
 
-
-    if (MI_OperationOptions_SetString(&(*command)->miOptions, "__MI_OPERATIONOPTIONS_ACTION", "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Command", 0) != MI_RESULT_OK)
+    value.instance = stream;
+    miResult = MI_Instance_AddElement((*sendOperation)->operationProperties, "Stream", &value, MI_INSTANCE, MI_FLAG_BORROW);
+    if (miResult != MI_RESULT_OK)
     {
-        GOTO_ERROR("Failed to set action option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        GOTO_ERROR("Failed to add Stream property to parameters", miResult);
     }
+
     {
 
-        (*command)->callbacks.instanceResult = CommandShellComplete;
-        (*command)->callbacks.callbackContext = *command;
+        (*sendOperation)->callbacks.instanceResult = SendShellComplete;
+        (*sendOperation)->callbacks.callbackContext = *sendOperation;
+        Atomic_Inc(&(*sendOperation)->refs); /* Dropped once the request completes */
 
         MI_Session_Invoke(&shell->miSession,
                 0, /* flags */
-                &(*command)->miOptions, /*options*/
+                &(*sendOperation)->miOptions, /*options*/
                 NULL, /* namespace */
                 "Shell",
-                "Command",
+                "Send",
                 &shell->shellInstance->__instance,
-                (*command)->commandProperties,
-                &((*command)->callbacks), &(*command)->miOperation);
+                (*sendOperation)->operationProperties,
+                &((*sendOperation)->callbacks), &(*sendOperation)->miOperation);
     }
 
-    __LOGD(("New command handle = %p", *command));
-    LogFunctionEnd("WSManRunShellCommandEx", MI_RESULT_OK);
+    LogFunctionEnd("WSManSendShellInput", MI_RESULT_OK);
     return;
 
 
@@ -1343,7 +3849,10 @@ error:
     {
         WSMAN_ERROR error = { 0 };
         error.code = miResult;
-        Utf8ToUtf16Le(batch, errorMessage, (MI_Char16**) &error.errorDetail);
+        if (batch)
+        {
+            Utf8ToUtf16Le(batch, errorMessage, (MI_Char16**) &error.errorDetail);
+        }
         async->completionFunction(
                 async->operationContext,
                 WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
@@ -1354,18 +3863,147 @@ error:
                 NULL);
      }
 
-    if ((*command)->miOptions.ft)
+    if (*sendOperation)
     {
-        MI_OperationOptions_Delete(&(*command)->miOptions);
+        OperationRelease(*sendOperation);
+        *sendOperation = NULL;
     }
-    if ((*command)->commandProperties)
+    LogFunctionEnd("WSManSendShellInput", miResult);
+}
+
+void MI_CALL CommandCloseShellComplete(
+    _In_opt_     MI_Operation *miOperation,
+    _In_     void *callbackContext,
+    _In_opt_ const MI_Instance *instance,
+             MI_Boolean moreResults,
+    _In_     MI_Result resultCode,
+    _In_opt_z_ const MI_Char *errorString,
+    _In_opt_ const MI_Instance *errorDetails,
+    _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
+{
+    WSMAN_COMMAND_HANDLE command = ( WSMAN_COMMAND_HANDLE ) callbackContext;
+    WSMAN_ERROR error = {0};
+    __LOGD(("%s: START, errorCode=%u", "CommandCloseShellComplete", resultCode));
+    error.code = resultCode;
+    if (resultCode != 0)
     {
-        MI_Instance_Delete((*command)->commandProperties);
+        if (errorString)
+        {
+            Utf8ToUtf16Le(command->batch, errorString, (MI_Char16**) &error.errorDetail);
+            __LOGD(("Error string = %s", errorString));
+        }
+        else
+        {
+            Utf8ToUtf16Le(command->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
+        }
     }
-    Batch_Delete(batch);
-    LogFunctionEnd("WSManRunShellCommandEx", miResult);
+
+    MI_Operation_Close(miOperation);
+
+    command->asyncCallback.completionFunction(
+            command->asyncCallback.operationContext,
+            WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+            &error,
+            command->shell,
+            command,
+            NULL,
+            NULL);
 }
-void MI_CALL SignalShellComplete(
+
+ MI_EXPORT void WINAPI WSManCloseCommand(
+    _Inout_opt_ WSMAN_COMMAND_HANDLE commandHandle,
+    MI_Uint32 flags,
+    _In_ WSMAN_SHELL_ASYNC *async)
+{
+    MI_Result miResult;
+    char *errorMessage = NULL;
+    MI_Value value;
+
+    LogFunctionStart("WSManCloseCommand");
+
+    miResult = MI_Application_NewInstance(&commandHandle->shell->session->api->application, "Signal", NULL, &commandHandle->commandClose);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to allocate receive properties instance", miResult);
+    }
+
+    value.string = commandHandle->commandId;
+    miResult = MI_Instance_AddElement(commandHandle->commandClose, "CommandId", &value, MI_STRING, 0);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to allocate receive properties instance", miResult);
+    }
+
+    value.string = "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/signal/terminate";
+    miResult = MI_Instance_AddElement(commandHandle->commandClose, "Code", &value, MI_STRING, 0);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to allocate receive properties instance", miResult);
+    }
+
+    MI_OperationOptions_SetString(&commandHandle->miOptions, "__MI_OPERATIONOPTIONS_ACTION", "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Signal", 0);
+
+    commandHandle->asyncCallback = *async;
+
+    {
+        commandHandle->callbacks.instanceResult = CommandCloseShellComplete;
+        commandHandle->callbacks.callbackContext = commandHandle;
+
+        MI_Session_Invoke(&commandHandle->shell->miSession,
+                0, /* flags */
+                &commandHandle->miOptions, /*options*/
+                NULL, /* namespace */
+                "Shell",
+                "Signal",
+                &commandHandle->shell->shellInstance->__instance,
+                commandHandle->commandClose,
+                &(commandHandle->callbacks), &commandHandle->miOperation);
+    }
+
+    LogFunctionEnd("WSManCloseCommand", MI_RESULT_OK);
+    return;
+
+
+error:
+    {
+        WSMAN_ERROR error = { 0 };
+        error.code = miResult;
+        Batch *batch = NULL;
+        batch = Batch_New(BATCH_MAX_PAGES);
+        if (batch != NULL)
+        {
+            Utf8ToUtf16Le(batch, errorMessage, (MI_Char16**) &error.errorDetail);
+        }
+
+        async->completionFunction(
+                async->operationContext,
+                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                &error,
+                commandHandle->shell,
+                commandHandle,
+                NULL,
+                NULL);
+        if (batch)
+        {
+            Batch_Delete(batch);
+        }
+     }
+
+    if (commandHandle->commandClose)
+    {
+        MI_Instance_Delete(commandHandle->commandClose);
+    }
+    LogFunctionEnd("WSManCloseCommand", miResult);
+    return;
+}
+
+void MI_CALL CloseSessionComplete(_In_opt_ void *competionContext
+)
+{
+    __LOGD(("%s: END", "CloseSessionComplete"));
+}
+
+void MI_CALL CloseShellComplete(
     _In_opt_     MI_Operation *miOperation,
     _In_     void *callbackContext,
     _In_opt_ const MI_Instance *instance,
@@ -1375,335 +4013,386 @@ void MI_CALL SignalShellComplete(
     _In_opt_ const MI_Instance *errorDetails,
     _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
 {
-    WSMAN_OPERATION_HANDLE operation = ( WSMAN_OPERATION_HANDLE ) callbackContext;
+    WSMAN_SHELL_HANDLE shell = ( WSMAN_SHELL_HANDLE ) callbackContext;
+    WSMAN_API_HANDLE api = shell->session->api; /* The client may close the session from its callback */
     WSMAN_ERROR error = {0};
-    __LOGD(("%s: START, errorCode=%u", "SignalShellComplete", resultCode));
+    __LOGD(("%s: START, errorCode=%u", "CloseShellComplete", resultCode));
     error.code = resultCode;
     if (resultCode != 0)
     {
         if (errorString)
         {
-            Utf8ToUtf16Le(operation->batch, errorString, (MI_Char16**) &error.errorDetail);
+            Utf8ToUtf16Le(shell->batch, errorString, (MI_Char16**) &error.errorDetail);
+            __LOGD(("Error string = %s", errorString));
         }
         else
         {
-            Utf8ToUtf16Le(operation->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
+            Utf8ToUtf16Le(shell->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
         }
     }
-    operation->asyncCallback.completionFunction(
-                operation->asyncCallback.operationContext,
+    shell->asyncCallback.completionFunction(
+                shell->asyncCallback.operationContext,
                 WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-                &error,
-                operation->shell,
-                operation->command,
-                operation,
+                &error,
+                shell,
+                NULL,
+                NULL,
                 NULL);
-    MI_Operation_Close(&operation->miOperation);
-    Batch_Delete(operation->batch);
-
-    LogFunctionEnd("SignalShellComplete", resultCode);
-}
-
-MI_EXPORT void WINAPI WSManSignalShell(
-    _In_ WSMAN_SHELL_HANDLE shell,
-    _In_opt_ WSMAN_COMMAND_HANDLE command,         // if NULL, the Signal will be sent to the shell
-    MI_Uint32 flags,
-    _In_ const MI_Char16* code,             // signal code
-    _In_ WSMAN_SHELL_ASYNC *async,
-    _Out_ WSMAN_OPERATION_HANDLE *signalOperation)  // should be closed using WSManCloseOperation
-{
-    MI_Result miResult;
-    char *errorMessage = NULL;
-    //MI_Instance *desiredStream = NULL;
-    Batch *batch = NULL;
-//    char *streamSetString = NULL;
-    MI_Value value;
-
-    LogFunctionStart("WSManSignalShell");
+    MI_Operation_Close(miOperation);
 
-    batch = Batch_New(BATCH_MAX_PAGES);
-    if (batch == NULL)
+    /* Operations the caller has not closed yet keep the pool and templates until they are */
+    if (Atomic_Read(&shell->operationRefs))
     {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        ShellOperationDereference(shell);
     }
 
-    (*signalOperation) = Batch_GetClear(batch, sizeof(struct WSMAN_OPERATION));
-    if (*signalOperation == NULL)
+    /* A session that has just deleted a shell cleanly is fit for the next one */
+    if (resultCode == MI_RESULT_OK)
     {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        SessionPoolReturn(api, &shell->sessionKey, &shell->miSession);
     }
-    (*signalOperation)->type = WSMAN_OPERATION_SIGNAL;
-    (*signalOperation)->shell = shell;
-    (*signalOperation)->command = command;
-    (*signalOperation)->asyncCallback = *async;
-    (*signalOperation)->batch = batch;
-
-    miResult = MI_Application_NewOperationOptions(&shell->session->api->application, MI_TRUE, &(*signalOperation)->miOptions);
-    if (miResult != MI_RESULT_OK)
+    else
     {
-        GOTO_ERROR("Failed to create operation options", miResult);
+        __LOGD(("%s: START", "CloseSessionComplete"));
+        MI_Session_Close(&shell->miSession, NULL, CloseSessionComplete);
     }
-
-    miResult = MI_Application_NewInstance(&shell->session->api->application, "Signal", NULL, &(*signalOperation)->operationProperties);
-    if (miResult != MI_RESULT_OK)
+    if (shell->sessionKey.password)
     {
-        GOTO_ERROR("Failed to allocate receive properties instance", miResult);
+        SecretWipe(shell->sessionKey.password, strlen(shell->sessionKey.password));
     }
+    __LOGD(("%s: END, errorCode=%u", "CloseShellComplete", resultCode));
+}
+MI_EXPORT void WINAPI WSManCloseShell(
+    _Inout_opt_ WSMAN_SHELL_HANDLE shellHandle,
+    MI_Uint32 flags,
+    _In_ WSMAN_SHELL_ASYNC *async)
+{
+    LogFunctionStart("WSManCloseShell");
 
-    if (!Utf16LeToUtf8(batch, code, &value.string))
+    shellHandle->asyncCallback = *async;
+
+    if (shellHandle->didCreate)
     {
-        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        shellHandle->callbacks.instanceResult = CloseShellComplete;
+        shellHandle->callbacks.callbackContext = shellHandle;
+
+        MI_Session_DeleteInstance(&shellHandle->miSession,
+                0, /* flags */
+                &shellHandle->operationOptions, /*options*/
+                NULL, /* namespace */
+                &shellHandle->shellInstance->__instance,
+                &shellHandle->callbacks,
+                &shellHandle->miDeleteShellOperation);
     }
-     miResult = MI_Instance_AddElement((*signalOperation)->operationProperties, "Code", &value, MI_STRING, 0);
-    if (miResult != MI_RESULT_OK)
+    else
     {
-        GOTO_ERROR("out of memory", miResult);
-    }
-    __LOGD(("Signal Code = %s", value.string));
+        /* The create or connect failed, so there is nothing on the server to delete, only
+         * what was set up here to create the shell with. A pooled session it was given is
+         * not trusted with another shell.
+         */
+        WSMAN_ERROR error = {0};
 
-    if (command)
-    {
-        value.string = command->commandId;
-        miResult = MI_Instance_AddElement((*signalOperation)->operationProperties, "CommandId", &value, MI_STRING, 0);
-        if (miResult != MI_RESULT_OK)
+        if (Atomic_Read(&shellHandle->operationRefs))
         {
-            GOTO_ERROR("out of memory", miResult);
+            ShellOperationDereference(shellHandle);
         }
-        __LOGD(("Signal for command %s", command->commandId));
-    }
+        else
+        {
+            ShellDeleteOperationTemplates(shellHandle);
+        }
+        if (shellHandle->operationOptions.ft)
+        {
+            MI_OperationOptions_Delete(&shellHandle->operationOptions);
+        }
+        if (shellHandle->miSession.ft)
+        {
+            MI_Session_Close(&shellHandle->miSession, NULL, CloseSessionComplete);
+        }
+        if (shellHandle->sessionKey.password)
+        {
+            SecretWipe(shellHandle->sessionKey.password, strlen(shellHandle->sessionKey.password));
+        }
+
+        error.code = MI_RESULT_OK;
+        shellHandle->asyncCallback.completionFunction(
+                    shellHandle->asyncCallback.operationContext,
+                    WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                    &error,
+                    shellHandle,
+                    NULL,
+                    NULL,
+                    NULL);
+     }
+
+    LogFunctionEnd("WSManCloseShell", MI_RESULT_OK);
+    return;
+}
 
+/* ShellControlComplete
+ * Disconnect or Reconnect has finished. The operation is closed before the client is told
+ * so that it can go straight on to the next call from its callback.
+ */
+void MI_CALL ShellControlComplete(
+    _In_opt_     MI_Operation *miOperation,
+    _In_     void *callbackContext,
+    _In_opt_ const MI_Instance *instance,
+             MI_Boolean moreResults,
+    _In_     MI_Result resultCode,
+    _In_opt_z_ const MI_Char *errorString,
+    _In_opt_ const MI_Instance *errorDetails,
+    _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
+{
+    WSMAN_SHELL_HANDLE shell = ( WSMAN_SHELL_HANDLE ) callbackContext;
+    WSMAN_SHELL_ASYNC async = shell->controlCallback;
+    WSMAN_ERROR error = {0};
+    __LOGD(("%s: START, errorCode=%u", "ShellControlComplete", resultCode));
+    error.code = resultCode;
+    if (resultCode != 0)
     {
-        MI_Value value;
-        MI_Type type;
-        if (__MI_Instance_GetElement(&shell->shellInstance->__instance, "ResourceUri", &value, &type, NULL, NULL) != MI_RESULT_OK)
+        if (errorString)
         {
-            GOTO_ERROR("Failed to get resource URI", MI_RESULT_FAILED);
+            Utf8ToUtf16Le(shell->batch, errorString, (MI_Char16**) &error.errorDetail);
         }
-        if (MI_OperationOptions_SetResourceUri(&(*signalOperation)->miOptions, value.string) != MI_RESULT_OK)
+        else
         {
-            GOTO_ERROR("Failed to set resource URI in options", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            Utf8ToUtf16Le(shell->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
         }
     }
-    if (MI_OperationOptions_SetNumber(&(*signalOperation)->miOptions, "__MI_OPERATIONOPTIONS_ISSHELL", 1, 0) != MI_RESULT_OK)
-    {
-        GOTO_ERROR("Failed to set IsShell option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-    }
-
-
-    if (MI_OperationOptions_SetString(&(*signalOperation)->miOptions, "__MI_OPERATIONOPTIONS_ACTION", "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Signal", 0) != MI_RESULT_OK)
+    else
     {
-        GOTO_ERROR("Failed to set action option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        Atomic_Swap(&shell->isDisconnected, shell->control == WSMAN_SHELL_CONTROL_DISCONNECT);
     }
 
+    MI_Operation_Close(&shell->miControlOperation);
+    if (shell->controlProperties)
     {
-
-        (*signalOperation)->callbacks.instanceResult = SignalShellComplete;
-        (*signalOperation)->callbacks.callbackContext = *signalOperation;
-
-        MI_Session_Invoke(&shell->miSession,
-                0, /* flags */
-                &(*signalOperation)->miOptions, /*options*/
-                NULL, /* namespace */
-                "Shell",
-                "Signal",
-                &shell->shellInstance->__instance,
-                (*signalOperation)->operationProperties,
-                &((*signalOperation)->callbacks), &(*signalOperation)->miOperation);
+        MI_Instance_Delete(shell->controlProperties);
+        shell->controlProperties = NULL;
     }
+    Atomic_Swap(&shell->controlBusy, 0);
 
-    LogFunctionEnd("WSManSignalShell", MI_RESULT_OK);
-    return;
-
-
-error:
-    {
-        WSMAN_ERROR error = { 0 };
-        error.code = miResult;
-        Utf8ToUtf16Le(batch, errorMessage, (MI_Char16**) &error.errorDetail);
-        async->completionFunction(
-                async->operationContext,
+    async.completionFunction(
+                async.operationContext,
                 WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
                 &error,
                 shell,
                 NULL,
                 NULL,
                 NULL);
-     }
 
-    if ((*signalOperation)->miOptions.ft)
+    LogFunctionEnd("ShellControlComplete", resultCode);
+}
+
+/* ShellControlInvoke
+ * Send one of the shell methods that need nothing back but a result, taking ownership of
+ * properties whether or not it could be sent. Fails with MI_RESULT_ALREADY_EXISTS while
+ * another one is still outstanding on the shell.
+ */
+static MI_Result ShellControlInvoke(WSMAN_SHELL_HANDLE shell, WSMAN_SHELL_CONTROL control, const char *methodName, MI_Instance *properties, WSMAN_SHELL_ASYNC *async)
+{
+    MI_OperationOptions *options;
+    MI_Result miResult;
+
+    if (Atomic_CompareAndSwap(&shell->controlBusy, 0, 1) != 0)
     {
-        MI_OperationOptions_Delete(&(*signalOperation)->miOptions);
+        MI_Instance_Delete(properties);
+        return MI_RESULT_ALREADY_EXISTS;
     }
-    if ((*signalOperation)->operationProperties)
+
+    miResult = ShellControlOptions(shell, control, &options);
+    if (miResult != MI_RESULT_OK)
     {
-        MI_Instance_Delete((*signalOperation)->operationProperties);
+        Atomic_Swap(&shell->controlBusy, 0);
+        MI_Instance_Delete(properties);
+        return miResult;
     }
-    LogFunctionEnd("WSManSignalShell", MI_RESULT_NOT_SUPPORTED);
+
+    shell->controlCallback = *async;
+    shell->control = control;
+    shell->controlProperties = properties;
+
+    memset(&shell->controlCallbacks, 0, sizeof(shell->controlCallbacks));
+    shell->controlCallbacks.instanceResult = ShellControlComplete;
+    shell->controlCallbacks.callbackContext = shell;
+
+    MI_Session_Invoke(&shell->miSession,
+            0, /* flags */
+            options, /*options*/
+            NULL, /* namespace */
+            "Shell",
+            methodName,
+            &shell->shellInstance->__instance,
+            properties,
+            &shell->controlCallbacks, &shell->miControlOperation);
+    return MI_RESULT_OK;
 }
 
-MI_Result DecodeReceiveStream(WSMAN_OPERATION_HANDLE operation, const MI_Instance *streamInstance)
+MI_EXPORT void WINAPI WSManDisconnectShell(
+    _Inout_ WSMAN_SHELL_HANDLE shell,
+    MI_Uint32 flags,
+    _In_ WSMAN_SHELL_DISCONNECT_INFO* disconnectInfo,
+    _In_ WSMAN_SHELL_ASYNC *async)
 {
-    DecodeBuffer decodeBuffer, decodedBuffer;
-    Batch *batch;
-    WSMAN_RESPONSE_DATA responseData;
-    WSMAN_ERROR error = {0};
-    const char *commandId = NULL;
-    const char *streamName = NULL;
-    const char *streamData = NULL;
-    MI_Boolean streamComplete = MI_FALSE;
+    MI_Result miResult;
+    char *errorMessage = NULL;
+    MI_Instance *properties = NULL;
     MI_Value value;
-    MI_Type type;
-    MI_Uint32 flags;
-
-    memset (&responseData, 0, sizeof(responseData));
-    memset(&decodedBuffer, 0, sizeof(decodedBuffer));
 
-    if (__MI_Instance_GetElement(streamInstance, "CommandId", &value, &type, &flags, NULL) == MI_RESULT_OK)
-    {
-        commandId = value.string;
-        __LOGD(("Command ID = %s", commandId));
-    }
+    LogFunctionStart("WSManDisconnectShell");
 
-    if (__MI_Instance_GetElement(streamInstance, "streamName", &value, &type, &flags, NULL) == MI_RESULT_OK)
+    if (!shell->didCreate)
     {
-        streamName = value.string;
-        __LOGD(("Stream Name = %s", streamName));
+        GOTO_ERROR("Shell was never created", MI_RESULT_INVALID_PARAMETER);
     }
 
-    if (__MI_Instance_GetElement(streamInstance, "endOfStream", &value, &type, &flags, NULL) == MI_RESULT_OK)
+    miResult = MI_Application_NewInstance(&shell->session->api->application, "Disconnect", NULL, &properties);
+    if (miResult != MI_RESULT_OK)
     {
-        streamComplete = value.boolean;
-        __LOGD(("End of stream = %d", streamComplete));
+        GOTO_ERROR("Failed to allocate disconnect properties instance", miResult);
     }
 
-    if (__MI_Instance_GetElement(streamInstance, "data", &value, &type, &flags, NULL) == MI_RESULT_OK)
+    /* How long the server should keep the shell for us, otherwise it uses the shell's own idle timeout */
+    if (disconnectInfo && disconnectInfo->idleTimeoutMs)
     {
-        streamData = value.string;
-        __LOGD(("Data = %s", streamData));
+        memset(&value, 0, sizeof(value));
+        value.datetime.isTimestamp = MI_FALSE;
+        value.datetime.u.interval.days = disconnectInfo->idleTimeoutMs / (24 * 60 * 60 * 1000);
+        value.datetime.u.interval.hours = (disconnectInfo->idleTimeoutMs / (60 * 60 * 1000)) % 24;
+        value.datetime.u.interval.minutes = (disconnectInfo->idleTimeoutMs / (60 * 1000)) % 60;
+        value.datetime.u.interval.seconds = (disconnectInfo->idleTimeoutMs / 1000) % 60;
+        value.datetime.u.interval.microseconds = (disconnectInfo->idleTimeoutMs % 1000) * 1000;
+        miResult = MI_Instance_AddElement(properties, "IdleTimeOut", &value, MI_DATETIME, 0);
+        if (miResult != MI_RESULT_OK)
+        {
+            GOTO_ERROR("out of memory", miResult);
+        }
+        __LOGD(("Disconnect idle timeout = %u ms", disconnectInfo->idleTimeoutMs));
     }
 
-    decodeBuffer.buffer = (char*)streamData;
-    decodeBuffer.bufferLength = Tcslen(streamData);
-    decodeBuffer.bufferUsed = decodeBuffer.bufferLength;
-    if (Base64DecodeBuffer(&decodeBuffer, &decodedBuffer) != MI_RESULT_OK)
+    if (flags & (WSMAN_FLAG_SERVER_BUFFERING_MODE_DROP | WSMAN_FLAG_SERVER_BUFFERING_MODE_BLOCK))
     {
-        error.code = MI_RESULT_FAILED;
-        Utf8ToUtf16Le(operation->batch, "Receive failed to convert stream data", (MI_Char16**) &error.errorDetail);
-        goto error;
+        value.string = (flags & WSMAN_FLAG_SERVER_BUFFERING_MODE_DROP) ? "Drop" : "Block";
+        miResult = MI_Instance_AddElement(properties, "BufferMode", &value, MI_STRING, 0);
+        if (miResult != MI_RESULT_OK)
+        {
+            GOTO_ERROR("out of memory", miResult);
+        }
+        __LOGD(("Disconnect buffer mode = %s", value.string));
     }
 
-    /* TODO!! */
-    responseData.receiveData.commandState = NULL;
-
-    batch = Batch_New(BATCH_MAX_PAGES);
-    if (!Utf8ToUtf16Le(batch, streamName, (MI_Char16**) &responseData.receiveData.streamId))
+    miResult = ShellControlInvoke(shell, WSMAN_SHELL_CONTROL_DISCONNECT, "Disconnect", properties, async);
+    properties = NULL;
+    if (miResult != MI_RESULT_OK)
     {
-        error.code = MI_RESULT_FAILED;
-        Utf8ToUtf16Le(operation->batch, "Receive failed to convert stream name", (MI_Char16**) &error.errorDetail);
-        goto error;
+        GOTO_ERROR("Failed to start disconnect", miResult);
     }
 
-    /* TODO!! Support compression */
-    responseData.receiveData.exitCode = 0;
-    responseData.receiveData.streamData.type = WSMAN_DATA_TYPE_BINARY;
-    responseData.receiveData.streamData.binaryData.data = (MI_Uint8*) decodedBuffer.buffer;
-    responseData.receiveData.streamData.binaryData.dataLength = decodedBuffer.bufferUsed;
-
-    flags = 0;
-    if (streamComplete)
-        flags = WSMAN_FLAG_CALLBACK_END_OF_STREAM;
-
-    operation->asyncCallback.completionFunction(
-            operation->asyncCallback.operationContext,
-            flags,
-            &error,
-            operation->shell,
-            operation->command,
-            operation,
-            &responseData);
-
-    free(decodedBuffer.buffer);
-
-    Batch_Delete(batch);
-    return MI_RESULT_OK;
+    LogFunctionEnd("WSManDisconnectShell", MI_RESULT_OK);
+    return;
 
 error:
-    operation->asyncCallback.completionFunction(
-                operation->asyncCallback.operationContext,
+    {
+        WSMAN_ERROR error = { 0 };
+        error.code = miResult;
+        Utf8ToUtf16Le(shell->batch, errorMessage, (MI_Char16**) &error.errorDetail);
+        async->completionFunction(
+                async->operationContext,
                 WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
                 &error,
-                operation->shell,
-                operation->command,
-                operation,
+                shell,
+                NULL,
+                NULL,
                 NULL);
-
-    return error.code;
+    }
+    if (properties)
+    {
+        MI_Instance_Delete(properties);
+    }
+    LogFunctionEnd("WSManDisconnectShell", miResult);
 }
 
-MI_Result DecodeReceiveCommandState(WSMAN_OPERATION_HANDLE operation, const MI_Instance *commandStateInstance, MI_Boolean *done)
+MI_EXPORT void WINAPI WSManReconnectShell(
+    _Inout_ WSMAN_SHELL_HANDLE shell,
+    MI_Uint32 flags,
+    _In_ WSMAN_SHELL_ASYNC *async)
 {
-    Batch *batch;
-    WSMAN_RESPONSE_DATA responseData = {{0}};
-    WSMAN_ERROR error = {0};
-    const char *commandId = NULL;
-    const char *state = NULL;
-    MI_Value value;
-    MI_Type type;
-    MI_Uint32 flags;
+    MI_Result miResult;
+    char *errorMessage = NULL;
+    MI_Instance *properties = NULL;
 
-    if (__MI_Instance_GetElement(commandStateInstance, "CommandId", &value, &type, &flags, NULL) == MI_RESULT_OK)
-    {
-        commandId = value.string;
-        __LOGD(("CommandID = %s", commandId));
-    }
+    LogFunctionStart("WSManReconnectShell");
 
-    if (__MI_Instance_GetElement(commandStateInstance, "state", &value, &type, &flags, NULL) == MI_RESULT_OK)
+    if (!shell->didCreate)
     {
-        state = value.string;
-        __LOGD(("Command state = %s", state));
+        GOTO_ERROR("Shell was never created", MI_RESULT_INVALID_PARAMETER);
     }
 
-
-    batch = Batch_New(BATCH_MAX_PAGES);
-    if (!Utf8ToUtf16Le(batch, state, (MI_Char16**) &responseData.receiveData.commandState))
+    miResult = MI_Application_NewInstance(&shell->session->api->application, "Reconnect", NULL, &properties);
+    if (miResult != MI_RESULT_OK)
     {
-        error.code = MI_RESULT_FAILED;
-        Utf8ToUtf16Le(operation->batch, "Receive failed to convert commandState", (MI_Char16**) &error.errorDetail);
-        goto error;
+        GOTO_ERROR("Failed to allocate reconnect properties instance", miResult);
     }
 
-    if (strcmp(state, WSMAN_COMMAND_STATE_DONE) == 0)
+    /* The send and receive templates and pooled operations are still here from before the
+     * disconnect, so once this completes the shell is used exactly as it was.
+     */
+    miResult = ShellControlInvoke(shell, WSMAN_SHELL_CONTROL_RECONNECT, "Reconnect", properties, async);
+    if (miResult != MI_RESULT_OK)
     {
-        flags = WSMAN_FLAG_CALLBACK_END_OF_OPERATION;
-        *done = MI_TRUE;
+        GOTO_ERROR("Failed to start reconnect", miResult);
     }
 
-    operation->asyncCallback.completionFunction(
-            operation->asyncCallback.operationContext,
-            0,
-            &error,
-            operation->shell,
-            operation->command,
-            operation,
-            &responseData);
-
-    Batch_Delete(batch);
-    return MI_RESULT_OK;
+    LogFunctionEnd("WSManReconnectShell", MI_RESULT_OK);
+    return;
 
 error:
-    operation->asyncCallback.completionFunction(
-                operation->asyncCallback.operationContext,
+    {
+        WSMAN_ERROR error = { 0 };
+        error.code = miResult;
+        Utf8ToUtf16Le(shell->batch, errorMessage, (MI_Char16**) &error.errorDetail);
+        async->completionFunction(
+                async->operationContext,
                 WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
                 &error,
-                operation->shell,
-                operation->command,
-                operation,
+                shell,
+                NULL,
+                NULL,
                 NULL);
+    }
+    LogFunctionEnd("WSManReconnectShell", miResult);
+}
 
-    return error.code;
+/* The provider reconnects a shell's commands along with the shell, so there is nothing to
+ * send here. It only tells the client whether its command is usable again.
+ */
+MI_EXPORT void WINAPI WSManReconnectShellCommand(
+    _Inout_ WSMAN_COMMAND_HANDLE commandHandle,
+    MI_Uint32 flags,
+    _In_ WSMAN_SHELL_ASYNC *async)
+{
+    WSMAN_ERROR error = {0};
+    LogFunctionStart("WSManReconnectShellCommand");
+    if (Atomic_Read(&commandHandle->shell->isDisconnected))
+    {
+        error.code = ERROR_WSMAN_SERVICE_STREAM_DISCONNECTED;
+        Utf8ToUtf16Le(commandHandle->batch, "Shell is disconnected", (MI_Char16**) &error.errorDetail);
+    }
+    async->completionFunction(
+            async->operationContext,
+            WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+            &error,
+            commandHandle->shell,
+            commandHandle,
+            NULL,
+            NULL);
+    LogFunctionEnd("WSManReconnectShellCommand", error.code);
 }
 
-void MI_CALL ReceiveShellComplete(
+/* ConnectShellComplete
+ * The server has handed over a shell created by another client. Picks up its streams and
+ * hands the connect response to the client the way CreateShellComplete does for create.
+ */
+void MI_CALL ConnectShellComplete(
     _In_opt_     MI_Operation *miOperation,
     _In_     void *callbackContext,
     _In_opt_ const MI_Instance *instance,
@@ -1713,263 +4402,249 @@ void MI_CALL ReceiveShellComplete(
     _In_opt_ const MI_Instance *errorDetails,
     _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
 {
-    MI_Boolean done = MI_FALSE;
-    WSMAN_OPERATION_HANDLE operation = ( WSMAN_OPERATION_HANDLE ) callbackContext;
+    WSMAN_SHELL_HANDLE shell = ( WSMAN_SHELL_HANDLE ) callbackContext;
     WSMAN_ERROR error = {0};
-    if (operation->command)
-    {
-        __LOGD(("%s: START, errorCode=%u, shellId=%s, commandId=%s", "ReceiveShellComplete", resultCode, operation->shell->shellInstance->ShellId.value, operation->command->commandId));
-    }
-    else
-    {
-        __LOGD(("%s: START, errorCode=%u, shellId=%s, commandId=<null>", "ReceiveShellComplete", resultCode, operation->shell->shellInstance->ShellId.value));
-    }
-    error.code = resultCode;
-    if (resultCode != 0)
+    WSMAN_RESPONSE_DATA responseData;
+    WSMAN_RESPONSE_DATA *response = NULL;
+
+    __LOGD(("%s: START, errorCode=%u", "ConnectShellComplete", resultCode));
+
+    memset(&responseData, 0, sizeof(responseData));
+
+    if ((resultCode == MI_RESULT_OK) && instance)
     {
-        if (errorDetails)
+        MI_Value value;
+        MI_Type type;
+
+        if ((__MI_Instance_GetElement(instance, "InputStreams", &value, &type, NULL, NULL) == MI_RESULT_OK) &&
+                (type == MI_STRING) &&
+                value.string &&
+                (Shell_Set_InputStreams(shell->shellInstance, value.string) != MI_RESULT_OK))
         {
-            MI_Value value;
-            MI_Uint32 type;
-            /* We need to check if this is a server-side timeout. If so we need to re-send the request */
-            //ProbableCause == 111 -- timeout
-            if ((MI_Instance_GetElement(errorDetails, "ProbableCause", &value, &type, NULL, NULL) == MI_RESULT_OK) &&
-                    (value.uint32 == 111))
-            {
-                __LOGD(("Timeout from remote machine, re-sending request"));
-                goto retry;
-            }
+            resultCode = MI_RESULT_SERVER_LIMITS_EXCEEDED;
         }
-        if (errorString)
+        if ((__MI_Instance_GetElement(instance, "OutputStreams", &value, &type, NULL, NULL) == MI_RESULT_OK) &&
+                (type == MI_STRING) &&
+                value.string &&
+                (Shell_Set_OutputStreams(shell->shellInstance, value.string) != MI_RESULT_OK))
         {
-            __LOGD(("Error string = %s", errorString));
-            if (strncmp("ERROR_WSMAN_OPERATION_TIMEDOUT", errorString, strlen("ERROR_WSMAN_OPERATION_TIMEDOUT")) == 0)
+            resultCode = MI_RESULT_SERVER_LIMITS_EXCEEDED;
+        }
+        if ((__MI_Instance_GetElement(instance, "connectResponseXml", &value, &type, NULL, NULL) == MI_RESULT_OK) &&
+                (type == MI_STRING) &&
+                value.string)
+        {
+            if (Utf8ToUtf16Le(shell->batch, value.string, (MI_Char16**) &responseData.connectData.data.text.buffer))
             {
-                /* We expect this error so lets fall through */
-                __LOGD(("Timeout on receive means no data yet so we just send another request"));
-                resultCode = 0;
+                responseData.connectData.data.type = WSMAN_DATA_TYPE_TEXT;
+                responseData.connectData.data.text.bufferLength = (MI_Uint32) (Utf16LeStrLenBytes(responseData.connectData.data.text.buffer) / sizeof(MI_Char16)) - 1;
+                response = &responseData;
             }
             else
             {
-                Utf8ToUtf16Le(operation->batch, errorString, (MI_Char16**) &error.errorDetail);
-                goto error;
+                resultCode = MI_RESULT_SERVER_LIMITS_EXCEEDED;
             }
         }
-        else
-        {
-            Utf8ToUtf16Le(operation->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
-            goto error;
-        }
     }
 
-    if (instance)
+    if (resultCode == MI_RESULT_OK)
     {
         MI_Value value;
-        MI_Uint32 type;
+        MI_Type type;
 
-        if (__MI_Instance_GetElement(instance, "CommandId", &value, &type, NULL, NULL) == MI_RESULT_OK)
-        {
-            __LOGD(("Receive result for CommandId=%s", value.string));
-        }
-        __LOGD(("Got an instance"));
-        if (__MI_Instance_GetElement(instance, "Stream", &value, &type, NULL, NULL) == MI_RESULT_OK)
+        if ((__MI_Instance_GetElement(&shell->shellInstance->__instance, "ResourceUri", &value, &type, NULL, NULL) != MI_RESULT_OK) ||
+                (ShellCreateOperationTemplates(shell, value.string) != MI_RESULT_OK))
         {
-            __LOGD(("Got a stream, type = %u", type));
-
-            if (type & MI_INSTANCE)
-            {
-                MI_Result miResult;
-
-                if (type & MI_ARRAY)
-                {
-                    int i;
-                    MI_InstanceA *instArray = (MI_InstanceA*) &value;
-
-                    for (i = 0; i != instArray->size; i++)
-                    {
-                        __LOGD(("Entry %u = %p", i, instArray->data[i]));
-                        miResult = DecodeReceiveStream(operation, instArray->data[i]);
-                    }
-
-                }
-                else
-                {
-                    __LOGD(("Entry %u = %p", 0, value.string));
-                    miResult = DecodeReceiveStream(operation, value.instance);
-                }
-                if (miResult != MI_RESULT_OK)
-                {
-                    error.code = MI_RESULT_FAILED;
-                    Utf8ToUtf16Le(operation->batch, "Receive failed to get stream data", (MI_Char16**) &error.errorDetail);
-                    goto error;
-                }
-            }
-            else
-            {
-                __LOGD(("It is an unsupported type"));
-                error.code = MI_RESULT_FAILED;
-                Utf8ToUtf16Le(operation->batch, "Receive data has unsupported type", (MI_Char16**) &error.errorDetail);
-                goto error;
-            }
+            resultCode = MI_RESULT_FAILED;
         }
-        else if (__MI_Instance_GetElement(instance, "CommandState", &value, &type, NULL, NULL) == MI_RESULT_OK)
-        {
-            MI_Result miResult = DecodeReceiveCommandState(operation, value.instance, &done);
-            if (miResult != MI_RESULT_OK)
-            {
-                error.code = MI_RESULT_FAILED;
-                Utf8ToUtf16Le(operation->batch, "Receive failed to get stream data", (MI_Char16**) &error.errorDetail);
-                goto error;
-            }
-         }
     }
 
-retry:
-    MI_Operation_Close(&operation->miOperation);
-
-    /* WHAT ABOUT TIMEOUT ? */
-    if (!done /*&& (resultCode == 0)*/)
+    error.code = resultCode;
+    if (errorString)
     {
-        __LOGD(("Sending new receive request"));
-        MI_Session_Invoke(&operation->shell->miSession,
-                0, /* flags */
-                &operation->miOptions, /*options*/
-                NULL, /* namespace */
-                "Shell",
-                "Receive",
-                &operation->shell->shellInstance->__instance,
-                operation->operationProperties,
-                &(operation->callbacks), &operation->miOperation);
+        Utf8ToUtf16Le(shell->batch, errorString, (MI_Char16**) &error.errorDetail);
+    }
+    else if (resultCode != MI_RESULT_OK)
+    {
+        Utf8ToUtf16Le(shell->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
     }
-    LogFunctionEnd("ReceiveShellComplete", resultCode);
 
-    return;
+    MI_Operation_Close(&shell->miControlOperation);
+    if (shell->controlProperties)
+    {
+        MI_Instance_Delete(shell->controlProperties);
+        shell->controlProperties = NULL;
+    }
+    Atomic_Swap(&shell->controlBusy, 0);
 
-error:
-    MI_Operation_Close(&operation->miOperation);
-    operation->asyncCallback.completionFunction(
-                operation->asyncCallback.operationContext,
+    if (resultCode == MI_RESULT_OK)
+    {
+        /* From here on the shell is ours, and closing it deletes it on the server */
+        shell->didCreate = MI_TRUE;
+        shell->asyncCallback.completionFunction(
+                shell->asyncCallback.operationContext,
+                0,
+                &error,
+                shell,
+                NULL,
+                NULL,
+                response);
+    }
+    else
+    {
+        shell->asyncCallback.completionFunction(
+                shell->asyncCallback.operationContext,
                 WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
                 &error,
-                operation->shell,
-                operation->command,
-                operation,
+                shell,
+                NULL,
+                NULL,
                 NULL);
-    Batch_Delete(operation->batch);
- }
+    }
+    LogFunctionEnd("ConnectShellComplete", resultCode);
+}
 
-MI_EXPORT void WINAPI WSManReceiveShellOutput(
-    _Inout_ WSMAN_SHELL_HANDLE shell,
-    _In_opt_ WSMAN_COMMAND_HANDLE command,
+/* WSManConnectShell
+ * Attach to a disconnected shell by ID without re-creating it. Connect does not say whether
+ * the shell's stream data is compressed, so the caller's flags have to match those the shell
+ * was created with, exactly as the Windows client expects.
+ */
+MI_EXPORT void WINAPI WSManConnectShell(
+    _Inout_ WSMAN_SESSION_HANDLE session,
     MI_Uint32 flags,
-    _In_opt_ WSMAN_STREAM_ID_SET *desiredStreamSet,  // request output from a particular stream or list of streams
+    _In_ const MI_Char16* resourceUri,
+    _In_ const MI_Char16* shellID,           // shell Identifier
+    _In_opt_ WSMAN_OPTION_SET *options,
+    _In_opt_ WSMAN_DATA *connectXml,                     // open content for connect shell
     _In_ WSMAN_SHELL_ASYNC *async,
-    _Out_ WSMAN_OPERATION_HANDLE *receiveOperation) // should be closed using WSManCloseOperation
+    _Out_ WSMAN_SHELL_HANDLE *_shell) // should be closed using WSManCloseShell
 {
+    Batch *batch = NULL;
+    MI_Instance *_shellInstance;
+    MI_OperationOptions *connectOptions;
     MI_Result miResult;
     char *errorMessage = NULL;
-    //MI_Instance *desiredStream = NULL;
-    Batch *batch = NULL;
-    char *streamSetString = NULL;
+    struct WSMAN_SHELL *shell = NULL;
+    char *tmpStr = NULL;
     MI_Value value;
 
-    LogFunctionStart("WSManReceiveShellOutput");
+    LogFunctionStart("WSManConnectShell");
+
+    *_shell = NULL;
 
     batch = Batch_New(BATCH_MAX_PAGES);
     if (batch == NULL)
     {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
 
-    (*receiveOperation) = Batch_GetClear(batch, sizeof(struct WSMAN_OPERATION));
-    if (*receiveOperation == NULL)
+    shell = Batch_GetClear(batch, sizeof(struct WSMAN_SHELL));
+    if (shell == NULL)
     {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
-    (*receiveOperation)->type = WSMAN_OPERATION_RECEIVE;
-    (*receiveOperation)->shell = shell;
-    (*receiveOperation)->command = command;
-    (*receiveOperation)->asyncCallback = *async;
-    (*receiveOperation)->batch = batch;
 
-    miResult = MI_Application_NewOperationOptions(&shell->session->api->application, MI_TRUE, &(*receiveOperation)->miOptions);
+    shell->batch = batch;
+    shell->session = session;
+    shell->asyncCallback = *async;
+    shell->isCompressed = (ShellFlags(session->api, flags) & WSMAN_FLAG_NO_COMPRESSION) ? MI_FALSE : MI_TRUE;
+    Lock_Init(&shell->streamNameLock);
+    Batch_Init(&shell->streamNameBatch, 1);
+
+    miResult = Instance_New(&_shellInstance, &Shell_rtti, batch);
     if (miResult != MI_RESULT_OK)
     {
-        GOTO_ERROR("Failed to create operation options", miResult);
+        GOTO_ERROR("Failed to create instance", miResult);
     }
+    shell->shellInstance = (Shell*) _shellInstance;
 
-    miResult = MI_Application_NewInstance(&shell->session->api->application, "Receive", NULL, &(*receiveOperation)->operationProperties);
-    if (miResult != MI_RESULT_OK)
+    if ((shellID == NULL) || (resourceUri == NULL))
     {
-        GOTO_ERROR("Failed to allocate receive properties instance", miResult);
+        GOTO_ERROR("Shell ID and resource URI are required", MI_RESULT_INVALID_PARAMETER);
     }
 
-    miResult = ExtractStreamSet(desiredStreamSet, batch, &streamSetString);
+    if (!Utf16LeToUtf8(batch, shellID, &tmpStr) ||
+            (Shell_Set_ShellId(shell->shellInstance, tmpStr) != MI_RESULT_OK))
+    {
+        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    __LOGD(("ShellID = %s", tmpStr));
+
+    if (!Utf16LeToUtf8(batch, resourceUri, &tmpStr) ||
+            (Shell_Set_ResourceUri(shell->shellInstance, tmpStr) != MI_RESULT_OK))
+    {
+        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    __LOGD(("Resource URI = %s", tmpStr));
+
+    /* WSManCloseShell deletes the shell with these, the same as one we created */
+    miResult = MI_Application_NewOperationOptions(&session->api->application, MI_TRUE, &shell->operationOptions);
     if (miResult != MI_RESULT_OK)
     {
-        GOTO_ERROR("Failed to convert receive desiredStreamSet", miResult);
+        GOTO_ERROR("Failed to create operation options", miResult);
+    }
+    if ((MI_OperationOptions_SetResourceUri(&shell->operationOptions, tmpStr) != MI_RESULT_OK) ||
+            (MI_OperationOptions_SetNumber(&shell->operationOptions, "__MI_OPERATIONOPTIONS_ISSHELL", 1, 0) != MI_RESULT_OK))
+    {
+        GOTO_ERROR("Failed to set shell options", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
 
-    value.string = streamSetString;
-    miResult = MI_Instance_AddElement((*receiveOperation)->operationProperties, "DesiredStream", &value, MI_STRING, 0);
+    miResult = ShellControlOptions(shell, WSMAN_SHELL_CONTROL_CONNECT, &connectOptions);
     if (miResult != MI_RESULT_OK)
     {
-        GOTO_ERROR("out of memory", miResult);
+        GOTO_ERROR("Failed to create connect options", miResult);
     }
-    __LOGD(("Stream set = %s", value.string));
 
-    if (command)
+    miResult = ExtractOptions(options, batch, connectOptions);
+    if (miResult != MI_RESULT_OK)
+        GOTO_ERROR("Failed to convert wsman options", miResult);
+
+    miResult = MI_Application_NewInstance(&session->api->application, "Connect", NULL, &shell->controlProperties);
+    if (miResult != MI_RESULT_OK)
     {
-        value.string = command->commandId;
-        miResult = MI_Instance_AddElement((*receiveOperation)->operationProperties, "CommandId", &value, MI_STRING, 0);
-        if (miResult != MI_RESULT_OK)
-        {
-            GOTO_ERROR("out of memory", miResult);
-        }
-        __LOGD(("Receive for command %s", command->commandId));
+        GOTO_ERROR("Failed to allocate connect properties instance", miResult);
     }
 
+    if (connectXml && (connectXml->type == WSMAN_DATA_TYPE_TEXT))
     {
-        MI_Value value;
-        MI_Type type;
-        if (__MI_Instance_GetElement(&shell->shellInstance->__instance, "ResourceUri", &value, &type, NULL, NULL) != MI_RESULT_OK)
+        if (!Utf16LeToUtf8(batch, connectXml->text.buffer, &value.string))
         {
-            GOTO_ERROR("Failed to get resource URI", MI_RESULT_FAILED);
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
         }
-        if (MI_OperationOptions_SetResourceUri(&(*receiveOperation)->miOptions, value.string) != MI_RESULT_OK)
+        miResult = MI_Instance_AddElement(shell->controlProperties, "connectXml", &value, MI_STRING, 0);
+        if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR("Failed to set resource URI in options", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+            GOTO_ERROR("out of memory", miResult);
         }
-    }
-    if (MI_OperationOptions_SetNumber(&(*receiveOperation)->miOptions, "__MI_OPERATIONOPTIONS_ISSHELL", 1, 0) != MI_RESULT_OK)
-    {
-        GOTO_ERROR("Failed to set IsShell option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        __LOGD(("Connect XML = %s", value.string));
     }
 
-    if (MI_OperationOptions_SetString(&(*receiveOperation)->miOptions, "__MI_OPERATIONOPTIONS_ACTION", "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Receive", 0) != MI_RESULT_OK)
+    miResult = ShellOpenSession(shell);
+    if (miResult != MI_RESULT_OK)
     {
-        GOTO_ERROR("Failed to set action option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        GOTO_ERROR("MI_Application_NewSession failed", miResult);
     }
-    {
 
-        (*receiveOperation)->callbacks.instanceResult = ReceiveShellComplete;
-        (*receiveOperation)->callbacks.callbackContext = *receiveOperation;
+    /* Nobody else has the handle yet, so the control slot is free */
+    shell->controlBusy = 1;
+    shell->control = WSMAN_SHELL_CONTROL_CONNECT;
+    shell->controlCallbacks.instanceResult = ConnectShellComplete;
+    shell->controlCallbacks.callbackContext = shell;
 
-        MI_Session_Invoke(&shell->miSession,
-                0, /* flags */
-                &(*receiveOperation)->miOptions, /*options*/
-                NULL, /* namespace */
-                "Shell",
-                "Receive",
-                &shell->shellInstance->__instance,
-                (*receiveOperation)->operationProperties,
-                &((*receiveOperation)->callbacks), &(*receiveOperation)->miOperation);
-    }
+    MI_Session_Invoke(&shell->miSession,
+            0, /* flags */
+            connectOptions, /*options*/
+            NULL, /* namespace */
+            "Shell",
+            "Connect",
+            &shell->shellInstance->__instance,
+            shell->controlProperties,
+            &shell->controlCallbacks, &shell->miControlOperation);
 
-    LogFunctionEnd("WSManReceiveShellOutput", MI_RESULT_OK);
+    *_shell = shell;
+    LogFunctionEnd("WSManConnectShell", MI_RESULT_OK);
     return;
 
-
 error:
     {
         WSMAN_ERROR error = { 0 };
@@ -1979,576 +4654,941 @@ error:
                 async->operationContext,
                 WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
                 &error,
-                shell,
+                NULL,
                 NULL,
                 NULL,
                 NULL);
-     }
-
-    if ((*receiveOperation)->miOptions.ft)
-    {
-        MI_OperationOptions_Delete(&(*receiveOperation)->miOptions);
-    }
-    if ((*receiveOperation)->operationProperties)
-    {
-        MI_Instance_Delete((*receiveOperation)->operationProperties);
     }
-    Batch_Delete(batch);
-    LogFunctionEnd("WSManReceiveShellOutput", miResult);
-}
 
-void MI_CALL SendShellComplete(
-    _In_opt_     MI_Operation *miOperation,
-    _In_     void *callbackContext,
-    _In_opt_ const MI_Instance *instance,
-             MI_Boolean moreResults,
-    _In_     MI_Result resultCode,
-    _In_opt_z_ const MI_Char *errorString,
-    _In_opt_ const MI_Instance *errorDetails,
-    _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
-{
-    WSMAN_OPERATION_HANDLE operation = ( WSMAN_OPERATION_HANDLE ) callbackContext;
-    WSMAN_ERROR error = {0};
-    __LOGD(("%s: START, errorCode=%u", "SendShellComplete", resultCode));
-    error.code = resultCode;
-    if (resultCode != 0)
+    if (shell)
     {
-        if (errorString)
+        if (shell->controlProperties)
         {
-            Utf8ToUtf16Le(operation->batch, errorString, (MI_Char16**) &error.errorDetail);
+            MI_Instance_Delete(shell->controlProperties);
         }
-        else
+        if (shell->operationOptions.ft)
         {
-            Utf8ToUtf16Le(operation->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
+            MI_OperationOptions_Delete(&shell->operationOptions);
         }
+        ShellDeleteOperationTemplates(shell);
     }
-    operation->asyncCallback.completionFunction(
-                operation->asyncCallback.operationContext,
-                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-                &error,
-                operation->shell,
-                operation->command,
-                operation,
-                NULL);
-    MI_Operation_Close(&operation->miOperation);
-    Batch_Delete(operation->batch);
-
-    LogFunctionEnd("SendShellComplete", resultCode);
+    if (batch)
+    {
+        Batch_Delete(batch);
+    }
+    LogFunctionEnd("WSManConnectShell", miResult);
 }
-MI_EXPORT void WINAPI WSManSendShellInput(
-    _In_ WSMAN_SHELL_HANDLE shell,
-    _In_opt_ WSMAN_COMMAND_HANDLE command,
+
+/* WSManConnectShellCommand
+ * The provider connects a shell together with all of its commands, so this only builds the
+ * client side handle for a command that is already running in a connected shell. Connect
+ * content for a single command has nowhere to go on this server and is refused.
+ */
+MI_EXPORT void WINAPI WSManConnectShellCommand(
+    _Inout_ WSMAN_SHELL_HANDLE shell,
     MI_Uint32 flags,
-    _In_ const MI_Char16* streamId,               // input stream name
-    _In_ WSMAN_DATA *streamData,        // data as binary - that can contain text (ANSI/UNICODE),
-                                        // binary content or objects or partial or full XML
-    BOOL endOfStream,
+    _In_ const MI_Char16* commandID,  //command Identifier
+    _In_opt_ WSMAN_OPTION_SET *options,
+    _In_opt_ WSMAN_DATA *connectXml,                // open content for connect command
     _In_ WSMAN_SHELL_ASYNC *async,
-    _Out_ WSMAN_OPERATION_HANDLE *sendOperation) // should be closed using WSManCloseOperation
+    _Out_ WSMAN_COMMAND_HANDLE *command) // should be closed using WSManCloseCommand
 {
     MI_Result miResult;
     char *errorMessage = NULL;
-    MI_Instance *stream = NULL;
     Batch *batch = NULL;
     MI_Value value;
+    MI_Type type;
+    WSMAN_ERROR error = { 0 };
+
+    LogFunctionStart("WSManConnectShellCommand");
+
+    *command = NULL;
+
+    batch = Batch_New(BATCH_MAX_PAGES);
+    if (batch == NULL)
+    {
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+
+    if (commandID == NULL)
+    {
+        GOTO_ERROR("Command ID is required", MI_RESULT_INVALID_PARAMETER);
+    }
+    if (connectXml)
+    {
+        GOTO_ERROR("Connect XML for a command is not supported", MI_RESULT_NOT_SUPPORTED);
+    }
+    if (Atomic_Read(&shell->isDisconnected) || !shell->didCreate)
+    {
+        GOTO_ERROR("Shell is not connected", ERROR_WSMAN_SERVICE_STREAM_DISCONNECTED);
+    }
+
+    (*command) = Batch_GetClear(batch, sizeof(struct WSMAN_COMMAND));
+    if (*command == NULL)
+    {
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    (*command)->shell = shell;
+    (*command)->asyncCallback = *async;
+    (*command)->batch = batch;
+    Lock_Init(&(*command)->run.lock);
+
+    if (!Utf16LeToUtf8(batch, commandID, &(*command)->commandId))
+    {
+        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    __LOGD(("command ID = %s", (*command)->commandId));
+
+    /* WSManCloseCommand signals terminate with these, as it does for a command we started */
+    if (__MI_Instance_GetElement(&shell->shellInstance->__instance, "ResourceUri", &value, &type, NULL, NULL) != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to get resource URI", MI_RESULT_FAILED);
+    }
+    miResult = CreateShellOperationOptions(shell, value.string, "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Signal", &(*command)->miOptions);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to create operation options", miResult);
+    }
+
+    miResult = ExtractOptions(options, batch, &(*command)->miOptions);
+    if (miResult != MI_RESULT_OK)
+        GOTO_ERROR("Failed to convert wsman options", miResult);
+
+    async->completionFunction(
+            async->operationContext,
+            WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+            &error,
+            shell,
+            *command,
+            NULL,
+            NULL);
+
+    __LOGD(("New command handle = %p", *command));
+    LogFunctionEnd("WSManConnectShellCommand", MI_RESULT_OK);
+    return;
+
+error:
+    error.code = miResult;
+    if (batch)
+    {
+        Utf8ToUtf16Le(batch, errorMessage, (MI_Char16**) &error.errorDetail);
+    }
+    async->completionFunction(
+            async->operationContext,
+            WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+            &error,
+            shell,
+            NULL,
+            NULL,
+            NULL);
+
+    if (*command && (*command)->miOptions.ft)
+    {
+        MI_OperationOptions_Delete(&(*command)->miOptions);
+    }
+    *command = NULL;
+    if (batch)
+    {
+        Batch_Delete(batch);
+    }
+    LogFunctionEnd("WSManConnectShellCommand", miResult);
+}
+
+/* How often the fan-out watchdog looks for hosts that have run out of time */
+#define FANOUT_WATCHDOG_POLL_MS 100
+
+typedef enum
+{
+    FANOUT_HOST_WAITING,
+    FANOUT_HOST_CREATING_SHELL,
+    FANOUT_HOST_RUNNING_COMMAND,
+    FANOUT_HOST_RECEIVING,
+    FANOUT_HOST_TERMINATING,
+    FANOUT_HOST_CLOSING_SHELL,
+    FANOUT_HOST_FINISHED
+} FANOUT_HOST_STATE;
+
+typedef struct WSMAN_FANOUT_HOST
+{
+    struct WSMAN_FANOUT *fanOut;
+    MI_Uint32 index;
+    MI_Char16 *host;
+    FANOUT_HOST_STATE state;
+    MI_Uint64 deadline;         /* ClientNow() past which the command is terminated, 0 for none */
+    WSMAN_SESSION_HANDLE session;
+    WSMAN_SHELL_HANDLE shell;
+    WSMAN_COMMAND_HANDLE command;
+    MI_Boolean receiving;       /* receive callbacks still to come */
+    MI_Boolean signalling;      /* terminate signal callback still to come */
+    MI_Uint32 errorCode;        /* first error the host hit */
+    MI_Char16 *errorDetail;     /* malloc'd */
+} WSMAN_FANOUT_HOST;
+
+struct WSMAN_FANOUT
+{
+    WSMAN_API_HANDLE api;
+    Batch *batch;
+    WSMAN_FANOUT_ASYNC async;
+
+    /* Copies of the request, everything about the shell is already in the template */
+    WSMAN_AUTHENTICATION_CREDENTIALS credentials;
+    MI_Char16 *commandLine;
+    WSMAN_COMMAND_ARG_SET args;
+    MI_Uint32 maxConcurrency;
+    MI_Uint32 hostTimeoutMs;
+    MI_Uint32 sessionOptionCount;
+    WSMAN_FANOUT_SESSION_OPTION *sessionOptions;
+    Shell *shellTemplate;
+    MI_OperationOptions shellOptions;
+
+    /* lock guards the host states and counts, callbackLock keeps the client callbacks apart */
+    Lock lock;
+    Lock callbackLock;
+    WSMAN_FANOUT_HOST *hosts;
+    MI_Uint32 hostCount;
+    MI_Uint32 nextHost;
+    MI_Uint32 activeHosts;
+    MI_Uint32 finishedHosts;
+    MI_Boolean cancelled;
+    MI_Boolean pumping;
+
+    Thread watchdogThread;
+    MI_Boolean watchdogStarted;
+    volatile ptrdiff_t shutdown;
+    volatile ptrdiff_t done;
+
+    MI_Char16 *terminateCode;
+    MI_Char16 *timedOutDetail;
+    MI_Char16 *abortedDetail;
+};
+
+static void FanOutShellCreated(PVOID operationContext, MI_Uint32 flags, WSMAN_ERROR *error, WSMAN_SHELL_HANDLE shell, WSMAN_COMMAND_HANDLE command, WSMAN_OPERATION_HANDLE operationHandle, WSMAN_RESPONSE_DATA *data);
+static void FanOutCommandStarted(PVOID operationContext, MI_Uint32 flags, WSMAN_ERROR *error, WSMAN_SHELL_HANDLE shell, WSMAN_COMMAND_HANDLE command, WSMAN_OPERATION_HANDLE operationHandle, WSMAN_RESPONSE_DATA *data);
+static void FanOutReceived(PVOID operationContext, MI_Uint32 flags, WSMAN_ERROR *error, WSMAN_SHELL_HANDLE shell, WSMAN_COMMAND_HANDLE command, WSMAN_OPERATION_HANDLE operationHandle, WSMAN_RESPONSE_DATA *data);
+static void FanOutSignalled(PVOID operationContext, MI_Uint32 flags, WSMAN_ERROR *error, WSMAN_SHELL_HANDLE shell, WSMAN_COMMAND_HANDLE command, WSMAN_OPERATION_HANDLE operationHandle, WSMAN_RESPONSE_DATA *data);
+static void FanOutShellClosed(PVOID operationContext, MI_Uint32 flags, WSMAN_ERROR *error, WSMAN_SHELL_HANDLE shell, WSMAN_COMMAND_HANDLE command, WSMAN_OPERATION_HANDLE operationHandle, WSMAN_RESPONSE_DATA *data);
+static void FanOutPump(struct WSMAN_FANOUT *fanOut);
+
+static MI_Char16 *FanOutStrdup(Batch *batch, const MI_Char16 *from)
+{
+    size_t length;
+    MI_Char16 *to;
+
+    if (from == NULL)
+        return NULL;
+
+    length = Utf16LeStrLenBytes(from);
+    to = batch ? Batch_Get(batch, length) : malloc(length);
+    if (to)
+        memcpy(to, from, length);
+    return to;
+}
+
+/* FanOutSetError
+ * Remember why the host failed. Only the first error is kept, it is the one that caused the rest.
+ * Called with the fan-out lock held.
+ */
+static void FanOutSetError(WSMAN_FANOUT_HOST *host, MI_Uint32 code, const MI_Char16 *detail)
+{
+    if (host->errorCode || (code == 0))
+        return;
+
+    host->errorCode = code;
+    host->errorDetail = FanOutStrdup(NULL, detail);
+}
+
+/* FanOutHostExpired
+ * Whether the host should stop, recording why. Called with the fan-out lock held.
+ */
+static MI_Boolean FanOutHostExpired(WSMAN_FANOUT_HOST *host, MI_Uint64 now)
+{
+    if (host->fanOut->cancelled)
+    {
+        FanOutSetError(host, WSMAN_ERROR_OPERATION_ABORTED, host->fanOut->abortedDetail);
+        return MI_TRUE;
+    }
+    if (host->deadline && (now >= host->deadline))
+    {
+        FanOutSetError(host, ERROR_WSMAN_OPERATION_TIMEDOUT, host->fanOut->timedOutDetail);
+        return MI_TRUE;
+    }
+    return MI_FALSE;
+}
+
+/* FanOutComplete
+ * Every host is done. Nothing may touch the fan-out after done is set, WSManCloseFanOut frees it.
+ */
+static void FanOutComplete(struct WSMAN_FANOUT *fanOut)
+{
+    WSMAN_ERROR error = {0};
+
+    Lock_Acquire(&fanOut->callbackLock);
+    fanOut->async.completionFunction(
+            fanOut->async.operationContext,
+            WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+            &error,
+            WSMAN_FANOUT_ALL_HOSTS,
+            NULL,
+            NULL);
+    Lock_Release(&fanOut->callbackLock);
+
+    Atomic_Swap(&fanOut->done, 1);
+    CondLock_Broadcast((ptrdiff_t) &fanOut->done);
+}
 
-    LogFunctionStart("WSManSendShellInput");
+/* FanOutHostDone
+ * Report the host's result and give its slot to the next host. Returns MI_TRUE if this was the last
+ * host, in which case the caller must call FanOutComplete and then leave the fan-out alone. While
+ * FanOutPump is running it finishes the fan-out itself.
+ */
+static MI_Boolean FanOutHostDone(WSMAN_FANOUT_HOST *host)
+{
+    struct WSMAN_FANOUT *fanOut = host->fanOut;
+    WSMAN_ERROR error = {0};
+    MI_Boolean last;
 
-    batch = Batch_New(BATCH_MAX_PAGES);
-    if (batch == NULL)
+    if (host->session)
     {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        WSManCloseSession(host->session, 0);
+        host->session = NULL;
     }
 
-    (*sendOperation) = Batch_GetClear(batch, sizeof(struct WSMAN_OPERATION));
-    if (sendOperation == NULL)
-    {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-    }
-    (*sendOperation)->type = WSMAN_OPERATION_SEND;
-    (*sendOperation)->shell = shell;
-    (*sendOperation)->command = command;
-    (*sendOperation)->asyncCallback = *async;
-    (*sendOperation)->batch = batch;
+    __LOGD(("Fan-out host %u done, errorCode=%u", host->index, host->errorCode));
 
-    miResult = MI_Application_NewOperationOptions(&shell->session->api->application, MI_TRUE, &(*sendOperation)->miOptions);
-    if (miResult != MI_RESULT_OK)
-    {
-        GOTO_ERROR("Failed to create operation options", miResult);
-    }
+    error.code = host->errorCode;
+    error.errorDetail = host->errorDetail;
+    Lock_Acquire(&fanOut->callbackLock);
+    fanOut->async.completionFunction(
+            fanOut->async.operationContext,
+            WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+            &error,
+            host->index,
+            host->host,
+            NULL);
+    Lock_Release(&fanOut->callbackLock);
 
-    miResult = MI_Application_NewInstance(&shell->session->api->application, "Send", NULL, &(*sendOperation)->operationProperties);
-    if (miResult != MI_RESULT_OK)
-    {
-        GOTO_ERROR("Failed to allocate operation properties instance", miResult);
-    }
+    Lock_Acquire(&fanOut->lock);
+    host->state = FANOUT_HOST_FINISHED;
+    fanOut->activeHosts--;
+    fanOut->finishedHosts++;
+    last = (fanOut->finishedHosts == fanOut->hostCount) && !fanOut->pumping;
+    Lock_Release(&fanOut->lock);
+
+    return last;
+}
+
+/* The host is done and nothing else will call back for it */
+static void FanOutHostFinished(WSMAN_FANOUT_HOST *host)
+{
+    struct WSMAN_FANOUT *fanOut = host->fanOut;
+
+    if (FanOutHostDone(host))
+        FanOutComplete(fanOut);
+    else
+        FanOutPump(fanOut);
+}
+
+static void FanOutCloseShell(WSMAN_FANOUT_HOST *host)
+{
+    WSMAN_SHELL_ASYNC async = { host, FanOutShellClosed };
 
-    miResult = MI_Application_NewInstance(&shell->session->api->application, "Stream", NULL, &stream);
+    WSManCloseShell(host->shell, 0, &async);
+}
+
+/* FanOutStartHost
+ * Connect to the host and send the create shell request. A failure to get that far is returned
+ * and nothing calls back for the host.
+ */
+static MI_Result FanOutStartHost(WSMAN_FANOUT_HOST *host)
+{
+    struct WSMAN_FANOUT *fanOut = host->fanOut;
+    WSMAN_SHELL_ASYNC async = { host, FanOutShellCreated };
+    WSMAN_SHELL_HANDLE shell;
+    MI_Result miResult;
+    MI_Uint32 index;
+
+    miResult = WSManCreateSession(fanOut->api, host->host, 0, &fanOut->credentials, NULL, &host->session);
     if (miResult != MI_RESULT_OK)
     {
-        GOTO_ERROR("Failed to allocate operation properties instance", miResult);
+        __LOGE(("Fan-out host %u - WSManCreateSession failed (result=%u)", host->index, miResult));
+        return miResult;
     }
 
-    if (command)
+    for (index = 0; index != fanOut->sessionOptionCount; index++)
     {
-        value.string = command->commandId;
-        miResult = MI_Instance_AddElement(stream, "CommandId", &value, MI_STRING, 0);
+        miResult = WSManSetSessionOption(host->session, fanOut->sessionOptions[index].option, &fanOut->sessionOptions[index].data);
         if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR("out of memory", miResult);
+            __LOGE(("Fan-out host %u - WSManSetSessionOption %u failed (result=%u)", host->index, fanOut->sessionOptions[index].option, miResult));
+            return miResult;
         }
-        __LOGD(("Send for command %s", command->commandId));
     }
 
-    if (streamId)
+    if (fanOut->hostTimeoutMs)
     {
-        if (!Utf16LeToUtf8(batch, streamId, &value.string))
-        {
-            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-        }
-        miResult = MI_Instance_AddElement(stream, "streamName", &value, MI_STRING, 0);
+        WSMAN_DATA timeout;
+
+        /* No single request may take longer than the whole host is allowed */
+        memset(&timeout, 0, sizeof(timeout));
+        timeout.type = WSMAN_DATA_TYPE_DWORD;
+        timeout.number = fanOut->hostTimeoutMs;
+        miResult = WSManSetSessionOption(host->session, WSMAN_OPTION_DEFAULT_OPERATION_TIMEOUTMS, &timeout);
         if (miResult != MI_RESULT_OK)
-        {
-            GOTO_ERROR("out of memory", miResult);
-        }
-        __LOGD(("Send stream name = %s", value.string));
+            return miResult;
+
+        host->deadline = ClientNow() + (MI_Uint64) fanOut->hostTimeoutMs * 1000;
     }
 
+    Lock_Acquire(&fanOut->lock);
+    host->state = FANOUT_HOST_CREATING_SHELL;
+    Lock_Release(&fanOut->lock);
 
-    if (streamData && streamData->type == WSMAN_DATA_TYPE_BINARY && streamData->binaryData.data)
+    miResult = ShellCreateFromTemplate(host->session, fanOut->shellTemplate, &fanOut->shellOptions, &async, &shell);
+    if (miResult == MI_RESULT_OK)
     {
-        DecodeBuffer decodeBuffer, decodedBuffer;
-        memset(&decodeBuffer, 0, sizeof(decodeBuffer));
-        memset(&decodedBuffer, 0, sizeof(decodedBuffer));
+        MI_Boolean cancel;
 
-        decodeBuffer.buffer = (MI_Char*) streamData->binaryData.data;
-        decodeBuffer.bufferLength = streamData->binaryData.dataLength;
-        decodeBuffer.bufferUsed = decodeBuffer.bufferLength;
+        /* Lets FanOutStopExpired cancel the create, and cancels it here if the fan-out was
+         * closed while it was being sent. FanOutShellCreated may have set it already.
+         */
+        Lock_Acquire(&fanOut->lock);
+        host->shell = shell;
+        cancel = (host->state == FANOUT_HOST_CREATING_SHELL) && FanOutHostExpired(host, ClientNow());
+        Lock_Release(&fanOut->lock);
 
-        /* NOTE: Base64EncodeBuffer allocates enough space for a NULL terminator */
-        miResult = Base64EncodeBuffer(&decodeBuffer, &decodedBuffer);
-        if (miResult != MI_RESULT_OK)
-        {
-            GOTO_ERROR("Base64EncodeBuffer failed", miResult);
-        }
+        if (cancel)
+            ShellCancelCreate(shell);
+    }
+    return miResult;
+}
 
-        /* Set the null terminator on the end of the buffer as this is supposed to be a string*/
-        memset(decodedBuffer.buffer + decodedBuffer.bufferUsed, 0, sizeof(MI_Char));
+/* FanOutPump
+ * Start waiting hosts while there is room for them, or fail them once the fan-out is cancelled.
+ * Only one thread pumps at a time. The state is looked at again under the lock before every
+ * host, so hosts finishing on other threads while it runs only need to leave it to carry on.
+ */
+static void FanOutPump(struct WSMAN_FANOUT *fanOut)
+{
+    MI_Boolean complete;
 
-        value.string = decodedBuffer.buffer;
+    Lock_Acquire(&fanOut->lock);
+    if (fanOut->pumping)
+    {
+        Lock_Release(&fanOut->lock);
+        return;
+    }
+    fanOut->pumping = MI_TRUE;
 
-        miResult = MI_Instance_AddElement(stream, "data", &value, MI_STRING, 0);
+    while ((fanOut->nextHost != fanOut->hostCount) &&
+           (fanOut->cancelled || (fanOut->activeHosts < fanOut->maxConcurrency)))
+    {
+        WSMAN_FANOUT_HOST *host = &fanOut->hosts[fanOut->nextHost++];
+        MI_Result miResult = MI_RESULT_OK;
 
-        if (miResult != MI_RESULT_OK)
+        fanOut->activeHosts++;
+        if (fanOut->cancelled)
         {
-            free(decodedBuffer.buffer);
-            GOTO_ERROR("out of memory", miResult);
+            FanOutSetError(host, WSMAN_ERROR_OPERATION_ABORTED, fanOut->abortedDetail);
+            miResult = WSMAN_ERROR_OPERATION_ABORTED;
         }
+        Lock_Release(&fanOut->lock);
 
-        __LOGD(("Send stream data = %s", value.string));
-        free(decodedBuffer.buffer);
-    }
+        if (miResult == MI_RESULT_OK)
+        {
+            miResult = FanOutStartHost(host);
+            if (miResult != MI_RESULT_OK)
+            {
+                MI_Char16 *detail = NULL;
 
-    if (endOfStream)
-    {
-        value.boolean = MI_TRUE;
-        miResult = MI_Instance_AddElement(stream, "endOfStream", &value, MI_BOOLEAN, 0);
+                Utf8ToUtf16Le(fanOut->batch, Result_ToString(miResult), &detail);
+                Lock_Acquire(&fanOut->lock);
+                FanOutSetError(host, miResult, detail);
+                Lock_Release(&fanOut->lock);
+            }
+        }
         if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR("out of memory", miResult);
+            FanOutHostDone(host);
         }
-        __LOGD(("Send stream end-of-stream %s", value.string));
+
+        Lock_Acquire(&fanOut->lock);
     }
 
-    value.instance = stream;
-    miResult = MI_Instance_AddElement((*sendOperation)->operationProperties, "Stream", &value, MI_INSTANCE, MI_FLAG_BORROW);
-    if (miResult != MI_RESULT_OK)
+    fanOut->pumping = MI_FALSE;
+    complete = (fanOut->finishedHosts == fanOut->hostCount);
+    Lock_Release(&fanOut->lock);
+
+    if (complete)
+        FanOutComplete(fanOut);
+}
+
+static void FanOutShellCreated(
+    PVOID operationContext,
+    MI_Uint32 flags,
+    WSMAN_ERROR *error,
+    WSMAN_SHELL_HANDLE shell,
+    WSMAN_COMMAND_HANDLE command,
+    WSMAN_OPERATION_HANDLE operationHandle,
+    WSMAN_RESPONSE_DATA *data)
+{
+    WSMAN_FANOUT_HOST *host = (WSMAN_FANOUT_HOST*) operationContext;
+    struct WSMAN_FANOUT *fanOut = host->fanOut;
+    WSMAN_SHELL_ASYNC async = { host, FanOutCommandStarted };
+    MI_Boolean expired;
+
+    Lock_Acquire(&fanOut->lock);
+    host->shell = shell;
+    FanOutSetError(host, error->code, error->errorDetail);
+    expired = error->code || FanOutHostExpired(host, ClientNow());
+    host->state = expired ? FANOUT_HOST_CLOSING_SHELL : FANOUT_HOST_RUNNING_COMMAND;
+    Lock_Release(&fanOut->lock);
+
+    /* A shell that failed to create is closed all the same, which frees what it was set up with */
+    if (expired)
     {
-        GOTO_ERROR("Failed to add Stream property to parameters", miResult);
+        FanOutCloseShell(host);
+        return;
     }
 
+    command = NULL;
+    WSManRunShellCommandEx(shell, 0, NULL, fanOut->commandLine, fanOut->args.argsCount ? &fanOut->args : NULL, NULL, &async, &command);
+
+    /* Lets FanOutStopExpired cancel the run unless FanOutCommandStarted has already had it */
+    Lock_Acquire(&fanOut->lock);
+    if ((host->state == FANOUT_HOST_RUNNING_COMMAND) && command)
     {
-        MI_Value value;
-        MI_Type type;
-        if (__MI_Instance_GetElement(&shell->shellInstance->__instance, "ResourceUri", &value, &type, NULL, NULL) != MI_RESULT_OK)
-        {
-            GOTO_ERROR("Failed to get resource URI", MI_RESULT_FAILED);
-        }
-        if (MI_OperationOptions_SetResourceUri(&(*sendOperation)->miOptions, value.string) != MI_RESULT_OK)
-        {
-            GOTO_ERROR("Failed to set resource URI in options", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-        }
+        host->command = command;
+        expired = FanOutHostExpired(host, ClientNow());
     }
-    if (MI_OperationOptions_SetNumber(&(*sendOperation)->miOptions, "__MI_OPERATIONOPTIONS_ISSHELL", 1, 0) != MI_RESULT_OK)
+    Lock_Release(&fanOut->lock);
+
+    if (expired)
+        CommandCancelRun(command);
+}
+
+static void FanOutCommandStarted(
+    PVOID operationContext,
+    MI_Uint32 flags,
+    WSMAN_ERROR *error,
+    WSMAN_SHELL_HANDLE shell,
+    WSMAN_COMMAND_HANDLE command,
+    WSMAN_OPERATION_HANDLE operationHandle,
+    WSMAN_RESPONSE_DATA *data)
+{
+    WSMAN_FANOUT_HOST *host = (WSMAN_FANOUT_HOST*) operationContext;
+    struct WSMAN_FANOUT *fanOut = host->fanOut;
+    WSMAN_SHELL_ASYNC async = { host, FanOutReceived };
+    WSMAN_OPERATION_HANDLE receive;
+    MI_Boolean expired;
+
+    /* Deleting the shell terminates a command that did start, the command handle is still
+     * in use by the run request until this returns so it is left alone.
+     */
+    Lock_Acquire(&fanOut->lock);
+    host->command = command;
+    FanOutSetError(host, error->code, error->errorDetail);
+    expired = error->code || FanOutHostExpired(host, ClientNow());
+    host->state = expired ? FANOUT_HOST_CLOSING_SHELL : FANOUT_HOST_RECEIVING;
+    host->receiving = !expired;
+    Lock_Release(&fanOut->lock);
+
+    if (expired)
+        FanOutCloseShell(host);
+    else
+        WSManReceiveShellOutput(shell, command, 0, NULL, &async, &receive);
+}
+
+static void FanOutReceived(
+    PVOID operationContext,
+    MI_Uint32 flags,
+    WSMAN_ERROR *error,
+    WSMAN_SHELL_HANDLE shell,
+    WSMAN_COMMAND_HANDLE command,
+    WSMAN_OPERATION_HANDLE operationHandle,
+    WSMAN_RESPONSE_DATA *data)
+{
+    WSMAN_FANOUT_HOST *host = (WSMAN_FANOUT_HOST*) operationContext;
+    struct WSMAN_FANOUT *fanOut = host->fanOut;
+    MI_Boolean last = error->code || (flags & WSMAN_FLAG_CALLBACK_END_OF_OPERATION);
+    MI_Boolean close = MI_FALSE;
+    MI_Boolean receiving;
+
+    /* Anything after the result that ended the receive is ignored */
+    Lock_Acquire(&fanOut->lock);
+    receiving = host->receiving;
+    Lock_Release(&fanOut->lock);
+    if (!receiving)
+        return;
+
+    if (!error->code && data)
     {
-        GOTO_ERROR("Failed to set IsShell option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        const MI_Char16 *state = data->receiveData.commandState;
+        const char *done = WSMAN_COMMAND_STATE_DONE;
+
+        while (state && *state && (*state == (MI_Char16) *done))
+        {
+            state++;
+            done++;
+        }
+        if (state && (*state == 0) && (*done == 0))
+            last = MI_TRUE;
+
+        Lock_Acquire(&fanOut->callbackLock);
+        fanOut->async.completionFunction(
+                fanOut->async.operationContext,
+                flags & ~WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
+                error,
+                host->index,
+                host->host,
+                &data->receiveData);
+        Lock_Release(&fanOut->callbackLock);
     }
 
-    if (MI_OperationOptions_SetString(&(*sendOperation)->miOptions, "__MI_OPERATIONOPTIONS_ACTION", "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Send", 0) != MI_RESULT_OK)
+    if (!last)
+        return;
+
+    /* The shell is deleted rather than the command closed, it takes the command with it */
+    Lock_Acquire(&fanOut->lock);
+    FanOutSetError(host, error->code, error->errorDetail);
+    host->receiving = MI_FALSE;
+    if (!host->signalling)
     {
-        GOTO_ERROR("Failed to set action option", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        host->state = FANOUT_HOST_CLOSING_SHELL;
+        close = MI_TRUE;
     }
+    Lock_Release(&fanOut->lock);
 
-    {
+    if (close)
+        FanOutCloseShell(host);
+}
 
-        (*sendOperation)->callbacks.instanceResult = SendShellComplete;
-        (*sendOperation)->callbacks.callbackContext = *sendOperation;
+static void FanOutSignalled(
+    PVOID operationContext,
+    MI_Uint32 flags,
+    WSMAN_ERROR *error,
+    WSMAN_SHELL_HANDLE shell,
+    WSMAN_COMMAND_HANDLE command,
+    WSMAN_OPERATION_HANDLE operationHandle,
+    WSMAN_RESPONSE_DATA *data)
+{
+    WSMAN_FANOUT_HOST *host = (WSMAN_FANOUT_HOST*) operationContext;
+    struct WSMAN_FANOUT *fanOut = host->fanOut;
+    MI_Boolean close = MI_FALSE;
 
-        MI_Session_Invoke(&shell->miSession,
-                0, /* flags */
-                &(*sendOperation)->miOptions, /*options*/
-                NULL, /* namespace */
-                "Shell",
-                "Send",
-                &shell->shellInstance->__instance,
-                (*sendOperation)->operationProperties,
-                &((*sendOperation)->callbacks), &(*sendOperation)->miOperation);
+    Lock_Acquire(&fanOut->lock);
+    host->signalling = MI_FALSE;
+    if (!host->receiving)
+    {
+        host->state = FANOUT_HOST_CLOSING_SHELL;
+        close = MI_TRUE;
     }
+    Lock_Release(&fanOut->lock);
 
-    LogFunctionEnd("WSManSendShellInput", MI_RESULT_OK);
-    return;
+    if (close)
+        FanOutCloseShell(host);
+}
 
+static void FanOutShellClosed(
+    PVOID operationContext,
+    MI_Uint32 flags,
+    WSMAN_ERROR *error,
+    WSMAN_SHELL_HANDLE shell,
+    WSMAN_COMMAND_HANDLE command,
+    WSMAN_OPERATION_HANDLE operationHandle,
+    WSMAN_RESPONSE_DATA *data)
+{
+    WSMAN_FANOUT_HOST *host = (WSMAN_FANOUT_HOST*) operationContext;
 
-error:
-    {
-        WSMAN_ERROR error = { 0 };
-        error.code = miResult;
-        Utf8ToUtf16Le(batch, errorMessage, (MI_Char16**) &error.errorDetail);
-        async->completionFunction(
-                async->operationContext,
-                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-                &error,
-                shell,
-                NULL,
-                NULL,
-                NULL);
-     }
+    Lock_Acquire(&host->fanOut->lock);
+    FanOutSetError(host, error->code, error->errorDetail);
+    Lock_Release(&host->fanOut->lock);
 
-    if ((*sendOperation)->miOptions.ft)
-    {
-        MI_OperationOptions_Delete(&(*sendOperation)->miOptions);
-    }
-    if ((*sendOperation)->operationProperties)
-    {
-        MI_Instance_Delete((*sendOperation)->operationProperties);
-    }
-    Batch_Delete(batch);
-    LogFunctionEnd("WSManSendShellInput", miResult);
+    FanOutHostFinished(host);
 }
 
-void MI_CALL CommandCloseShellComplete(
-    _In_opt_     MI_Operation *miOperation,
-    _In_     void *callbackContext,
-    _In_opt_ const MI_Instance *instance,
-             MI_Boolean moreResults,
-    _In_     MI_Result resultCode,
-    _In_opt_z_ const MI_Char *errorString,
-    _In_opt_ const MI_Instance *errorDetails,
-    _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
+/* FanOutStopExpired
+ * Stop every host that is past its deadline, or every host at all once the fan-out is
+ * cancelled. A create or run request still in flight is cancelled and its callback then
+ * closes the shell. A command that is running is terminated and the receive sees it finish.
+ */
+static void FanOutStopExpired(struct WSMAN_FANOUT *fanOut)
 {
-    WSMAN_COMMAND_HANDLE command = ( WSMAN_COMMAND_HANDLE ) callbackContext;
-    WSMAN_ERROR error = {0};
-    __LOGD(("%s: START, errorCode=%u", "CommandCloseShellComplete", resultCode));
-    error.code = resultCode;
-    if (resultCode != 0)
+    MI_Uint64 now = ClientNow();
+    MI_Uint32 index;
+
+    for (index = 0; index != fanOut->hostCount; index++)
     {
-        if (errorString)
+        WSMAN_FANOUT_HOST *host = &fanOut->hosts[index];
+        WSMAN_SHELL_ASYNC async = { host, FanOutSignalled };
+        WSMAN_OPERATION_HANDLE signal;
+        WSMAN_SHELL_HANDLE cancelCreate = NULL;
+        WSMAN_COMMAND_HANDLE cancelRun = NULL;
+        MI_Boolean terminate = MI_FALSE;
+
+        Lock_Acquire(&fanOut->lock);
+        if ((host->state == FANOUT_HOST_CREATING_SHELL) && host->shell && FanOutHostExpired(host, now))
         {
-            Utf8ToUtf16Le(command->batch, errorString, (MI_Char16**) &error.errorDetail);
-            __LOGD(("Error string = %s", errorString));
+            cancelCreate = host->shell;
         }
-        else
+        else if ((host->state == FANOUT_HOST_RUNNING_COMMAND) && host->command && FanOutHostExpired(host, now))
         {
-            Utf8ToUtf16Le(command->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
+            cancelRun = host->command;
+        }
+        else if ((host->state == FANOUT_HOST_RECEIVING) && FanOutHostExpired(host, now))
+        {
+            host->state = FANOUT_HOST_TERMINATING;
+            host->signalling = MI_TRUE;
+            terminate = MI_TRUE;
+        }
+        Lock_Release(&fanOut->lock);
+
+        /* A request that has just finished is left alone, its callback is moving the host on */
+        if (cancelCreate)
+        {
+            __LOGW(("Fan-out host %u - cancelling shell create, errorCode=%u", index, host->errorCode));
+            ShellCancelCreate(cancelCreate);
+        }
+        else if (cancelRun)
+        {
+            __LOGW(("Fan-out host %u - cancelling command, errorCode=%u", index, host->errorCode));
+            CommandCancelRun(cancelRun);
+        }
+        else if (terminate)
+        {
+            __LOGW(("Fan-out host %u - terminating command, errorCode=%u", index, host->errorCode));
+            WSManSignalShell(host->shell, host->command, 0, fanOut->terminateCode, &async, &signal);
         }
     }
+}
 
-    MI_Operation_Close(miOperation);
+static PAL_Uint32 THREAD_API FanOutWatchdogThread(void *param)
+{
+    struct WSMAN_FANOUT *fanOut = (struct WSMAN_FANOUT*) param;
 
-    command->asyncCallback.completionFunction(
-            command->asyncCallback.operationContext,
-            WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-            &error,
-            command->shell,
-            command,
-            NULL,
-            NULL);
+    while (!Atomic_Read(&fanOut->shutdown))
+    {
+        FanOutStopExpired(fanOut);
+        Sleep_Milliseconds(FANOUT_WATCHDOG_POLL_MS);
+    }
+    return 0;
 }
 
- MI_EXPORT void WINAPI WSManCloseCommand(
-    _Inout_opt_ WSMAN_COMMAND_HANDLE commandHandle,
+static void FanOutDelete(struct WSMAN_FANOUT *fanOut)
+{
+    MI_Uint32 index;
+
+    for (index = 0; index != fanOut->hostCount; index++)
+    {
+        free(fanOut->hosts[index].errorDetail);
+    }
+    if (fanOut->credentials.userAccount.password)
+    {
+        MI_Char16 *password = (MI_Char16*) fanOut->credentials.userAccount.password;
+        SecretWipe(password, Utf16LeStrLenBytes(password));
+    }
+    if (fanOut->shellOptions.ft)
+    {
+        MI_OperationOptions_Delete(&fanOut->shellOptions);
+    }
+    Batch_Delete(fanOut->batch);
+}
+
+MI_EXPORT MI_Uint32 WINAPI WSManRunShellCommandFanOut(
+    _In_ WSMAN_API_HANDLE apiHandle,
     MI_Uint32 flags,
-    _In_ WSMAN_SHELL_ASYNC *async)
+    _In_ WSMAN_FANOUT_INFO *info,
+    _In_ WSMAN_FANOUT_ASYNC *async,
+    _Out_ WSMAN_FANOUT_HANDLE *_fanOut)
 {
     MI_Result miResult;
     char *errorMessage = NULL;
-    MI_Value value;
+    Batch *batch = NULL;
+    struct WSMAN_FANOUT *fanOut = NULL;
+    MI_Instance *_shellInstance;
+    MI_Uint32 index;
+
+    LogFunctionStart("WSManRunShellCommandFanOut");
+
+    *_fanOut = NULL;
+
+    if ((info == NULL) || (info->hostCount == 0) || (info->hosts == NULL) ||
+        (info->commandLine == NULL) || (async == NULL) || (async->completionFunction == NULL) ||
+        (info->sessionOptionCount && (info->sessionOptions == NULL)))
+    {
+        GOTO_ERROR("Invalid parameter", MI_RESULT_INVALID_PARAMETER);
+    }
+
+    /* Checked here rather than failing every host the same way in WSManCreateSession */
+    if (info->credentials == NULL)
+    {
+        GOTO_ERROR("No authentication credentials given", MI_RESULT_ACCESS_DENIED);
+    }
+    if ((info->credentials->authenticationMechanism != WSMAN_FLAG_AUTH_BASIC) &&
+        (info->credentials->authenticationMechanism != WSMAN_FLAG_AUTH_NEGOTIATE) &&
+        (info->credentials->authenticationMechanism != WSMAN_FLAG_AUTH_KERBEROS))
+    {
+        GOTO_ERROR("Unsupported authentication type", MI_RESULT_ACCESS_DENIED);
+    }
+
+    batch = Batch_New(BATCH_MAX_PAGES);
+    if (batch == NULL)
+    {
+        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
 
-    LogFunctionStart("WSManCloseCommand");
+    fanOut = Batch_GetClear(batch, sizeof(struct WSMAN_FANOUT));
+    if (fanOut == NULL)
+    {
+        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    fanOut->api = apiHandle;
+    fanOut->batch = batch;
+    fanOut->async = *async;
+    fanOut->maxConcurrency = info->maxConcurrency ? info->maxConcurrency : WSMAN_FANOUT_DEFAULT_CONCURRENCY;
+    fanOut->hostTimeoutMs = info->hostTimeoutMs;
+    Lock_Init(&fanOut->lock);
+    Lock_Init(&fanOut->callbackLock);
 
-    miResult = MI_Application_NewInstance(&commandHandle->shell->session->api->application, "Signal", NULL, &commandHandle->commandClose);
-    if (miResult != MI_RESULT_OK)
+    if (!Utf8ToUtf16Le(batch, WSMAN_SIGNAL_SHELL_CODE_TERMINATE, &fanOut->terminateCode) ||
+        !Utf8ToUtf16Le(batch, "The host did not finish within the fan-out host timeout", &fanOut->timedOutDetail) ||
+        !Utf8ToUtf16Le(batch, "The fan-out was closed before the host finished", &fanOut->abortedDetail))
     {
-        GOTO_ERROR("Failed to allocate receive properties instance", miResult);
+        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
 
-    value.string = commandHandle->commandId;
-    miResult = MI_Instance_AddElement(commandHandle->commandClose, "CommandId", &value, MI_STRING, 0);
+    /* Every host gets a clone of the same create shell request */
+    miResult = MI_Application_NewOperationOptions(&apiHandle->application, MI_TRUE, &fanOut->shellOptions);
     if (miResult != MI_RESULT_OK)
     {
-        GOTO_ERROR("Failed to allocate receive properties instance", miResult);
+        GOTO_ERROR("Failed to create operation options", miResult);
     }
-
-    value.string = "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/signal/terminate";
-    miResult = MI_Instance_AddElement(commandHandle->commandClose, "Code", &value, MI_STRING, 0);
+    miResult = Instance_New(&_shellInstance, &Shell_rtti, batch);
     if (miResult != MI_RESULT_OK)
     {
-        GOTO_ERROR("Failed to allocate receive properties instance", miResult);
+        GOTO_ERROR("Failed to create instance", miResult);
     }
-
-    MI_OperationOptions_SetString(&commandHandle->miOptions, "__MI_OPERATIONOPTIONS_ACTION", "http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Signal", 0);
-
-    commandHandle->asyncCallback = *async;
-
+    fanOut->shellTemplate = (Shell*) _shellInstance;
+    miResult = ShellFillTemplate(batch, ShellFlags(apiHandle, info->shellFlags), info->resourceUri, NULL, info->startupInfo, info->options, info->createXml, fanOut->shellTemplate, &fanOut->shellOptions, &errorMessage);
+    if (miResult != MI_RESULT_OK)
     {
-        commandHandle->callbacks.instanceResult = CommandCloseShellComplete;
-        commandHandle->callbacks.callbackContext = commandHandle;
-
-        MI_Session_Invoke(&commandHandle->shell->miSession,
-                0, /* flags */
-                &commandHandle->miOptions, /*options*/
-                NULL, /* namespace */
-                "Shell",
-                "Signal",
-                &commandHandle->shell->shellInstance->__instance,
-                commandHandle->commandClose,
-                &(commandHandle->callbacks), &commandHandle->miOperation);
+        goto error;
     }
 
-    LogFunctionEnd("WSManCloseCommand", MI_RESULT_OK);
-    return;
-
-
-error:
+    fanOut->credentials = *info->credentials;
+    fanOut->credentials.userAccount.username = FanOutStrdup(batch, info->credentials->userAccount.username);
+    fanOut->credentials.userAccount.password = FanOutStrdup(batch, info->credentials->userAccount.password);
+    fanOut->commandLine = FanOutStrdup(batch, info->commandLine);
+    if (info->args && info->args->argsCount)
     {
-        WSMAN_ERROR error = { 0 };
-        error.code = miResult;
-        Batch *batch = NULL;
-        batch = Batch_New(BATCH_MAX_PAGES);
-        if (batch != NULL)
+        fanOut->args.argsCount = info->args->argsCount;
+        fanOut->args.args = Batch_Get(batch, sizeof(MI_Char16*) * info->args->argsCount);
+        if (fanOut->args.args == NULL)
         {
-            Utf8ToUtf16Le(batch, errorMessage, (MI_Char16**) &error.errorDetail);
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
         }
-
-        async->completionFunction(
-                async->operationContext,
-                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-                &error,
-                commandHandle->shell,
-                commandHandle,
-                NULL,
-                NULL);
-        if (batch)
+        for (index = 0; index != info->args->argsCount; index++)
         {
-            Batch_Delete(batch);
+            fanOut->args.args[index] = FanOutStrdup(batch, info->args->args[index]);
         }
-     }
-
-    if (commandHandle->commandClose)
-    {
-        MI_Instance_Delete(commandHandle->commandClose);
     }
-    LogFunctionEnd("WSManCloseCommand", miResult);
-    return;
-}
-
-void MI_CALL CloseSessionComplete(_In_opt_ void *competionContext
-)
-{
-    __LOGD(("%s: END", "CloseSessionComplete"));
-}
-
-void MI_CALL CloseShellComplete(
-    _In_opt_     MI_Operation *miOperation,
-    _In_     void *callbackContext,
-    _In_opt_ const MI_Instance *instance,
-             MI_Boolean moreResults,
-    _In_     MI_Result resultCode,
-    _In_opt_z_ const MI_Char *errorString,
-    _In_opt_ const MI_Instance *errorDetails,
-    _In_opt_ MI_Result (MI_CALL * resultAcknowledgement)(_In_ MI_Operation *operation))
-{
-    WSMAN_SHELL_HANDLE shell = ( WSMAN_SHELL_HANDLE ) callbackContext;
-    WSMAN_ERROR error = {0};
-    __LOGD(("%s: START, errorCode=%u", "CloseShellComplete", resultCode));
-    error.code = resultCode;
-    if (resultCode != 0)
+    if (info->sessionOptionCount)
     {
-        if (errorString)
+        fanOut->sessionOptionCount = info->sessionOptionCount;
+        fanOut->sessionOptions = Batch_Get(batch, sizeof(WSMAN_FANOUT_SESSION_OPTION) * info->sessionOptionCount);
+        if (fanOut->sessionOptions == NULL)
         {
-            Utf8ToUtf16Le(shell->batch, errorString, (MI_Char16**) &error.errorDetail);
-            __LOGD(("Error string = %s", errorString));
+            GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
         }
-        else
+        for (index = 0; index != info->sessionOptionCount; index++)
         {
-            Utf8ToUtf16Le(shell->batch, Result_ToString(resultCode), (MI_Char16**) &error.errorDetail);
+            fanOut->sessionOptions[index] = info->sessionOptions[index];
+            if (info->sessionOptions[index].data.type == WSMAN_DATA_TYPE_TEXT)
+            {
+                fanOut->sessionOptions[index].data.text.buffer = FanOutStrdup(batch, info->sessionOptions[index].data.text.buffer);
+            }
         }
     }
-    shell->asyncCallback.completionFunction(
-                shell->asyncCallback.operationContext,
-                WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-                &error,
-                shell,
-                NULL,
-                NULL,
-                NULL);
-    MI_Operation_Close(miOperation);
-    __LOGD(("%s: START", "CloseSessionComplete"));
-    MI_Session_Close(&shell->miSession, NULL, CloseSessionComplete);
-    __LOGD(("%s: END, errorCode=%u", "CloseShellComplete", resultCode));
-}
-MI_EXPORT void WINAPI WSManCloseShell(
-    _Inout_opt_ WSMAN_SHELL_HANDLE shellHandle,
-    MI_Uint32 flags,
-    _In_ WSMAN_SHELL_ASYNC *async)
-{
-    LogFunctionStart("WSManCloseShell");
 
-    shellHandle->asyncCallback = *async;
+    fanOut->hostCount = info->hostCount;
+    fanOut->hosts = Batch_GetClear(batch, sizeof(WSMAN_FANOUT_HOST) * info->hostCount);
+    if (fanOut->hosts == NULL)
+    {
+        GOTO_ERROR("Alloc failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    for (index = 0; index != info->hostCount; index++)
+    {
+        fanOut->hosts[index].fanOut = fanOut;
+        fanOut->hosts[index].index = index;
+        fanOut->hosts[index].host = FanOutStrdup(batch, info->hosts[index]);
+    }
 
-    if (shellHandle->didCreate)
+    if (fanOut->hostTimeoutMs)
     {
-        shellHandle->callbacks.instanceResult = CloseShellComplete;
-        shellHandle->callbacks.callbackContext = shellHandle;
+        if (Thread_CreateJoinable(&fanOut->watchdogThread, FanOutWatchdogThread, NULL, fanOut) != 0)
+        {
+            GOTO_ERROR("Failed to create fan-out watchdog thread", MI_RESULT_FAILED);
+        }
+        fanOut->watchdogStarted = MI_TRUE;
+    }
 
-        MI_Session_DeleteInstance(&shellHandle->miSession,
-                0, /* flags */
-                &shellHandle->operationOptions, /*options*/
-                NULL, /* namespace */
-                &shellHandle->shellInstance->__instance,
-                &shellHandle->callbacks,
-                &shellHandle->miDeleteShellOperation);
+    __LOGD(("Fan-out to %u hosts, %u at a time, host timeout %ums", fanOut->hostCount, fanOut->maxConcurrency, fanOut->hostTimeoutMs));
+
+    /* Callbacks may start, and the fan-out may even finish, before FanOutPump returns */
+    *_fanOut = fanOut;
+    FanOutPump(fanOut);
+
+    LogFunctionEnd("WSManRunShellCommandFanOut", MI_RESULT_OK);
+    return MI_RESULT_OK;
+
+error:
+    if (fanOut)
+    {
+        FanOutDelete(fanOut);
     }
-    else
+    else if (batch)
     {
-        WSMAN_ERROR error = {0};
-        error.code = MI_RESULT_OK;
-        shellHandle->asyncCallback.completionFunction(
-                    shellHandle->asyncCallback.operationContext,
-                    WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-                    &error,
-                    shellHandle,
-                    NULL,
-                    NULL,
-                    NULL);
-     }
-
-    LogFunctionEnd("WSManCloseShell", MI_RESULT_OK);
-    return;
+        Batch_Delete(batch);
+    }
+    LogFunctionEnd("WSManRunShellCommandFanOut", miResult);
+    return miResult;
 }
 
-MI_EXPORT void WINAPI WSManDisconnectShell(
-    _Inout_ WSMAN_SHELL_HANDLE shell,
-    MI_Uint32 flags,
-    _In_ WSMAN_SHELL_DISCONNECT_INFO* disconnectInfo,
-    _In_ WSMAN_SHELL_ASYNC *async)
+MI_EXPORT MI_Uint32 WINAPI WSManCloseFanOut(
+    _Inout_opt_ WSMAN_FANOUT_HANDLE fanOut,
+    MI_Uint32 flags)
 {
-    WSMAN_ERROR error = {0};
-    LogFunctionStart("WSManDisconnectShell");
-    error.code = MI_RESULT_NOT_SUPPORTED;
-    async->completionFunction(
-            async->operationContext,
-            WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-            &error,
-            shell,
-            NULL,
-            NULL,
-            NULL);
-     LogFunctionEnd("WSManDisconnectShell", MI_RESULT_NOT_SUPPORTED);
-}
+    PAL_Uint32 threadResult;
 
-MI_EXPORT void WINAPI WSManReconnectShell(
-    _Inout_ WSMAN_SHELL_HANDLE shell,
-    MI_Uint32 flags,
-    _In_ WSMAN_SHELL_ASYNC *async)
-{
-    WSMAN_ERROR error = {0};
-    LogFunctionStart("WSManReconnectShell");
-    error.code = MI_RESULT_NOT_SUPPORTED;
-    async->completionFunction(
-            async->operationContext,
-            WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-            &error,
-            shell,
-            NULL,
-            NULL,
-            NULL);
-     LogFunctionEnd("WSManReconnectShell", MI_RESULT_NOT_SUPPORTED);
-}
+    LogFunctionStart("WSManCloseFanOut");
 
-MI_EXPORT void WINAPI WSManReconnectShellCommand(
-    _Inout_ WSMAN_COMMAND_HANDLE commandHandle,
-    MI_Uint32 flags,
-    _In_ WSMAN_SHELL_ASYNC *async)
-{
-    WSMAN_ERROR error = {0};
-    LogFunctionStart("WSManReconnectShellCommand");
-    error.code = MI_RESULT_NOT_SUPPORTED;
-    async->completionFunction(
-            async->operationContext,
-            WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-            &error,
-            commandHandle->shell ,
-            NULL,
-            NULL,
-            NULL);
-     LogFunctionEnd("WSManReconnectShellCommand", MI_RESULT_NOT_SUPPORTED);
-}
+    if (fanOut == NULL)
+    {
+        LogFunctionEnd("WSManCloseFanOut", MI_RESULT_OK);
+        return MI_RESULT_OK;
+    }
 
-MI_EXPORT void WINAPI WSManConnectShell(
-    _Inout_ WSMAN_SESSION_HANDLE session,
-    MI_Uint32 flags,
-    _In_ const MI_Char16* resourceUri,
-    _In_ const MI_Char16* shellID,           // shell Identifier
-    _In_opt_ WSMAN_OPTION_SET *options,
-    _In_opt_ WSMAN_DATA *connectXml,                     // open content for connect shell
-    _In_ WSMAN_SHELL_ASYNC *async,
-    _Out_ WSMAN_SHELL_HANDLE *shell) // should be closed using WSManCloseShell
-{
-    WSMAN_ERROR error = {0};
-    *shell = NULL;
-    LogFunctionStart("WSManConnectShell");
-    error.code = MI_RESULT_NOT_SUPPORTED;
-    async->completionFunction(
-            async->operationContext,
-            WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-            &error,
-            *shell,
-            NULL,
-            NULL,
-            NULL);
-     LogFunctionEnd("WSManConnectShell", MI_RESULT_NOT_SUPPORTED);
-}
+    /* Hosts still waiting are failed by the next host to finish, the rest are stopped here */
+    Lock_Acquire(&fanOut->lock);
+    fanOut->cancelled = MI_TRUE;
+    Lock_Release(&fanOut->lock);
+    FanOutStopExpired(fanOut);
 
-MI_EXPORT void WINAPI WSManConnectShellCommand(
-    _Inout_ WSMAN_SHELL_HANDLE shell,
-    MI_Uint32 flags,
-    _In_ const MI_Char16* commandID,  //command Identifier
-    _In_opt_ WSMAN_OPTION_SET *options,
-    _In_opt_ WSMAN_DATA *connectXml,                // open content for connect command
-    _In_ WSMAN_SHELL_ASYNC *async,
-    _Out_ WSMAN_COMMAND_HANDLE *command) // should be closed using WSManCloseCommand
-{
-    WSMAN_ERROR error = {0};
-    LogFunctionStart("WSManConnectShellCommand");
-    error.code = MI_RESULT_NOT_SUPPORTED;
-    async->completionFunction(
-            async->operationContext,
-            WSMAN_FLAG_CALLBACK_END_OF_OPERATION,
-            &error,
-            shell,
-            NULL,
-            NULL,
-            NULL);
-     LogFunctionEnd("WSManConnectShellCommand", MI_RESULT_NOT_SUPPORTED);
+    do
+    {
+    } while (CondLock_Wait((ptrdiff_t) &fanOut->done,
+                           &fanOut->done,
+                           0,
+                           CONDLOCK_DEFAULT_SPINCOUNT) == 0);
+
+    if (fanOut->watchdogStarted)
+    {
+        Atomic_Swap(&fanOut->shutdown, 1);
+        Thread_Join(&fanOut->watchdogThread, &threadResult);
+        Thread_Destroy(&fanOut->watchdogThread);
+    }
+
+    FanOutDelete(fanOut);
+
+    LogFunctionEnd("WSManCloseFanOut", MI_RESULT_OK);
+    return MI_RESULT_OK;
 }
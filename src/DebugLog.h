@@ -0,0 +1,60 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#ifndef _DebugLog_h_
+#define _DebugLog_h_
+#include <stddef.h>
+#include <MI.h>
+#include <base/logbase.h>
+#include <base/log.h>
+
+/* Debug tracing on the request paths. Include after base/log.h.
+ *
+ * DEBUG_LOG_ENABLED() is a single log level check. Anything that has to do work just to
+ * produce the arguments of a debug log, such as looking up IDs or measuring a payload, goes
+ * behind it so the work is skipped at the default log level.
+ *
+ * Configuring with -DPSRP_DEBUG_LOG=OFF defines PSRP_NO_DEBUG_LOG, which turns __LOGD into
+ * nothing and DEBUG_LOG_ENABLED() into a constant so release builds carry no debug tracing.
+ */
+#ifdef PSRP_NO_DEBUG_LOG
+/* The arguments still go to a function that is never called so they keep being type checked
+ * and locals that are only logged do not turn into unused variable warnings.
+ */
+MI_INLINE void DebugLog_Discard(const char *format, ...) __attribute__((format(printf, 1, 2)));
+MI_INLINE void DebugLog_Discard(const char *format, ...)
+{
+}
+# undef __LOGD
+# define __LOGD(ARGS) do { if (0) DebugLog_Discard ARGS; } while (0)
+# define DEBUG_LOG_ENABLED() 0
+#else
+# define DEBUG_LOG_ENABLED() (Log_GetLevel() >= OMI_DEBUG)
+#endif
+
+/* Most characters of a payload that go in the log. The whole payload is only represented by
+ * its length and DebugLog_Hash so two logs can still be matched up.
+ */
+#define DEBUG_LOG_PAYLOAD_PREFIX 64
+
+/* FNV-1a over a payload that is too long to log */
+MI_INLINE MI_Uint32 DebugLog_Hash(const char *data, size_t length)
+{
+    MI_Uint32 hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i != length; i++)
+    {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#endif /* _DebugLog_h_ */
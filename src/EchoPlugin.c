@@ -0,0 +1,446 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <MI.h>
+#include "wsman.h"
+#include <pal/lock.h>
+#include <pal/atomic.h>
+#include <pal/sleep.h>
+#include <pal/thread.h>
+#include <base/logbase.h>
+#include <base/log.h>
+#include "EchoPlugin.h"
+#include "Utilities.h"
+#include "DebugLog.h"
+
+static const MI_Char16 _stdoutStream[] = { 's', 't', 'd', 'o', 'u', 't', 0 };
+static const MI_Char16 _exitCommand[] = { 'e', 'x', 'i', 't', 0 };
+
+static MI_Uint32 _latencyMs;
+static MI_Uint32 _payloadSize;
+
+/* One block of output waiting for a Receive to send it on */
+typedef struct _EchoOutput
+{
+    struct _EchoOutput *next;
+    MI_Uint32 dataLength;
+    MI_Uint8 data[1];
+} EchoOutput;
+
+/* Output queue for a shell or a command. Output is handed to the Receive in order by
+ * whichever thread finds nobody else is already draining it.
+ */
+typedef struct _EchoTarget
+{
+    Lock lock;
+    WSMAN_PLUGIN_REQUEST *receive;
+    EchoOutput *head;
+    EchoOutput *tail;
+    MI_Boolean draining;
+
+    /* The shell or command request itself and whether it has been completed yet */
+    WSMAN_PLUGIN_REQUEST *request;
+    ptrdiff_t completed;
+
+    /* One until the target is completed plus one for each Send and Receive running on it */
+    volatile ptrdiff_t refs;
+} EchoTarget;
+
+typedef struct _EchoShell
+{
+    EchoTarget target;
+} EchoShell;
+
+typedef struct _EchoCommand
+{
+    EchoTarget target;
+    MI_Boolean exitOnReceive;   /* the command line was exit */
+} EchoCommand;
+
+static void _EchoLatency(void)
+{
+    if (_latencyMs)
+        Sleep_Milliseconds(_latencyMs);
+}
+
+static void _EchoTargetInit(EchoTarget *target, WSMAN_PLUGIN_REQUEST *request)
+{
+    memset(target, 0, sizeof(*target));
+    Lock_Init(&target->lock);
+    target->request = request;
+    target->refs = 1;
+}
+
+static void _EchoTargetAddRef(EchoTarget *target)
+{
+    Atomic_Inc(&target->refs);
+}
+
+/* _EchoTargetRelease
+ * Drop a reference and free the target along with any output nobody will receive now.
+ */
+static void _EchoTargetRelease(EchoTarget *target)
+{
+    EchoOutput *output;
+
+    if (Atomic_Dec(&target->refs) != 0)
+        return;
+
+    while ((output = target->head) != NULL)
+    {
+        target->head = output->next;
+        free(output);
+    }
+    free(target);
+}
+
+/* _EchoDrain
+ * Hand queued output to the target's Receive. WSManPluginReceiveResult blocks until the client
+ * has a Receive request waiting, so it is called without holding the lock.
+ */
+static void _EchoDrain(EchoTarget *target)
+{
+    Lock_Acquire(&target->lock);
+    if (target->draining)
+    {
+        Lock_Release(&target->lock);
+        return;
+    }
+    target->draining = MI_TRUE;
+
+    while (target->receive && target->head)
+    {
+        WSMAN_PLUGIN_REQUEST *receive = target->receive;
+        EchoOutput *output = target->head;
+        WSMAN_DATA data;
+
+        target->head = output->next;
+        if (target->head == NULL)
+            target->tail = NULL;
+        Lock_Release(&target->lock);
+
+        data.type = WSMAN_DATA_TYPE_BINARY;
+        data.binaryData.dataLength = output->dataLength;
+        data.binaryData.data = output->data;
+        WSManPluginReceiveResult(receive, 0, _stdoutStream, &data, NULL, 0);
+        free(output);
+
+        Lock_Acquire(&target->lock);
+    }
+
+    target->draining = MI_FALSE;
+    Lock_Release(&target->lock);
+}
+
+/* _EchoEndReceive
+ * Detach the target's Receive, wait for any delivery to it to finish and complete it.
+ */
+static void _EchoEndReceive(EchoTarget *target)
+{
+    WSMAN_PLUGIN_REQUEST *receive;
+
+    Lock_Acquire(&target->lock);
+    receive = target->receive;
+    target->receive = NULL;
+    while (target->draining)
+    {
+        Lock_Release(&target->lock);
+        Sleep_Milliseconds(1);
+        Lock_Acquire(&target->lock);
+    }
+    Lock_Release(&target->lock);
+
+    if (receive)
+        WSManPluginOperationComplete(receive, 0, 0, NULL);
+}
+
+/* _EchoComplete
+ * End the target's Receive and complete the shell or command itself. Shutdown and Signal
+ * can race to do this so only the first caller does anything. Completing is taken under
+ * the lock so a Send running alongside either queues its output before the Receive is
+ * ended or sees the target completed and drops it. The target is freed once the last
+ * Send or Receive running on it has returned.
+ */
+static void _EchoComplete(EchoTarget *target)
+{
+    ptrdiff_t completed;
+
+    Lock_Acquire(&target->lock);
+    completed = Atomic_CompareAndSwap(&target->completed, 0, 1);
+    Lock_Release(&target->lock);
+    if (completed != 0)
+        return;
+
+    WSManPluginRegisterShutdownCallback(target->request, NULL, NULL);
+    _EchoEndReceive(target);
+    WSManPluginOperationComplete(target->request, 0, 0, NULL);
+
+    _EchoTargetRelease(target);
+}
+
+static PAL_Uint32 THREAD_API _EchoCompleteThread(void *param)
+{
+    _EchoComplete((EchoTarget*) param);
+    return 0;
+}
+
+/* The provider calls shutdown callbacks while walking its list of operations, which completing
+ * an operation changes, so the completion is done on another thread.
+ */
+static void MI_CALL _EchoShutdownCallback(void *shutdownContext)
+{
+    if (Thread_CreateDetached(_EchoCompleteThread, NULL, shutdownContext) != 0)
+    {
+        __LOGE(("EchoPlugin failed to create shutdown thread"));
+    }
+}
+
+static void MI_CALL EchoPlugin_Shutdown(void* pluginContext)
+{
+}
+
+static void MI_CALL EchoPlugin_Shell(
+    void* pluginContext,
+    WSMAN_PLUGIN_REQUEST *requestDetails,
+    MI_Uint32 flags,
+    MI_Char16 *extraInfo,
+    WSMAN_SHELL_STARTUP_INFO *startupInfo,
+    WSMAN_DATA *inboundShellInformation)
+{
+    EchoShell *shell = malloc(sizeof(EchoShell));
+
+    _EchoLatency();
+
+    if (shell == NULL)
+    {
+        WSManPluginOperationComplete(requestDetails, 0, MI_RESULT_SERVER_LIMITS_EXCEEDED, NULL);
+        return;
+    }
+    _EchoTargetInit(&shell->target, requestDetails);
+
+    WSManPluginRegisterShutdownCallback(requestDetails, _EchoShutdownCallback, &shell->target);
+    WSManPluginReportContext(requestDetails, 0, shell);
+}
+
+static void MI_CALL EchoPlugin_ReleaseShellContext(void* pluginContext, void* shellContext)
+{
+}
+
+static void MI_CALL EchoPlugin_Command(
+    void* pluginContext,
+    WSMAN_PLUGIN_REQUEST *requestDetails,
+    MI_Uint32 flags,
+    void* shellContext,
+    MI_Char16 *commandLine,
+    WSMAN_COMMAND_ARG_SET *arguments)
+{
+    EchoCommand *command = malloc(sizeof(EchoCommand));
+
+    _EchoLatency();
+
+    if (command == NULL)
+    {
+        WSManPluginOperationComplete(requestDetails, 0, MI_RESULT_SERVER_LIMITS_EXCEEDED, NULL);
+        return;
+    }
+    _EchoTargetInit(&command->target, requestDetails);
+    command->exitOnReceive = MI_FALSE;
+    if (commandLine)
+    {
+        MI_Uint32 i;
+
+        for (i = 0; commandLine[i] && (commandLine[i] == _exitCommand[i]); i++)
+            ;
+        command->exitOnReceive = (commandLine[i] == _exitCommand[i]);
+    }
+
+    WSManPluginRegisterShutdownCallback(requestDetails, _EchoShutdownCallback, &command->target);
+    WSManPluginReportContext(requestDetails, 0, command);
+}
+
+static void MI_CALL EchoPlugin_ReleaseCommandContext(void* pluginContext, void* shellContext, void* commandContext)
+{
+}
+
+static EchoTarget *_EchoGetTarget(void* shellContext, void* commandContext)
+{
+    if (commandContext)
+        return &((EchoCommand*) commandContext)->target;
+
+    return &((EchoShell*) shellContext)->target;
+}
+
+static void MI_CALL EchoPlugin_Send(
+    void* pluginContext,
+    WSMAN_PLUGIN_REQUEST *requestDetails,
+    MI_Uint32 flags,
+    void* shellContext,
+    void* commandContext,
+    MI_Char16 *stream,
+    WSMAN_DATA *inboundData)
+{
+    EchoTarget *target = _EchoGetTarget(shellContext, commandContext);
+    EchoOutput *output = NULL;
+    MI_Uint32 inLength = inboundData->binaryData.dataLength;
+    MI_Uint32 outLength = _payloadSize ? _payloadSize : inLength;
+
+    _EchoTargetAddRef(target);
+
+    /* The inbound data goes away once the Send is completed so copy it first */
+    if (inLength && outLength)
+    {
+        output = malloc(sizeof(EchoOutput) + outLength);
+        if (output)
+        {
+            MI_Uint32 copied = 0;
+
+            while (copied < outLength)
+            {
+                MI_Uint32 chunk = (outLength - copied) < inLength ? (outLength - copied) : inLength;
+                memcpy(output->data + copied, inboundData->binaryData.data, chunk);
+                copied += chunk;
+            }
+            output->next = NULL;
+            output->dataLength = outLength;
+        }
+    }
+
+    _EchoLatency();
+    WSManPluginOperationComplete(requestDetails, 0, (output || !inLength) ? 0 : MI_RESULT_SERVER_LIMITS_EXCEEDED, NULL);
+
+    if (output)
+    {
+        MI_Boolean queued;
+
+        Lock_Acquire(&target->lock);
+        queued = !target->completed;
+        if (queued)
+        {
+            if (target->tail)
+                target->tail->next = output;
+            else
+                target->head = output;
+            target->tail = output;
+        }
+        Lock_Release(&target->lock);
+
+        if (queued)
+            _EchoDrain(target);
+        else
+            free(output); /* Nothing will receive it now */
+    }
+
+    _EchoTargetRelease(target);
+}
+
+static void MI_CALL EchoPlugin_Receive(
+    void* pluginContext,
+    WSMAN_PLUGIN_REQUEST *requestDetails,
+    MI_Uint32 flags,
+    void* shellContext,
+    void* commandContext,
+    WSMAN_STREAM_ID_SET* streamSet)
+{
+    EchoTarget *target = _EchoGetTarget(shellContext, commandContext);
+    MI_Result refused = MI_RESULT_OK;
+
+    _EchoTargetAddRef(target);
+
+    Lock_Acquire(&target->lock);
+    if (target->completed)
+        refused = MI_RESULT_NOT_FOUND;
+    else if (target->receive)
+        refused = MI_RESULT_ALREADY_EXISTS;
+    else
+        target->receive = requestDetails;
+    Lock_Release(&target->lock);
+
+    if (refused != MI_RESULT_OK)
+    {
+        WSManPluginOperationComplete(requestDetails, 0, refused, NULL);
+    }
+    else if (commandContext && ((EchoCommand*) commandContext)->exitOnReceive)
+    {
+        /* Ending the Receive reports the command done */
+        _EchoComplete(target);
+    }
+    else
+    {
+        _EchoDrain(target);
+    }
+
+    _EchoTargetRelease(target);
+}
+
+/* Any signal to a command ends it, there is nothing else for it to do */
+static void MI_CALL EchoPlugin_Signal(
+    void* pluginContext,
+    WSMAN_PLUGIN_REQUEST *requestDetails,
+    MI_Uint32 flags,
+    void* shellContext,
+    void* commandContext,
+    MI_Char16 *code)
+{
+    _EchoLatency();
+
+    if (commandContext)
+    {
+        _EchoComplete(_EchoGetTarget(shellContext, commandContext));
+    }
+    WSManPluginOperationComplete(requestDetails, 0, 0, NULL);
+}
+
+static void MI_CALL EchoPlugin_Connect(
+    void* pluginContext,
+    WSMAN_PLUGIN_REQUEST *requestDetails,
+    MI_Uint32 flags,
+    void* shellContext,
+    void* commandContext,
+    WSMAN_DATA *inboundConnectInformation)
+{
+    _EchoLatency();
+    WSManPluginOperationComplete(requestDetails, 0, 0, NULL);
+}
+
+static void MI_CALL EchoPlugin_ShellClose(void* pluginContext, void* shellContext)
+{
+}
+
+static MI_Uint32 _EchoConfigNumber(const char *name, MI_Uint32 defaultValue)
+{
+    char valueString[16];
+
+    if (_GetConfigValueFromConfigFile(name, valueString, sizeof(valueString)) == MI_RESULT_OK)
+    {
+        return (MI_Uint32) strtoul(valueString, NULL, 10);
+    }
+    return defaultValue;
+}
+
+MI_Uint32 MI_CALL EchoPlugin_Init(PwrshPluginWkr_Ptrs* wkrPtrs)
+{
+    _latencyMs = _EchoConfigNumber("echopluginlatencyms", 0);
+    _payloadSize = _EchoConfigNumber("echopluginpayloadsize", 0);
+    __LOGD(("EchoPlugin_Init latency=%ums, payload=%u bytes", _latencyMs, _payloadSize));
+
+    wkrPtrs->shutdownPluginFuncPtr = EchoPlugin_Shutdown;
+    wkrPtrs->wsManPluginShellFuncPtr = EchoPlugin_Shell;
+    wkrPtrs->wsManPluginReleaseShellContextFuncPtr = EchoPlugin_ReleaseShellContext;
+    wkrPtrs->wsManPluginCommandFuncPtr = EchoPlugin_Command;
+    wkrPtrs->wsManPluginReleaseCommandContextFuncPtr = EchoPlugin_ReleaseCommandContext;
+    wkrPtrs->wsManPluginSendFuncPtr = EchoPlugin_Send;
+    wkrPtrs->wsManPluginReceiveFuncPtr = EchoPlugin_Receive;
+    wkrPtrs->wsManPluginSignalFuncPtr = EchoPlugin_Signal;
+    wkrPtrs->wsManPluginConnectFuncPtr = EchoPlugin_Connect;
+    wkrPtrs->wsManPluginShellCloseFuncPtr = EchoPlugin_ShellClose;
+
+    return MI_RESULT_OK;
+}
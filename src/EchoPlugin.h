@@ -0,0 +1,26 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#ifndef _EchoPlugin_h_
+#define _EchoPlugin_h_
+#include <MI.h>
+#include "wsman.h"
+
+/* Native stand-in for the PowerShell plugin, selected with shellplugin=echo in omiserver.conf.
+ * It accepts every shell and command and echoes whatever is sent to them back as stdout
+ * output, so the provider can be load tested without CoreCLR or PowerShell installed.
+ * A command whose command line is exit finishes with no output once a Receive asks for it.
+ *
+ * echopluginlatencyms   - delay in ms before each operation completes, default 0
+ * echopluginpayloadsize - bytes of output produced per Send, default 0 which echoes the
+ *                         Send data unchanged. Larger sizes repeat the input to fill it.
+ */
+MI_Uint32 MI_CALL EchoPlugin_Init(_Out_ PwrshPluginWkr_Ptrs* wkrPtrs);
+
+#endif /* _EchoPlugin_h_ */
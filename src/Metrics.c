@@ -0,0 +1,355 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <MI.h>
+#include <pal/strings.h>
+#include <pal/atomic.h>
+#include <pal/sleep.h>
+#include <pal/thread.h>
+#include <base/paths.h>
+#include <base/logbase.h>
+#include <base/log.h>
+#include "Metrics.h"
+#include "Utilities.h"
+#include "DebugLog.h"
+
+/* Number of per-CPU slots. CPUs beyond this share slots, which is still correct, just
+ * not contention free.
+ */
+#define METRICS_SLOTS 64
+
+/* Latency bucket i counts operations that took less than 2^i microseconds, the last bucket
+ * takes everything from about 8 seconds up.
+ */
+#define METRICS_BUCKETS 24
+
+/* How often the writer thread checks for SIGUSR2, the interval and shutdown */
+#define METRICS_POLL_MS 100
+
+typedef struct _MetricsSlot
+{
+    volatile ptrdiff_t count[Metrics_OperationCount];
+    volatile ptrdiff_t errors[Metrics_OperationCount];
+    volatile ptrdiff_t totalMicroseconds[Metrics_OperationCount];
+    volatile ptrdiff_t histogram[Metrics_OperationCount][METRICS_BUCKETS];
+    volatile ptrdiff_t counters[Metrics_CounterCount];
+    volatile ptrdiff_t gauges[Metrics_GaugeCount];
+} __attribute__((aligned(64))) MetricsSlot;
+
+static MetricsSlot _slots[METRICS_SLOTS];
+
+static const char *_operationNames[Metrics_OperationCount] = { "Shell", "Command", "Send", "Receive", "Signal", "Connect" };
+static const char *_counterNames[Metrics_CounterCount] =
+{
+    "bytesIn", "bytesOut", "compressedBytesIn", "uncompressedBytesIn", "compressedBytesOut", "uncompressedBytesOut",
+    "reapedShells", "reclaimedBytes",
+    "bufferedBytes", "spilledBytes"
+};
+static const char *_gaugeNames[Metrics_GaugeCount] = { "activeShells", "activeCommands", "queuedReceives", "waitingResults" };
+static const char *_startupPhaseNames[Metrics_StartupPhaseCount] =
+{
+    "setHomeDir", "loadCoreClr", "tpaList", "initializeCoreClr", "createDelegate", "initPlugin", "total"
+};
+
+static MI_Uint64 _startupPhases[Metrics_StartupPhaseCount];
+static char _startupRuntime[PAL_MAX_PATH_SIZE];
+static MI_Boolean _startupTpaListCached;
+
+static Thread _writerThread;
+static MI_Boolean _writerRunning;
+static volatile ptrdiff_t _writerShutdown;
+static volatile ptrdiff_t _writeRequested;
+static MI_Uint32 _writeIntervalSeconds;
+static char _metricsPath[PAL_MAX_PATH_SIZE];
+
+static MetricsSlot *_MetricsSlot(void)
+{
+    int cpu = sched_getcpu();
+
+    if (cpu < 0)
+        cpu = 0;
+    return &_slots[cpu % METRICS_SLOTS];
+}
+
+/* Metrics slots are almost always only touched by one CPU so this rarely goes round more than once */
+void Metrics_AtomicAdd(volatile ptrdiff_t *value, ptrdiff_t delta)
+{
+    ptrdiff_t current;
+
+    do
+    {
+        current = *value;
+    } while (Atomic_CompareAndSwap(value, current, current + delta) != current);
+}
+
+static ptrdiff_t _MetricsSum(const volatile ptrdiff_t *first)
+{
+    ptrdiff_t total = 0;
+    size_t offset = (const char*) first - (const char*) &_slots[0];
+    MI_Uint32 i;
+
+    for (i = 0; i != METRICS_SLOTS; i++)
+        total += *(const volatile ptrdiff_t*) ((const char*) &_slots[i] + offset);
+    return total;
+}
+
+MI_Uint64 Metrics_Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((MI_Uint64) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+void Metrics_Observe(Metrics_Operation operation, MI_Uint64 startTime, MI_Uint32 errorCode)
+{
+    MetricsSlot *slot;
+    MI_Uint64 elapsed;
+    MI_Uint32 bucket = 0;
+
+    if ((MI_Uint32) operation >= Metrics_OperationCount)
+        return;
+
+    elapsed = Metrics_Now() - startTime;
+    if (elapsed)
+        bucket = 64 - __builtin_clzll(elapsed);
+    if (bucket >= METRICS_BUCKETS)
+        bucket = METRICS_BUCKETS - 1;
+
+    slot = _MetricsSlot();
+    Atomic_Inc(&slot->count[operation]);
+    if (errorCode)
+        Atomic_Inc(&slot->errors[operation]);
+    Metrics_AtomicAdd(&slot->totalMicroseconds[operation], (ptrdiff_t) elapsed);
+    Atomic_Inc(&slot->histogram[operation][bucket]);
+}
+
+void Metrics_Add(Metrics_Counter counter, MI_Uint64 value)
+{
+    Metrics_AtomicAdd(&_MetricsSlot()->counters[counter], (ptrdiff_t) value);
+}
+
+/* Gauges go up on one CPU and down on another so a single slot can go negative, only the
+ * sum over every slot means anything.
+ */
+void Metrics_GaugeAdd(Metrics_Gauge gauge, ptrdiff_t delta)
+{
+    Metrics_AtomicAdd(&_MetricsSlot()->gauges[gauge], delta);
+}
+
+void Metrics_SetStartupPhase(Metrics_StartupPhase phase, MI_Uint64 microseconds)
+{
+    if ((MI_Uint32) phase < Metrics_StartupPhaseCount)
+        _startupPhases[phase] = microseconds;
+}
+
+void Metrics_SetStartupRuntime(const char *runtimeDirectory, MI_Boolean tpaListCached)
+{
+    Strlcpy(_startupRuntime, runtimeDirectory, sizeof(_startupRuntime));
+    _startupTpaListCached = tpaListCached;
+}
+
+/* Write a string as a JSON string, only paths go through here so a minimal escape does */
+static void _MetricsWriteString(FILE *file, const char *value)
+{
+    fputc('"', file);
+    for (; *value; value++)
+    {
+        if ((*value == '"') || (*value == '\\'))
+            fprintf(file, "\\%c", *value);
+        else if ((unsigned char) *value < 0x20)
+            fprintf(file, "\\u%04x", (unsigned char) *value);
+        else
+            fputc(*value, file);
+    }
+    fputc('"', file);
+}
+
+static double _MetricsRatio(ptrdiff_t compressed, ptrdiff_t uncompressed)
+{
+    return uncompressed ? (double) compressed / uncompressed : 0;
+}
+
+MI_Result Metrics_Write(const char *path)
+{
+    char tempPath[PAL_MAX_PATH_SIZE + 8];
+    ptrdiff_t counters[Metrics_CounterCount];
+    FILE *file;
+    MI_Uint32 operation, bucket, i;
+    const char *separator;
+
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    file = fopen(tempPath, "w");
+    if (file == NULL)
+    {
+        __LOGE(("Metrics_Write failed to open %s", tempPath));
+        return MI_RESULT_FAILED;
+    }
+
+    fprintf(file, "{\n  \"pid\": %d,\n  \"uptimeMicroseconds\": %llu,\n  \"operations\": {\n",
+        (int) getpid(), (unsigned long long) Metrics_Now());
+
+    for (operation = 0; operation != Metrics_OperationCount; operation++)
+    {
+        fprintf(file, "    \"%s\": { \"count\": %ld, \"errors\": %ld, \"totalMicroseconds\": %ld, \"histogram\": [",
+            _operationNames[operation],
+            (long) _MetricsSum(&_slots[0].count[operation]),
+            (long) _MetricsSum(&_slots[0].errors[operation]),
+            (long) _MetricsSum(&_slots[0].totalMicroseconds[operation]));
+
+        /* Only buckets with something in them, as [upper bound in microseconds, count] */
+        separator = "";
+        for (bucket = 0; bucket != METRICS_BUCKETS; bucket++)
+        {
+            ptrdiff_t count = _MetricsSum(&_slots[0].histogram[operation][bucket]);
+            if (count)
+            {
+                if (bucket == METRICS_BUCKETS - 1)
+                    fprintf(file, "%s[null, %ld]", separator, (long) count);
+                else
+                    fprintf(file, "%s[%lu, %ld]", separator, 1UL << bucket, (long) count);
+                separator = ", ";
+            }
+        }
+        fprintf(file, "] }%s\n", (operation == Metrics_OperationCount - 1) ? "" : ",");
+    }
+    fprintf(file, "  },\n");
+
+    fprintf(file, "  \"startupRuntime\": ");
+    _MetricsWriteString(file, _startupRuntime);
+    fprintf(file, ",\n  \"startupTpaListCached\": %s,\n  \"startupMicroseconds\": {",
+        _startupTpaListCached ? "true" : "false");
+    for (i = 0; i != Metrics_StartupPhaseCount; i++)
+    {
+        fprintf(file, "%s \"%s\": %llu", i ? "," : "", _startupPhaseNames[i], (unsigned long long) _startupPhases[i]);
+    }
+    fprintf(file, " },\n");
+
+    for (i = 0; i != Metrics_CounterCount; i++)
+    {
+        counters[i] = _MetricsSum(&_slots[0].counters[i]);
+        fprintf(file, "  \"%s\": %ld,\n", _counterNames[i], (long) counters[i]);
+    }
+    fprintf(file, "  \"compressionRatioIn\": %.4f,\n  \"compressionRatioOut\": %.4f,\n",
+        _MetricsRatio(counters[Metrics_CompressedBytesIn], counters[Metrics_UncompressedBytesIn]),
+        _MetricsRatio(counters[Metrics_CompressedBytesOut], counters[Metrics_UncompressedBytesOut]));
+
+    for (i = 0; i != Metrics_GaugeCount; i++)
+    {
+        fprintf(file, "  \"%s\": %ld%s\n", _gaugeNames[i], (long) _MetricsSum(&_slots[0].gauges[i]),
+            (i == Metrics_GaugeCount - 1) ? "" : ",");
+    }
+    fprintf(file, "}\n");
+
+    if ((fclose(file) != 0) || (rename(tempPath, path) != 0))
+    {
+        __LOGE(("Metrics_Write failed to write %s", path));
+        unlink(tempPath);
+        return MI_RESULT_FAILED;
+    }
+    return MI_RESULT_OK;
+}
+
+static void _MetricsSignalHandler(int signalNumber)
+{
+    _writeRequested = 1;
+}
+
+static PAL_Uint32 THREAD_API _MetricsWriterThread(void *param)
+{
+    MI_Uint64 lastWrite = Metrics_Now();
+
+    while (!Atomic_Read(&_writerShutdown))
+    {
+        MI_Boolean write = Atomic_Swap(&_writeRequested, 0) != 0;
+
+        if (_writeIntervalSeconds &&
+            ((Metrics_Now() - lastWrite) >= ((MI_Uint64) _writeIntervalSeconds * 1000000)))
+        {
+            write = MI_TRUE;
+        }
+        if (write)
+        {
+            Metrics_Write(_metricsPath);
+            lastWrite = Metrics_Now();
+        }
+        Sleep_Milliseconds(METRICS_POLL_MS);
+    }
+    return 0;
+}
+
+void Metrics_Start(void)
+{
+    char value[16];
+    struct sigaction action, previous;
+
+    if ((_GetConfigValueFromConfigFile("psrpmetrics", value, sizeof(value)) != MI_RESULT_OK) ||
+        (Tcscasecmp(value, "true") != 0))
+    {
+        return;
+    }
+    if (_GetConfigValueFromConfigFile("psrpmetricsinterval", value, sizeof(value)) == MI_RESULT_OK)
+    {
+        _writeIntervalSeconds = (MI_Uint32) strtoul(value, NULL, 10);
+    }
+    snprintf(_metricsPath, sizeof(_metricsPath), "%s/psrpmetrics.%d.json", OMI_GetPath(ID_LOCALSTATEDIR), (int) getpid());
+
+    /* Do not take SIGUSR2 away from the host process if it is already using it */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = _MetricsSignalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if ((sigaction(SIGUSR2, NULL, &previous) == 0) && (previous.sa_handler == SIG_DFL))
+    {
+        sigaction(SIGUSR2, &action, NULL);
+    }
+    else
+    {
+        __LOGE(("Metrics_Start - SIGUSR2 is already in use, metrics are only written on the interval"));
+    }
+
+    _writerShutdown = 0;
+    if (Thread_CreateJoinable(&_writerThread, _MetricsWriterThread, NULL, NULL) != 0)
+    {
+        __LOGE(("Metrics_Start - failed to create writer thread"));
+        return;
+    }
+    _writerRunning = MI_TRUE;
+    __LOGD(("Metrics_Start - writing metrics to %s, interval=%us", _metricsPath, _writeIntervalSeconds));
+}
+
+void Metrics_Stop(void)
+{
+    PAL_Uint32 threadResult;
+    struct sigaction previous;
+
+    if (!_writerRunning)
+        return;
+
+    Atomic_Swap(&_writerShutdown, 1);
+    Thread_Join(&_writerThread, &threadResult);
+    Thread_Destroy(&_writerThread);
+    _writerRunning = MI_FALSE;
+
+    /* Put SIGUSR2 back the way it was if it is still ours, this module is about to be unloaded */
+    if ((sigaction(SIGUSR2, NULL, &previous) == 0) && (previous.sa_handler == _MetricsSignalHandler))
+    {
+        signal(SIGUSR2, SIG_DFL);
+    }
+
+    /* Leave a final copy behind */
+    Metrics_Write(_metricsPath);
+}
@@ -0,0 +1,98 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#ifndef _Metrics_h_
+#define _Metrics_h_
+#include <stddef.h>
+#include <MI.h>
+
+/* Operation latency and throughput metrics for the shell provider. Everything is counted
+ * into per-CPU slots with atomic adds so recording never takes a lock, and the slots are
+ * only summed when the metrics are written out.
+ *
+ * Writing is turned on with psrpmetrics=true in omiserver.conf. The metrics are then written
+ * as JSON to psrpmetrics.<pid>.json in the OMI local state directory whenever the process
+ * gets SIGUSR2, and every psrpmetricsinterval seconds if that is set.
+ */
+
+/* Same order as CommonData_Type so a request type can be passed straight through */
+typedef enum _Metrics_Operation
+{
+    Metrics_Shell,
+    Metrics_Command,
+    Metrics_Send,
+    Metrics_Receive,
+    Metrics_Signal,
+    Metrics_Connect,
+    Metrics_OperationCount
+} Metrics_Operation;
+
+typedef enum _Metrics_Counter
+{
+    Metrics_BytesIn,                /* Send payload bytes handed to the plugin */
+    Metrics_BytesOut,               /* Output bytes the plugin handed back */
+    Metrics_CompressedBytesIn,      /* Compressed Send payload bytes before decompression */
+    Metrics_UncompressedBytesIn,    /* ... and the same payload after decompression */
+    Metrics_CompressedBytesOut,     /* Output bytes after compression */
+    Metrics_UncompressedBytesOut,   /* ... and the same output before compression */
+    Metrics_ReapedShells,           /* Shells shut down by the idle reaper */
+    Metrics_ReclaimedBytes,         /* Resident bytes given back by trimming the heap after reaping */
+    Metrics_BufferedBytes,          /* Output bytes held for a disconnected client */
+    Metrics_SpilledBytes,           /* ... and the part of them that went to a spill file */
+    Metrics_CounterCount
+} Metrics_Counter;
+
+typedef enum _Metrics_Gauge
+{
+    Metrics_ActiveShells,
+    Metrics_ActiveCommands,
+    Metrics_QueuedReceives,         /* Receive requests queued behind the one being answered */
+    Metrics_WaitingResults,         /* Plugin threads blocked waiting for a Receive request */
+    Metrics_GaugeCount
+} Metrics_Gauge;
+
+/* Phases of Shell_Load, the CoreCLR ones are filled in from startCoreCLR */
+typedef enum _Metrics_StartupPhase
+{
+    Metrics_StartupSetHomeDir,
+    Metrics_StartupLoadCoreClr,         /* dlopen of libcoreclr and its entry points */
+    Metrics_StartupTpaList,
+    Metrics_StartupInitializeCoreClr,
+    Metrics_StartupCreateDelegate,
+    Metrics_StartupInitPlugin,
+    Metrics_StartupTotal,
+    Metrics_StartupPhaseCount
+} Metrics_StartupPhase;
+
+/* Monotonic time in microseconds to use as an operation start time */
+MI_Uint64 Metrics_Now(void);
+
+/* Record an operation that started at startTime and has just completed */
+void Metrics_Observe(Metrics_Operation operation, MI_Uint64 startTime, MI_Uint32 errorCode);
+
+void Metrics_Add(Metrics_Counter counter, MI_Uint64 value);
+void Metrics_GaugeAdd(Metrics_Gauge gauge, ptrdiff_t delta);
+
+/* Record how long Shell_Load took and which runtime it loaded. Kept whether or not metrics
+ * are being written so they are there if writing is turned on later.
+ */
+void Metrics_SetStartupPhase(Metrics_StartupPhase phase, MI_Uint64 microseconds);
+void Metrics_SetStartupRuntime(const char *runtimeDirectory, MI_Boolean tpaListCached);
+
+/* Lock-free add, also used for counters kept outside the metrics such as per-shell bytes */
+void Metrics_AtomicAdd(volatile ptrdiff_t *value, ptrdiff_t delta);
+
+/* Read the configuration and start writing metrics if they are turned on */
+void Metrics_Start(void);
+void Metrics_Stop(void);
+
+/* Write the current metrics to a file, replacing it atomically */
+MI_Result Metrics_Write(const char *path);
+
+#endif /* _Metrics_h_ */
@@ -10,6 +10,13 @@
 #include <iconv.h>
 #include <sys/types.h>
 #include <pwd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
 #include <MI.h>
 #include "Shell.h"
 #include "wsman.h"
@@ -20,6 +27,7 @@
 #include <pal/lock.h>
 #include <pal/atomic.h>
 #include <pal/sem.h>
+#include <pal/sleep.h>
 #include <base/batch.h>
 #include <base/result.h>
 #include <base/instance.h>
@@ -27,6 +35,10 @@
 #include <base/logbase.h>
 #include <base/log.h>
 #include "Utilities.h"
+#include "EchoPlugin.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "DebugLog.h"
 
 /* Note: Change logging level in omiserver.conf */
 #define SHELL_LOGGING_FILE "shellserver"
@@ -37,6 +49,43 @@
 #define GOTO_ERROR(message, result) { miResult = result; errorMessage=message; __LOGE(("%s (result=%u)", errorMessage, miResult)); goto error; }
 #define GOTO_ERROR_EX(message, result, label) {miResult = result; errorMessage=message; __LOGE(("%s (result=%u)", errorMessage, miResult));  goto label; }
 
+/* Maximum number of Receive requests a client may have queued up behind the one currently
+ * waiting on the plug-in for output.
+ */
+#define RECEIVE_MAX_PENDING_CONTEXTS 8
+
+/* How long a Receive request waits for output from when it arrived before it is answered with
+ * an empty Running response, whether it waited in common.miRequestContext or in the queue.
+ */
+#define RECEIVE_RESPONSE_TIMEOUT_MS (30 * 1000)
+
+/* What the psrpwarmup=shell shell is created with, the same as a PowerShell client asks for */
+#define WARMUP_SHELL_NAME "Microsoft.PowerShell"
+#define WARMUP_SHELL_RESOURCE_URI "http://schemas.microsoft.com/powershell/Microsoft.PowerShell"
+#define WARMUP_SHELL_INPUT_STREAMS "stdin pr"
+#define WARMUP_SHELL_OUTPUT_STREAMS "stdout"
+
+/* How long after shutting shells down the idle reaper trims the heap, so they have had time
+ * to finish, and the longest it sleeps without looking at the shells again
+ */
+#define IDLE_REAPER_TRIM_DELAY_MS 1000
+#define IDLE_REAPER_MAX_WAIT_MS (60 * 60 * 1000)
+
+/* Disconnected output
+ * While a shell is disconnected the plugin keeps producing output with nobody to send it to.
+ * Rather than blocking it, up to psrpdisconnectbuffer bytes per shell are held in memory and a
+ * further psrpdisconnectspill bytes go to an unlinked temporary file that is read back through
+ * a mapping. The file and its mapping grow DISCONNECT_SPILL_CHUNK at a time as output is
+ * spilled, and once that much has been delivered it is given back rather than waiting for
+ * everything to go. Only once both are full does the plugin wait for the client to come back.
+ * When it does, consecutive results for the same stream go out together in Receives of up to
+ * DISCONNECT_COALESCE_BYTES. psrpdisconnectbuffer=0 turns buffering off.
+ */
+#define DISCONNECT_DEFAULT_BUFFER (16 * 1024 * 1024)
+#define DISCONNECT_DEFAULT_SPILL (256 * 1024 * 1024)
+#define DISCONNECT_SPILL_CHUNK (4 * 1024 * 1024)
+#define DISCONNECT_COALESCE_BYTES (128 * 1024)
+
 #define POWERSHELL_INIT_STRING  "<InitializationParameters><Param Name=\"PSVersion\" Value=\"5.0\"></Param></InitializationParameters>"
 
 typedef struct _StreamSet
@@ -94,8 +143,21 @@ struct _CommonData
 
     /* used to protect hierarchy of objects so children hold refcount to immediate parent */
     ptrdiff_t refcount;
+
+    /* Metrics_Now() when the request came in. For Receive it is when the request currently
+     * in miRequestContext started waiting for output.
+     */
+    MI_Uint64 startTime;
+
+    /* Trace correlation ID of the client request, changes along with startTime */
+    MI_Uint32 traceId;
+
+    /* DebugLog_Hash of the ShellId for trace events, 0 until the first event works it out */
+    MI_Uint32 shellIdHash;
 } ;
 
+enum { Connected, Disconnected };
+
 struct _ShellData
 {
     CommonData common;
@@ -127,7 +189,40 @@ struct _ShellData
      */
     MI_Context *deleteInstanceContext;
 
-    enum { Connected, Disconnected } connectedState;
+    /* Connected or Disconnected. Disconnect and Reconnect change it while Enumerate, Get and
+     * the idle reaper read it, so it is only read and written with Atomic_*.
+     */
+    volatile ptrdiff_t connectedState;
+
+    /* Copy of the shell as it was created that nothing changes afterwards. Enumerate and Get
+     * report from it so they never race with requests updating miOperationInstance.
+     */
+    MI_Instance *shellInstance;
+
+    /* Metrics_Now() of the last client request for the shell and the payload bytes that have
+     * gone through it. Updated with atomics on the data path.
+     */
+    volatile ptrdiff_t lastActivity;
+    volatile ptrdiff_t bytesIn;
+    volatile ptrdiff_t bytesOut;
+
+    /* Microseconds without a client request after which the idle reaper shuts the shell down,
+     * 0 for never. disconnectedTimeout is used instead while the shell is disconnected.
+     */
+    MI_Uint64 idleTimeout;
+    MI_Uint64 disconnectedTimeout;
+    volatile ptrdiff_t reaped;
+
+    /* Output held for a disconnected client across all of the shell's receives, in memory and
+     * in spill files.
+     */
+    volatile ptrdiff_t bufferedBytes;
+    volatile ptrdiff_t spilledBytes;
+
+    /* The psrpwarmup=shell shell, which has no client. It sits on the warm-up list instead of
+     * the shell list and is shut down as soon as it is reported. Set before the shell is listed.
+     */
+    MI_Boolean isWarmUp;
 };
 
 struct _CommandData
@@ -160,6 +255,26 @@ struct _SendData
 
  PAL_Uint32 THREAD_API ReceiveTimeoutThread(void* param);
 
+/* One WSManPluginReceiveResult held for a disconnected client. The strings and, unless it went
+ * to the spill file, the data are allocated along with it.
+ */
+typedef struct _BufferedOutput
+{
+    struct _BufferedOutput *next;
+    MI_Uint32 flags;
+    MI_Uint32 exitCode;
+    MI_Char16 *streamName;
+    MI_Char16 *commandState;
+    MI_Boolean hasData;
+    MI_Boolean spilled;
+    MI_Uint32 dataLength;
+    MI_Uint64 spillOffset;
+    MI_Uint8 *data;
+
+    /* What the item counts against the shell's memory limit */
+    size_t bufferedSize;
+} BufferedOutput;
+
 struct _ReceiveData
 {
     /* MUST BE FIRST ITEM IN STRUCTURE as pointer to CommonData gets cast to ReceiveData */
@@ -173,6 +288,46 @@ struct _ReceiveData
     Thread timeoutThread;
     Sem timeoutSemaphore;
     ptrdiff_t shutdownThread;
+
+    /* Compressor for outbound data on compressed shells, created on first use and kept for the
+     * life of the receive so its workspace is not reallocated for every result.
+     */
+    MI_Boolean compressStreamInitialized;
+    CompressStream compressStream;
+
+    /* Receive requests that arrived while common.miRequestContext was still waiting for output.
+     * Clients that pipeline Receive requests rely on them being answered in the order they came in,
+     * so they are promoted into common.miRequestContext oldest first.
+     */
+    Lock pendingContextsLock;
+    MI_Context *pendingContexts[RECEIVE_MAX_PENDING_CONTEXTS];
+    MI_Uint64 pendingArrivals[RECEIVE_MAX_PENDING_CONTEXTS];
+    MI_Uint32 pendingContextsHead;
+    MI_Uint32 pendingContextsCount;
+
+    /* Metrics_Now() when the request in common.miRequestContext arrived, which the response
+     * timeout counts from. Set under pendingContextsLock along with the promotion.
+     */
+    MI_Uint64 requestArrival;
+
+    /* Output the plugin produced while the shell was disconnected, oldest first, and the spill
+     * file for what did not fit in memory. Only one thread drains at a time, which is what
+     * lets it read the spill file without holding outputLock. A completion that comes in while
+     * there is still output to deliver is held back until it has all gone.
+     */
+    Lock outputLock;
+    BufferedOutput *outputHead;
+    BufferedOutput *outputTail;
+    MI_Boolean draining;
+    MI_Boolean discardOutput;
+    int spillFd;
+    MI_Uint8 *spill;
+    MI_Uint64 spillSize;        /* Bytes mapped, only changes while nothing is draining */
+    MI_Uint64 spillUsed;        /* Bytes written, spilled output is appended */
+    MI_Uint64 spillDelivered;   /* Everything before this has gone to the client */
+    MI_Uint64 spillTrimmed;     /* Everything before this has been given back */
+    MI_Boolean completePending;
+    MI_Uint32 completeErrorCode;
 };
 
 struct _SignalData
@@ -191,6 +346,12 @@ struct _ConnectData
 };
 
 void CommonData_Release(CommonData *commonData);
+void RecursiveNotifyShutdown(CommonData *commonData);
+static MI_Boolean _CreateWarmUpShell(Shell_Self *self);
+static void DrainWarmUpShells(Shell_Self *self);
+static MI_Boolean RemoveWarmUpShell(struct _Shell_Self *shell, ShellData *shellData);
+static void _DrainBufferedOutput(ReceiveData *receiveData);
+static MI_Boolean _DiscardBufferedOutput(ReceiveData *receiveData);
 
 ShellData *GetShellFromOperation(CommonData *commonData)
 {
@@ -261,6 +422,30 @@ static const char* GetCommandId(CommonData *data)
     return commandId;
 }
 
+/* Record a trace event for a request. Invoke is stamped with when the request came in rather
+ * than when it is handed on.
+ */
+static void TraceRequest(CommonData *data, Trace_Type type, MI_Uint32 value)
+{
+    ShellData *shellData;
+
+    if (!Trace_Enabled())
+        return;
+
+    if (data->shellIdHash == 0)
+    {
+        shellData = GetShellFromOperation(data);
+        if (shellData && shellData->shellId)
+        {
+            if (shellData->common.shellIdHash == 0)
+                shellData->common.shellIdHash = DebugLog_Hash(shellData->shellId, strlen(shellData->shellId));
+            data->shellIdHash = shellData->common.shellIdHash;
+        }
+    }
+    Trace_Record(type, data->requestType, data, data->traceId, data->shellIdHash, value,
+        (type == Trace_Invoke) ? data->startTime : Metrics_Now());
+}
+
 
 
 /* set HOME environment variable to home of user
@@ -294,7 +479,7 @@ static int SetHomeDir(const char** home)
 }
 
 
-static void PrintDataFunctionStart(CommonData *data, const char *function)
+static void _PrintDataFunctionStart(CommonData *data, const char *function)
 {
     const char *shellId = GetShellId(data);
     const char *commandId = GetCommandId(data);
@@ -303,7 +488,7 @@ static void PrintDataFunctionStart(CommonData *data, const char *function)
             function, data, CommonData_Type_String(data->requestType), shellId, commandId, data->miRequestContext, data->miOperationInstance, (void*)data->refcount));
 }
 
-static void PrintDataFunctionStartStr(CommonData *data, const char *function, const char *name, const char *val)
+static void _PrintDataFunctionStartStr(CommonData *data, const char *function, const char *name, const char *val)
 {
     const char *shellId = GetShellId(data);
     const char *commandId = GetCommandId(data);
@@ -311,7 +496,7 @@ static void PrintDataFunctionStartStr(CommonData *data, const char *function, co
     __LOGD(("%s: START commonData=%p, type=%s, ShellID = %s, CommandID = %s, miContext=%p, miInstance=%p, %s=%s",
             function, data, CommonData_Type_String(data->requestType), shellId, commandId, data->miRequestContext, data->miOperationInstance, name, val));
 }
-static void PrintDataFunctionStartNumStr(CommonData *data, const char *function, const char *name, MI_Uint32 val, const char *name2, const char *val2)
+static void _PrintDataFunctionStartNumStr(CommonData *data, const char *function, const char *name, MI_Uint32 val, const char *name2, const char *val2)
 {
     const char *shellId = GetShellId(data);
     const char *commandId = GetCommandId(data);
@@ -320,7 +505,7 @@ static void PrintDataFunctionStartNumStr(CommonData *data, const char *function,
             function, data, CommonData_Type_String(data->requestType), shellId, commandId, data->miRequestContext, data->miOperationInstance, name, val, name2, val2));
 }
 
-static void PrintDataFunctionStartStr2(CommonData *data, const char *function, const char *name1, const char *val1, const char *name2, const char *val2)
+static void _PrintDataFunctionStartStr2(CommonData *data, const char *function, const char *name1, const char *val1, const char *name2, const char *val2)
 {
     const char *shellId = GetShellId(data);
     const char *commandId = GetCommandId(data);
@@ -328,7 +513,7 @@ static void PrintDataFunctionStartStr2(CommonData *data, const char *function, c
     __LOGD(("%s: START commonData=%p, type=%s, ShellID = %s, CommandID = %s, miContext=%p, miInstance=%p, %s=%s, %s=%s",
             function, data, CommonData_Type_String(data->requestType), shellId, commandId, data->miRequestContext, data->miOperationInstance, name1, val1, name2, val2));
 }
-static void PrintDataFunctionTag(CommonData *data, const char *function, const char *tagName)
+static void _PrintDataFunctionTag(CommonData *data, const char *function, const char *tagName)
 {
     const char *shellId = GetShellId(data);
     const char *commandId = GetCommandId(data);
@@ -336,7 +521,7 @@ static void PrintDataFunctionTag(CommonData *data, const char *function, const c
     __LOGD(("%s: %s commonData=%p, type=%s, ShellID = %s, CommandID = %s",
             function, tagName, data, CommonData_Type_String(data->requestType), shellId, commandId));
 }
-static void PrintDataFunctionEnd(CommonData *data, const char *function, MI_Result miResult)
+static void _PrintDataFunctionEnd(CommonData *data, const char *function, MI_Result miResult)
 {
     const char *shellId = GetShellId(data);
     const char *commandId = GetCommandId(data);
@@ -344,12 +529,101 @@ static void PrintDataFunctionEnd(CommonData *data, const char *function, MI_Resu
             function, data, CommonData_Type_String(data->requestType), shellId, commandId, miResult, Result_ToString(miResult)));
 }
 
+/* The PrintDataFunction helpers look up the shell and command IDs, so skip the calls
+ * altogether unless debug logging is on.
+ */
+#define PrintDataFunctionStart(data, function) \
+    do { if (DEBUG_LOG_ENABLED()) _PrintDataFunctionStart(data, function); } while (0)
+#define PrintDataFunctionStartStr(data, function, name, val) \
+    do { if (DEBUG_LOG_ENABLED()) _PrintDataFunctionStartStr(data, function, name, val); } while (0)
+#define PrintDataFunctionStartNumStr(data, function, name, val, name2, val2) \
+    do { if (DEBUG_LOG_ENABLED()) _PrintDataFunctionStartNumStr(data, function, name, val, name2, val2); } while (0)
+#define PrintDataFunctionStartStr2(data, function, name1, val1, name2, val2) \
+    do { if (DEBUG_LOG_ENABLED()) _PrintDataFunctionStartStr2(data, function, name1, val1, name2, val2); } while (0)
+#define PrintDataFunctionTag(data, function, tagName) \
+    do { if (DEBUG_LOG_ENABLED()) _PrintDataFunctionTag(data, function, tagName); } while (0)
+#define PrintDataFunctionEnd(data, function, miResult) \
+    do { if (DEBUG_LOG_ENABLED()) _PrintDataFunctionEnd(data, function, miResult); } while (0)
+
 /* The master shell object that the provider passes back as context for all provider
  * operations. Currently it only needs to point to the list of shells.
  */
+typedef enum _PluginState
+{
+    PluginState_Loading = 0,
+    PluginState_Ready,
+    PluginState_Failed
+} PluginState;
+
+/* Shell table
+ * FindShellFromSelf looks shells up in an open addressed table of the listed shells, keyed on
+ * DebugLog_Hash of the ShellId, without taking shellListLock. Shells are added to empty slots
+ * in place and removed by marking their slot, both under shellListLock. When half the slots
+ * have been used the table is rebuilt from the shell list and the new one swapped in.
+ *
+ * Readers count themselves in one of two reader counts, picked by the parity of an epoch,
+ * while they look a shell up and take a reference on it. After removing a shell or replacing
+ * the table, the writer moves the epoch on and waits for the count readers of the old epoch
+ * used to drain. After that nobody can still be looking at the removed shell or the old table.
+ * The owner's reference on a shell is dropped only after the shell has been removed, so a
+ * reader that finds a shell can always take a reference on it.
+ */
+#define SHELL_TABLE_MIN_SIZE 64
+#define SHELL_TABLE_REMOVED ((ShellData*) -1)
+
+typedef struct _ShellTableSlot
+{
+    MI_Uint32 hash;
+    ShellData * volatile shellData;     /* NULL if never used, SHELL_TABLE_REMOVED once removed */
+} ShellTableSlot;
+
+typedef struct _ShellTable
+{
+    MI_Uint32 mask;                     /* size - 1, the size being a power of two */
+    MI_Uint32 used;                     /* slots that are not NULL */
+    ShellTableSlot slots[1];
+} ShellTable;
+
 struct _Shell_Self
 {
+    /* Protected by shellListLock, which is held to add or remove a shell and by the callers
+     * that go through every shell. Finding a shell by ID goes through shellTable instead.
+     */
     ShellData *shellList;
+    Lock shellListLock;
+
+    /* The shell table readers look shells up in and the epoch they are counted by. The table
+     * is changed and replaced under shellListLock.
+     */
+    ShellTable * volatile shellTable;
+    volatile ptrdiff_t shellTableEpoch;
+    volatile ptrdiff_t shellTableReaders[2];
+
+    /* The psrpwarmup=shell shell until it completes, also protected by shellListLock */
+    ShellData *warmUpShells;
+
+    /* PluginState, the latch shell creates wait on while psrpwarmup loads the plugin. Nothing
+     * else reaches the plugin without a shell, so _CallCreateShell is the only place to wait.
+     */
+    volatile ptrdiff_t pluginState;
+    Thread warmUpThread;
+    MI_Boolean warmUpThreadStarted;
+
+    /* Idle shell reaping, see StartIdleReaper. Timeouts are in microseconds, 0 for none. */
+    MI_Uint64 defaultIdleTimeout;
+    MI_Uint64 maxIdleTimeout;
+    Thread reaperThread;
+    MI_Boolean reaperStarted;
+    volatile ptrdiff_t reaperShutdown;
+
+    /* Posted to make the reaper look at the shells again before it would have, see
+     * WakeIdleReaper
+     */
+    Sem reaperWake;
+
+    /* Limits on output held for a disconnected shell in bytes, see DISCONNECT_DEFAULT_BUFFER */
+    MI_Uint64 disconnectBufferSize;
+    MI_Uint64 disconnectSpillSize;
 
     PwrshPluginWkr_Ptrs managedPointers;
 
@@ -360,241 +634,1031 @@ struct _Shell_Self
 } ;
 
 
-/* Based on the shell ID, find the existing ShellData object */
-ShellData * FindShellFromSelf(struct _Shell_Self *shell, const MI_Char *shellId)
-{
-    ShellData *shellData = shell->shellList;
+/* Runtime properties from the [clr] section of psrp.conf for coreclr_initialize, e.g.
+ *     [clr]
+ *     System.GC.Server = true
+ *     System.GC.HeapHardLimit = 209715200
+ */
+#define CLR_MAX_PROPERTIES 32
 
-    __LOGD(("FindShellFromSelf - looking for shell %s", shellId));
+typedef struct _ClrProperties
+{
+    Batch *batch;
+    int count;
+    const char *keys[CLR_MAX_PROPERTIES];
+    const char *values[CLR_MAX_PROPERTIES];
+} ClrProperties;
 
-    if (shellId == NULL)
-        return NULL;
+static MI_Result _AddClrProperty(void *context, const char *key, const char *value)
+{
+    ClrProperties *properties = (ClrProperties*) context;
 
-    while (shellData)
+    if (properties->count == CLR_MAX_PROPERTIES)
     {
-        __LOGD(("FindShellFromSelf - currently found %s", shellData->shellId));
-
-        if (Tcscmp(shellId, shellData->shellId) == 0)
-        {
-            __LOGD(("FindShellFromSelf -- found what we were looking for"));
-            break;
-        }
-        shellData = (ShellData*)shellData->common.siblingData;
+        __LOGE(("Shell_Load - more than %u [clr] properties, ignoring %s", CLR_MAX_PROPERTIES, key));
+        return MI_RESULT_OK;
     }
-
-    return shellData;
+    properties->keys[properties->count] = Batch_Strdup(properties->batch, key);
+    properties->values[properties->count] = Batch_Strdup(properties->batch, value);
+    if ((properties->keys[properties->count] == NULL) || (properties->values[properties->count] == NULL))
+    {
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    }
+    properties->count++;
+    return MI_RESULT_OK;
 }
 
-/* Shell_Load is called after the provider has been loaded to return
- * the provider schema to the engine. It also allocates and returns our own
- * context object that is passed to all operations that holds the current
- * state of all our shells.
+/* Log how long each phase of Shell_Load took as one line and hand the times to the metrics,
+ * so cold start time can be tracked across PowerShell versions.
  */
-void MI_CALL Shell_Load(Shell_Self** self, MI_Module_Self* selfModule,
-        MI_Context* context)
+static void _ReportStartupTimes(MI_Uint64 *phases, const CoreCLRStartupTimes *clrTimes, MI_Uint64 loadStart, MI_Uint32 miResult)
 {
-    MI_Uint32 miResult = MI_RESULT_OK;
-    int ret;
-    char *errorMessage = NULL;
-
-    _GetLogOptionsFromConfigFile(SHELL_LOGGING_FILE);
+    MI_Uint32 phase;
 
-    __LOGD(("Shell_Load - allocating shell"));
-    *self = calloc(1, sizeof(Shell_Self));
-    if (*self == NULL)
-    {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-    }
+    phases[Metrics_StartupLoadCoreClr] = clrTimes->loadLibrary;
+    phases[Metrics_StartupTpaList] = clrTimes->tpaList;
+    phases[Metrics_StartupInitializeCoreClr] = clrTimes->initialize;
+    phases[Metrics_StartupTotal] = Metrics_Now() - loadStart;
 
-    /* Initialize the environment
-     *
-     * This is necessary because OMI can launch this process as a non-root user;
-     * but OMI does not do anything to ensure the environment is correct.
-     * For instance, if HOME=/root in omiserver, * this omiagent process inherits the value.
-     * However, for a shell provider, this causes problems.
-     * PowerShell depends on HOME to be correct; i.e. the user's home folder,
-     * and throws an exception if it gets an IO error on HOME.
-     *
-     * Here we lookup the user's home folder via getpwuid(),
-     * and set HOME for our process to the correct value.
-     */
-    __LOGD(("Shell_Load - setting HOME for effective user"));
-    ret = SetHomeDir(&(*self)->home);
-    if (ret != 0)
+    for (phase = 0; phase != Metrics_StartupPhaseCount; phase++)
     {
-        __LOGE(("Shell_Load - failed to set HOME for user"));
+        Metrics_SetStartupPhase((Metrics_StartupPhase) phase, phases[phase]);
     }
+    Metrics_SetStartupRuntime(clrTimes->runtimeDirectory, clrTimes->tpaListCached ? MI_TRUE : MI_FALSE);
 
-    /* Initialize the CLR */
-    __LOGD(("Shell_Load - loading CLR"));
-    ret = startCoreCLR("ps_omi_host", &(*self)->hostHandle, &(*self)->domainId);
-    if (ret != 0)
-    {
-        GOTO_ERROR("Failed to start CLR", MI_RESULT_FAILED);
-    }
-    __LOGD(("Shell_Load - CLR loaded"));
+    __LOGI(("Shell_Load startup result=%u runtime=%s tpaListCached=%d setHomeDirUs=%llu loadCoreClrUs=%llu tpaListUs=%llu "
+            "initializeCoreClrUs=%llu createDelegateUs=%llu initPluginUs=%llu totalUs=%llu",
+            miResult, clrTimes->runtimeDirectory, clrTimes->tpaListCached,
+            (unsigned long long) phases[Metrics_StartupSetHomeDir],
+            (unsigned long long) phases[Metrics_StartupLoadCoreClr],
+            (unsigned long long) phases[Metrics_StartupTpaList],
+            (unsigned long long) phases[Metrics_StartupInitializeCoreClr],
+            (unsigned long long) phases[Metrics_StartupCreateDelegate],
+            (unsigned long long) phases[Metrics_StartupInitPlugin],
+            (unsigned long long) phases[Metrics_StartupTotal]));
+}
 
-    /* TODO: call into the managed function to get the shell delegates */
-    InitPluginWkrPtrsFuncPtr entryPointDelegate = NULL;
+/* Count a reader of the shell table in the current epoch. Returns the epoch to leave with. */
+static ptrdiff_t ShellTableEnter(struct _Shell_Self *shell)
+{
+    ptrdiff_t epoch;
 
-    /* Create delegate to managed code InitPlugin method in PowerShell assembly */
-    ret = createDelegate(
-        (*self)->hostHandle,
-        (*self)->domainId,
-        "System.Management.Automation, Version=3.0.0.0, Culture=neutral, PublicKeyToken=31bf3856ad364e35",
-        "System.Management.Automation.Remoting.WSManPluginManagedEntryWrapper",
-        "InitPlugin",
-        (void**)&entryPointDelegate);
-    if (ret != 0)
+    for (;;)
     {
-        GOTO_ERROR("Failed to create powershell delegate InitPlugin", MI_RESULT_FAILED);
-    }
-    __LOGD(("Shell_Load - delegate created"));
+        epoch = Atomic_Read(&shell->shellTableEpoch);
+        Atomic_Inc(&shell->shellTableReaders[epoch & 1]);
 
-
-    /* Call managed delegate InitPlugin method */
-    if (entryPointDelegate)
-    {
-        __LOGD(("Shell_Load - Calling InitPlugun"));
-        miResult = entryPointDelegate(&(*self)->managedPointers);
-        if (miResult)
-        {
-            GOTO_ERROR("Powershell InitPlugin failed", miResult);
-        }
+        /* A writer that moved the epoch on in between may not have seen us, count again */
+        if (Atomic_Read(&shell->shellTableEpoch) == epoch)
+            return epoch;
+        Atomic_Dec(&shell->shellTableReaders[epoch & 1]);
     }
-    __LOGE(("Shell_Load PostResult %p, %u", context, miResult));
-    MI_Context_PostResult(context, miResult);
-    return;
+}
 
-error:
-    __LOGE(("Shell_Load PostResult %p, %u", context, miResult));
-    MI_Context_PostError(context, miResult, MI_RESULT_TYPE_MI, errorMessage);
+static void ShellTableLeave(struct _Shell_Self *shell, ptrdiff_t epoch)
+{
+    Atomic_Dec(&shell->shellTableReaders[epoch & 1]);
 }
 
-/* Shell_Unload is called after all operations have completed, or they should
- * be completed. This function is called right before the provider is unloaded.
- * We clean up our shell context object at this point as no more operations will
- * be using it.
+/* Wait for every reader that could have seen the table before the caller changed it. Called
+ * with shellListLock held, which readers never take. Readers only hold on for one lookup.
  */
-void MI_CALL Shell_Unload(Shell_Self* self, MI_Context* context)
+static void ShellTableSynchronize(struct _Shell_Self *shell)
 {
-    int ret;
-
-    __LOGD(("Shell_Unload"));
+    ptrdiff_t epoch = Atomic_Inc(&shell->shellTableEpoch) - 1;
 
+    while (Atomic_Read(&shell->shellTableReaders[epoch & 1]) != 0)
+        Sleep_Milliseconds(0);
+}
 
-    /* TODO: Do we have any shells still active? */
+/* Build a table of the shells on the list with room for as many again. Called with
+ * shellListLock held.
+ */
+static ShellTable *ShellTableBuild(struct _Shell_Self *shell)
+{
+    ShellTable *table;
+    ShellData *shellData;
+    MI_Uint32 count = 0;
+    MI_Uint32 size = SHELL_TABLE_MIN_SIZE;
+    MI_Uint32 index;
 
-    /* NOTE: Expectation is that WSManPluginReportCompletion should be called, but it is not looking like that is always happening */
+    for (shellData = shell->shellList; shellData; shellData = (ShellData*)shellData->common.siblingData)
+        count++;
+    while (size < count * 4)
+        size *= 2;
 
-    /* Call managed code Shutdown function */
-    if (self->managedPointers.shutdownPluginFuncPtr)
-        self->managedPointers.shutdownPluginFuncPtr(self);
+    table = calloc(1, sizeof(ShellTable) + (size - 1) * sizeof(ShellTableSlot));
+    if (table == NULL)
+        return NULL;
+    table->mask = size - 1;
+    table->used = count;
 
-    /* TODO: Shut down CLR */
-    ret = stopCoreCLR(self->hostHandle, self->domainId);
-    if (ret != 0)
+    for (shellData = shell->shellList; shellData; shellData = (ShellData*)shellData->common.siblingData)
     {
-        __LOGE(("Stopping CLR failed"));
-    }
+        MI_Uint32 hash = DebugLog_Hash(shellData->shellId, strlen(shellData->shellId));
 
-    if (self->home)
-    {
-        PAL_Free((void*)self->home);
+        for (index = hash & table->mask; table->slots[index].shellData; index = (index + 1) & table->mask)
+            ;
+        table->slots[index].hash = hash;
+        table->slots[index].shellData = shellData;
     }
-    free(self);
+    return table;
+}
 
-    __LOGD(("Shell_Unload PostResult %p, %u", context, MI_RESULT_OK));
+/* Put a shell that has just gone on the list into the table. Called with shellListLock held. */
+static MI_Boolean ShellTableAdd(struct _Shell_Self *shell, ShellData *shellData)
+{
+    ShellTable *table = shell->shellTable;
+    MI_Uint32 hash;
+    MI_Uint32 index;
 
-    Log_Close();
+    if ((table == NULL) || ((table->used + 1) * 2 > table->mask + 1))
+    {
+        ShellTable *newTable = ShellTableBuild(shell);
+        if (newTable == NULL)
+            return MI_FALSE;
 
-    MI_Context_PostResult(context, MI_RESULT_OK);
+        Atomic_Swap((ptrdiff_t*) &shell->shellTable, (ptrdiff_t) newTable);
+        ShellTableSynchronize(shell);
+        free(table);
+        return MI_TRUE;
+    }
+
+    /* The hash is in place before the slot is filled in for readers to see */
+    hash = DebugLog_Hash(shellData->shellId, strlen(shellData->shellId));
+    for (index = hash & table->mask; table->slots[index].shellData; index = (index + 1) & table->mask)
+        ;
+    table->slots[index].hash = hash;
+    Atomic_Swap((ptrdiff_t*) &table->slots[index].shellData, (ptrdiff_t) shellData);
+    table->used++;
+    return MI_TRUE;
 }
 
-/* Shell_EnumerateInstances should return all active shell instances to the client.
- * It is not currently supported.
+/* Mark a shell's slot removed and wait until no reader can still have it. Called with
+ * shellListLock held.
  */
-void MI_CALL Shell_EnumerateInstances(Shell_Self* self, MI_Context* context,
-        const MI_Char* nameSpace, const MI_Char* className,
-        const MI_PropertySet* propertySet, MI_Boolean keysOnly,
-        const MI_Filter* filter)
+static void ShellTableRemove(struct _Shell_Self *shell, ShellData *shellData)
 {
-    /* Enumerate through the list of shells and post the results back */
-    ShellData *shellData = self->shellList;
-    MI_Result miResult = MI_RESULT_OK;
+    ShellTable *table = shell->shellTable;
+    MI_Uint32 hash;
+    MI_Uint32 index;
 
-    __LOGD(("Shell_EnumerateInstances"));
-    while (shellData)
+    if (table == NULL)
+        return;
+
+    hash = DebugLog_Hash(shellData->shellId, strlen(shellData->shellId));
+    for (index = hash & table->mask; table->slots[index].shellData; index = (index + 1) & table->mask)
     {
-        __LOGD(("Shell_EnumerateInstances PostInstance %p, %p", context, shellData->common.miOperationInstance));
-        miResult = MI_Context_PostInstance(context, shellData->common.miOperationInstance);
-        if (miResult != MI_RESULT_OK)
+        if (table->slots[index].shellData == shellData)
         {
-            __LOGE(("Shell_EnumerateInstances failed to post instance"));
-            break;
+            Atomic_Swap((ptrdiff_t*) &table->slots[index].shellData, (ptrdiff_t) SHELL_TABLE_REMOVED);
+            ShellTableSynchronize(shell);
+            return;
         }
-
-        shellData = (ShellData*) shellData->common.siblingData;
     }
-    __LOGD(("Shell_EnumerateInstances PostResult %p, %u", context, miResult));
-    MI_Context_PostResult(context, miResult);
 }
 
-/* Shell_GetInstance should return information about a shell.
- * It is not currently supported.
+/* Based on the shell ID, find the existing ShellData object and take a reference on it,
+ * which the caller drops with CommonData_Release. No lock is taken, see the shell table.
  */
-void MI_CALL Shell_GetInstance(Shell_Self* self, MI_Context* context,
-        const MI_Char* nameSpace, const MI_Char* className,
-        const Shell* instanceName, const MI_PropertySet* propertySet)
+ShellData * FindShellFromSelf(struct _Shell_Self *shell, const MI_Char *shellId)
 {
-    MI_Result miResult = MI_RESULT_NOT_FOUND;
-    ShellData *shellData = FindShellFromSelf(self, instanceName->ShellId.value);
+    ShellTable *table;
+    ShellData *shellData = NULL;
+    ShellData *candidate;
+    MI_Uint32 hash;
+    MI_Uint32 index;
+    ptrdiff_t epoch;
 
-    if (shellData)
+    __LOGD(("FindShellFromSelf - looking for shell %s", shellId));
+
+    if (shellId == NULL)
+        return NULL;
+
+    hash = DebugLog_Hash(shellId, strlen(shellId));
+    epoch = ShellTableEnter(shell);
+    table = (ShellTable*) Atomic_Read((ptrdiff_t*) &shell->shellTable);
+    if (table)
     {
-        __LOGD(("Shell_GetInstances PostInstance %p, %p", context, shellData->common.miOperationInstance));
-        miResult = MI_Context_PostInstance(context, shellData->common.miOperationInstance);
-        if (miResult != MI_RESULT_OK)
+        for (index = hash & table->mask;
+             (candidate = table->slots[index].shellData) != NULL;
+             index = (index + 1) & table->mask)
         {
-            __LOGE(("Shell_GetInstances failed to post instance"));
+            if ((candidate != SHELL_TABLE_REMOVED) &&
+                (table->slots[index].hash == hash) &&
+                (Tcscmp(shellId, candidate->shellId) == 0))
+            {
+                __LOGD(("FindShellFromSelf -- found what we were looking for"));
+                Atomic_Inc(&candidate->common.refcount);
+                shellData = candidate;
+                break;
+            }
         }
     }
-    __LOGD(("Shell_GetInstance PostResult %p, %u", context, miResult));
-    MI_Context_PostResult(context, miResult);
+    ShellTableLeave(shell, epoch);
+
+    return shellData;
 }
 
+/* FindActiveShellFromSelf
+ * FindShellFromSelf for client requests on the shell, which also count as shell activity.
+ * The caller releases the shell it returns.
+ */
+static ShellData * FindActiveShellFromSelf(struct _Shell_Self *shell, const MI_Char *shellId)
+{
+    ShellData *shellData = FindShellFromSelf(shell, shellId);
 
+    if (shellData)
+        Atomic_Swap(&shellData->lastActivity, (ptrdiff_t) Metrics_Now());
 
-/* ExtractStreamSet takes a list of streams that are space delimited and
- * copies the data into the ShellData object for the stream. These stream
- * names are allocated and so will need to be deleted when the shell is deleted.
- * We allocate a single buffer for the array and the string, then insert null terminators
- * into the string where spaces were and fix up the array pointers to these strings.
- */
-static MI_Boolean ExtractStreamSet(CommonData *commonData, const MI_Char *streams, StreamSet *streamSet)
+    return shellData;
+}
+
+static void RemoveShellFromSelf(struct _Shell_Self *shell, ShellData *shellData)
 {
-    MI_Char *cursor = (MI_Char*) streams;
-    MI_Uint32 i;
+    ShellData **pointerToPatch;
 
-    /* Count how many stream names we have so we can allocate the array */
-    while (cursor && *cursor)
+    Lock_Acquire(&shell->shellListLock);
+    pointerToPatch = &shell->shellList;
+    while (*pointerToPatch && (*pointerToPatch != shellData))
     {
-        streamSet->streamNamesCount++;
-        cursor = Tcschr(cursor, MI_T(' '));
-        if (cursor && *cursor)
-        {
-            cursor++;
-        }
+        pointerToPatch = (ShellData **)&(*pointerToPatch)->common.siblingData;
+    }
+    if (*pointerToPatch)
+    {
+        *pointerToPatch = (ShellData *)shellData->common.siblingData;
+        ShellTableRemove(shell, shellData);
     }
+    Lock_Release(&shell->shellListLock);
+}
 
-    /* Allocate the buffer for the array and all strings inside the array */
-    streamSet->streamNames = Batch_Get(commonData->batch,
-              (sizeof(MI_Char*) * streamSet->streamNamesCount)); /* array length */
-    if (streamSet->streamNames == NULL)
-        return MI_FALSE;
+/* SnapshotShells
+ * Take a reference on every shell, or only the one matching shellId if there is one, and return
+ * them in an array the caller frees after releasing each shell. The list lock is only held while
+ * the references are taken so reporting the shells afterwards holds nothing up.
+ */
+static MI_Result SnapshotShells(struct _Shell_Self *shell, const MI_Char *shellId, ShellData ***shells, MI_Uint32 *shellCount)
+{
+    ShellData *shellData;
+    MI_Uint32 count = 0;
 
-    /* Point cursor to start of stream names again */
-    cursor = (MI_Char*) streams;
+    *shells = NULL;
+    *shellCount = 0;
+
+    Lock_Acquire(&shell->shellListLock);
+    for (shellData = shell->shellList; shellData; shellData = (ShellData*)shellData->common.siblingData)
+    {
+        if ((shellId == NULL) || (Tcscmp(shellId, shellData->shellId) == 0))
+            count++;
+    }
+
+    if (count)
+    {
+        *shells = malloc(count * sizeof(ShellData*));
+        if (*shells == NULL)
+        {
+            Lock_Release(&shell->shellListLock);
+            return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+        }
+
+        for (shellData = shell->shellList; shellData; shellData = (ShellData*)shellData->common.siblingData)
+        {
+            if ((shellId == NULL) || (Tcscmp(shellId, shellData->shellId) == 0))
+            {
+                Atomic_Inc(&shellData->common.refcount);
+                (*shells)[(*shellCount)++] = shellData;
+            }
+        }
+    }
+    Lock_Release(&shell->shellListLock);
+
+    return MI_RESULT_OK;
+}
+
+static void IntervalFromMicroseconds(MI_Uint64 microseconds, MI_Datetime *datetime)
+{
+    MI_Uint64 seconds = microseconds / 1000000;
+
+    memset(datetime, 0, sizeof(*datetime));
+    datetime->isTimestamp = MI_FALSE;
+    datetime->u.interval.microseconds = (MI_Uint32) (microseconds % 1000000);
+    datetime->u.interval.seconds = (MI_Uint32) (seconds % 60);
+    datetime->u.interval.minutes = (MI_Uint32) ((seconds / 60) % 60);
+    datetime->u.interval.hours = (MI_Uint32) ((seconds / 3600) % 24);
+    datetime->u.interval.days = (MI_Uint32) (seconds / 86400);
+}
+
+/* PostShellSnapshot
+ * Post a shell as it is right now: its creation properties plus its state, run time,
+ * inactivity and byte counts.
+ */
+static MI_Result PostShellSnapshot(MI_Context *context, ShellData *shellData, MI_Boolean keysOnly)
+{
+    MI_Instance *instance = NULL;
+    MI_Value value;
+    MI_Uint64 now = Metrics_Now();
+    MI_Result miResult;
+
+    if (keysOnly)
+    {
+        Shell shell;
+
+        miResult = Shell_Construct(&shell, context);
+        if (miResult != MI_RESULT_OK)
+            return miResult;
+        Shell_SetPtr_ShellId(&shell, shellData->shellId);
+        miResult = Shell_Post(&shell, context);
+        Shell_Destruct(&shell);
+        return miResult;
+    }
+
+    miResult = Instance_Clone(shellData->shellInstance, &instance, NULL);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    value.string = (Atomic_Read(&shellData->connectedState) == Disconnected) ? MI_T("Disconnected") : MI_T("Connected");
+    MI_Instance_SetElement(instance, MI_T("State"), &value, MI_STRING, 0);
+    IntervalFromMicroseconds(now - shellData->common.startTime, &value.datetime);
+    MI_Instance_SetElement(instance, MI_T("ShellRunTime"), &value, MI_DATETIME, 0);
+    IntervalFromMicroseconds(now - (MI_Uint64) Atomic_Read(&shellData->lastActivity), &value.datetime);
+    MI_Instance_SetElement(instance, MI_T("ShellInactivity"), &value, MI_DATETIME, 0);
+    value.uint64 = (MI_Uint64) Atomic_Read(&shellData->bytesIn);
+    MI_Instance_SetElement(instance, MI_T("BytesIn"), &value, MI_UINT64, 0);
+    value.uint64 = (MI_Uint64) Atomic_Read(&shellData->bytesOut);
+    MI_Instance_SetElement(instance, MI_T("BytesOut"), &value, MI_UINT64, 0);
+
+    miResult = MI_Context_PostInstance(context, instance);
+    MI_Instance_Delete(instance);
+    return miResult;
+}
+
+/* Microseconds in an interval, 0 for a timestamp since only intervals are timeouts */
+static MI_Uint64 MicrosecondsFromInterval(const MI_Datetime *datetime)
+{
+    if (datetime->isTimestamp)
+        return 0;
+
+    return ((((MI_Uint64) datetime->u.interval.days * 24 + datetime->u.interval.hours) * 60 +
+              datetime->u.interval.minutes) * 60 + datetime->u.interval.seconds) * 1000000 +
+           datetime->u.interval.microseconds;
+}
+
+/* The timeout the client asked for, or the default, but never more than psrpmaxidletimeout */
+static MI_Uint64 EffectiveIdleTimeout(Shell_Self *self, MI_Uint64 requested)
+{
+    MI_Uint64 timeout = requested ? requested : self->defaultIdleTimeout;
+
+    if (self->maxIdleTimeout && ((timeout == 0) || (timeout > self->maxIdleTimeout)))
+        timeout = self->maxIdleTimeout;
+    return timeout;
+}
+
+/* _SetIdleTimeouts
+ * Work out a new shell's idle timeout from its IdleTimeout and record the timeouts in
+ * shellInstance so Enumerate and Get report the ones that are enforced.
+ */
+static void _SetIdleTimeouts(Shell_Self *self, ShellData *shellData)
+{
+    MI_Value value;
+    MI_Type type;
+    MI_Uint32 flags;
+    MI_Uint64 requested = 0;
+
+    if ((MI_Instance_GetElement(shellData->shellInstance, MI_T("IdleTimeout"), &value, &type, &flags, NULL) == MI_RESULT_OK) &&
+        (type == MI_DATETIME) && !(flags & MI_FLAG_NULL))
+    {
+        requested = MicrosecondsFromInterval(&value.datetime);
+    }
+    shellData->idleTimeout = EffectiveIdleTimeout(self, requested);
+    shellData->disconnectedTimeout = shellData->idleTimeout;
+
+    if (shellData->idleTimeout)
+    {
+        IntervalFromMicroseconds(shellData->idleTimeout, &value.datetime);
+        MI_Instance_SetElement(shellData->shellInstance, MI_T("IdleTimeout"), &value, MI_DATETIME, 0);
+    }
+    if (self->maxIdleTimeout)
+    {
+        IntervalFromMicroseconds(self->maxIdleTimeout, &value.datetime);
+        MI_Instance_SetElement(shellData->shellInstance, MI_T("MaxIdleTimeout"), &value, MI_DATETIME, 0);
+    }
+}
+
+/* Resident set size from /proc/self/statm, 0 if it cannot be read */
+static MI_Uint64 _ResidentBytes(void)
+{
+    unsigned long size, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if (statm == NULL)
+        return 0;
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return (MI_Uint64) resident * (MI_Uint64) sysconf(_SC_PAGESIZE);
+}
+
+/* Give the memory reaped shells were using back to the system. The provider keeps no caches
+ * of its own on the server side, so this is down to the heap.
+ */
+static void _TrimAfterReaping(void)
+{
+#if defined(__GLIBC__)
+    MI_Uint64 before = _ResidentBytes();
+    MI_Uint64 after;
+
+    malloc_trim(0);
+    after = _ResidentBytes();
+    if (before > after)
+    {
+        Metrics_Add(Metrics_ReclaimedBytes, before - after);
+        __LOGI(("Idle reaper - trimmed heap, reclaimed %llu bytes", (unsigned long long) (before - after)));
+    }
+#endif
+}
+
+/* Take a reference on every shell that has been idle for longer than its timeout and mark it
+ * reaped so it is only shut down once. Shells the client is already deleting are left to it.
+ * nextDue is set to the microseconds until the next shell times out, 0 if none will. The
+ * caller frees the array.
+ */
+static MI_Uint32 _CollectIdleShells(Shell_Self *self, ShellData ***shells, MI_Uint64 *nextDue)
+{
+    ShellData *shellData;
+    MI_Uint64 now = Metrics_Now();
+    MI_Uint32 count = 0, capacity = 0;
+
+    *shells = NULL;
+    *nextDue = 0;
+    Lock_Acquire(&self->shellListLock);
+    for (shellData = self->shellList; shellData; shellData = (ShellData*)shellData->common.siblingData)
+    {
+        MI_Uint64 timeout = (Atomic_Read(&shellData->connectedState) == Disconnected) ? shellData->disconnectedTimeout : shellData->idleTimeout;
+        MI_Uint64 lastActivity = (MI_Uint64) Atomic_Read(&shellData->lastActivity);
+
+        if ((timeout == 0) || shellData->reaped || shellData->deleteInstanceContext)
+            continue;
+
+        if ((now < lastActivity) || ((now - lastActivity) <= timeout))
+        {
+            MI_Uint64 due = (now < lastActivity) ? timeout : timeout - (now - lastActivity);
+            if ((*nextDue == 0) || (due < *nextDue))
+                *nextDue = due;
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            ShellData **grown = realloc(*shells, (capacity + 8) * sizeof(ShellData*));
+            if (grown == NULL)
+                break;
+            *shells = grown;
+            capacity += 8;
+        }
+        Atomic_Swap(&shellData->reaped, 1);
+        Atomic_Inc(&shellData->common.refcount);
+        (*shells)[count++] = shellData;
+    }
+    Lock_Release(&self->shellListLock);
+    return count;
+}
+
+static PAL_Uint32 THREAD_API _IdleReaperThread(void *param)
+{
+    Shell_Self *self = (Shell_Self*) param;
+    MI_Boolean trimPending = MI_FALSE;
+
+    while (!Atomic_Read(&self->reaperShutdown))
+    {
+        ShellData **shells;
+        MI_Uint32 count, i;
+        MI_Uint64 nextDue, waitMs;
+
+        /* Shells reaped last time round have had a while to shut down by now */
+        if (trimPending)
+        {
+            _TrimAfterReaping();
+            trimPending = MI_FALSE;
+        }
+
+        count = _CollectIdleShells(self, &shells, &nextDue);
+        for (i = 0; i != count; i++)
+        {
+            __LOGW(("Idle reaper - shutting down shell %s, no client request for %llus",
+                shells[i]->shellId,
+                (unsigned long long) ((Metrics_Now() - (MI_Uint64) Atomic_Read(&shells[i]->lastActivity)) / 1000000)));
+            Metrics_Add(Metrics_ReapedShells, 1);
+            RecursiveNotifyShutdown(&shells[i]->common);
+            CommonData_Release(&shells[i]->common);
+            trimPending = MI_TRUE;
+        }
+        free(shells);
+
+        /* Sleep until the next shell is due, or until WakeIdleReaper says that may be sooner */
+        waitMs = nextDue ? (nextDue + 999) / 1000 : IDLE_REAPER_MAX_WAIT_MS;
+        if (waitMs > IDLE_REAPER_MAX_WAIT_MS)
+            waitMs = IDLE_REAPER_MAX_WAIT_MS;
+        if (trimPending && (waitMs > IDLE_REAPER_TRIM_DELAY_MS))
+            waitMs = IDLE_REAPER_TRIM_DELAY_MS;
+        Sem_TimedWait(&self->reaperWake, (int) waitMs);
+    }
+    return 0;
+}
+
+/* A shell has been added or its timeout has changed, so the reaper may be sleeping past the
+ * time it is due. Requests only ever move a shell's time out later so they do not need this.
+ */
+static void WakeIdleReaper(Shell_Self *self)
+{
+    if (self->reaperStarted)
+        Sem_Post(&self->reaperWake, 1);
+}
+
+/* StartIdleReaper
+ * Shells are shut down once they have gone without a client request for longer than their idle
+ * timeout, or the timeout given to Disconnect while they are disconnected. A shell's timeout is
+ * the IdleTimeout its client created it with, psrpidletimeout (seconds) in omiserver.conf when
+ * the client did not give one, and never more than psrpmaxidletimeout (seconds). This is what
+ * frees the shells of clients that went away without deleting them.
+ */
+static void StartIdleReaper(Shell_Self *self)
+{
+    char value[16];
+
+    if (_GetConfigValueFromConfigFile("psrpidletimeout", value, sizeof(value)) == MI_RESULT_OK)
+        self->defaultIdleTimeout = (MI_Uint64) strtoul(value, NULL, 10) * 1000000;
+    if (_GetConfigValueFromConfigFile("psrpmaxidletimeout", value, sizeof(value)) == MI_RESULT_OK)
+        self->maxIdleTimeout = (MI_Uint64) strtoul(value, NULL, 10) * 1000000;
+
+    self->reaperShutdown = 0;
+    if (Sem_Init(&self->reaperWake, 0, 0) != 0)
+    {
+        __LOGE(("StartIdleReaper - failed to create reaper semaphore, idle shells will not be reaped"));
+        return;
+    }
+    if (Thread_CreateJoinable(&self->reaperThread, _IdleReaperThread, NULL, self) != 0)
+    {
+        __LOGE(("StartIdleReaper - failed to create reaper thread, idle shells will not be reaped"));
+        Sem_Destroy(&self->reaperWake);
+        return;
+    }
+    self->reaperStarted = MI_TRUE;
+    __LOGD(("StartIdleReaper - default idle timeout %llus, maximum %llus",
+        (unsigned long long) (self->defaultIdleTimeout / 1000000), (unsigned long long) (self->maxIdleTimeout / 1000000)));
+}
+
+static void StopIdleReaper(Shell_Self *self)
+{
+    PAL_Uint32 threadResult;
+
+    if (!self->reaperStarted)
+        return;
+
+    Atomic_Swap(&self->reaperShutdown, 1);
+    Sem_Post(&self->reaperWake, 1);
+    Thread_Join(&self->reaperThread, &threadResult);
+    Thread_Destroy(&self->reaperThread);
+    self->reaperStarted = MI_FALSE;
+    Sem_Destroy(&self->reaperWake);
+}
+
+/* Read psrpdisconnectbuffer and psrpdisconnectspill from omiserver.conf */
+static void ReadDisconnectBufferConfig(Shell_Self *self)
+{
+    char value[32];
+
+    self->disconnectBufferSize = DISCONNECT_DEFAULT_BUFFER;
+    self->disconnectSpillSize = DISCONNECT_DEFAULT_SPILL;
+    if (_GetConfigValueFromConfigFile("psrpdisconnectbuffer", value, sizeof(value)) == MI_RESULT_OK)
+        self->disconnectBufferSize = (MI_Uint64) strtoull(value, NULL, 10);
+    if (_GetConfigValueFromConfigFile("psrpdisconnectspill", value, sizeof(value)) == MI_RESULT_OK)
+        self->disconnectSpillSize = (MI_Uint64) strtoull(value, NULL, 10);
+
+    /* The spill file is mapped in one piece, however far it has grown */
+    if (self->disconnectSpillSize > (MI_Uint64) (size_t) -1)
+        self->disconnectSpillSize = (MI_Uint64) (size_t) -1;
+}
+
+/* Name of the account this process runs as */
+static MI_Boolean _GetAgentUserName(char *name, size_t nameLength)
+{
+    struct passwd pwd;
+    struct passwd *result = NULL;
+    char buffer[1024];
+
+    if ((getpwuid_r(geteuid(), &pwd, buffer, sizeof(buffer), &result) != 0) || (result == NULL) ||
+        (Strlcpy(name, pwd.pw_name, nameLength) >= nameLength))
+    {
+        return MI_FALSE;
+    }
+    return MI_TRUE;
+}
+
+/* LoadPlugin
+ * Start the plugin, either the echo plugin or PowerShell in CoreCLR, and report how long each
+ * phase of loading took. startupPhases already has the phases Shell_Load did itself.
+ */
+static MI_Result LoadPlugin(Shell_Self *self, MI_Uint64 loadStart, MI_Uint64 *startupPhases)
+{
+    MI_Result miResult = MI_RESULT_OK;
+    int ret;
+    char *errorMessage = NULL;
+    MI_Uint64 phaseStart;
+    CoreCLRStartupTimes clrTimes;
+    InitPluginWkrPtrsFuncPtr entryPointDelegate = NULL;
+
+    memset(&clrTimes, 0, sizeof(clrTimes));
+
+    /* The native echo plugin stands in for PowerShell when load testing the provider itself */
+    {
+        char plugin[16];
+        if ((_GetConfigValueFromConfigFile("shellplugin", plugin, sizeof(plugin)) == MI_RESULT_OK) &&
+            (Tcscasecmp(plugin, "echo") == 0))
+        {
+            __LOGD(("LoadPlugin - using echo plugin"));
+            miResult = EchoPlugin_Init(&self->managedPointers);
+            if (miResult)
+            {
+                GOTO_ERROR("Echo plugin initialization failed", miResult);
+            }
+            _ReportStartupTimes(startupPhases, &clrTimes, loadStart, miResult);
+            return miResult;
+        }
+    }
+
+    /* Initialize the CLR */
+    __LOGD(("LoadPlugin - loading CLR"));
+    {
+        ClrProperties clrProperties;
+
+        clrProperties.count = 0;
+        clrProperties.batch = Batch_New(BATCH_MAX_PAGES);
+        if ((clrProperties.batch == NULL) ||
+            (_GetConfigSectionFromConfigFile("clr", _AddClrProperty, &clrProperties) == MI_RESULT_SERVER_LIMITS_EXCEEDED))
+        {
+            if (clrProperties.batch)
+                Batch_Delete(clrProperties.batch);
+            GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        }
+        ret = startCoreCLR("ps_omi_host", clrProperties.count, clrProperties.keys, clrProperties.values,
+                &self->hostHandle, &self->domainId, &clrTimes);
+        Batch_Delete(clrProperties.batch);
+    }
+    if (ret != 0)
+    {
+        GOTO_ERROR("Failed to start CLR", MI_RESULT_FAILED);
+    }
+    __LOGD(("LoadPlugin - CLR loaded"));
+
+    /* Create delegate to managed code InitPlugin method in PowerShell assembly */
+    phaseStart = Metrics_Now();
+    ret = createDelegate(
+        self->hostHandle,
+        self->domainId,
+        "System.Management.Automation, Version=3.0.0.0, Culture=neutral, PublicKeyToken=31bf3856ad364e35",
+        "System.Management.Automation.Remoting.WSManPluginManagedEntryWrapper",
+        "InitPlugin",
+        (void**)&entryPointDelegate);
+    startupPhases[Metrics_StartupCreateDelegate] = Metrics_Now() - phaseStart;
+    if (ret != 0)
+    {
+        GOTO_ERROR("Failed to create powershell delegate InitPlugin", MI_RESULT_FAILED);
+    }
+    __LOGD(("LoadPlugin - delegate created"));
+
+
+    /* Call managed delegate InitPlugin method */
+    if (entryPointDelegate)
+    {
+        __LOGD(("LoadPlugin - Calling InitPlugun"));
+        phaseStart = Metrics_Now();
+        miResult = entryPointDelegate(&self->managedPointers);
+        startupPhases[Metrics_StartupInitPlugin] = Metrics_Now() - phaseStart;
+        if (miResult)
+        {
+            GOTO_ERROR("Powershell InitPlugin failed", miResult);
+        }
+    }
+    _ReportStartupTimes(startupPhases, &clrTimes, loadStart, miResult);
+    return miResult;
+
+error:
+    _ReportStartupTimes(startupPhases, &clrTimes, loadStart, miResult);
+    return miResult;
+}
+
+/* Open the readiness latch _CallCreateShell waits on */
+static void SetPluginState(Shell_Self *self, PluginState state)
+{
+    Atomic_Swap(&self->pluginState, (ptrdiff_t) state);
+    CondLock_Broadcast((ptrdiff_t) &self->pluginState);
+}
+
+/* Wait for the plugin to finish loading. Returns MI_FALSE if it failed to. */
+static MI_Boolean WaitForPlugin(Shell_Self *self)
+{
+    do
+    {
+    } while (CondLock_Wait((ptrdiff_t) &self->pluginState,
+                           &self->pluginState,
+                           PluginState_Loading,
+                           CONDLOCK_DEFAULT_SPINCOUNT) == 0);
+
+    return self->pluginState == PluginState_Ready;
+}
+
+typedef struct _WarmUpParams
+{
+    Shell_Self *self;
+    MI_Uint64 loadStart;
+    MI_Uint64 startupPhases[Metrics_StartupPhaseCount];
+    MI_Boolean throwawayShell;
+} WarmUpParams;
+
+/* Load the plugin in the background for psrpwarmup */
+static PAL_Uint32 THREAD_API _WarmUpThread(void *_params)
+{
+    WarmUpParams *params = (WarmUpParams*) _params;
+    Shell_Self *self = params->self;
+
+    if (LoadPlugin(self, params->loadStart, params->startupPhases) != MI_RESULT_OK)
+    {
+        __LOGE(("_WarmUpThread - plugin failed to load, shell creates will fail"));
+        SetPluginState(self, PluginState_Failed);
+        free(params);
+        return 0;
+    }
+    SetPluginState(self, PluginState_Ready);
+
+    /* Run the plugin's shell code once with a shell nobody gets */
+    if (params->throwawayShell)
+    {
+        if (!_CreateWarmUpShell(self))
+        {
+            __LOGE(("_WarmUpThread - failed to create warm-up shell"));
+        }
+    }
+    free(params);
+    return 0;
+}
+
+/* Shell_Load is called after the provider has been loaded to return
+ * the provider schema to the engine. It also allocates and returns our own
+ * context object that is passed to all operations that holds the current
+ * state of all our shells.
+ *
+ * With psrpwarmup=true in omiserver.conf the plugin is loaded on a background thread and
+ * Shell_Load returns straight away, so only requests that need the plugin wait for it.
+ * psrpwarmup=shell also creates and shuts down one shell once the plugin has loaded so the
+ * first client's shell does not pay for running that code for the first time. No command is
+ * run in it: a PowerShell command needs a runspace pool opened by the client's PSRP messages,
+ * which a shell without a client does not have. The first command still runs cold.
+ */
+void MI_CALL Shell_Load(Shell_Self** self, MI_Module_Self* selfModule,
+        MI_Context* context)
+{
+    MI_Uint32 miResult = MI_RESULT_OK;
+    int ret;
+    char *errorMessage = NULL;
+    MI_Uint64 loadStart = Metrics_Now();
+    MI_Uint64 phaseStart;
+    MI_Uint64 startupPhases[Metrics_StartupPhaseCount];
+    char warmUp[16];
+
+    memset(startupPhases, 0, sizeof(startupPhases));
+
+    _GetLogOptionsFromConfigFile(SHELL_LOGGING_FILE);
+    Metrics_Start();
+    Trace_Start();
+
+    __LOGD(("Shell_Load - allocating shell"));
+    *self = calloc(1, sizeof(Shell_Self));
+    if (*self == NULL)
+    {
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    Lock_Init(&(*self)->shellListLock);
+    ReadDisconnectBufferConfig(*self);
+
+    /* Initialize the environment
+     *
+     * This is necessary because OMI can launch this process as a non-root user;
+     * but OMI does not do anything to ensure the environment is correct.
+     * For instance, if HOME=/root in omiserver, * this omiagent process inherits the value.
+     * However, for a shell provider, this causes problems.
+     * PowerShell depends on HOME to be correct; i.e. the user's home folder,
+     * and throws an exception if it gets an IO error on HOME.
+     *
+     * Here we lookup the user's home folder via getpwuid(),
+     * and set HOME for our process to the correct value.
+     */
+    __LOGD(("Shell_Load - setting HOME for effective user"));
+    phaseStart = Metrics_Now();
+    ret = SetHomeDir(&(*self)->home);
+    startupPhases[Metrics_StartupSetHomeDir] = Metrics_Now() - phaseStart;
+    if (ret != 0)
+    {
+        __LOGE(("Shell_Load - failed to set HOME for user"));
+    }
+
+    if ((_GetConfigValueFromConfigFile("psrpwarmup", warmUp, sizeof(warmUp)) == MI_RESULT_OK) &&
+        ((Tcscasecmp(warmUp, "true") == 0) || (Tcscasecmp(warmUp, "shell") == 0)))
+    {
+        WarmUpParams *params = malloc(sizeof(WarmUpParams));
+
+        if (params)
+        {
+            params->self = *self;
+            params->loadStart = loadStart;
+            memcpy(params->startupPhases, startupPhases, sizeof(startupPhases));
+            params->throwawayShell = Tcscasecmp(warmUp, "shell") == 0;
+            if (Thread_CreateJoinable(&(*self)->warmUpThread, _WarmUpThread, NULL, params) == 0)
+            {
+                __LOGD(("Shell_Load - loading plugin in the background"));
+                (*self)->warmUpThreadStarted = MI_TRUE;
+                StartIdleReaper(*self);
+                MI_Context_PostResult(context, MI_RESULT_OK);
+                return;
+            }
+            free(params);
+        }
+        __LOGE(("Shell_Load - failed to start warm-up thread, loading plugin now"));
+    }
+
+    miResult = LoadPlugin(*self, loadStart, startupPhases);
+    if (miResult)
+    {
+        GOTO_ERROR("Failed to load plugin", miResult);
+    }
+    SetPluginState(*self, PluginState_Ready);
+    StartIdleReaper(*self);
+    __LOGE(("Shell_Load PostResult %p, %u", context, miResult));
+    MI_Context_PostResult(context, miResult);
+    return;
+
+error:
+    Metrics_Stop();
+    Trace_Stop();
+    __LOGE(("Shell_Load PostResult %p, %u", context, miResult));
+    MI_Context_PostError(context, miResult, MI_RESULT_TYPE_MI, errorMessage);
+}
+
+/* Shell_Unload is called after all operations have completed, or they should
+ * be completed. This function is called right before the provider is unloaded.
+ * We clean up our shell context object at this point as no more operations will
+ * be using it.
+ */
+void MI_CALL Shell_Unload(Shell_Self* self, MI_Context* context)
+{
+    int ret;
+
+    __LOGD(("Shell_Unload"));
+
+
+    /* TODO: Do we have any shells still active? */
+
+    /* NOTE: Expectation is that WSManPluginReportCompletion should be called, but it is not looking like that is always happening */
+
+    /* Let a background load finish before shutting the plugin down */
+    if (self->warmUpThreadStarted)
+    {
+        PAL_Uint32 threadResult;
+        Thread_Join(&self->warmUpThread, &threadResult);
+        Thread_Destroy(&self->warmUpThread);
+    }
+
+    StopIdleReaper(self);
+
+    /* A warm-up shell the plugin has not finished with yet */
+    DrainWarmUpShells(self);
+
+    /* Call managed code Shutdown function */
+    if (self->managedPointers.shutdownPluginFuncPtr)
+        self->managedPointers.shutdownPluginFuncPtr(self);
+
+    /* TODO: Shut down CLR */
+    if (self->hostHandle)
+    {
+        ret = stopCoreCLR(self->hostHandle, self->domainId);
+        if (ret != 0)
+        {
+            __LOGE(("Stopping CLR failed"));
+        }
+    }
+
+    if (self->home)
+    {
+        PAL_Free((void*)self->home);
+    }
+    free(self->shellTable);
+    free(self);
+
+    Metrics_Stop();
+    Trace_Stop();
+
+    __LOGD(("Shell_Unload PostResult %p, %u", context, MI_RESULT_OK));
+
+    Log_Close();
+
+    MI_Context_PostResult(context, MI_RESULT_OK);
+}
+
+/* Shell_EnumerateInstances returns a snapshot of every active shell. Only the list walk is
+ * done under the shell list lock, the instances are built and posted after it is released.
+ */
+void MI_CALL Shell_EnumerateInstances(Shell_Self* self, MI_Context* context,
+        const MI_Char* nameSpace, const MI_Char* className,
+        const MI_PropertySet* propertySet, MI_Boolean keysOnly,
+        const MI_Filter* filter)
+{
+    ShellData **shells;
+    MI_Uint32 shellCount, i;
+    MI_Result miResult;
+
+    __LOGD(("Shell_EnumerateInstances"));
+    miResult = SnapshotShells(self, NULL, &shells, &shellCount);
+
+    for (i = 0; i != shellCount; i++)
+    {
+        if (miResult == MI_RESULT_OK)
+        {
+            miResult = PostShellSnapshot(context, shells[i], keysOnly);
+            if (miResult != MI_RESULT_OK)
+            {
+                __LOGE(("Shell_EnumerateInstances failed to post instance"));
+            }
+        }
+        CommonData_Release(&shells[i]->common);
+    }
+    free(shells);
+
+    __LOGD(("Shell_EnumerateInstances PostResult %p, %u, %u shells", context, miResult, shellCount));
+    MI_Context_PostResult(context, miResult);
+}
+
+/* Shell_GetInstance returns a snapshot of one shell */
+void MI_CALL Shell_GetInstance(Shell_Self* self, MI_Context* context,
+        const MI_Char* nameSpace, const MI_Char* className,
+        const Shell* instanceName, const MI_PropertySet* propertySet)
+{
+    ShellData **shells = NULL;
+    MI_Uint32 shellCount = 0;
+    MI_Result miResult = MI_RESULT_NOT_FOUND;
+
+    if (instanceName->ShellId.value)
+        miResult = SnapshotShells(self, instanceName->ShellId.value, &shells, &shellCount);
+
+    if (shellCount)
+    {
+        miResult = PostShellSnapshot(context, shells[0], MI_FALSE);
+        if (miResult != MI_RESULT_OK)
+        {
+            __LOGE(("Shell_GetInstances failed to post instance"));
+        }
+        CommonData_Release(&shells[0]->common);
+    }
+    else if (miResult == MI_RESULT_OK)
+    {
+        miResult = MI_RESULT_NOT_FOUND;
+    }
+    free(shells);
+
+    __LOGD(("Shell_GetInstance PostResult %p, %u", context, miResult));
+    MI_Context_PostResult(context, miResult);
+}
+
+
+
+/* ExtractStreamSet takes a list of streams that are space delimited and
+ * copies the data into the ShellData object for the stream. These stream
+ * names are allocated and so will need to be deleted when the shell is deleted.
+ * We allocate a single buffer for the array and the string, then insert null terminators
+ * into the string where spaces were and fix up the array pointers to these strings.
+ */
+static MI_Boolean ExtractStreamSet(CommonData *commonData, const MI_Char *streams, StreamSet *streamSet)
+{
+    MI_Char *cursor = (MI_Char*) streams;
+    MI_Uint32 i;
+
+    /* Count how many stream names we have so we can allocate the array */
+    while (cursor && *cursor)
+    {
+        streamSet->streamNamesCount++;
+        cursor = Tcschr(cursor, MI_T(' '));
+        if (cursor && *cursor)
+        {
+            cursor++;
+        }
+    }
+
+    /* Allocate the buffer for the array and all strings inside the array */
+    streamSet->streamNames = Batch_Get(commonData->batch,
+              (sizeof(MI_Char*) * streamSet->streamNamesCount)); /* array length */
+    if (streamSet->streamNames == NULL)
+        return MI_FALSE;
+
+    /* Point cursor to start of stream names again */
+    cursor = (MI_Char*) streams;
 
     /* Loop through the streams fixing up the array pointers and replace spaces with null terminator */
     for (i = 0; i != streamSet->streamNamesCount; i++)
@@ -864,6 +1928,14 @@ PAL_Uint32  _CallCreateShell(void *_params)
 {
     CreateShellParams *params = (CreateShellParams*) _params;
 
+    if (!WaitForPlugin(params->self))
+    {
+        WSManPluginOperationComplete(params->requestDetails, 0, MI_RESULT_FAILED, NULL);
+        free(params);
+        return 0;
+    }
+
+    TraceRequest((CommonData*) params->requestDetails, Trace_PluginCall, 0);
     params->self->managedPointers.wsManPluginShellFuncPtr(
             params->self,
             params->requestDetails,
@@ -883,6 +1955,8 @@ MI_Boolean CallCreateShell(
         _In_opt_ WSMAN_DATA *inboundShellInformation)
 {
     CreateShellParams *params = malloc(sizeof(CreateShellParams));
+
+    TraceRequest((CommonData*) requestDetails, Trace_Invoke, 0);
     if (params)
     {
         params->self = self;
@@ -899,6 +1973,229 @@ MI_Boolean CallCreateShell(
 
     return MI_FALSE;
 }
+/* Give a shell an ID of our own for when the client does not ask for one */
+static MI_Boolean _GenerateShellId(ShellData *shellData)
+{
+    shellData->shellId = Batch_Get(shellData->common.batch, sizeof(MI_Char)*ID_LENGTH);
+    if (shellData->shellId == NULL)
+        return MI_FALSE;
+
+    return Stprintf(shellData->shellId, ID_LENGTH, MI_T("%llx"), (MI_Uint64) shellData) >= 0;
+}
+
+/* _SetShellId
+ * Use the ShellId the client asked for, or the shell's own one which then goes back to the client
+ * in the created instance.
+ */
+static MI_Result _SetShellId(ShellData *shellData, MI_Instance *miOperationInstance, const Shell *newInstance)
+{
+    MI_Value value;
+    MI_Type type;
+
+    if (newInstance->ShellId.value == NULL)
+    {
+        if ((shellData->shellId == NULL) && !_GenerateShellId(shellData))
+            return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+        return Shell_SetPtr_ShellId((Shell*)miOperationInstance, shellData->shellId);
+    }
+
+    if ((MI_Instance_GetElement(miOperationInstance, MI_T("ShellId"), &value, &type, NULL, NULL) != MI_RESULT_OK) ||
+            (type != MI_STRING))
+    {
+        return MI_RESULT_FAILED;
+    }
+    shellData->shellId = value.string;
+    return MI_RESULT_OK;
+}
+
+/* The unchanging copy Enumerate and Get report from. They add the changing properties
+ * themselves and leave out the creation XML, which can be large.
+ */
+static MI_Boolean _SetShellInstance(ShellData *shellData, MI_Context *context)
+{
+    MI_Value value;
+    MI_Uint32 flags;
+    const MI_Char *owner;
+
+    if (Instance_Clone(shellData->common.miOperationInstance, &shellData->shellInstance, shellData->common.batch) != MI_RESULT_OK)
+        return MI_FALSE;
+
+    MI_Instance_ClearElement(shellData->shellInstance, MI_T("CreationXml"));
+    value.uint32 = (MI_Uint32) getpid();
+    MI_Instance_SetElement(shellData->shellInstance, MI_T("ProcessId"), &value, MI_UINT32, 0);
+
+    /* The owner is the authenticated user unless the client said otherwise */
+    if (((MI_Instance_GetElement(shellData->shellInstance, MI_T("Owner"), &value, NULL, &flags, NULL) != MI_RESULT_OK) ||
+            (flags & MI_FLAG_NULL)) &&
+        (MI_Context_GetStringOption(context, MI_T("HTTP_USERNAME"), &owner) == MI_RESULT_OK))
+    {
+        value.string = (MI_Char*) owner;
+        MI_Instance_SetElement(shellData->shellInstance, MI_T("Owner"), &value, MI_STRING, 0);
+    }
+    return MI_TRUE;
+}
+
+/* Plumb a shell into our list. Failure paths after this need to unplumb it! Returns MI_FALSE,
+ * with the shell not on the list, if there was no memory to grow the shell table.
+ */
+static MI_Boolean AddShellToSelf(struct _Shell_Self *shell, ShellData *shellData)
+{
+    shellData->shell = shell;
+    shellData->connectedState = Connected;
+    Lock_Acquire(&shell->shellListLock);
+    shellData->common.siblingData = (CommonData *)shell->shellList;
+    shell->shellList = shellData;
+    if (!ShellTableAdd(shell, shellData))
+    {
+        shell->shellList = (ShellData *)shellData->common.siblingData;
+        Lock_Release(&shell->shellListLock);
+        return MI_FALSE;
+    }
+    Lock_Release(&shell->shellListLock);
+    WakeIdleReaper(shell);
+    return MI_TRUE;
+}
+
+/* _CreateWarmUpShell
+ * Create the psrpwarmup=shell shell. It has no client, so it is created for the account the
+ * agent runs as and is shut down as soon as the plugin reports it.
+ */
+static MI_Boolean _CreateWarmUpShell(Shell_Self *self)
+{
+    ShellData *shellData;
+    Batch *batch;
+    Shell warmUpInstance;
+    MI_Char16 *initString;
+    char senderName[256];
+
+    if (!_GetAgentUserName(senderName, sizeof(senderName)))
+        return MI_FALSE;
+
+    batch = Batch_New(BATCH_MAX_PAGES);
+    if (batch == NULL)
+        goto error;
+
+    shellData = Batch_GetClear(batch, sizeof(*shellData));
+    if (shellData == NULL)
+        goto error;
+    shellData->common.batch = batch;
+
+    /* Only the fields ExtractStartupInfo reads are filled in */
+    memset(&warmUpInstance, 0, sizeof(warmUpInstance));
+    warmUpInstance.Name.value = MI_T(WARMUP_SHELL_NAME);
+    warmUpInstance.Name.exists = MI_TRUE;
+    warmUpInstance.InputStreams.value = MI_T(WARMUP_SHELL_INPUT_STREAMS);
+    warmUpInstance.InputStreams.exists = MI_TRUE;
+    warmUpInstance.OutputStreams.value = MI_T(WARMUP_SHELL_OUTPUT_STREAMS);
+    warmUpInstance.OutputStreams.exists = MI_TRUE;
+
+    if (!_GenerateShellId(shellData) ||
+        !ExtractStreamSet(&shellData->common, warmUpInstance.InputStreams.value, &shellData->inputStreams) ||
+        !ExtractStreamSet(&shellData->common, warmUpInstance.OutputStreams.value, &shellData->outputStreams) ||
+        !ExtractStartupInfo(shellData, &warmUpInstance) ||
+        !Utf8ToUtf16Le(batch, WARMUP_SHELL_RESOURCE_URI, (MI_Char16**)&shellData->common.pluginRequest.resourceUri) ||
+        !Utf8ToUtf16Le(batch, POWERSHELL_INIT_STRING, &initString) ||
+        !Utf8ToUtf16Le(batch, senderName, (MI_Char16**)&shellData->common.senderDetails.senderName))
+    {
+        goto error;
+    }
+
+    shellData->common.pluginRequest.senderDetails = &shellData->common.senderDetails;
+    shellData->common.pluginRequest.operationInfo = &shellData->common.operationInfo;
+
+    shellData->common.refcount = 1;
+    shellData->common.requestType = CommonData_Type_Shell;
+    shellData->common.startTime = Metrics_Now();
+    shellData->common.traceId = Trace_NextId();
+    shellData->lastActivity = (ptrdiff_t) shellData->common.startTime;
+    shellData->shell = self;
+    shellData->isWarmUp = MI_TRUE;
+
+    Lock_Acquire(&self->shellListLock);
+    shellData->common.siblingData = (CommonData *)self->warmUpShells;
+    self->warmUpShells = shellData;
+    Lock_Release(&self->shellListLock);
+
+    PrintDataFunctionStart(&shellData->common, "_CreateWarmUpShell");
+    if (!CallCreateShell(self, &shellData->common.pluginRequest, 0, initString, &shellData->wsmanStartupInfo, NULL))
+    {
+        RemoveWarmUpShell(self, shellData);
+        CommonData_Release(&shellData->common);
+        return MI_FALSE;
+    }
+    return MI_TRUE;
+
+error:
+    if (batch)
+        Batch_Delete(batch);
+    return MI_FALSE;
+}
+
+/* Take a shell off the warm-up list. Returns MI_FALSE if it was not on it. */
+static MI_Boolean RemoveWarmUpShell(struct _Shell_Self *shell, ShellData *shellData)
+{
+    ShellData **pointerToPatch;
+    MI_Boolean found = MI_FALSE;
+
+    Lock_Acquire(&shell->shellListLock);
+    pointerToPatch = &shell->warmUpShells;
+    while (*pointerToPatch && (*pointerToPatch != shellData))
+    {
+        pointerToPatch = (ShellData **)&(*pointerToPatch)->common.siblingData;
+    }
+    if (*pointerToPatch)
+    {
+        *pointerToPatch = (ShellData *)shellData->common.siblingData;
+        found = MI_TRUE;
+    }
+    Lock_Release(&shell->shellListLock);
+    return found;
+}
+
+/* Does the client ask for compressed streams? */
+static MI_Boolean _IsCompressionRequested(const Shell *newInstance)
+{
+    MI_Value value;
+    MI_Type type;
+    MI_Uint32 flags;
+    MI_Uint32 index;
+
+    return (MI_Instance_GetElement(&newInstance->__instance, MI_T("CompressionMode"), &value, &type, &flags, &index) == 0) &&
+           (type == MI_STRING) &&
+           value.string;
+}
+
+/* Shut down every warm-up shell still waiting on the plugin */
+static void DrainWarmUpShells(Shell_Self *self)
+{
+    ShellData **shells = NULL;
+    ShellData *shellData;
+    MI_Uint32 shellCount = 0, i;
+
+    Lock_Acquire(&self->shellListLock);
+    for (shellData = self->warmUpShells; shellData; shellData = (ShellData*)shellData->common.siblingData)
+        shellCount++;
+    if (shellCount)
+        shells = malloc(shellCount * sizeof(ShellData*));
+    if (shells == NULL)
+        shellCount = 0;
+    for (i = 0, shellData = self->warmUpShells; i != shellCount; i++, shellData = (ShellData*)shellData->common.siblingData)
+    {
+        Atomic_Inc(&shellData->common.refcount);
+        shells[i] = shellData;
+    }
+    Lock_Release(&self->shellListLock);
+
+    /* The shutdown callbacks complete the shells, which takes the lock */
+    for (i = 0; i != shellCount; i++)
+    {
+        RecursiveNotifyShutdown(&shells[i]->common);
+        CommonData_Release(&shells[i]->common);
+    }
+    free(shells);
+}
+
 /* Shell_CreateInstance
  * Called by the client to create a shell. The shell is given an ID by us and sent back.
  * The list of streams that a command could have is listed out in the shell instance passed
@@ -944,34 +2241,9 @@ void MI_CALL Shell_CreateInstance(Shell_Self* self, MI_Context* context,
         GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
 
-    if (newInstance->ShellId.value == NULL)
-    {
-        /* Set the shell ID to be the pointer within the bigger buffer */
-        shellData->shellId = Batch_Get(batch, sizeof(MI_Char)*ID_LENGTH);
-        if (shellData->shellId == NULL)
-        {
-            GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-        }
-
-        if (Stprintf(shellData->shellId, ID_LENGTH, MI_T("%llx"), (MI_Uint64) shellData) < 0)
-        {
-            GOTO_ERROR("out of memory", MI_RESULT_FAILED);
-        }
-        if ((miResult = Shell_SetPtr_ShellId((Shell*)miOperationInstance, shellData->shellId)) != MI_RESULT_OK)
-        {
-            GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-        }
-    }
-    else
+    if ((miResult = _SetShellId(shellData, miOperationInstance, newInstance)) != MI_RESULT_OK)
     {
-        MI_Value value;
-        MI_Type type;
-        if ((MI_Instance_GetElement(miOperationInstance, MI_T("ShellId"), &value, &type, NULL, NULL) != MI_RESULT_OK) ||
-                (type != MI_STRING))
-        {
-            GOTO_ERROR("Failed to find shell name", MI_RESULT_FAILED);
-        }
-        shellData->shellId = value.string;
+        GOTO_ERROR("Failed to set shell ID", miResult);
     }
 
     /* Extract the outbound stream names that are space delimited into an
@@ -1005,19 +2277,7 @@ void MI_CALL Shell_CreateInstance(Shell_Self* self, MI_Context* context,
         pExtraInfo = &shellData->extraInfo;
     }
 
-    {
-        MI_Value value;
-        MI_Type type;
-        MI_Uint32 flags;
-        MI_Uint32 index;
-
-        if ((MI_Instance_GetElement(&newInstance->__instance, MI_T("CompressionMode"), &value, &type, &flags, &index) == 0) &&
-                (type == MI_STRING) &&
-                value.string)
-        {
-            shellData->isCompressed = MI_TRUE;
-        }
-    }
+    shellData->isCompressed = _IsCompressionRequested(newInstance);
 
     if (!Utf8ToUtf16Le(shellData->common.batch, POWERSHELL_INIT_STRING, &initString))
     {
@@ -1027,16 +2287,22 @@ void MI_CALL Shell_CreateInstance(Shell_Self* self, MI_Context* context,
     shellData->common.refcount = 1;
     shellData->common.parentData = NULL;    /* We are the top-level shell object */
     shellData->common.requestType = CommonData_Type_Shell;
+    shellData->common.startTime = Metrics_Now();
+    shellData->common.traceId = Trace_NextId();
     shellData->common.miRequestContext = context;
     shellData->common.miOperationInstance = miOperationInstance;
+    shellData->lastActivity = (ptrdiff_t) shellData->common.startTime;
 
-    /* Plumb this shell into our list. Failure paths after this need to unplumb it!
-    */
-    shellData->common.siblingData = (CommonData *)self->shellList;
-    self->shellList = shellData;
-    shellData->shell = self;
-    shellData->connectedState = Connected;
+    if (!_SetShellInstance(shellData, context))
+    {
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    _SetIdleTimeouts(self, shellData);
 
+    if (!AddShellToSelf(self, shellData))
+    {
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
 
     /* Lock the provider host from being unloaded and record the context such that we can unlock it
      * when the shell is deleted (in DeleteInstance). There may be a few other places where the
@@ -1052,10 +2318,16 @@ void MI_CALL Shell_CreateInstance(Shell_Self* self, MI_Context* context,
     PrintDataFunctionStart(&shellData->common, "Shell_CreateInstance");
     if (!CallCreateShell(self, &shellData->common.pluginRequest, 0, initString, &shellData->wsmanStartupInfo, pExtraInfo))
     {
-        /* Need to detatch ourself */
-        /* TODO: This is not thread safe... another shell could come in and mess this up */
-        self->shellList = (ShellData*) shellData->common.siblingData;
-        GOTO_ERROR("CallCreateShell failed", MI_RESULT_FAILED);
+        /* Need to detatch ourself. A request that found the shell on the list may still hold a
+         * reference, so the shell is freed by whichever release is the last.
+         */
+        RemoveShellFromSelf(self, shellData);
+        miResult = MI_RESULT_FAILED;
+        PrintDataFunctionEnd(&shellData->common, "Shell_CreateInstance", miResult);
+        MI_Context_RequestUnload(context);
+        MI_Context_PostError(context, miResult, MI_RESULT_TYPE_MI, "CallCreateShell failed");
+        CommonData_Release(&shellData->common);
+        return;
     }
 
     return;
@@ -1082,6 +2354,7 @@ void MI_CALL Shell_ModifyInstance(Shell_Self* self, MI_Context* context,
 void RecursiveNotifyShutdown(CommonData *commonData)
 {
     CommonData *child = NULL;;
+    WSManPluginShutdownCallback shutdownCallback;
 
     /* If there are children notify them first */
     if (commonData->requestType == CommonData_Type_Shell)
@@ -1093,26 +2366,40 @@ void RecursiveNotifyShutdown(CommonData *commonData)
         child = ((CommandData*)commonData)->childNext;
     }
 
+    /* Notifying a receive can complete it, which takes it off the list */
     while (child)
     {
+        CommonData *next = child->siblingData;
         RecursiveNotifyShutdown(child);
-        child = child->siblingData;
+        child = next;
+    }
+
+    /* Nobody is coming back for held output. A receive the plugin has already completed was
+     * only waiting to deliver it, so it is done with once that is gone.
+     */
+    if ((commonData->requestType == CommonData_Type_Receive) &&
+        _DiscardBufferedOutput((ReceiveData*) commonData))
+    {
+        return;
     }
 
-    /* Now notify for this object if a shutdown registration is present */
-    if (commonData->shutdownCallback)
+    /* Now notify for this object if a shutdown registration is present. The reaper, DeleteInstance
+     * and unload can all get here for the same object, only the one that takes the callback calls it.
+     */
+    shutdownCallback = (WSManPluginShutdownCallback) Atomic_Swap((ptrdiff_t*) &commonData->shutdownCallback, (ptrdiff_t) NULL);
+    if (shutdownCallback)
     {
         PrintDataFunctionTag(commonData, "RecursiveNotifyShutdown", "Calling registered shutdown callback");
-        commonData->shutdownCallback(commonData->shutdownContext);
-        commonData->shutdownCallback = NULL;
-        commonData->shutdownContext = NULL;
+        shutdownCallback(commonData->shutdownContext);
     }
 }
 
+/* Thread for RecursiveNotifyShutdown, given a reference on the shell that it drops */
 PAL_Uint32 _RecursiveNotifyShutdown(void *params)
 {
     CommonData *commonData = (CommonData*) params;
     RecursiveNotifyShutdown(commonData);
+    CommonData_Release(commonData);
     return 0;
 }
 
@@ -1140,8 +2427,13 @@ void MI_CALL Shell_DeleteInstance(Shell_Self* self, MI_Context* context,
            here because the shell itself will tell us when it is finished.
            We do it on a separate thread so we do not block the protocol
            thread if another request is needed during the shutdown.
+           The thread drops our reference when it is done.
            */
-        Thread_CreateDetached(_RecursiveNotifyShutdown, NULL, shellData);
+        if (Thread_CreateDetached(_RecursiveNotifyShutdown, NULL, shellData) != 0)
+        {
+            RecursiveNotifyShutdown(&shellData->common);
+            CommonData_Release(&shellData->common);
+        }
     }
     else
     {
@@ -1265,6 +2557,7 @@ PAL_Uint32  _CallCommand(void *_params)
 {
     CommandParams *params = (CommandParams*) _params;
 
+    TraceRequest((CommonData*) params->requestDetails, Trace_PluginCall, 0);
     params->self->managedPointers.wsManPluginCommandFuncPtr(
             params->self,
             params->requestDetails,
@@ -1284,6 +2577,8 @@ MI_Boolean CallCommand(
         _In_opt_ WSMAN_COMMAND_ARG_SET *arguments)
 {
     CommandParams *params = malloc(sizeof(CommandParams));
+
+    TraceRequest((CommonData*) requestDetails, Trace_Invoke, 0);
     if (params)
     {
         params->self = self;
@@ -1320,7 +2615,7 @@ void MI_CALL Shell_Invoke_Command(Shell_Self* self, MI_Context* context,
 
     __LOGD(("Shell_Invoke_Command Name=%s, ShellId=%s", instanceName->Name.value, instanceName->ShellId.value));
 
-    shellData = FindShellFromSelf(self, instanceName->ShellId.value);
+    shellData = FindActiveShellFromSelf(self, instanceName->ShellId.value);
 
     if (!shellData)
     {
@@ -1389,6 +2684,8 @@ void MI_CALL Shell_Invoke_Command(Shell_Self* self, MI_Context* context,
     commandData->common.refcount = 1;
     commandData->common.parentData = (CommonData*)shellData;
     commandData->common.requestType = CommonData_Type_Command;
+    commandData->common.startTime = Metrics_Now();
+    commandData->common.traceId = Trace_NextId();
     commandData->common.miRequestContext = context;
     commandData->common.miOperationInstance = miOperationInstance;
 
@@ -1411,6 +2708,7 @@ void MI_CALL Shell_Invoke_Command(Shell_Self* self, MI_Context* context,
     }
 
     /* Success path will send the response back from the callback from this API*/
+    CommonData_Release(&shellData->common);
     return;
 
 error:
@@ -1424,6 +2722,8 @@ error:
 
     if (batch)
         Batch_Delete(batch);
+    if (shellData)
+        CommonData_Release(&shellData->common);
 }
 
 CommandData *FindCommandFromShell(const ShellData *shell, const MI_Char *commandId)
@@ -1465,6 +2765,7 @@ PAL_Uint32  _CallSend(void *_params)
 {
     SendParams *params = (SendParams*) _params;
 
+    TraceRequest((CommonData*) params->requestDetails, Trace_PluginCall, 0);
     params->self->managedPointers.wsManPluginSendFuncPtr(
             params->self,
             params->requestDetails,
@@ -1486,6 +2787,8 @@ MI_Boolean CallSend(
         _In_ WSMAN_DATA *inboundData)
 {
     SendParams *params = malloc(sizeof(SendParams));
+
+    TraceRequest((CommonData*) requestDetails, Trace_Invoke, 0);
     if (params)
     {
         params->self = self;
@@ -1518,7 +2821,7 @@ void MI_CALL Shell_Invoke_Send(Shell_Self* self, MI_Context* context,
 {
     MI_Result miResult = MI_RESULT_OK;
     MI_Uint32 pluginFlags = 0;
-    ShellData *shellData = FindShellFromSelf(self, instanceName->ShellId.value);
+    ShellData *shellData = FindActiveShellFromSelf(self, instanceName->ShellId.value);
     CommandData *commandData = NULL;
     SendData *sendData = NULL;
     Batch *batch = NULL;
@@ -1560,6 +2863,8 @@ void MI_CALL Shell_Invoke_Send(Shell_Self* self, MI_Context* context,
         GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
     sendData->common.batch = batch;
+    sendData->common.startTime = Metrics_Now();
+    sendData->common.traceId = Trace_NextId();
 
     miResult = Instance_Clone(&in->__instance, &clonedIn, batch);
     if (miResult != MI_RESULT_OK)
@@ -1606,9 +2911,13 @@ void MI_CALL Shell_Invoke_Send(Shell_Self* self, MI_Context* context,
             /* Free the previously allocated buffer and switch the
              * decodedBuffer back to decodeBuffer for further processing.
              */
+            Metrics_Add(Metrics_CompressedBytesIn, decodeBuffer.bufferUsed);
+            Metrics_Add(Metrics_UncompressedBytesIn, decodedBuffer.bufferUsed);
             free(decodeBuffer.buffer);
             decodeBuffer = decodedBuffer;
         }
+        Metrics_Add(Metrics_BytesIn, decodeBuffer.bufferUsed);
+        Metrics_AtomicAdd(&shellData->bytesIn, decodeBuffer.bufferUsed);
     }
     else
     {
@@ -1683,6 +2992,7 @@ void MI_CALL Shell_Invoke_Send(Shell_Self* self, MI_Context* context,
         }
     }
     /* Now the plugin has been called the result is sent from the WSManPluginOperationComplete callback */
+    CommonData_Release(&shellData->common);
     return;
 
 error:
@@ -1696,6 +3006,8 @@ error:
 
     if (batch)
         Batch_Delete(batch);
+    if (shellData)
+        CommonData_Release(&shellData->common);
 }
 
 typedef struct _ReceiveParams
@@ -1712,6 +3024,7 @@ PAL_Uint32  _CallReceive(void *_params)
 {
     ReceiveParams *params = (ReceiveParams*) _params;
 
+    TraceRequest((CommonData*) params->requestDetails, Trace_PluginCall, 0);
     params->self->managedPointers.wsManPluginReceiveFuncPtr(
             params->self,
             params->requestDetails,
@@ -1731,6 +3044,8 @@ MI_Boolean CallReceive(
         _In_opt_ WSMAN_STREAM_ID_SET* streamSet)
 {
     ReceiveParams *params = malloc(sizeof(ReceiveParams));
+
+    TraceRequest((CommonData*) requestDetails, Trace_Invoke, 0);
     if (params)
     {
         params->self = self;
@@ -1807,6 +3122,88 @@ static MI_Result  _CreateReceiveTimeoutThread(ReceiveData *receiveData)
      return MI_RESULT_OK;
 }
 
+/* _PromotePendingReceiveContext
+ * Move the oldest queued Receive request into common.miRequestContext if that is free and wake
+ * up anything waiting for it. Needs to be called every time common.miRequestContext is taken.
+ */
+static void _PromotePendingReceiveContext(ReceiveData *receiveData)
+{
+    MI_Boolean promoted = MI_FALSE;
+
+    Lock_Acquire(&receiveData->pendingContextsLock);
+    if (receiveData->pendingContextsCount &&
+        (Atomic_CompareAndSwap((ptrdiff_t*) &receiveData->common.miRequestContext, (ptrdiff_t) NULL,
+                               (ptrdiff_t) receiveData->pendingContexts[receiveData->pendingContextsHead]) == (ptrdiff_t) NULL))
+    {
+        receiveData->requestArrival = receiveData->pendingArrivals[receiveData->pendingContextsHead];
+        receiveData->pendingContexts[receiveData->pendingContextsHead] = NULL;
+        receiveData->pendingContextsHead = (receiveData->pendingContextsHead + 1) % RECEIVE_MAX_PENDING_CONTEXTS;
+        receiveData->pendingContextsCount--;
+        receiveData->common.startTime = Metrics_Now();
+        receiveData->common.traceId = Trace_NextId();
+        promoted = MI_TRUE;
+    }
+    Lock_Release(&receiveData->pendingContextsLock);
+
+    if (promoted)
+    {
+        Metrics_GaugeAdd(Metrics_QueuedReceives, -1);
+        TraceRequest(&receiveData->common, Trace_Invoke, 0);
+        PrintDataFunctionTag(&receiveData->common, "_PromotePendingReceiveContext", "Promoted queued receive");
+        if (!receiveData->shutdownThread)
+            Sem_Post(&receiveData->timeoutSemaphore, 1);   /* Wake up thread to reset timer */
+        CondLock_Broadcast((ptrdiff_t)&receiveData->common.miRequestContext);
+    }
+}
+
+/* _QueueReceiveContext
+ * Hand a new Receive request to an existing receive operation. It goes straight into
+ * common.miRequestContext if nothing is ahead of it, otherwise it waits its turn.
+ */
+static MI_Boolean _QueueReceiveContext(ReceiveData *receiveData, MI_Context *context)
+{
+    MI_Uint32 index;
+
+    Lock_Acquire(&receiveData->pendingContextsLock);
+    if (receiveData->pendingContextsCount == RECEIVE_MAX_PENDING_CONTEXTS)
+    {
+        Lock_Release(&receiveData->pendingContextsLock);
+        return MI_FALSE;
+    }
+    index = (receiveData->pendingContextsHead + receiveData->pendingContextsCount) % RECEIVE_MAX_PENDING_CONTEXTS;
+    receiveData->pendingContexts[index] = context;
+    receiveData->pendingArrivals[index] = Metrics_Now();
+    receiveData->pendingContextsCount++;
+    Lock_Release(&receiveData->pendingContextsLock);
+    Metrics_GaugeAdd(Metrics_QueuedReceives, 1);
+
+    _PromotePendingReceiveContext(receiveData);
+    return MI_TRUE;
+}
+
+/* _TakePendingReceiveContext
+ * Remove the oldest queued Receive request without promoting it. Used when the receive is
+ * being torn down and every outstanding request needs to be answered.
+ */
+static MI_Context *_TakePendingReceiveContext(ReceiveData *receiveData)
+{
+    MI_Context *context = NULL;
+
+    Lock_Acquire(&receiveData->pendingContextsLock);
+    if (receiveData->pendingContextsCount)
+    {
+        context = receiveData->pendingContexts[receiveData->pendingContextsHead];
+        receiveData->pendingContexts[receiveData->pendingContextsHead] = NULL;
+        receiveData->pendingContextsHead = (receiveData->pendingContextsHead + 1) % RECEIVE_MAX_PENDING_CONTEXTS;
+        receiveData->pendingContextsCount--;
+    }
+    Lock_Release(&receiveData->pendingContextsLock);
+
+    if (context)
+        Metrics_GaugeAdd(Metrics_QueuedReceives, -1);
+    return context;
+}
+
 /* Shell_Invoke_Receive
  * This gets called to queue up a receive of output from the provider when there is enough
  * data to send.
@@ -1820,7 +3217,7 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
         const Shell_Receive* in)
 {
     MI_Result miResult = MI_RESULT_OK;
-    ShellData *shellData = FindShellFromSelf(self, instanceName->ShellId.value);
+    ShellData *shellData = FindActiveShellFromSelf(self, instanceName->ShellId.value);
     CommandData *commandData = NULL;
     ReceiveData *receiveData = NULL;
     Batch *batch = NULL;
@@ -1834,7 +3231,7 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
         GOTO_ERROR("Failed to find shell", MI_RESULT_NOT_FOUND);
     }
 
-    if (shellData->connectedState != Connected)
+    if (Atomic_Read(&shellData->connectedState) != Connected)
     {
         GOTO_ERROR("Shell is in disconnected state", MI_RESULT_NOT_SUPPORTED);
     }
@@ -1880,9 +3277,10 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
 
     if (receiveData)
     {
-        /* We already have a Receive queued up with the plug-in so cache the context and wake it up in case it is waiting for it */
-        MI_Context *tmpContext = (MI_Context*) Atomic_Swap((ptrdiff_t*) &receiveData->common.miRequestContext, (ptrdiff_t) context);
-        if (tmpContext != NULL)
+        /* We already have a Receive queued up with the plug-in so cache the context and wake it up in case it is waiting for it.
+         * If the client has pipelined its Receive requests the previous one may still be waiting, in which case this one queues behind it.
+         */
+        if (!_QueueReceiveContext(receiveData, context))
         {
             GOTO_ERROR("Receive is still processing a command so cannot process another one yet", MI_RESULT_NOT_SUPPORTED);
         }
@@ -1896,6 +3294,10 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
 
         Sem_Post(&receiveData->timeoutSemaphore, 1);   /* Wake up thread to reset timer */
         CondLock_Broadcast((ptrdiff_t)&receiveData->common.miRequestContext); /* Broadcast in case we have thread waiting for context */
+
+        /* Output held while the client was away goes out first */
+        _DrainBufferedOutput(receiveData);
+        CommonData_Release(&shellData->common);
         return;
     }
 
@@ -1941,8 +3343,13 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
 
     receiveData->common.refcount = 1;
     receiveData->common.miRequestContext = context;
+    Lock_Init(&receiveData->pendingContextsLock);
+    Lock_Init(&receiveData->outputLock);
     receiveData->common.miOperationInstance = clonedIn;
     receiveData->common.requestType = CommonData_Type_Receive;
+    receiveData->common.startTime = Metrics_Now();
+    receiveData->common.traceId = Trace_NextId();
+    receiveData->requestArrival = receiveData->common.startTime;
 
     PrintDataFunctionStart(&receiveData->common, "Shell_Invoke_Receive");
 
@@ -2000,6 +3407,7 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
     }
 
     /* Posting on receive context happens when we get WSManPluginOperationComplete callback to terminate the request or WSManPluginReceiveResult with some data */
+    CommonData_Release(&shellData->common);
     return;
 
 error:
@@ -2013,6 +3421,8 @@ error:
     {
         Batch_Delete(batch);
     }
+    if (shellData)
+        CommonData_Release(&shellData->common);
 }
 
 typedef struct _SignalParams
@@ -2028,6 +3438,8 @@ typedef struct _SignalParams
 PAL_Uint32  _CallSignal(void *_params)
 {
     SignalParams *params = (SignalParams*) _params;
+
+    TraceRequest((CommonData*) params->requestDetails, Trace_PluginCall, 0);
     params->self->managedPointers.wsManPluginSignalFuncPtr(
             params->self,
             params->requestDetails,
@@ -2047,6 +3459,8 @@ MI_Boolean CallSignal(
         _In_ MI_Char16 *code)
 {
     SignalParams *params = malloc(sizeof(SignalParams));
+
+    TraceRequest((CommonData*) requestDetails, Trace_Invoke, 0);
     if (params)
     {
         params->self = self;
@@ -2076,7 +3490,7 @@ void MI_CALL Shell_Invoke_Signal(Shell_Self* self, MI_Context* context,
         const Shell_Signal* in)
 {
     MI_Result miResult = MI_RESULT_OK;
-    ShellData *shellData = FindShellFromSelf(self, instanceName->ShellId.value);
+    ShellData *shellData = FindActiveShellFromSelf(self, instanceName->ShellId.value);
     CommandData *commandData = NULL;
     SignalData *signalData = NULL;
     Batch *batch = NULL;
@@ -2139,6 +3553,8 @@ void MI_CALL Shell_Invoke_Signal(Shell_Self* self, MI_Context* context,
     signalData->common.miRequestContext = context;
     signalData->common.miOperationInstance = clonedIn;
     signalData->common.requestType = CommonData_Type_Signal;
+    signalData->common.startTime = Metrics_Now();
+    signalData->common.traceId = Trace_NextId();
 
     {
         void *providerShellContext = shellData->pluginShellContext;
@@ -2182,6 +3598,7 @@ void MI_CALL Shell_Invoke_Signal(Shell_Self* self, MI_Context* context,
     }
 
     /* Posting on signal context happens when we get a WSManPluginOperationComplete callback */
+    CommonData_Release(&shellData->common);
     return;
 
 error:
@@ -2194,6 +3611,8 @@ error:
     {
         Batch_Delete(batch);
     }
+    if (shellData)
+        CommonData_Release(&shellData->common);
 }
 
 void MI_CALL Shell_Invoke_Disconnect(
@@ -2206,7 +3625,7 @@ void MI_CALL Shell_Invoke_Disconnect(
     const Shell_Disconnect* in)
 {
     MI_Result miResult = MI_RESULT_OK;
-    ShellData *shellData = FindShellFromSelf(self, instanceName->ShellId.value);
+    ShellData *shellData = FindActiveShellFromSelf(self, instanceName->ShellId.value);
     Shell_Disconnect resultInstance;
     char *errorMessage = NULL;
 
@@ -2217,15 +3636,17 @@ void MI_CALL Shell_Invoke_Disconnect(
         GOTO_ERROR("Failed to find shell", MI_RESULT_NOT_FOUND);
     }
 
-    /* TODO: HANDLE SHELL TIMEOUT */
-
+    /* The client says how long the shell may stay disconnected, within psrpmaxidletimeout */
+    shellData->disconnectedTimeout = EffectiveIdleTimeout(self,
+        in->IdleTimeOut.exists ? MicrosecondsFromInterval(&in->IdleTimeOut.value) : shellData->idleTimeout);
 
     /* Mark the shell as disconnected so any other operations will fail until they are reconnected */
     {
         MI_Value value;
         value.string = MI_T("Disconnected");
         MI_Instance_SetElement(shellData->common.miOperationInstance, MI_T("State"), &value, MI_STRING, 0);
-        shellData->connectedState = Disconnected;
+        Atomic_Swap(&shellData->connectedState, Disconnected);
+        WakeIdleReaper(self);
     }
 
     /* Enumerate through the nested Receive operations to disconnect them */
@@ -2243,6 +3664,13 @@ void MI_CALL Shell_Invoke_Disconnect(
                     MI_Context_PostError(miContext, ERROR_WSMAN_SERVICE_STREAM_DISCONNECTED, MI_RESULT_TYPE_WINRM, MI_T("The WS-Management service cannot process the request because the stream is currently disconnected."));
                     _ShutdownReceiveTimeoutThread((ReceiveData*)child);
                 }
+                while ((miContext = _TakePendingReceiveContext((ReceiveData*)child)) != NULL)
+                {
+                    MI_Context_PostError(miContext, ERROR_WSMAN_SERVICE_STREAM_DISCONNECTED, MI_RESULT_TYPE_WINRM, MI_T("The WS-Management service cannot process the request because the stream is currently disconnected."));
+                }
+
+                /* A plugin thread waiting for a Receive request can hold its output now */
+                CondLock_Broadcast((ptrdiff_t)&child->miRequestContext);
             }
             else if (child->requestType == CommonData_Type_Command)
             {
@@ -2258,6 +3686,11 @@ void MI_CALL Shell_Invoke_Disconnect(
                         {
                             MI_Context_PostError(miContext, ERROR_WSMAN_SERVICE_STREAM_DISCONNECTED, MI_RESULT_TYPE_WINRM, MI_T("The WS-Management service cannot process the request because the stream is currently disconnected."));
                         }
+                        while ((miContext = _TakePendingReceiveContext((ReceiveData*)commandChild)) != NULL)
+                        {
+                            MI_Context_PostError(miContext, ERROR_WSMAN_SERVICE_STREAM_DISCONNECTED, MI_RESULT_TYPE_WINRM, MI_T("The WS-Management service cannot process the request because the stream is currently disconnected."));
+                        }
+                        CondLock_Broadcast((ptrdiff_t)&commandChild->miRequestContext);
                     }
                     commandChild = commandChild->siblingData;
                 }
@@ -2288,6 +3721,8 @@ error:
         MI_Context_PostError(context, miResult, MI_RESULT_TYPE_MI, errorMessage);
     }
     __LOGD(("Shell_Invoke_Disconnect PostResult %p, %u", context, miResult));
+    if (shellData)
+        CommonData_Release(&shellData->common);
 
 }
 
@@ -2301,7 +3736,7 @@ void MI_CALL Shell_Invoke_Reconnect(
     const Shell_Reconnect* in)
 {
     MI_Result miResult = MI_RESULT_OK;
-    ShellData *shellData = FindShellFromSelf(self, instanceName->ShellId.value);
+    ShellData *shellData = FindActiveShellFromSelf(self, instanceName->ShellId.value);
     Shell_Reconnect resultInstance;
     char *errorMessage = NULL;
 
@@ -2317,7 +3752,8 @@ void MI_CALL Shell_Invoke_Reconnect(
         MI_Value value;
         value.string = MI_T("Connected");
         MI_Instance_SetElement(shellData->common.miOperationInstance, MI_T("State"), &value, MI_STRING, 0);
-        shellData->connectedState = Connected;
+        Atomic_Swap(&shellData->connectedState, Connected);
+        WakeIdleReaper(self);
     }
 
 error:
@@ -2339,6 +3775,8 @@ error:
         MI_Context_PostError(context, miResult, MI_RESULT_TYPE_MI, errorMessage);
     }
     __LOGD(("Shell_Invoke_Reconnect PostResult %p, %u", context, miResult));
+    if (shellData)
+        CommonData_Release(&shellData->common);
 }
 
 typedef struct _ConnectParams
@@ -2355,6 +3793,8 @@ typedef struct _ConnectParams
 PAL_Uint32  _CallConnect(void *_params)
 {
     ConnectParams *params = (ConnectParams*) _params;
+
+    TraceRequest((CommonData*) params->requestDetails, Trace_PluginCall, 0);
     params->self->managedPointers.wsManPluginConnectFuncPtr(
             params->self,
             params->requestDetails,
@@ -2374,6 +3814,8 @@ MI_Boolean CallConnect(
         _In_opt_ WSMAN_DATA *inboundConnectInformation)
 {
     ConnectParams *params = malloc(sizeof(ConnectParams));
+
+    TraceRequest((CommonData*) requestDetails, Trace_Invoke, 0);
     if (params)
     {
         params->self = self;
@@ -2400,7 +3842,7 @@ void MI_CALL Shell_Invoke_Connect(
     const Shell_Connect* in)
 {
     MI_Result miResult = MI_RESULT_OK;
-    ShellData *shellData = FindShellFromSelf(self, instanceName->ShellId.value);
+    ShellData *shellData = FindActiveShellFromSelf(self, instanceName->ShellId.value);
     CommandData *commandData = NULL;
     ConnectData *connectData = NULL;
     Batch *batch = NULL;
@@ -2450,6 +3892,8 @@ void MI_CALL Shell_Invoke_Connect(
     connectData->common.miRequestContext = context;
     connectData->common.miOperationInstance = clonedIn;
     connectData->common.requestType = CommonData_Type_Connect;
+    connectData->common.startTime = Metrics_Now();
+    connectData->common.traceId = Trace_NextId();
 
     /* Copy over in/out streams from shell into connect instance */
     {
@@ -2493,7 +3937,8 @@ void MI_CALL Shell_Invoke_Connect(
             MI_Value value;
             value.string = MI_T("Connected");
             MI_Instance_SetElement(shellData->common.miOperationInstance, MI_T("State"), &value, MI_STRING, 0);
-            shellData->connectedState = Connected;
+            Atomic_Swap(&shellData->connectedState, Connected);
+        WakeIdleReaper(self);
         }
 
 
@@ -2512,6 +3957,7 @@ void MI_CALL Shell_Invoke_Connect(
     }
 
     /* Posting on signal context happens when we get a WSManPluginOperationComplete callback */
+    CommonData_Release(&shellData->common);
     return;
 
 error:
@@ -2524,6 +3970,8 @@ error:
     {
         Batch_Delete(batch);
     }
+    if (shellData)
+        CommonData_Release(&shellData->common);
 }
 
 /* report a shell or command context from the winrm plugin. We use this for future calls into the plugin.
@@ -2541,15 +3989,34 @@ MI_EXPORT  MI_Uint32 MI_CALL WSManPluginReportContext(
     char *errorMessage = NULL;
     MI_Context *miContext = (MI_Context*) Atomic_Swap((ptrdiff_t*)&commonData->miRequestContext, (ptrdiff_t) NULL);
 
+    TraceRequest(commonData, Trace_ReportContext, 0);
     PrintDataFunctionStart(commonData, "WSManPluginReportContext");
     /* Grab the providers context, which may be shell or command, and store it in our object */
     if (commonData->requestType == CommonData_Type_Shell)
     {
-        ((ShellData*)commonData)->pluginShellContext = context;
+        ShellData *shellData = (ShellData*)commonData;
+
+        shellData->pluginShellContext = context;
+
+        if (shellData->isWarmUp)
+        {
+            /* The warm-up shell has done its job, shut it down like a DeleteInstance would */
+            Atomic_Inc(&shellData->common.refcount);
+            if (Thread_CreateDetached(_RecursiveNotifyShutdown, NULL, shellData) != 0)
+            {
+                RecursiveNotifyShutdown(&shellData->common);
+                CommonData_Release(&shellData->common);
+            }
+            PrintDataFunctionEnd(commonData, "WSManPluginReportContext", MI_RESULT_OK);
+            return MI_RESULT_OK;
+        }
+
+        Metrics_GaugeAdd(Metrics_ActiveShells, 1);
     }
     else if (commonData->requestType == CommonData_Type_Command)
     {
         ((CommandData*)commonData)->pluginCommandContext = context;
+        Metrics_GaugeAdd(Metrics_ActiveCommands, 1);
     }
     else
     {
@@ -2565,11 +4032,13 @@ MI_EXPORT  MI_Uint32 MI_CALL WSManPluginReportContext(
     }
     PrintDataFunctionTag(commonData, "WSManPluginReportContext", "PostResult");
     miResult = MI_Context_PostResult(miContext, miResult);
+    Metrics_Observe((Metrics_Operation) commonData->requestType, commonData->startTime, MI_RESULT_OK);
     PrintDataFunctionEnd(commonData, "WSManPluginReportContext", miResult);
     return miResult;
 
 error:
     MI_Context_PostError(miContext, miResult, MI_RESULT_TYPE_MI, errorMessage);
+    Metrics_Observe((Metrics_Operation) commonData->requestType, commonData->startTime, miResult);
     PrintDataFunctionEnd(commonData, "WSManPluginReportContext", miResult);
     return miResult;
 }
@@ -2654,181 +4123,680 @@ MI_Uint32 _WSManPluginReceiveResult(
     PrintDataFunctionStartStr2(commonData, "_WSManPluginReceiveResult", "commandState", commandState, "flags", ReceiveResultsFlags(flags));
 
 
-    /* Clone the result object for Receive because we will reuse it for each receive response */
-//    miResult = Instance_Clone(commonData->miOperationInstance, (MI_Instance**)&receive, NULL);
-    miResult = Instance_NewDynamic(&receive, MI_T("Receive"), MI_FLAG_METHOD, tempBatch);
-    if (miResult != MI_RESULT_OK)
+    /* Clone the result object for Receive because we will reuse it for each receive response */
+//    miResult = Instance_Clone(commonData->miOperationInstance, (MI_Instance**)&receive, NULL);
+    miResult = Instance_NewDynamic(&receive, MI_T("Receive"), MI_FLAG_METHOD, tempBatch);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR_EX("out of memory", miResult, errorSkipInstanceDeletes);
+    }
+
+    miResult =  CommandState_Construct(&commandStateInst, receiveContext);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR_EX("out of memory", miResult, errorSkipInstanceDeletes);
+    }
+    miResult = Stream_Construct(&receiveStream, receiveContext);
+    if (miResult != MI_RESULT_OK)
+    {
+        Stream_Destruct(&receiveStream);
+        GOTO_ERROR_EX("out of memory", miResult, errorSkipInstanceDeletes);
+    }
+
+    /* Set the command ID for the instances that need it */
+    if (MI_Instance_GetElement(commonData->miOperationInstance, MI_T("commandId"), &miValue, NULL, NULL, NULL) == MI_RESULT_OK)
+    {
+        commandId = miValue.string;
+    }
+    if (commandId)
+    {
+        CommandState_SetPtr_commandId(&commandStateInst, commandId);
+        Stream_SetPtr_commandId(&receiveStream, commandId);
+    }
+
+    if (streamResult)
+    {
+        decodeBuffer.buffer = (MI_Char*)streamResult->binaryData.data;
+        decodeBuffer.bufferLength = streamResult->binaryData.dataLength;
+        decodeBuffer.bufferUsed = decodeBuffer.bufferLength;
+        Metrics_Add(Metrics_BytesOut, decodeBuffer.bufferUsed);
+        {
+            ShellData *shellData = GetShellFromOperation(commonData);
+            if (shellData)
+                Metrics_AtomicAdd(&shellData->bytesOut, decodeBuffer.bufferUsed);
+        }
+
+        if (IsStreamCompressed(commonData))
+        {
+            ReceiveData *receiveData = (ReceiveData*)commonData;
+
+            if (!receiveData->compressStreamInitialized)
+            {
+                miResult = CompressStreamInit(&receiveData->compressStream);
+                if (miResult != MI_RESULT_OK)
+                {
+                    decodeBuffer.buffer = NULL;
+                    GOTO_ERROR("CompressStreamInit failed", miResult);
+                }
+                receiveData->compressStreamInitialized = MI_TRUE;
+            }
+
+            /* Re-compress it from decodeBuffer to decodedBuffer. Each result is a PSRP message
+             * boundary so the whole thing is flushed out. The result buffer gets handed over
+             * to us and we need to free it.
+             */
+            miResult = CompressStreamFeed(&receiveData->compressStream, decodeBuffer.buffer, decodeBuffer.bufferUsed);
+            if (miResult == MI_RESULT_OK)
+            {
+                miResult = CompressStreamFinish(&receiveData->compressStream, &decodedBuffer, sizeof(MI_Char));
+            }
+            if (miResult != MI_RESULT_OK)
+            {
+                decodeBuffer.buffer = NULL;
+                GOTO_ERROR("CompressStream failed", miResult);
+            }
+            Metrics_Add(Metrics_UncompressedBytesOut, decodeBuffer.bufferUsed);
+            Metrics_Add(Metrics_CompressedBytesOut, decodedBuffer.bufferUsed);
+
+            /* switch the decodedBuffer back to decodeBuffer for further processing.
+             */
+            decodeBuffer = decodedBuffer;
+        }
+
+        /* NOTE: Base64EncodeBuffer allocates enough space for a NULL terminator */
+        miResult = Base64EncodeBuffer(&decodeBuffer, &decodedBuffer);
+
+        /* Free previously allocated buffer if it was compressed. */
+        if (IsStreamCompressed(commonData))
+        {
+            free(decodeBuffer.buffer);
+        }
+        decodeBuffer.buffer = NULL;
+
+        if (miResult != MI_RESULT_OK)
+        {
+            GOTO_ERROR("Base64EncodeBuffer failed", miResult);
+        }
+
+        /* Set the null terminator on the end of the buffer as this is supposed to be a string*/
+        memset(decodedBuffer.buffer + decodedBuffer.bufferUsed, 0, sizeof(MI_Char));
+
+        /* Add the final string to the stream. This is just a pointer to it and
+        * is not getting copied so we need to delete the buffer after we have posted the instance
+        * to the receive context.
+        */
+        Stream_SetPtr_data(&receiveStream, decodedBuffer.buffer);
+
+        /* Stream holds the results of the inbound/outbound stream. A result can have more
+        * than one stream, either for the same stream or different ones.
+        */
+        if (flags & WSMAN_FLAG_RECEIVE_RESULT_NO_MORE_DATA)
+            Stream_Set_endOfStream(&receiveStream, MI_TRUE);
+        else
+            Stream_Set_endOfStream(&receiveStream, MI_FALSE);
+
+        if (streamName)
+        {
+            Stream_SetPtr_streamName(&receiveStream, streamName);
+        }
+
+        /* Add the stream embedded instance to the receive result.  */
+        {
+            MI_Value miValue;
+            miValue.instance = &receiveStream.__instance;
+            miResult = MI_Instance_AddElement(receive, MI_T("Stream"), &miValue, MI_INSTANCE, MI_FLAG_BORROW | MI_FLAG_OUT | MI_FLAG_PARAMETER);
+            if (miResult != MI_RESULT_OK)
+            {
+                GOTO_ERROR("MI_Instance_AddElement failed", miResult);
+            }
+        }
+    }
+
+    /* CommandState tells the client if we are done or not with this stream.
+    */
+
+    if (commandState &&
+        (Tcscasecmp(commandState, WSMAN_COMMAND_STATE_DONE) == 0))
+    {
+        /* TODO: Mark stream as complete for either shell or command */
+        CommandState_SetPtr_state(&commandStateInst, WSMAN_COMMAND_STATE_DONE);
+    }
+    else if (commandState)
+    {
+        CommandState_SetPtr_state(&commandStateInst, commandState);
+    }
+    else
+    {
+        CommandState_SetPtr_state(&commandStateInst, WSMAN_COMMAND_STATE_RUNNING);
+    }
+
+
+    /* The result of the Receive contains the command results and a set of streams.
+    * We only support one stream at a time for now.
+    */
+    miValue.uint32 = MI_RESULT_OK;
+    miResult = MI_Instance_AddElement(receive, MI_T("MIReturn"), &miValue, MI_UINT32, MI_FLAG_OUT | MI_FLAG_PARAMETER);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("MI_Instance_AddElement failed", miResult);
+    }
+    miValue.instance = &commandStateInst.__instance;
+    miResult = MI_Instance_AddElement(receive, MI_T("CommandState"), &miValue, MI_INSTANCE, MI_FLAG_BORROW | MI_FLAG_OUT | MI_FLAG_PARAMETER);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("MI_Instance_AddElement failed", miResult);
+    }
+
+
+    /* Post the result back to the client. We can delete the base-64 encoded buffer after
+    * posting it.
+    */
+    PrintDataFunctionTag(commonData, "_WSManPluginReceiveResult", "PostInstance");
+    MI_Context_PostInstance(receiveContext, receive);
+
+error:
+    /* Clean up the various result objects */
+    CommandState_Destruct(&commandStateInst);
+    Stream_Destruct(&receiveStream);
+
+errorSkipInstanceDeletes:
+    Metrics_Observe(Metrics_Receive, commonData->startTime, miResult);
+    PrintDataFunctionTag(commonData, "_WSManPluginReceiveResult", "PostResult");
+    if (miResult == MI_RESULT_OK)
+    {
+        MI_Context_PostResult(receiveContext, miResult);
+    }
+    else
+    {
+        MI_Context_PostError(receiveContext, miResult, MI_RESULT_TYPE_MI, errorMessage);
+    }
+
+
+    if (tempBatch)
+        Batch_Delete(tempBatch);
+
+    if (decodedBuffer.buffer)
+        free(decodedBuffer.buffer);
+
+    PrintDataFunctionEnd(commonData, "_WSManPluginReceiveResult", miResult);
+    return (MI_Uint32) miResult;
+
+}
+
+/* Map at least size bytes of the spill file, a whole number of chunks. The mapping may move, so
+ * only while nothing is draining.
+ */
+static MI_Boolean _MapSpill(ReceiveData *receiveData, MI_Uint64 size)
+{
+    void *spill;
+
+    size = ((size + DISCONNECT_SPILL_CHUNK - 1) / DISCONNECT_SPILL_CHUNK) * DISCONNECT_SPILL_CHUNK;
+#if defined(__linux__)
+    if (receiveData->spill)
+        spill = mremap(receiveData->spill, (size_t) receiveData->spillSize, (size_t) size, MREMAP_MAYMOVE);
+    else
+#endif
+        spill = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, receiveData->spillFd, 0);
+    if (spill == MAP_FAILED)
+    {
+        __LOGE(("_MapSpill - failed to map %llu bytes of spill file (errno=%d)", (unsigned long long) size, errno));
+        return MI_FALSE;
+    }
+#if !defined(__linux__)
+    if (receiveData->spill)
+        munmap(receiveData->spill, (size_t) receiveData->spillSize);
+#endif
+    receiveData->spill = (MI_Uint8*) spill;
+    receiveData->spillSize = size;
+    return MI_TRUE;
+}
+
+/* Open the receive's spill file. It is unlinked straight away so it goes when we do, and only
+ * appended to with pwrite so a full disk is an error rather than a SIGBUS through the mapping.
+ */
+static MI_Boolean _OpenSpill(ReceiveData *receiveData, MI_Uint64 size)
+{
+    const char *directory = getenv("TMPDIR");
+    char path[PAL_MAX_PATH_SIZE];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/psrpspill.XXXXXX", (directory && *directory) ? directory : "/tmp");
+    fd = mkstemp(path);
+    if (fd < 0)
+    {
+        __LOGE(("_OpenSpill - failed to create spill file in %s (errno=%d)", path, errno));
+        return MI_FALSE;
+    }
+    unlink(path);
+
+    receiveData->spillFd = fd;
+    receiveData->spill = NULL;
+    if (!_MapSpill(receiveData, size))
+    {
+        close(fd);
+        return MI_FALSE;
+    }
+    receiveData->spillUsed = 0;
+    receiveData->spillDelivered = 0;
+    receiveData->spillTrimmed = 0;
+    return MI_TRUE;
+}
+
+/* Give back the part of the spill file that has been delivered once there is a chunk of it.
+ * Called by the draining thread, which is what keeps the file open.
+ */
+static void _TrimSpill(ReceiveData *receiveData)
+{
+#if defined(FALLOC_FL_PUNCH_HOLE)
+    MI_Uint64 end = receiveData->spillDelivered - (receiveData->spillDelivered % DISCONNECT_SPILL_CHUNK);
+
+    if ((receiveData->spill == NULL) || (end <= receiveData->spillTrimmed))
+        return;
+
+    /* Punching out the file also drops the pages from the mapping */
+    if (fallocate(receiveData->spillFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            (off_t) receiveData->spillTrimmed, (off_t) (end - receiveData->spillTrimmed)) != 0)
+    {
+        __LOGD(("_TrimSpill - failed to give back spill file space (errno=%d)", errno));
+        return;
+    }
+    receiveData->spillTrimmed = end;
+#endif
+}
+
+/* Close the spill file once nothing in it is needed. Called with outputLock held and nothing
+ * draining, or once the receive is complete.
+ */
+static void _CloseSpill(ReceiveData *receiveData)
+{
+    if (receiveData->spill == NULL)
+        return;
+    munmap(receiveData->spill, (size_t) receiveData->spillSize);
+    close(receiveData->spillFd);
+    receiveData->spill = NULL;
+    receiveData->spillUsed = 0;
+}
+
+/* Append spilled output, growing the file and the mapping as needed. size is the most the file
+ * may hold before it is emptied. Called with outputLock held.
+ */
+static MI_Boolean _SpillWrite(ReceiveData *receiveData, MI_Uint64 size, const MI_Uint8 *data, MI_Uint32 length, MI_Uint64 *offset)
+{
+    MI_Uint32 written = 0;
+
+    if (receiveData->spillUsed + length > size)
+        return MI_FALSE;
+    if ((receiveData->spill == NULL) && !_OpenSpill(receiveData, length))
+        return MI_FALSE;
+
+    /* The draining thread reads the mapping without outputLock, so it cannot move under it. The
+     * result waits for the drain like it would for room.
+     */
+    if (receiveData->spillUsed + length > receiveData->spillSize)
+    {
+        if (receiveData->draining || !_MapSpill(receiveData, receiveData->spillUsed + length))
+            return MI_FALSE;
+    }
+
+    while (written != length)
+    {
+        ssize_t ret = pwrite(receiveData->spillFd, data + written, length - written, (off_t) (receiveData->spillUsed + written));
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            __LOGE(("_SpillWrite - failed to write spill file (errno=%d)", errno));
+            return MI_FALSE;
+        }
+        written += (MI_Uint32) ret;
+    }
+    *offset = receiveData->spillUsed;
+    receiveData->spillUsed += length;
+    return MI_TRUE;
+}
+
+static void _FreeBufferedOutput(ShellData *shellData, BufferedOutput *item)
+{
+    while (item)
+    {
+        BufferedOutput *next = item->next;
+
+        if (shellData)
+        {
+            Metrics_AtomicAdd(&shellData->bufferedBytes, -(ptrdiff_t) item->bufferedSize);
+            if (item->spilled)
+                Metrics_AtomicAdd(&shellData->spilledBytes, -(ptrdiff_t) item->dataLength);
+        }
+        free(item);
+        item = next;
+    }
+}
+
+/* _BufferReceiveResult
+ * Hold on to a result rather than waiting for a Receive request, if the shell is disconnected
+ * or older output is still held, so it goes out in order once the client is back. Returns
+ * MI_FALSE if it has to go out the usual way, either because it does not need holding or
+ * because the limits are reached. Called with outputLock held.
+ */
+static MI_Boolean _BufferReceiveResult(
+    ReceiveData *receiveData,
+    MI_Uint32 flags,
+    const MI_Char16 *streamName,
+    WSMAN_DATA *streamResult,
+    const MI_Char16 *commandState,
+    MI_Uint32 exitCode)
+{
+    ShellData *shellData = GetShellFromOperation(&receiveData->common);
+    Shell_Self *self;
+    BufferedOutput *item;
+    size_t nameBytes = streamName ? Utf16LeStrLenBytes(streamName) : 0;
+    size_t stateBytes = commandState ? Utf16LeStrLenBytes(commandState) : 0;
+    MI_Uint32 dataLength = streamResult ? streamResult->binaryData.dataLength : 0;
+    MI_Boolean spilled = MI_FALSE;
+    size_t size;
+
+    /* The shell is going away and nobody is coming back for it */
+    if (receiveData->discardOutput)
+        return MI_TRUE;
+
+    if ((shellData == NULL) || (shellData->shell->disconnectBufferSize == 0))
+        return MI_FALSE;
+    if ((receiveData->outputHead == NULL) && (Atomic_Read(&shellData->connectedState) == Connected))
+        return MI_FALSE;
+    self = shellData->shell;
+
+    /* The data goes to the spill file if it does not fit in memory, the rest still has to */
+    size = sizeof(BufferedOutput) + nameBytes + stateBytes;
+    if ((MI_Uint64) shellData->bufferedBytes + size + dataLength > self->disconnectBufferSize)
     {
-        GOTO_ERROR_EX("out of memory", miResult, errorSkipInstanceDeletes);
+        if ((dataLength == 0) ||
+            ((MI_Uint64) shellData->bufferedBytes + size > self->disconnectBufferSize) ||
+            ((MI_Uint64) shellData->spilledBytes + dataLength > self->disconnectSpillSize))
+        {
+            return MI_FALSE;
+        }
+        spilled = MI_TRUE;
+    }
+    else
+    {
+        size += dataLength;
     }
 
-    miResult =  CommandState_Construct(&commandStateInst, receiveContext);
-    if (miResult != MI_RESULT_OK)
+    item = malloc(size);
+    if (item == NULL)
+        return MI_FALSE;
+    memset(item, 0, sizeof(BufferedOutput));
+    item->flags = flags;
+    item->exitCode = exitCode;
+    item->hasData = streamResult != NULL;
+    item->dataLength = dataLength;
+    item->bufferedSize = size;
+    if (streamName)
     {
-        GOTO_ERROR_EX("out of memory", miResult, errorSkipInstanceDeletes);
+        item->streamName = (MI_Char16*) (item + 1);
+        memcpy(item->streamName, streamName, nameBytes);
     }
-    miResult = Stream_Construct(&receiveStream, receiveContext);
-    if (miResult != MI_RESULT_OK)
+    if (commandState)
     {
-        Stream_Destruct(&receiveStream);
-        GOTO_ERROR_EX("out of memory", miResult, errorSkipInstanceDeletes);
+        item->commandState = (MI_Char16*) ((MI_Uint8*) (item + 1) + nameBytes);
+        memcpy(item->commandState, commandState, stateBytes);
     }
 
-    /* Set the command ID for the instances that need it */
-    if (MI_Instance_GetElement(commonData->miOperationInstance, MI_T("commandId"), &miValue, NULL, NULL, NULL) == MI_RESULT_OK)
+    if (spilled)
     {
-        commandId = miValue.string;
+        if (!_SpillWrite(receiveData, self->disconnectSpillSize, streamResult->binaryData.data, dataLength, &item->spillOffset))
+        {
+            free(item);
+            return MI_FALSE;
+        }
+        item->spilled = MI_TRUE;
+        Metrics_AtomicAdd(&shellData->spilledBytes, dataLength);
+        Metrics_Add(Metrics_SpilledBytes, dataLength);
     }
-    if (commandId)
+    else if (dataLength)
     {
-        CommandState_SetPtr_commandId(&commandStateInst, commandId);
-        Stream_SetPtr_commandId(&receiveStream, commandId);
+        item->data = (MI_Uint8*) (item + 1) + nameBytes + stateBytes;
+        memcpy(item->data, streamResult->binaryData.data, dataLength);
     }
+    Metrics_AtomicAdd(&shellData->bufferedBytes, (ptrdiff_t) size);
+    Metrics_Add(Metrics_BufferedBytes, dataLength);
 
-    if (streamResult)
+    if (receiveData->outputTail)
+        receiveData->outputTail->next = item;
+    else
+        receiveData->outputHead = item;
+    receiveData->outputTail = item;
+    return MI_TRUE;
+}
+
+/* Whether next can go out in the same Receive as item */
+static MI_Boolean _CanCoalesce(const BufferedOutput *item, const BufferedOutput *next)
+{
+    size_t nameBytes;
+
+    if (!item->hasData || !next->hasData || item->commandState ||
+        (item->flags & WSMAN_FLAG_RECEIVE_RESULT_NO_MORE_DATA) ||
+        ((item->streamName == NULL) != (next->streamName == NULL)))
     {
-        decodeBuffer.buffer = (MI_Char*)streamResult->binaryData.data;
-        decodeBuffer.bufferLength = streamResult->binaryData.dataLength;
-        decodeBuffer.bufferUsed = decodeBuffer.bufferLength;
+        return MI_FALSE;
+    }
+    if (item->streamName == NULL)
+        return MI_TRUE;
 
-        if (IsStreamCompressed(commonData))
-        {
-            /* Re-compress it from decodeBuffer to decodedBuffer. The result buffer
-             * gets allocated in this function and we need to free it.
-             */
-            miResult = CompressBuffer(&decodeBuffer, &decodedBuffer, sizeof(MI_Char));
-            if (miResult != MI_RESULT_OK)
-            {
-                decodeBuffer.buffer = NULL;
-                GOTO_ERROR("CompressBuffer failed", miResult);
-            }
+    nameBytes = Utf16LeStrLenBytes(item->streamName);
+    return (nameBytes == Utf16LeStrLenBytes(next->streamName)) &&
+           (memcmp(item->streamName, next->streamName, nameBytes) == 0);
+}
 
-            /* switch the decodedBuffer back to decodeBuffer for further processing.
-             */
-            decodeBuffer = decodedBuffer;
-        }
+static const MI_Uint8 *_BufferedData(ReceiveData *receiveData, const BufferedOutput *item)
+{
+    return item->spilled ? receiveData->spill + item->spillOffset : item->data;
+}
 
-        /* NOTE: Base64EncodeBuffer allocates enough space for a NULL terminator */
-        miResult = Base64EncodeBuffer(&decodeBuffer, &decodedBuffer);
+/* Take the oldest held output off the list along with whatever can be coalesced with it. The
+ * data is joined into a new buffer if there is more than one, otherwise it is used where it is.
+ * Called with outputLock held by the draining thread.
+ */
+static BufferedOutput *_TakeBufferedOutput(ReceiveData *receiveData, MI_Uint8 **joined, MI_Uint32 *dataLength)
+{
+    BufferedOutput *first = receiveData->outputHead;
+    BufferedOutput *last = first;
+    BufferedOutput *item;
+    MI_Uint32 total = first->dataLength;
 
-        /* Free previously allocated buffer if it was compressed. */
-        if (IsStreamCompressed(commonData))
+    while (last->next && _CanCoalesce(last, last->next) &&
+           (total + last->next->dataLength <= DISCONNECT_COALESCE_BYTES))
+    {
+        last = last->next;
+        total += last->dataLength;
+    }
+
+    *joined = NULL;
+    if (last != first)
+    {
+        *joined = malloc(total);
+        if (*joined == NULL)
         {
-            free(decodeBuffer.buffer);
+            last = first;
+            total = first->dataLength;
         }
-        decodeBuffer.buffer = NULL;
+    }
 
-        if (miResult != MI_RESULT_OK)
+    receiveData->outputHead = last->next;
+    if (receiveData->outputHead == NULL)
+        receiveData->outputTail = NULL;
+    last->next = NULL;
+
+    if (*joined)
+    {
+        MI_Uint32 offset = 0;
+        for (item = first; item; item = item->next)
         {
-            GOTO_ERROR("Base64EncodeBuffer failed", miResult);
+            memcpy(*joined + offset, _BufferedData(receiveData, item), item->dataLength);
+            offset += item->dataLength;
         }
+    }
+    *dataLength = total;
+    return first;
+}
 
-        /* Set the null terminator on the end of the buffer as this is supposed to be a string*/
-        memset(decodedBuffer.buffer + decodedBuffer.bufferUsed, 0, sizeof(MI_Char));
+/* _DrainBufferedOutput
+ * Answer Receive requests from held output for as long as there are both, then finish a
+ * completion that was waiting for the output to go. Only one thread drains at a time, any
+ * other just leaves it to that one.
+ */
+static void _DrainBufferedOutput(ReceiveData *receiveData)
+{
+    ShellData *shellData = GetShellFromOperation(&receiveData->common);
+    MI_Boolean complete = MI_FALSE;
 
-        /* Add the final string to the stream. This is just a pointer to it and
-        * is not getting copied so we need to delete the buffer after we have posted the instance
-        * to the receive context.
-        */
-        Stream_SetPtr_data(&receiveStream, decodedBuffer.buffer);
+    Lock_Acquire(&receiveData->outputLock);
+    if (receiveData->draining)
+    {
+        Lock_Release(&receiveData->outputLock);
+        return;
+    }
+    receiveData->draining = MI_TRUE;
 
-        /* Stream holds the results of the inbound/outbound stream. A result can have more
-        * than one stream, either for the same stream or different ones.
-        */
-        if (flags & WSMAN_FLAG_RECEIVE_RESULT_NO_MORE_DATA)
-            Stream_Set_endOfStream(&receiveStream, MI_TRUE);
-        else
-            Stream_Set_endOfStream(&receiveStream, MI_FALSE);
+    for (;;)
+    {
+        MI_Context *miContext = NULL;
+        BufferedOutput *items, *last, *item;
+        MI_Uint8 *joined;
+        MI_Uint32 dataLength;
+        WSMAN_DATA streamResult;
 
-        if (streamName)
+        if (receiveData->outputHead)
         {
-            Stream_SetPtr_streamName(&receiveStream, streamName);
+            miContext = (MI_Context *) Atomic_Swap((ptrdiff_t*)&receiveData->common.miRequestContext, (ptrdiff_t) NULL);
         }
+        if (miContext == NULL)
+            break;
 
-        /* Add the stream embedded instance to the receive result.  */
+        items = _TakeBufferedOutput(receiveData, &joined, &dataLength);
+        Lock_Release(&receiveData->outputLock);
+
+        for (last = items; last->next; last = last->next)
+            ;
+        memset(&streamResult, 0, sizeof(streamResult));
+        streamResult.type = WSMAN_DATA_TYPE_BINARY;
+        streamResult.binaryData.data = joined ? joined : (MI_Uint8*) _BufferedData(receiveData, items);
+        streamResult.binaryData.dataLength = dataLength;
+
+        Sem_Post(&receiveData->timeoutSemaphore, 1);
+        TraceRequest(&receiveData->common, Trace_ReceiveResult, dataLength);
+        _WSManPluginReceiveResult(miContext, &receiveData->common, last->flags, items->streamName,
+            items->hasData ? &streamResult : NULL, last->commandState, last->exitCode);
+        free(joined);
+        for (item = items; item; item = item->next)
         {
-            MI_Value miValue;
-            miValue.instance = &receiveStream.__instance;
-            miResult = MI_Instance_AddElement(receive, MI_T("Stream"), &miValue, MI_INSTANCE, MI_FLAG_BORROW | MI_FLAG_OUT | MI_FLAG_PARAMETER);
-            if (miResult != MI_RESULT_OK)
-            {
-                GOTO_ERROR("MI_Instance_AddElement failed", miResult);
-            }
+            if (item->spilled)
+                receiveData->spillDelivered = item->spillOffset + item->dataLength;
         }
-    }
+        _TrimSpill(receiveData);
+        _FreeBufferedOutput(shellData, items);
+        _PromotePendingReceiveContext(receiveData);
 
-    /* CommandState tells the client if we are done or not with this stream.
-    */
+        /* A plugin thread may be waiting for room */
+        CondLock_Broadcast((ptrdiff_t)&receiveData->common.miRequestContext);
 
-    if (commandState &&
-        (Tcscasecmp(commandState, WSMAN_COMMAND_STATE_DONE) == 0))
-    {
-        /* TODO: Mark stream as complete for either shell or command */
-        CommandState_SetPtr_state(&commandStateInst, WSMAN_COMMAND_STATE_DONE);
+        Lock_Acquire(&receiveData->outputLock);
     }
-    else if (commandState)
+
+    receiveData->draining = MI_FALSE;
+    if (receiveData->outputHead == NULL)
     {
-        CommandState_SetPtr_state(&commandStateInst, commandState);
+        _CloseSpill(receiveData);
+        complete = receiveData->completePending;
+        receiveData->completePending = MI_FALSE;
     }
-    else
+    Lock_Release(&receiveData->outputLock);
+
+    if (complete)
     {
-        CommandState_SetPtr_state(&commandStateInst, WSMAN_COMMAND_STATE_RUNNING);
+        PrintDataFunctionTag(&receiveData->common, "_DrainBufferedOutput", "Held output delivered, completing");
+        WSManPluginOperationComplete(&receiveData->common.pluginRequest, 0, receiveData->completeErrorCode, NULL);
     }
+}
 
+/* _DeferReceiveComplete
+ * Hold back the plugin completing a receive while it still has output to deliver, unless the
+ * shell is going away, in which case the output is dropped instead. Returns MI_TRUE if the
+ * completion is left for _DrainBufferedOutput.
+ */
+static MI_Boolean _DeferReceiveComplete(ReceiveData *receiveData, MI_Uint32 errorCode)
+{
+    ShellData *shellData = GetShellFromOperation(&receiveData->common);
+    BufferedOutput *discarded = NULL;
+    MI_Boolean deferred = MI_FALSE;
 
-    /* The result of the Receive contains the command results and a set of streams.
-    * We only support one stream at a time for now.
-    */
-    miValue.uint32 = MI_RESULT_OK;
-    miResult = MI_Instance_AddElement(receive, MI_T("MIReturn"), &miValue, MI_UINT32, MI_FLAG_OUT | MI_FLAG_PARAMETER);
-    if (miResult != MI_RESULT_OK)
+    Lock_Acquire(&receiveData->outputLock);
+    if ((shellData == NULL) || shellData->reaped || shellData->deleteInstanceContext)
     {
-        GOTO_ERROR("MI_Instance_AddElement failed", miResult);
+        receiveData->discardOutput = MI_TRUE;
+        discarded = receiveData->outputHead;
+        receiveData->outputHead = receiveData->outputTail = NULL;
     }
-    miValue.instance = &commandStateInst.__instance;
-    miResult = MI_Instance_AddElement(receive, MI_T("CommandState"), &miValue, MI_INSTANCE, MI_FLAG_BORROW | MI_FLAG_OUT | MI_FLAG_PARAMETER);
-    if (miResult != MI_RESULT_OK)
+    if (receiveData->outputHead || receiveData->draining)
     {
-        GOTO_ERROR("MI_Instance_AddElement failed", miResult);
+        receiveData->completePending = MI_TRUE;
+        receiveData->completeErrorCode = errorCode;
+        deferred = MI_TRUE;
     }
+    Lock_Release(&receiveData->outputLock);
 
-
-    /* Post the result back to the client. We can delete the base-64 encoded buffer after
-    * posting it.
-    */
-    PrintDataFunctionTag(commonData, "_WSManPluginReceiveResult", "PostInstance");
-    MI_Context_PostInstance(receiveContext, receive);
-
-error:
-    /* Clean up the various result objects */
-    CommandState_Destruct(&commandStateInst);
-    Stream_Destruct(&receiveStream);
-
-errorSkipInstanceDeletes:
-    PrintDataFunctionTag(commonData, "_WSManPluginReceiveResult", "PostResult");
-    if (miResult == MI_RESULT_OK)
+    _FreeBufferedOutput(shellData, discarded);
+    if (deferred)
     {
-        MI_Context_PostResult(receiveContext, miResult);
+        PrintDataFunctionTag(&receiveData->common, "WSManPluginOperationComplete", "Deferred until held output is delivered");
     }
-    else
+    return deferred;
+}
+
+/* _DiscardBufferedOutput
+ * Drop held output because the shell is shutting down. Anything still trying to produce output
+ * is let go. Returns MI_TRUE if this completed the receive, which means it is gone.
+ */
+static MI_Boolean _DiscardBufferedOutput(ReceiveData *receiveData)
+{
+    ShellData *shellData = GetShellFromOperation(&receiveData->common);
+    BufferedOutput *discarded;
+    MI_Boolean complete = MI_FALSE;
+
+    Lock_Acquire(&receiveData->outputLock);
+    receiveData->discardOutput = MI_TRUE;
+    discarded = receiveData->outputHead;
+    receiveData->outputHead = receiveData->outputTail = NULL;
+    if (!receiveData->draining)
     {
-        MI_Context_PostError(receiveContext, miResult, MI_RESULT_TYPE_MI, errorMessage);
+        complete = receiveData->completePending;
+        receiveData->completePending = MI_FALSE;
     }
+    Lock_Release(&receiveData->outputLock);
 
+    _FreeBufferedOutput(shellData, discarded);
+    CondLock_Broadcast((ptrdiff_t)&receiveData->common.miRequestContext);
 
-    if (tempBatch)
-        Batch_Delete(tempBatch);
-
-    if (decodedBuffer.buffer)
-        free(decodedBuffer.buffer);
+    if (complete)
+    {
+        WSManPluginOperationComplete(&receiveData->common.pluginRequest, 0, receiveData->completeErrorCode, NULL);
+    }
+    return complete;
+}
 
-    PrintDataFunctionEnd(commonData, "_WSManPluginReceiveResult", miResult);
-    return (MI_Uint32) miResult;
+/* Whether another Receive request is queued behind the current one */
+static MI_Boolean _ReceiveQueued(ReceiveData *receiveData)
+{
+    MI_Boolean queued;
 
+    Lock_Acquire(&receiveData->pendingContextsLock);
+    queued = (receiveData->pendingContextsCount != 0);
+    Lock_Release(&receiveData->pendingContextsLock);
+    return queued;
 }
 
-MI_EXPORT  MI_Uint32 MI_CALL WSManPluginReceiveResult(
-    _In_ WSMAN_PLUGIN_REQUEST *requestDetails,
+static MI_Uint32 _DeliverReceiveResult(
+    _In_ ReceiveData *receiveData,
     _In_ MI_Uint32 flags,
     _In_opt_ const MI_Char16 * streamName,
     _In_opt_ WSMAN_DATA *streamResult,
@@ -2836,26 +4804,50 @@ MI_EXPORT  MI_Uint32 MI_CALL WSManPluginReceiveResult(
     _In_ MI_Uint32 exitCode
     )
 {
-    ReceiveData *receiveData = (ReceiveData*)requestDetails;
-    MI_Context *miContext;
+    MI_Context *miContext = NULL;
     MI_Result miResult = MI_RESULT_FAILED;
+    MI_Boolean buffered = MI_FALSE;
 
 
-    /* Wait for a Receive request to come in before we post the result back */
-    do
+    /* Wait for a Receive request to come in before we post the result back, unless the result
+     * can be held for a disconnected client. Held output always goes first.
+     */
+    Metrics_GaugeAdd(Metrics_WaitingResults, 1);
+    for (;;)
     {
-    } while (CondLock_Wait((ptrdiff_t)&receiveData->common.miRequestContext,
-                           (ptrdiff_t*)&receiveData->common.miRequestContext,
-                           0,
-                           CONDLOCK_DEFAULT_SPINCOUNT) == 0);
+        Lock_Acquire(&receiveData->outputLock);
+        buffered = _BufferReceiveResult(receiveData, flags, streamName, streamResult, commandState, exitCode);
+        if (!buffered && (receiveData->outputHead == NULL))
+        {
+            miContext = (MI_Context *) Atomic_Swap((ptrdiff_t*)&receiveData->common.miRequestContext, (ptrdiff_t) NULL);
+        }
+        Lock_Release(&receiveData->outputLock);
+        if (buffered || miContext)
+            break;
+
+        _DrainBufferedOutput(receiveData);
+        CondLock_Wait((ptrdiff_t)&receiveData->common.miRequestContext,
+                      (ptrdiff_t*)&receiveData->common.miRequestContext,
+                      0,
+                      CONDLOCK_DEFAULT_SPINCOUNT);
+    }
+    Metrics_GaugeAdd(Metrics_WaitingResults, -1);
 
     PrintDataFunctionStart(&receiveData->common, "WSManPluginReceiveResult");
 
-    miContext = (MI_Context *) Atomic_Swap((ptrdiff_t*)&receiveData->common.miRequestContext, (ptrdiff_t) NULL);
-    if (miContext)
+    if (buffered)
+    {
+        /* The client may have come back in the meantime */
+        miResult = MI_RESULT_OK;
+        _DrainBufferedOutput(receiveData);
+    }
+    else if (miContext)
     {
         Sem_Post(&receiveData->timeoutSemaphore, 1);
+        TraceRequest(&receiveData->common, Trace_ReceiveResult,
+            (streamResult && (streamResult->type == WSMAN_DATA_TYPE_BINARY)) ? streamResult->binaryData.dataLength : 0);
         miResult = _WSManPluginReceiveResult(miContext, &receiveData->common, flags, streamName, streamResult, commandState, exitCode);
+        _PromotePendingReceiveContext(receiveData);
     }
 
     PrintDataFunctionEnd(&receiveData->common, "WSManPluginReceiveResult", miResult);
@@ -2863,32 +4855,99 @@ MI_EXPORT  MI_Uint32 MI_CALL WSManPluginReceiveResult(
     return miResult;
 }
 
+MI_EXPORT  MI_Uint32 MI_CALL WSManPluginReceiveResult(
+    _In_ WSMAN_PLUGIN_REQUEST *requestDetails,
+    _In_ MI_Uint32 flags,
+    _In_opt_ const MI_Char16 * streamName,
+    _In_opt_ WSMAN_DATA *streamResult,
+    _In_opt_ const MI_Char16 * commandState,
+    _In_ MI_Uint32 exitCode
+    )
+{
+    ReceiveData *receiveData = (ReceiveData*)requestDetails;
+    WSMAN_DATA chunk;
+
+    if ((streamResult == NULL) || (streamResult->type != WSMAN_DATA_TYPE_BINARY))
+        return _DeliverReceiveResult(receiveData, flags, streamName, streamResult, commandState, exitCode);
+
+    /* A result of more than MAX_COMPRESS_BUFFER_BLOCK goes out a block per Receive for as long
+     * as the client has another Receive waiting, compressed or not, so the first of it is on its
+     * way before the rest is encoded. A client with one Receive outstanding still gets it all in
+     * one response.
+     */
+    chunk = *streamResult;
+    while ((chunk.binaryData.dataLength > MAX_COMPRESS_BUFFER_BLOCK) && _ReceiveQueued(receiveData))
+    {
+        WSMAN_DATA first = chunk;
+        MI_Uint32 miResult;
+
+        first.binaryData.dataLength = MAX_COMPRESS_BUFFER_BLOCK;
+        miResult = _DeliverReceiveResult(receiveData, 0, streamName, &first, NULL, 0);
+        if (miResult != MI_RESULT_OK)
+            return miResult;
+
+        chunk.binaryData.data += MAX_COMPRESS_BUFFER_BLOCK;
+        chunk.binaryData.dataLength -= MAX_COMPRESS_BUFFER_BLOCK;
+    }
+    return _DeliverReceiveResult(receiveData, flags, streamName, &chunk, commandState, exitCode);
+}
+
+/* _TakeExpiredReceiveContext
+ * Take the request in common.miRequestContext if it has waited the response timeout since it
+ * arrived and there is no held output to answer it with. Otherwise set wait to the milliseconds
+ * until it will have, or leave it alone if there is no request.
+ */
+static MI_Context *_TakeExpiredReceiveContext(ReceiveData *receiveData, int *wait)
+{
+    MI_Context *miContext = NULL;
+    MI_Context *current;
+    MI_Uint64 now = Metrics_Now();
+    MI_Uint64 waited;
+
+    /* Holding the lock keeps a promotion, and the arrival time that goes with it, from
+     * happening in between reading the request and taking it.
+     */
+    Lock_Acquire(&receiveData->pendingContextsLock);
+    current = (MI_Context *) Atomic_Read((ptrdiff_t*)&receiveData->common.miRequestContext);
+    if (current)
+    {
+        waited = (now > receiveData->requestArrival) ? (now - receiveData->requestArrival) / 1000 : 0;
+        if (waited < RECEIVE_RESPONSE_TIMEOUT_MS)
+        {
+            *wait = (int) (RECEIVE_RESPONSE_TIMEOUT_MS - waited);
+        }
+        else if ((receiveData->outputHead == NULL) &&
+                 (Atomic_CompareAndSwap((ptrdiff_t*)&receiveData->common.miRequestContext, (ptrdiff_t) current, (ptrdiff_t) NULL) == (ptrdiff_t) current))
+        {
+            miContext = current;
+        }
+    }
+    Lock_Release(&receiveData->pendingContextsLock);
+    return miContext;
+}
+
 PAL_Uint32 THREAD_API ReceiveTimeoutThread(void* param)
 {
     ReceiveData *receiveData = (ReceiveData*) param;
     MI_Result miResult = MI_RESULT_OK;
+    int wait = RECEIVE_RESPONSE_TIMEOUT_MS;
 
     PrintDataFunctionTag(&receiveData->common, "ReceiveTimeoutThread", "Thread starting");
     while (!receiveData->shutdownThread)
     {
         int semWaitRet;
+        MI_Context *miContext;
 
         PrintDataFunctionTag(&receiveData->common, "ReceiveTimeoutThread", "Waiting....");
-        semWaitRet = Sem_TimedWait(&receiveData->timeoutSemaphore, 30*1000);
-        //semWaitRet = Sem_TimedWait(&receiveData->timeoutSemaphore, receiveData->timeoutMilliseconds);
+        semWaitRet = Sem_TimedWait(&receiveData->timeoutSemaphore, wait);
 
         if (semWaitRet == 1)
         {
-            MI_Context *miContext;
-            /* It timed out so probably need to post a result */
+            /* It timed out so probably need to post a result. Held output answers the current
+             * request if there is any.
+             */
             PrintDataFunctionTag(&receiveData->common, "ReceiveTimeoutThread", "Thread timed out");
-
-            miContext = (MI_Context *) Atomic_Swap((ptrdiff_t*)&receiveData->common.miRequestContext, (ptrdiff_t) NULL);
-            if (miContext)
-            {
-                PrintDataFunctionTag(&receiveData->common, "ReceiveTimeoutThread", "Sending timeout response");
-                miResult = _WSManPluginReceiveResult(miContext, &receiveData->common, 0, NULL, NULL, NULL, 0);
-            }
+            _DrainBufferedOutput(receiveData);
         }
         else if (semWaitRet == -1)
         {
@@ -2899,6 +4958,20 @@ PAL_Uint32 THREAD_API ReceiveTimeoutThread(void* param)
         {
             PrintDataFunctionTag(&receiveData->common, "ReceiveTimeoutThread", "Thread got signalled");
             /* 0 means we were woken up so nothing to do except check to see if we need to go back to sleep or exit  */
+            if (receiveData->shutdownThread)
+                break;
+        }
+
+        /* Every request has its own timeout from when it arrived. A queued request promoted in
+         * place of one answered here may have used up its own timeout waiting in the queue, so
+         * it is answered straight away too.
+         */
+        wait = RECEIVE_RESPONSE_TIMEOUT_MS;
+        while ((miContext = _TakeExpiredReceiveContext(receiveData, &wait)) != NULL)
+        {
+            PrintDataFunctionTag(&receiveData->common, "ReceiveTimeoutThread", "Sending timeout response");
+            miResult = _WSManPluginReceiveResult(miContext, &receiveData->common, 0, NULL, NULL, NULL, 0);
+            _PromotePendingReceiveContext(receiveData);
         }
     }
 
@@ -3004,10 +5077,18 @@ MI_EXPORT  MI_Uint32 MI_CALL WSManPluginOperationComplete(
     MI_Instance *miInstance;
     char *extendedInformation = NULL;
 
+    /* Output held for a disconnected client has to be delivered before the receive ends */
+    if ((commonData->requestType == CommonData_Type_Receive) &&
+        _DeferReceiveComplete((ReceiveData*) commonData, errorCode))
+    {
+        return MI_RESULT_OK;
+    }
+
     if (_extendedInformation)
     {
         Utf16LeToUtf8(commonData->batch, _extendedInformation, &extendedInformation);
     }
+    TraceRequest(commonData, Trace_OperationComplete, errorCode);
     PrintDataFunctionStartNumStr(commonData, "WSManPluginOperationComplete", "errorCode", errorCode, "extendedInfo", extendedInformation);
 
     miContext = (MI_Context*) Atomic_Swap((ptrdiff_t*)&commonData->miRequestContext, (ptrdiff_t) NULL);
@@ -3022,21 +5103,28 @@ MI_EXPORT  MI_Uint32 MI_CALL WSManPluginOperationComplete(
         /* TODO: Are there other outstanding operations? */
 
         ShellData *shellData = (ShellData *)commonData;
-        ShellData **pointerToPatch = &shellData->shell->shellList;
 
-        while (*pointerToPatch && (*pointerToPatch != shellData))
+        /* The warm-up shell has no client to tell */
+        if (RemoveWarmUpShell(shellData->shell, shellData))
         {
-            pointerToPatch = (ShellData **)&(*pointerToPatch)->common.siblingData;
+            PrintDataFunctionTag(commonData, "WSManPluginOperationComplete", "Warm-up shell completed");
+            break;
         }
-        if (*pointerToPatch)
-            *pointerToPatch = (ShellData *)shellData->common.siblingData;
+
+        RemoveShellFromSelf(shellData->shell, shellData);
 
         if (miContext)
         {
+            /* Never got as far as WSManPluginReportContext so the create failed */
+            Metrics_Observe(Metrics_Shell, commonData->startTime, errorCode ? errorCode : MI_RESULT_FAILED);
             PrintDataFunctionTag(commonData, "WSManPluginOperationComplete", "PostResult");
             MI_Context_RequestUnload(miContext);
             MI_Context_PostResult(miContext, MI_RESULT_FAILED);
         }
+        else
+        {
+            Metrics_GaugeAdd(Metrics_ActiveShells, -1);
+        }
 
         /* Report that the Shell DeleteInstance has completed. */
         if (shellData->deleteInstanceContext)
@@ -3053,9 +5141,14 @@ MI_EXPORT  MI_Uint32 MI_CALL WSManPluginOperationComplete(
 
         if (miContext)
         {
+            Metrics_Observe(Metrics_Command, commonData->startTime, errorCode ? errorCode : MI_RESULT_FAILED);
             PrintDataFunctionTag(commonData, "WSManPluginOperationComplete", "PostResult");
             MI_Context_PostResult(miContext, MI_RESULT_FAILED);
         }
+        else
+        {
+            Metrics_GaugeAdd(Metrics_ActiveCommands, -1);
+        }
 
         break;
     }
@@ -3075,8 +5168,30 @@ MI_EXPORT  MI_Uint32 MI_CALL WSManPluginOperationComplete(
             /* We have a pending request that needs to be terminated */
             _WSManPluginReceiveResult(miContext, commonData, WSMAN_FLAG_RECEIVE_RESULT_NO_MORE_DATA, NULL, NULL, commandState, errorCode);
         }
+        /* Any pipelined requests behind it get the same answer */
+        while ((miContext = _TakePendingReceiveContext(receiveData)) != NULL)
+        {
+            MI_Char16 *commandState;
+            if (!Utf8ToUtf16Le(commonData->batch, WSMAN_COMMAND_STATE_DONE, &commandState))
+            {
+                MI_Context_PostError(miContext, MI_RESULT_FAILED, MI_RESULT_TYPE_MI, "Utf8ToUtf16Le failed");
+                continue;
+            }
+            _WSManPluginReceiveResult(miContext, commonData, WSMAN_FLAG_RECEIVE_RESULT_NO_MORE_DATA, NULL, NULL, commandState, errorCode);
+        }
         _ShutdownReceiveTimeoutThread(receiveData);
 
+        /* Nothing is draining by now, see _DeferReceiveComplete */
+        _FreeBufferedOutput(GetShellFromOperation(commonData), receiveData->outputHead);
+        receiveData->outputHead = receiveData->outputTail = NULL;
+        _CloseSpill(receiveData);
+
+        if (receiveData->compressStreamInitialized)
+        {
+            CompressStreamDestroy(&receiveData->compressStream);
+            receiveData->compressStreamInitialized = MI_FALSE;
+        }
+
         break;
     }
     /* Send/Receive only need to post back the operation instance with the MIReturn code set */
@@ -3093,6 +5208,7 @@ MI_EXPORT  MI_Uint32 MI_CALL WSManPluginOperationComplete(
         miResult = MI_Context_PostInstance(miContext, miInstance);
         PrintDataFunctionTag(commonData, "WSManPluginOperationComplete", "PostResult");
         MI_Context_PostResult(miContext, miResult);
+        Metrics_Observe((Metrics_Operation) commonData->requestType, commonData->startTime, errorCode);
 
         MI_Instance_Delete(miInstance);
 
@@ -3120,6 +5236,7 @@ MI_EXPORT  MI_Uint32 MI_CALL WSManPluginOperationComplete(
         miResult = MI_Context_PostInstance(miContext, miInstance);
         PrintDataFunctionTag(commonData, "WSManPluginOperationComplete", "PostResult");
         MI_Context_PostResult(miContext, miResult);
+        Metrics_Observe(Metrics_Connect, commonData->startTime, errorCode);
 
         MI_Instance_Delete(miInstance);
 
@@ -3162,8 +5279,9 @@ MI_EXPORT  void MI_CALL WSManPluginRegisterShutdownCallback(
 
     PrintDataFunctionStart(commonData, "WSManPluginRegisterShutdownCallback");
 
-    commonData->shutdownCallback = shutdownCallback;
+    /* The context has to be there before the callback can be taken */
     commonData->shutdownContext = shutdownContext;
+    Atomic_Swap((ptrdiff_t*) &commonData->shutdownCallback, (ptrdiff_t) shutdownCallback);
     __LOGD(("WSManPluginRegisterShutdownCallback - callback %p, context %p", shutdownCallback, shutdownContext));
 }
 
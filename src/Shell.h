@@ -49,6 +49,8 @@ typedef struct _Shell
     MI_ConstDatetimeField ShellRunTime;
     MI_ConstDatetimeField ShellInactivity;
     MI_ConstStringField CreationXml;
+    MI_ConstUint64Field BytesIn;
+    MI_ConstUint64Field BytesOut;
 }
 Shell;
 
@@ -700,6 +702,38 @@ MI_INLINE MI_Result MI_CALL Shell_Clear_CreationXml(
         19);
 }
 
+MI_INLINE MI_Result MI_CALL Shell_Set_BytesIn(
+    Shell* self,
+    MI_Uint64 x)
+{
+    ((MI_Uint64Field*)&self->BytesIn)->value = x;
+    ((MI_Uint64Field*)&self->BytesIn)->exists = 1;
+    return MI_RESULT_OK;
+}
+
+MI_INLINE MI_Result MI_CALL Shell_Clear_BytesIn(
+    Shell* self)
+{
+    memset((void*)&self->BytesIn, 0, sizeof(self->BytesIn));
+    return MI_RESULT_OK;
+}
+
+MI_INLINE MI_Result MI_CALL Shell_Set_BytesOut(
+    Shell* self,
+    MI_Uint64 x)
+{
+    ((MI_Uint64Field*)&self->BytesOut)->value = x;
+    ((MI_Uint64Field*)&self->BytesOut)->exists = 1;
+    return MI_RESULT_OK;
+}
+
+MI_INLINE MI_Result MI_CALL Shell_Clear_BytesOut(
+    Shell* self)
+{
+    memset((void*)&self->BytesOut, 0, sizeof(self->BytesOut));
+    return MI_RESULT_OK;
+}
+
 /*
 **==============================================================================
 **
@@ -0,0 +1,325 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#include <MI.h>
+#include <pal/strings.h>
+#include <pal/atomic.h>
+#include <base/paths.h>
+#include <base/logbase.h>
+#include <base/log.h>
+#include "Trace.h"
+#include "Utilities.h"
+#include "DebugLog.h"
+
+/* Events kept per thread unless psrptraceevents says otherwise */
+#define TRACE_DEFAULT_EVENTS 4096
+
+/* A thread's ring. Requests are handed to the plugin on a new thread each time so rings are
+ * not tied to a thread for good: a thread claims a free one the first time it records and
+ * gives it back when it exits. Rings are never taken off the list while tracing is on, which
+ * is what lets the list be walked from a signal handler.
+ */
+typedef struct _TraceRing
+{
+    struct _TraceRing *next;
+    ptrdiff_t inUse;
+    MI_Uint32 threadId;
+
+    /* Only ever written by the thread that has the ring */
+    Trace_RingHeader header;
+    Trace_Event events[1];
+} TraceRing;
+
+static TraceRing *volatile _rings;
+static volatile ptrdiff_t _traceEnabled;
+static volatile ptrdiff_t _nextRequestId;
+
+/* Threads inside Trace_Record. Trace_Stop waits for them to leave before the rings go. */
+static volatile ptrdiff_t _traceWriters;
+static MI_Uint32 _ringCapacity;
+static pthread_key_t _ringKey;
+static char _tracePath[PAL_MAX_PATH_SIZE];
+
+/* Signals we write the trace for. SIGUSR1 asks for it, the rest are crashes. */
+static const int _crashSignals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+static MI_Boolean _crashSignalInstalled[sizeof(_crashSignals) / sizeof(_crashSignals[0])];
+static MI_Boolean _requestSignalInstalled;
+
+MI_Boolean Trace_Enabled(void)
+{
+    return _traceEnabled != 0;
+}
+
+MI_Uint32 Trace_NextId(void)
+{
+    return (MI_Uint32) Atomic_Inc(&_nextRequestId);
+}
+
+static MI_Uint32 _TraceThreadId(void)
+{
+#if defined(__linux__)
+    return (MI_Uint32) syscall(SYS_gettid);
+#else
+    return (MI_Uint32) (size_t) pthread_self();
+#endif
+}
+
+/* Called when a thread that has a ring exits */
+static void _TraceReleaseRing(void *ring)
+{
+    Atomic_Swap(&((TraceRing*) ring)->inUse, 0);
+}
+
+static TraceRing *_TraceClaimRing(void)
+{
+    TraceRing *ring;
+    TraceRing *head;
+
+    for (ring = _rings; ring; ring = ring->next)
+    {
+        if (Atomic_CompareAndSwap(&ring->inUse, 0, 1) == 0)
+            break;
+    }
+
+    if (ring == NULL)
+    {
+        ring = calloc(1, sizeof(TraceRing) + ((_ringCapacity - 1) * sizeof(Trace_Event)));
+        if (ring == NULL)
+            return NULL;
+
+        ring->inUse = 1;
+        ring->header.capacity = _ringCapacity;
+        do
+        {
+            head = _rings;
+            ring->next = head;
+        } while (Atomic_CompareAndSwap((ptrdiff_t*) &_rings, (ptrdiff_t) head, (ptrdiff_t) ring) != (ptrdiff_t) head);
+    }
+
+    ring->threadId = _TraceThreadId();
+    pthread_setspecific(_ringKey, ring);
+    return ring;
+}
+
+void Trace_Record(
+    Trace_Type type,
+    MI_Uint32 requestType,
+    const void *request,
+    MI_Uint32 requestId,
+    MI_Uint32 shellIdHash,
+    MI_Uint32 value,
+    MI_Uint64 timestamp)
+{
+    TraceRing *ring;
+    Trace_Event *event;
+
+    if (!_traceEnabled)
+        return;
+
+    /* Check again once Trace_Stop can see us, it may have started in between */
+    Atomic_Inc(&_traceWriters);
+    if (!_traceEnabled)
+        goto done;
+
+    ring = (TraceRing*) pthread_getspecific(_ringKey);
+    if ((ring == NULL) && ((ring = _TraceClaimRing()) == NULL))
+        goto done;
+
+    event = &ring->events[ring->header.written % ring->header.capacity];
+    event->timestamp = timestamp;
+    event->request = (MI_Uint64) (size_t) request;
+    event->requestId = requestId;
+    event->shellIdHash = shellIdHash;
+    event->value = value;
+    event->threadId = ring->threadId;
+    event->type = (MI_Uint8) type;
+    event->requestType = (MI_Uint8) requestType;
+
+    /* The event has to be complete before it counts as written */
+    __asm__ __volatile__("" ::: "memory");
+    ring->header.written++;
+
+done:
+    Atomic_Dec(&_traceWriters);
+}
+
+static MI_Boolean _TraceWriteAll(int fd, const void *data, size_t length)
+{
+    const char *position = (const char*) data;
+
+    while (length)
+    {
+        ssize_t written = write(fd, position, length);
+        if (written <= 0)
+            return MI_FALSE;
+        position += written;
+        length -= (size_t) written;
+    }
+    return MI_TRUE;
+}
+
+MI_Result Trace_Write(const char *path)
+{
+    Trace_FileHeader fileHeader;
+    Trace_RingHeader ringHeader;
+    TraceRing *ring;
+    MI_Boolean ok;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return MI_RESULT_FAILED;
+
+    memset(&fileHeader, 0, sizeof(fileHeader));
+    memcpy(fileHeader.magic, TRACE_FILE_MAGIC, sizeof(fileHeader.magic));
+    fileHeader.version = TRACE_FILE_VERSION;
+    fileHeader.eventSize = sizeof(Trace_Event);
+    fileHeader.processId = (MI_Uint32) getpid();
+    ok = _TraceWriteAll(fd, &fileHeader, sizeof(fileHeader));
+
+    /* Events still being recorded while this runs may be torn, the decoder skips anything
+     * that does not look like an event.
+     */
+    for (ring = _rings; ok && ring; ring = ring->next)
+    {
+        ringHeader = ring->header;
+        ok = _TraceWriteAll(fd, &ringHeader, sizeof(ringHeader)) &&
+             _TraceWriteAll(fd, ring->events, ringHeader.capacity * sizeof(Trace_Event));
+    }
+
+    if ((close(fd) != 0) || !ok)
+        return MI_RESULT_FAILED;
+    return MI_RESULT_OK;
+}
+
+static void _TraceRequestSignalHandler(int signalNumber)
+{
+    Trace_Write(_tracePath);
+}
+
+/* Write the trace and let the crash carry on as it would have without us */
+static void _TraceCrashSignalHandler(int signalNumber)
+{
+    Trace_Write(_tracePath);
+    signal(signalNumber, SIG_DFL);
+    raise(signalNumber);
+}
+
+/* Only take a signal the host process is not already using */
+static MI_Boolean _TraceInstallHandler(int signalNumber, void (*handler)(int), int flags)
+{
+    struct sigaction action, previous;
+
+    if ((sigaction(signalNumber, NULL, &previous) != 0) || (previous.sa_handler != SIG_DFL))
+        return MI_FALSE;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = flags;
+    return sigaction(signalNumber, &action, NULL) == 0;
+}
+
+static void _TraceRemoveHandler(int signalNumber, void (*handler)(int))
+{
+    struct sigaction previous;
+
+    if ((sigaction(signalNumber, NULL, &previous) == 0) && (previous.sa_handler == handler))
+    {
+        signal(signalNumber, SIG_DFL);
+    }
+}
+
+void Trace_Start(void)
+{
+    char value[16];
+    MI_Uint32 i;
+
+    if ((_GetConfigValueFromConfigFile("psrptrace", value, sizeof(value)) != MI_RESULT_OK) ||
+        (Tcscasecmp(value, "true") != 0))
+    {
+        return;
+    }
+    _ringCapacity = TRACE_DEFAULT_EVENTS;
+    if (_GetConfigValueFromConfigFile("psrptraceevents", value, sizeof(value)) == MI_RESULT_OK)
+    {
+        _ringCapacity = (MI_Uint32) strtoul(value, NULL, 10);
+        if (_ringCapacity == 0)
+            _ringCapacity = TRACE_DEFAULT_EVENTS;
+    }
+    snprintf(_tracePath, sizeof(_tracePath), "%s/psrptrace.%d.bin", OMI_GetPath(ID_LOCALSTATEDIR), (int) getpid());
+
+    if (pthread_key_create(&_ringKey, _TraceReleaseRing) != 0)
+    {
+        __LOGE(("Trace_Start - failed to create thread key"));
+        return;
+    }
+
+    _requestSignalInstalled = _TraceInstallHandler(SIGUSR1, _TraceRequestSignalHandler, SA_RESTART);
+    if (!_requestSignalInstalled)
+    {
+        __LOGE(("Trace_Start - SIGUSR1 is already in use, the trace is only written on unload or crash"));
+    }
+    for (i = 0; i != sizeof(_crashSignals) / sizeof(_crashSignals[0]); i++)
+    {
+        _crashSignalInstalled[i] = _TraceInstallHandler(_crashSignals[i], _TraceCrashSignalHandler, SA_RESETHAND | SA_NODEFER);
+    }
+
+    _traceEnabled = 1;
+    __LOGD(("Trace_Start - writing trace to %s, %u events per thread", _tracePath, _ringCapacity));
+}
+
+void Trace_Stop(void)
+{
+    TraceRing *ring;
+    MI_Uint32 i;
+
+    if (!_traceEnabled)
+        return;
+    Atomic_Swap(&_traceEnabled, 0);
+
+    /* Put the signals back the way they were, this module is about to be unloaded */
+    if (_requestSignalInstalled)
+        _TraceRemoveHandler(SIGUSR1, _TraceRequestSignalHandler);
+    for (i = 0; i != sizeof(_crashSignals) / sizeof(_crashSignals[0]); i++)
+    {
+        if (_crashSignalInstalled[i])
+            _TraceRemoveHandler(_crashSignals[i], _TraceCrashSignalHandler);
+    }
+
+    /* Leave a final copy behind */
+    if (Trace_Write(_tracePath) != MI_RESULT_OK)
+    {
+        __LOGE(("Trace_Stop - failed to write %s", _tracePath));
+    }
+
+    /* Nothing new gets recorded now, wait for anything still being recorded before freeing
+     * the rings. Threads still holding rings must not give them back after they are freed.
+     */
+    while (Atomic_Read(&_traceWriters) != 0)
+        sched_yield();
+
+    pthread_key_delete(_ringKey);
+    while ((ring = _rings) != NULL)
+    {
+        _rings = ring->next;
+        free(ring);
+    }
+}
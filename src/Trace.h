@@ -0,0 +1,92 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#ifndef _Trace_h_
+#define _Trace_h_
+#include <MI.h>
+
+/* Binary request tracing for the shell provider. Every thread records fixed size events into
+ * a ring of its own without taking locks, so tracing is cheap enough to leave on and the last
+ * few thousand events of every thread are there to look at after a latency problem.
+ *
+ * Tracing is turned on with psrptrace=true in omiserver.conf, psrptraceevents sets the number
+ * of events kept per thread. The rings are written to psrptrace.<pid>.bin in the OMI local
+ * state directory when the process gets SIGUSR1, when it crashes and when the provider is
+ * unloaded. psrptracedecode turns that file into Chrome trace event JSON.
+ */
+
+#define TRACE_FILE_MAGIC "PSRPTRC1"
+#define TRACE_FILE_VERSION 1
+
+typedef enum _Trace_Type
+{
+    Trace_Invoke = 1,           /* Request came in from the client */
+    Trace_PluginCall,           /* Request is being handed to the plugin */
+    Trace_ReportContext,        /* Plugin reported the shell or command context */
+    Trace_ReceiveResult,        /* Output posted back to a Receive, value is the byte count */
+    Trace_OperationComplete     /* Plugin completed the request, value is the error code */
+} Trace_Type;
+
+/* One event, as it is kept in the ring and written to the file */
+typedef struct _Trace_Event
+{
+    MI_Uint64 timestamp;        /* Metrics_Now() */
+    MI_Uint64 request;          /* CommonData pointer, only meaningful within one process */
+    MI_Uint32 requestId;        /* Correlation ID, unique for every client request */
+    MI_Uint32 shellIdHash;      /* DebugLog_Hash of the ShellId, 0 if there is none yet */
+    MI_Uint32 value;
+    MI_Uint32 threadId;
+    MI_Uint8 type;              /* Trace_Type */
+    MI_Uint8 requestType;       /* CommonData_Type */
+    MI_Uint8 reserved[6];
+} Trace_Event;
+
+/* The file is a Trace_FileHeader followed by a Trace_RingHeader and its events for every ring.
+ * Once a ring has wrapped the oldest event is at written % capacity.
+ */
+typedef struct _Trace_FileHeader
+{
+    char magic[8];
+    MI_Uint32 version;
+    MI_Uint32 eventSize;
+    MI_Uint32 processId;
+    MI_Uint32 reserved;
+} Trace_FileHeader;
+
+typedef struct _Trace_RingHeader
+{
+    MI_Uint32 capacity;
+    MI_Uint32 reserved;
+    MI_Uint64 written;
+} Trace_RingHeader;
+
+MI_Boolean Trace_Enabled(void);
+
+/* A new correlation ID for a request */
+MI_Uint32 Trace_NextId(void);
+
+void Trace_Record(
+    Trace_Type type,
+    MI_Uint32 requestType,
+    const void *request,
+    MI_Uint32 requestId,
+    MI_Uint32 shellIdHash,
+    MI_Uint32 value,
+    MI_Uint64 timestamp);
+
+/* Read the configuration and start tracing if it is turned on */
+void Trace_Start(void);
+void Trace_Stop(void);
+
+/* Write every ring to a file. Only uses async-signal-safe calls so it can be called from a
+ * signal handler.
+ */
+MI_Result Trace_Write(const char *path);
+
+#endif /* _Trace_h_ */
@@ -0,0 +1,207 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+/* psrptracedecode
+ * Turns a psrptrace.<pid>.bin file written by the provider into Chrome trace event JSON,
+ * which chrome://tracing and Perfetto load directly. Every shell is shown as a process and
+ * every provider thread as a thread in it. Each event is an instant marker and each client
+ * request is a span from when it came in to when it was answered.
+ *
+ *     psrptracedecode psrptrace.1234.bin > trace.json
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Trace.h"
+
+typedef struct _OpenRequest
+{
+    MI_Uint32 requestId;
+    MI_Uint32 threadId;
+    MI_Uint64 timestamp;
+} OpenRequest;
+
+static const char *_requestTypes[] = { "Shell", "Command", "Send", "Receive", "Signal", "Connect" };
+static const char *_eventTypes[] = { "", "Invoke", "PluginCall", "ReportContext", "ReceiveResult", "OperationComplete" };
+
+static const char *RequestTypeName(MI_Uint8 requestType)
+{
+    return requestType < sizeof(_requestTypes) / sizeof(_requestTypes[0]) ? _requestTypes[requestType] : "Unknown";
+}
+
+static int CompareEvents(const void *left, const void *right)
+{
+    const Trace_Event *l = (const Trace_Event*) left;
+    const Trace_Event *r = (const Trace_Event*) right;
+
+    if (l->timestamp != r->timestamp)
+        return l->timestamp < r->timestamp ? -1 : 1;
+    return (int) l->type - (int) r->type;
+}
+
+/* Read every ring into one array, oldest event first within each ring */
+static Trace_Event *ReadEvents(FILE *file, size_t *eventCount)
+{
+    Trace_RingHeader ringHeader;
+    Trace_Event *events = NULL;
+    Trace_Event *ring = NULL;
+    size_t count = 0;
+    MI_Uint64 i, first, kept;
+
+    while (fread(&ringHeader, sizeof(ringHeader), 1, file) == 1)
+    {
+        Trace_Event *grown;
+
+        ring = realloc(ring, ringHeader.capacity * sizeof(Trace_Event));
+        if ((ring == NULL) || (fread(ring, sizeof(Trace_Event), ringHeader.capacity, file) != ringHeader.capacity))
+        {
+            fprintf(stderr, "psrptracedecode: trace file is truncated\n");
+            break;
+        }
+
+        kept = ringHeader.written < ringHeader.capacity ? ringHeader.written : ringHeader.capacity;
+        first = ringHeader.written < ringHeader.capacity ? 0 : ringHeader.written % ringHeader.capacity;
+
+        grown = realloc(events, (count + kept) * sizeof(Trace_Event));
+        if (grown == NULL)
+            break;
+        events = grown;
+
+        for (i = 0; i != kept; i++)
+        {
+            Trace_Event *event = &ring[(first + i) % ringHeader.capacity];
+
+            /* Skip anything torn by being written out while it was recorded */
+            if ((event->timestamp == 0) || (event->type < Trace_Invoke) || (event->type > Trace_OperationComplete))
+                continue;
+            events[count++] = *event;
+        }
+    }
+
+    free(ring);
+    *eventCount = count;
+    return events;
+}
+
+/* Requests that have come in but have not been answered, keyed on request ID */
+static OpenRequest *FindOpenRequest(OpenRequest *table, size_t tableSize, MI_Uint32 requestId)
+{
+    size_t slot = (requestId * 2654435761u) & (tableSize - 1);
+
+    while (table[slot].requestId && (table[slot].requestId != requestId))
+        slot = (slot + 1) & (tableSize - 1);
+    return &table[slot];
+}
+
+int main(int argc, char **argv)
+{
+    Trace_FileHeader header;
+    Trace_Event *events;
+    OpenRequest *openRequests;
+    MI_Uint32 *shells = NULL;
+    size_t eventCount, tableSize, shellCount = 0, i, j;
+    MI_Uint64 origin;
+    const char *separator = "";
+    FILE *file;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: psrptracedecode <psrptrace.pid.bin>\n");
+        return 1;
+    }
+
+    file = fopen(argv[1], "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "psrptracedecode: cannot open %s\n", argv[1]);
+        return 1;
+    }
+    if ((fread(&header, sizeof(header), 1, file) != 1) ||
+        (memcmp(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic)) != 0) ||
+        (header.version != TRACE_FILE_VERSION) ||
+        (header.eventSize != sizeof(Trace_Event)))
+    {
+        fprintf(stderr, "psrptracedecode: %s is not a trace file this version can read\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+
+    events = ReadEvents(file, &eventCount);
+    fclose(file);
+    qsort(events, eventCount, sizeof(Trace_Event), CompareEvents);
+
+    for (tableSize = 16; tableSize < eventCount * 2; tableSize *= 2)
+        ;
+    openRequests = calloc(tableSize, sizeof(OpenRequest));
+    if ((openRequests == NULL) || ((eventCount != 0) && (events == NULL)))
+    {
+        fprintf(stderr, "psrptracedecode: out of memory\n");
+        return 1;
+    }
+    origin = eventCount ? events[0].timestamp : 0;
+
+    printf("{\"otherData\":{\"pid\":%u},\"traceEvents\":[\n", header.processId);
+    for (i = 0; i != eventCount; i++)
+    {
+        const Trace_Event *event = &events[i];
+        const char *requestType = RequestTypeName(event->requestType);
+        OpenRequest *open = FindOpenRequest(openRequests, tableSize, event->requestId);
+
+        /* Name each shell the first time it shows up */
+        for (j = 0; (j != shellCount) && (shells[j] != event->shellIdHash); j++)
+            ;
+        if (j == shellCount)
+        {
+            MI_Uint32 *grown = realloc(shells, (shellCount + 1) * sizeof(MI_Uint32));
+            if (grown)
+            {
+                shells = grown;
+                shells[shellCount++] = event->shellIdHash;
+                printf("%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"shell %08x\"}}",
+                    separator, event->shellIdHash, event->shellIdHash);
+                separator = ",\n";
+            }
+        }
+
+        printf("%s{\"name\":\"%s %s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":%u,\"tid\":%u,"
+               "\"args\":{\"requestId\":%u,\"request\":\"0x%llx\",\"value\":%u}}",
+            separator, requestType, _eventTypes[event->type], (unsigned long long) (event->timestamp - origin),
+            event->shellIdHash, event->threadId, event->requestId, (unsigned long long) event->request, event->value);
+        separator = ",\n";
+
+        /* A request ends at whichever comes first of its context, its output or its completion */
+        if (event->type == Trace_Invoke)
+        {
+            if (open->requestId == 0)
+            {
+                open->requestId = event->requestId;
+                open->threadId = event->threadId;
+                open->timestamp = event->timestamp;
+            }
+        }
+        else if ((event->type != Trace_PluginCall) && open->requestId && open->timestamp)
+        {
+            printf("%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%u,\"tid\":%u,"
+                   "\"args\":{\"requestId\":%u,\"end\":\"%s\",\"value\":%u}}",
+                separator, requestType, (unsigned long long) (open->timestamp - origin),
+                (unsigned long long) (event->timestamp - open->timestamp), event->shellIdHash, open->threadId,
+                event->requestId, _eventTypes[event->type], event->value);
+
+            /* Keep the slot so the probe chain stays intact, a zero timestamp marks it answered */
+            open->timestamp = 0;
+        }
+    }
+    printf("\n]}\n");
+
+    free(shells);
+    free(openRequests);
+    free(events);
+    return 0;
+}
@@ -8,12 +8,19 @@
 */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
 #include <pal/strings.h>
 #include <base/logbase.h>
 #include <base/log.h>
 #include <base/conf.h>
 #include <base/paths.h>
 #include <MI.h>
+#include "Utilities.h"
+
+/* File next to omiserver.conf for settings that do not fit in it */
+#define PSRP_CONFIG_FILE_NAME "psrp.conf"
 
 MI_Result _GetLogOptionsFromConfigFile(const MI_Char *logfileName)
 {
@@ -72,3 +79,141 @@ error:
     return MI_RESULT_INVALID_PARAMETER;
 }
 
+/* _GetConfigValueFromConfigFile
+ * Look up a single key=value setting from the OMI configuration file. Returns MI_RESULT_NOT_FOUND
+ * if the key is not present so the caller can fall back to its default.
+ */
+MI_Result _GetConfigValueFromConfigFile(const char *name, char *value, size_t valueLength)
+{
+    char path[PAL_MAX_PATH_SIZE];
+    Conf* conf;
+    MI_Result miResult = MI_RESULT_NOT_FOUND;
+
+    /* Form the configuration file path */
+    Strlcpy(path, OMI_GetPath(ID_CONFIGFILE), sizeof(path));
+
+    /* Open the configuration file */
+    conf = Conf_Open(path);
+    if (!conf)
+    {
+        trace_MIFailedToOpenConfigFile(scs(path));
+        return MI_RESULT_FAILED;
+    }
+
+    /* For each key=value pair in configuration file */
+    for (;;)
+    {
+        const char* key;
+        const char* tmpValue;
+        int r = Conf_Read(conf, &key, &tmpValue);
+
+        if (r == -1)
+        {
+            trace_MIFailedToReadConfigValue(path, scs(Conf_Error(conf)));
+            miResult = MI_RESULT_FAILED;
+            break;
+        }
+
+        if (r == 1)
+            break;
+
+        if (strcmp(key, name) == 0)
+        {
+            Strlcpy(value, tmpValue, valueLength);
+            miResult = MI_RESULT_OK;
+            break;
+        }
+    }
+
+    /* Close configuration file */
+    Conf_Close(conf);
+
+    return miResult;
+}
+
+static char *_TrimConfigString(char *value)
+{
+    char *end;
+
+    while (isspace((unsigned char) *value))
+        value++;
+    end = value + strlen(value);
+    while ((end != value) && isspace((unsigned char) end[-1]))
+        end--;
+    *end = '\0';
+    return value;
+}
+
+/* _GetConfigSectionFromConfigFile
+ * Call back with every key = value setting in one [section] of psrp.conf, which lives in the
+ * same directory as omiserver.conf, or of the file PSRP_CONFIG_FILE names. Conf_Read has no
+ * sections and omiserver reads omiserver.conf too, so settings with free-form keys go in a file
+ * of our own. Returns MI_RESULT_NOT_FOUND if there is no such file.
+ */
+MI_Result _GetConfigSectionFromConfigFile(const char *section, ConfigSectionCallback callback, void *context)
+{
+    char path[PAL_MAX_PATH_SIZE];
+    char line[1024];
+    const char *fileOverride = getenv("PSRP_CONFIG_FILE");
+    MI_Boolean inSection = MI_FALSE;
+    MI_Result miResult = MI_RESULT_OK;
+    FILE *file;
+
+    if (fileOverride && *fileOverride)
+    {
+        Strlcpy(path, fileOverride, sizeof(path));
+    }
+    else
+    {
+        char *fileName;
+
+        Strlcpy(path, OMI_GetPath(ID_CONFIGFILE), sizeof(path));
+        fileName = strrchr(path, '/');
+        fileName = fileName ? fileName + 1 : path;
+        Strlcpy(fileName, PSRP_CONFIG_FILE_NAME, sizeof(path) - (fileName - path));
+    }
+
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return MI_RESULT_NOT_FOUND;
+    }
+
+    while (fgets(line, sizeof(line), file))
+    {
+        char *key = _TrimConfigString(line);
+        char *value;
+
+        /* Skip blank lines and comments */
+        if ((*key == '\0') || (*key == '#') || (*key == ';'))
+            continue;
+
+        if (*key == '[')
+        {
+            char *end = strchr(key, ']');
+            if (end)
+                *end = '\0';
+            inSection = (Tcscasecmp(_TrimConfigString(key + 1), section) == 0);
+            continue;
+        }
+        if (!inSection)
+            continue;
+
+        value = strchr(key, '=');
+        if (value == NULL)
+        {
+            __LOGE(("%s: expected key = value in [%s], ignoring '%s'", path, section, key));
+            continue;
+        }
+        *value = '\0';
+        key = _TrimConfigString(key);
+        value = _TrimConfigString(value + 1);
+
+        miResult = callback(context, key, value);
+        if (miResult != MI_RESULT_OK)
+            break;
+    }
+
+    fclose(file);
+    return miResult;
+}
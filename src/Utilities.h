@@ -8,4 +8,8 @@
 */
 
 MI_Result _GetLogOptionsFromConfigFile(const MI_Char *logFileName);
+MI_Result _GetConfigValueFromConfigFile(const char *name, char *value, size_t valueLength);
 
+/* Called for each key = value setting of a psrp.conf section, stops reading on failure */
+typedef MI_Result (*ConfigSectionCallback)(void *context, const char *key, const char *value);
+MI_Result _GetConfigSectionFromConfigFile(const char *section, ConfigSectionCallback callback, void *context);
@@ -0,0 +1,790 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <MI.h>
+#include <pal/atomic.h>
+#include <pal/lock.h>
+#include <pal/thread.h>
+#include <pal/sleep.h>
+#include "wsman.h"
+
+/* Client side benchmarks. libpsrpclient is driven through the WSMan API the way a PSRP
+ * client drives it, against an omiserver that is running the echo plugin (shellplugin=echo
+ * in omiserver.conf) on this machine, so the server does little more than hand each Send
+ * back to the Receive. Along with the latency of each iteration it prints the process CPU
+ * time per iteration, which is what the client spends setting up, running and tearing down
+ * its Send and Receive operations plus the protocol work underneath them.
+ *
+ * usage: clientbench [-w send|receive|fanout|all] [-n iterations] [-s size] [-h connection]... [-u user] [-p password] [-c]
+ *                    [-k concurrency] [-t host timeout] [-b stalled hosts]
+ *
+ *  -w  send     a Send per iteration through one command, closed from the caller once it has
+ *               completed, with one Receive left running to collect the echo
+ *      receive  a Send followed by a new Receive per iteration, closed once the echo is in
+ *      fanout   WSManRunShellCommandFanOut of the echo plugin's exit command to every -h
+ *               connection plus -b loopback endpoints of clientbench's own that accept
+ *               connections and never answer. It is run twice, once left to time the stalled
+ *               hosts out and once closed early to cancel them. Either way the echo hosts must
+ *               succeed, every stalled host must fail and no more than -k stalled hosts may
+ *               ever be connected at once. Point -h at several omiservers, or at one listening
+ *               on several ports, to have more than one echo host.
+ *      all      send and receive (default)
+ *  -n  iterations per workload (default 1000)
+ *  -s  message size in bytes (default 64)
+ *  -h  connection as given to WSManCreateSession (default localhost:5985). fanout takes up to
+ *      16 of them, the other workloads use the first.
+ *  -u  user name for basic authentication, -p its password
+ *  -c  leave compression on
+ *  -k  hosts the fan-out works on at once (default 2)
+ *  -t  fan-out host timeout in ms (default 1000)
+ *  -b  stalled hosts for the fan-out (default 2)
+ */
+
+#define BENCH_RESOURCE_URI "http://schemas.microsoft.com/powershell/Microsoft.PowerShell"
+#define BENCH_MAX_STRING 256
+#define BENCH_MAX_HOSTS 16
+#define BENCH_STALL_MAX_CONNECTIONS 64
+#define BENCH_STALL_POLL_MS 50
+
+typedef enum _BenchWorkload
+{
+    BenchSend,
+    BenchReceive,
+    BenchFanOutWorkload,
+    BenchWorkloadCount
+} BenchWorkload;
+
+static const char *_workloadNames[BenchWorkloadCount] = { "send", "receive", "fanout" };
+
+typedef struct _BenchOptions
+{
+    MI_Uint32 iterations;
+    MI_Uint32 messageSize;
+    MI_Boolean compressed;
+    MI_Char16 connections[BENCH_MAX_HOSTS][BENCH_MAX_STRING];
+    MI_Uint32 connectionCount;
+    MI_Char16 user[BENCH_MAX_STRING];
+    MI_Char16 password[BENCH_MAX_STRING];
+    MI_Uint32 concurrency;
+    MI_Uint32 hostTimeoutMs;
+    MI_Uint32 stalledHosts;
+} BenchOptions;
+
+/* What the callbacks hand back to the thread waiting on them. completed is bumped by every
+ * callback that ends a create, command, Send or close, and received counts the echoed bytes.
+ */
+typedef struct _BenchClient
+{
+    volatile ptrdiff_t completed;
+    volatile ptrdiff_t received;
+    volatile ptrdiff_t receiveEnded;
+    MI_Uint32 errorCode;
+    WSMAN_SHELL_HANDLE shell;
+    WSMAN_COMMAND_HANDLE command;
+} BenchClient;
+
+static double NowUs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000.0) + (now.tv_nsec / 1000.0);
+}
+
+/* User and system time of every thread in the process, the client's own included */
+static double CpuUs(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return ((usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000.0) +
+        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/* The API takes UTF-16, everything given on the command line is ASCII */
+static void Widen(MI_Char16 *target, const char *source)
+{
+    size_t i;
+
+    for (i = 0; source[i] && (i != BENCH_MAX_STRING - 1); i++)
+        target[i] = (MI_Char16) source[i];
+    target[i] = 0;
+}
+
+static void BenchCompleted(BenchClient *client, WSMAN_ERROR *error)
+{
+    if (error && error->code && (client->errorCode == 0))
+        client->errorCode = error->code;
+    Atomic_Inc(&client->completed);
+    CondLock_Broadcast((ptrdiff_t) &client->completed);
+}
+
+/* Wait for the callback after the one that left completed at previous */
+static MI_Uint32 BenchWait(BenchClient *client, ptrdiff_t previous)
+{
+    while (Atomic_Read(&client->completed) == previous)
+    {
+        CondLock_Wait((ptrdiff_t) &client->completed, &client->completed, previous, CONDLOCK_DEFAULT_SPINCOUNT);
+    }
+    return client->errorCode;
+}
+
+static void BenchShellCallback(
+    void *operationContext,
+    MI_Uint32 flags,
+    WSMAN_ERROR *error,
+    WSMAN_SHELL_HANDLE shell,
+    WSMAN_COMMAND_HANDLE command,
+    WSMAN_OPERATION_HANDLE operationHandle,
+    WSMAN_RESPONSE_DATA *data)
+{
+    BenchClient *client = (BenchClient*) operationContext;
+
+    if (shell)
+        client->shell = shell;
+    if (command)
+        client->command = command;
+    BenchCompleted(client, error);
+}
+
+static void BenchReceiveCallback(
+    void *operationContext,
+    MI_Uint32 flags,
+    WSMAN_ERROR *error,
+    WSMAN_SHELL_HANDLE shell,
+    WSMAN_COMMAND_HANDLE command,
+    WSMAN_OPERATION_HANDLE operationHandle,
+    WSMAN_RESPONSE_DATA *data)
+{
+    BenchClient *client = (BenchClient*) operationContext;
+
+    if (data && (error == NULL || error->code == 0))
+    {
+        Atomic_Add(&client->received, data->receiveData.streamData.binaryData.dataLength);
+    }
+    if (flags & WSMAN_FLAG_CALLBACK_END_OF_OPERATION)
+    {
+        if (error && error->code && (client->errorCode == 0))
+            client->errorCode = error->code;
+        Atomic_Inc(&client->receiveEnded);
+    }
+    CondLock_Broadcast((ptrdiff_t) &client->received);
+}
+
+/* Wait until the Receive has seen expected bytes or has ended */
+static MI_Uint32 BenchWaitReceived(BenchClient *client, ptrdiff_t expected)
+{
+    ptrdiff_t received;
+
+    while (((received = Atomic_Read(&client->received)) < expected) && !Atomic_Read(&client->receiveEnded))
+    {
+        CondLock_Wait((ptrdiff_t) &client->received, &client->received, received, CONDLOCK_DEFAULT_SPINCOUNT);
+    }
+    if ((client->errorCode == 0) && (received < expected))
+        client->errorCode = MI_RESULT_FAILED;
+    return client->errorCode;
+}
+
+static MI_Uint32 BenchStartReceive(BenchClient *client, WSMAN_OPERATION_HANDLE *receiveOperation)
+{
+    static MI_Char16 stdoutStream[] = { 's', 't', 'd', 'o', 'u', 't', 0 };
+    const MI_Char16 *streamIds[1] = { stdoutStream };
+    WSMAN_STREAM_ID_SET streamSet = { 1, streamIds };
+    WSMAN_SHELL_ASYNC async = { client, BenchReceiveCallback };
+
+    client->receiveEnded = 0;
+    *receiveOperation = NULL;
+    WSManReceiveShellOutput(client->shell, client->command, 0, &streamSet, &async, receiveOperation);
+    return (*receiveOperation == NULL) ? MI_RESULT_FAILED : MI_RESULT_OK;
+}
+
+/* Send one message on the command and wait for it to complete, then close the operation */
+static MI_Uint32 BenchSendMessage(BenchClient *client, MI_Uint8 *message, MI_Uint32 messageSize)
+{
+    static MI_Char16 stdinStream[] = { 's', 't', 'd', 'i', 'n', 0 };
+    WSMAN_SHELL_ASYNC async = { client, BenchShellCallback };
+    WSMAN_OPERATION_HANDLE sendOperation = NULL;
+    WSMAN_DATA data;
+    ptrdiff_t previous = Atomic_Read(&client->completed);
+    MI_Uint32 errorCode;
+
+    data.type = WSMAN_DATA_TYPE_BINARY;
+    data.binaryData.dataLength = messageSize;
+    data.binaryData.data = message;
+    WSManSendShellInput(client->shell, client->command, 0, stdinStream, &data, MI_FALSE, &async, &sendOperation);
+    errorCode = BenchWait(client, previous);
+    WSManCloseOperation(sendOperation, 0);
+    return errorCode;
+}
+
+static MI_Uint32 BenchOpen(WSMAN_SESSION_HANDLE session, BenchClient *client, const BenchOptions *options)
+{
+    static MI_Char16 resourceUri[BENCH_MAX_STRING];
+    static MI_Char16 stdinStream[] = { 's', 't', 'd', 'i', 'n', ' ', 'p', 'r', 0 };
+    static MI_Char16 stdoutStream[] = { 's', 't', 'd', 'o', 'u', 't', 0 };
+    static MI_Char16 commandLine[] = { 'e', 'c', 'h', 'o', 0 };
+    const MI_Char16 *inputIds[1] = { stdinStream };
+    const MI_Char16 *outputIds[1] = { stdoutStream };
+    WSMAN_STREAM_ID_SET inputSet = { 1, inputIds };
+    WSMAN_STREAM_ID_SET outputSet = { 1, outputIds };
+    WSMAN_SHELL_STARTUP_INFO startupInfo;
+    WSMAN_SHELL_ASYNC async = { client, BenchShellCallback };
+    WSMAN_SHELL_HANDLE shell = NULL;
+    WSMAN_COMMAND_HANDLE command = NULL;
+    ptrdiff_t previous;
+    MI_Uint32 errorCode;
+
+    Widen(resourceUri, BENCH_RESOURCE_URI);
+    memset(&startupInfo, 0, sizeof(startupInfo));
+    startupInfo.inputStreamSet = &inputSet;
+    startupInfo.outputStreamSet = &outputSet;
+
+    previous = Atomic_Read(&client->completed);
+    WSManCreateShellEx(session, options->compressed ? 0 : WSMAN_FLAG_NO_COMPRESSION, resourceUri, NULL, &startupInfo, NULL, NULL, &async, &shell);
+    errorCode = BenchWait(client, previous);
+    if (errorCode)
+        return errorCode;
+
+    previous = Atomic_Read(&client->completed);
+    WSManRunShellCommandEx(client->shell, 0, NULL, commandLine, NULL, NULL, &async, &command);
+    return BenchWait(client, previous);
+}
+
+static void BenchClose(BenchClient *client)
+{
+    WSMAN_SHELL_ASYNC async = { client, BenchShellCallback };
+    ptrdiff_t previous;
+
+    if (client->command)
+    {
+        previous = Atomic_Read(&client->completed);
+        WSManCloseCommand(client->command, 0, &async);
+        BenchWait(client, previous);
+    }
+    if (client->shell)
+    {
+        previous = Atomic_Read(&client->completed);
+        WSManCloseShell(client->shell, 0, &async);
+        BenchWait(client, previous);
+    }
+}
+
+static int CompareSamples(const void *a, const void *b)
+{
+    double left = *(const double*) a;
+    double right = *(const double*) b;
+    return (left > right) - (left < right);
+}
+
+static double Percentile(const double *samples, MI_Uint32 count, double fraction)
+{
+    MI_Uint32 index;
+
+    if (count == 0)
+        return 0;
+
+    index = (MI_Uint32) (fraction * count);
+    if (index >= count)
+        index = count - 1;
+    return samples[index];
+}
+
+static MI_Uint32 RunWorkload(WSMAN_SESSION_HANDLE session, BenchWorkload workload, const BenchOptions *options)
+{
+    BenchClient client;
+    WSMAN_OPERATION_HANDLE receiveOperation = NULL;
+    MI_Uint8 *message;
+    double *samples;
+    MI_Uint32 count = 0;
+    MI_Uint32 errorCode;
+    double start, cpuStart, seconds, cpuUs = 0;
+
+    samples = calloc(options->iterations, sizeof(double));
+    message = malloc(options->messageSize);
+    if ((samples == NULL) || (message == NULL))
+    {
+        free(samples);
+        free(message);
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    }
+    memset(message, 'x', options->messageSize);
+
+    memset(&client, 0, sizeof(client));
+    errorCode = BenchOpen(session, &client, options);
+    if ((errorCode == 0) && (workload == BenchSend))
+        errorCode = BenchStartReceive(&client, &receiveOperation);
+
+    start = NowUs();
+    cpuStart = CpuUs();
+    while ((errorCode == 0) && (count != options->iterations))
+    {
+        double iterationStart = NowUs();
+        ptrdiff_t expected = Atomic_Read(&client.received) + options->messageSize;
+
+        errorCode = BenchSendMessage(&client, message, options->messageSize);
+        if ((errorCode == 0) && (workload == BenchReceive))
+            errorCode = BenchStartReceive(&client, &receiveOperation);
+        if (errorCode == 0)
+            errorCode = BenchWaitReceived(&client, expected);
+        if (workload == BenchReceive)
+        {
+            WSManCloseOperation(receiveOperation, 0);
+            receiveOperation = NULL;
+        }
+        if (errorCode == 0)
+            samples[count++] = NowUs() - iterationStart;
+    }
+    cpuUs = CpuUs() - cpuStart;
+    seconds = (NowUs() - start) / 1000000.0;
+
+    if (receiveOperation)
+        WSManCloseOperation(receiveOperation, 0);
+    BenchClose(&client);
+
+    qsort(samples, count, sizeof(double), CompareSamples);
+    printf("{\"workload\":\"%s\",\"result\":%u,\"iterations\":%u,\"compressed\":%s,\"messageBytes\":%u,"
+        "\"seconds\":%.6f,\"opsPerSecond\":%.1f,\"cpuUsPerIteration\":%.1f,"
+        "\"latencyUs\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+        _workloadNames[workload], errorCode, count, options->compressed ? "true" : "false", options->messageSize,
+        seconds, seconds > 0 ? count / seconds : 0, count ? cpuUs / count : 0,
+        Percentile(samples, count, 0.50), Percentile(samples, count, 0.99), Percentile(samples, count, 0.999),
+        count ? samples[count - 1] : 0);
+    fflush(stdout);
+
+    free(samples);
+    free(message);
+    return errorCode;
+}
+
+/* Loopback endpoints that accept connections and never answer, standing in for hosts that
+ * hang. Whatever the client sends is read and thrown away. open is how many of the client's
+ * connections to them are still open and maxOpen the most there have been at once, which the
+ * fan-out's concurrency limit bounds since each stalled host holds its connection until it
+ * is given up on.
+ */
+typedef struct _BenchStall
+{
+    MI_Uint32 count;
+    int listeners[BENCH_MAX_HOSTS];
+    MI_Uint32 ports[BENCH_MAX_HOSTS];
+    Thread thread;
+    volatile ptrdiff_t stop;
+    MI_Uint32 open;
+    MI_Uint32 maxOpen;
+} BenchStall;
+
+static PAL_Uint32 THREAD_API BenchStallThread(void *param)
+{
+    BenchStall *stall = (BenchStall*) param;
+    struct pollfd fds[BENCH_MAX_HOSTS + BENCH_STALL_MAX_CONNECTIONS];
+    MI_Uint32 count = stall->count;
+    MI_Uint32 i;
+    char buffer[4096];
+
+    for (i = 0; i != stall->count; i++)
+    {
+        fds[i].fd = stall->listeners[i];
+        fds[i].events = POLLIN;
+    }
+
+    while (!Atomic_Read(&stall->stop))
+    {
+        if (poll(fds, count, BENCH_STALL_POLL_MS) <= 0)
+            continue;
+
+        for (i = 0; i != count; i++)
+        {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            if (i < stall->count)
+            {
+                int connection = accept(fds[i].fd, NULL, NULL);
+
+                if (connection < 0)
+                    continue;
+                if (count == MI_COUNT(fds))
+                {
+                    close(connection);
+                    continue;
+                }
+                fds[count].fd = connection;
+                fds[count].events = POLLIN;
+                fds[count].revents = 0;
+                count++;
+                stall->open++;
+                if (stall->open > stall->maxOpen)
+                    stall->maxOpen = stall->open;
+            }
+            else if (read(fds[i].fd, buffer, sizeof(buffer)) <= 0)
+            {
+                close(fds[i].fd);
+                fds[i--] = fds[--count];
+                stall->open--;
+            }
+        }
+    }
+
+    for (i = stall->count; i != count; i++)
+        close(fds[i].fd);
+    return 0;
+}
+
+static MI_Uint32 BenchStallStart(BenchStall *stall, MI_Uint32 count)
+{
+    MI_Uint32 i;
+
+    memset(stall, 0, sizeof(*stall));
+    for (i = 0; i != count; i++)
+    {
+        struct sockaddr_in address;
+        socklen_t length = sizeof(address);
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (listener < 0)
+            break;
+        stall->listeners[stall->count++] = listener;
+
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if ((bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0) ||
+            (listen(listener, 16) != 0) ||
+            (getsockname(listener, (struct sockaddr*) &address, &length) != 0))
+            break;
+        stall->ports[i] = ntohs(address.sin_port);
+    }
+    if ((i == count) && (Thread_CreateJoinable(&stall->thread, BenchStallThread, NULL, stall) == 0))
+        return MI_RESULT_OK;
+
+    for (i = 0; i != stall->count; i++)
+        close(stall->listeners[i]);
+    stall->count = 0;
+    return MI_RESULT_FAILED;
+}
+
+static void BenchStallStop(BenchStall *stall)
+{
+    PAL_Uint32 threadResult;
+    MI_Uint32 i;
+
+    Atomic_Swap(&stall->stop, 1);
+    Thread_Join(&stall->thread, &threadResult);
+    Thread_Destroy(&stall->thread);
+    for (i = 0; i != stall->count; i++)
+        close(stall->listeners[i]);
+}
+
+/* What the fan-out callback hands back, indexed by host */
+typedef struct _BenchFanOut
+{
+    volatile ptrdiff_t done;
+    double start;
+    MI_Uint32 results[BENCH_MAX_HOSTS * 2];
+    double finishedUs[BENCH_MAX_HOSTS * 2];
+} BenchFanOut;
+
+static void BenchFanOutCallback(
+    void *operationContext,
+    MI_Uint32 flags,
+    WSMAN_ERROR *error,
+    MI_Uint32 hostIndex,
+    const MI_Char16 *host,
+    WSMAN_RECEIVE_DATA_RESULT *data)
+{
+    BenchFanOut *fanOut = (BenchFanOut*) operationContext;
+
+    if (!(flags & WSMAN_FLAG_CALLBACK_END_OF_OPERATION))
+        return;
+
+    if (hostIndex == WSMAN_FANOUT_ALL_HOSTS)
+    {
+        Atomic_Swap(&fanOut->done, 1);
+        CondLock_Broadcast((ptrdiff_t) &fanOut->done);
+        return;
+    }
+    fanOut->results[hostIndex] = error ? error->code : 0;
+    fanOut->finishedUs[hostIndex] = NowUs() - fanOut->start;
+}
+
+/* RunFanOut
+ * Run exit on every echo host and stalled host once. With cancel the fan-out is closed
+ * halfway through the host timeout, and given ten times as long so a cancel that does not
+ * work shows up as the stalled hosts running out the clock instead of hanging the run.
+ */
+static MI_Uint32 RunFanOut(WSMAN_API_HANDLE api, const BenchOptions *options, WSMAN_AUTHENTICATION_CREDENTIALS *credentials, MI_Boolean cancel)
+{
+    static MI_Char16 resourceUri[BENCH_MAX_STRING];
+    static MI_Char16 stdinStream[] = { 's', 't', 'd', 'i', 'n', ' ', 'p', 'r', 0 };
+    static MI_Char16 stdoutStream[] = { 's', 't', 'd', 'o', 'u', 't', 0 };
+    static MI_Char16 commandLine[] = { 'e', 'x', 'i', 't', 0 };
+    static BenchFanOut fanOut;
+    static MI_Char16 stalledHosts[BENCH_MAX_HOSTS][BENCH_MAX_STRING];
+    const MI_Char16 *hosts[BENCH_MAX_HOSTS * 2];
+    const MI_Char16 *inputIds[1] = { stdinStream };
+    const MI_Char16 *outputIds[1] = { stdoutStream };
+    WSMAN_STREAM_ID_SET inputSet = { 1, inputIds };
+    WSMAN_STREAM_ID_SET outputSet = { 1, outputIds };
+    WSMAN_SHELL_STARTUP_INFO startupInfo;
+    WSMAN_FANOUT_SESSION_OPTION unencrypted;
+    WSMAN_FANOUT_INFO info;
+    WSMAN_FANOUT_ASYNC async = { &fanOut, BenchFanOutCallback };
+    WSMAN_FANOUT_HANDLE handle = NULL;
+    BenchStall stall;
+    MI_Uint32 hostCount = 0;
+    MI_Uint32 echoFailed = 0;
+    MI_Uint32 stalledFailed = 0;
+    MI_Uint32 i;
+    MI_Uint32 errorCode;
+    MI_Boolean passed;
+    double closeUs = 0;
+    char port[32];
+
+    if (BenchStallStart(&stall, options->stalledHosts) != MI_RESULT_OK)
+        return MI_RESULT_FAILED;
+
+    /* Echo hosts first so they are not stuck behind the stalled ones */
+    for (i = 0; i != options->connectionCount; i++)
+        hosts[hostCount++] = options->connections[i];
+    for (i = 0; i != stall.count; i++)
+    {
+        snprintf(port, sizeof(port), "127.0.0.1:%u", stall.ports[i]);
+        Widen(stalledHosts[i], port);
+        hosts[hostCount++] = stalledHosts[i];
+    }
+
+    Widen(resourceUri, BENCH_RESOURCE_URI);
+    memset(&startupInfo, 0, sizeof(startupInfo));
+    startupInfo.inputStreamSet = &inputSet;
+    startupInfo.outputStreamSet = &outputSet;
+
+    /* Plain http on loopback, as for the other workloads */
+    memset(&unencrypted, 0, sizeof(unencrypted));
+    unencrypted.option = WSMAN_OPTION_UNENCRYPTED_MESSAGES;
+    unencrypted.data.type = WSMAN_DATA_TYPE_DWORD;
+    unencrypted.data.number = 1;
+
+    memset(&info, 0, sizeof(info));
+    info.hostCount = hostCount;
+    info.hosts = hosts;
+    info.credentials = credentials;
+    info.shellFlags = options->compressed ? 0 : WSMAN_FLAG_NO_COMPRESSION;
+    info.resourceUri = resourceUri;
+    info.startupInfo = &startupInfo;
+    info.commandLine = commandLine;
+    info.maxConcurrency = options->concurrency;
+    info.hostTimeoutMs = cancel ? options->hostTimeoutMs * 10 : options->hostTimeoutMs;
+    info.sessionOptionCount = 1;
+    info.sessionOptions = &unencrypted;
+
+    memset(&fanOut, 0, sizeof(fanOut));
+    fanOut.start = NowUs();
+    errorCode = WSManRunShellCommandFanOut(api, 0, &info, &async, &handle);
+    if (errorCode == 0)
+    {
+        if (cancel)
+        {
+            double closeStart;
+
+            Sleep_Milliseconds(options->hostTimeoutMs / 2);
+            closeStart = NowUs();
+            WSManCloseFanOut(handle, 0);
+            closeUs = NowUs() - closeStart;
+        }
+        else
+        {
+            while (!Atomic_Read(&fanOut.done))
+            {
+                CondLock_Wait((ptrdiff_t) &fanOut.done, &fanOut.done, 0, CONDLOCK_DEFAULT_SPINCOUNT);
+            }
+            WSManCloseFanOut(handle, 0);
+        }
+    }
+    BenchStallStop(&stall);
+
+    for (i = 0; i != hostCount; i++)
+    {
+        if (i < options->connectionCount)
+            echoFailed += (fanOut.results[i] != 0);
+        else
+            stalledFailed += (fanOut.results[i] != 0);
+    }
+
+    /* Every stalled host has to be given up on, within the timeout or by the close */
+    passed = (errorCode == 0) && (echoFailed == 0) && (stalledFailed == stall.count) &&
+        (stall.maxOpen <= options->concurrency) &&
+        (!cancel || (closeUs < options->hostTimeoutMs * 1000.0));
+
+    printf("{\"workload\":\"%s\",\"result\":%u,\"passed\":%s,\"echoHosts\":%u,\"echoFailed\":%u,"
+        "\"stalledHosts\":%u,\"stalledFailed\":%u,\"concurrency\":%u,\"maxStalledConnections\":%u,"
+        "\"hostTimeoutMs\":%u,\"closeUs\":%.1f,\"results\":[",
+        cancel ? "fanout-cancel" : "fanout", errorCode, passed ? "true" : "false", options->connectionCount, echoFailed,
+        stall.count, stalledFailed, options->concurrency, stall.maxOpen,
+        info.hostTimeoutMs, closeUs);
+    for (i = 0; i != hostCount; i++)
+        printf("%s{\"result\":%u,\"finishedUs\":%.1f}", i ? "," : "", fanOut.results[i], fanOut.finishedUs[i]);
+    printf("]}\n");
+    fflush(stdout);
+
+    if (errorCode == 0 && !passed)
+        errorCode = MI_RESULT_FAILED;
+    return errorCode;
+}
+
+static void Usage(void)
+{
+    fprintf(stderr, "usage: clientbench [-w send|receive|fanout|all] [-n iterations] [-s size] [-h connection]... [-u user] [-p password] [-c]\n"
+                    "                   [-k concurrency] [-t host timeout] [-b stalled hosts]\n");
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    WSMAN_API_HANDLE api;
+    WSMAN_SESSION_HANDLE session;
+    WSMAN_AUTHENTICATION_CREDENTIALS credentials;
+    WSMAN_DATA unencrypted;
+    int workload = -1;  /* -1 runs all of them */
+    int i;
+    MI_Uint32 errorCode;
+    MI_Uint32 failed = 0;
+
+    memset(&options, 0, sizeof(options));
+    options.iterations = 1000;
+    options.messageSize = 64;
+    options.concurrency = 2;
+    options.hostTimeoutMs = 1000;
+    options.stalledHosts = 2;
+
+    for (i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-c") == 0))
+        {
+            options.compressed = MI_TRUE;
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-n") == 0))
+        {
+            options.iterations = strtoul(argv[++i], NULL, 10);
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-s") == 0))
+        {
+            options.messageSize = strtoul(argv[++i], NULL, 10);
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-h") == 0) && (options.connectionCount != BENCH_MAX_HOSTS))
+        {
+            Widen(options.connections[options.connectionCount++], argv[++i]);
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-k") == 0))
+        {
+            options.concurrency = strtoul(argv[++i], NULL, 10);
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-t") == 0))
+        {
+            options.hostTimeoutMs = strtoul(argv[++i], NULL, 10);
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-b") == 0))
+        {
+            options.stalledHosts = strtoul(argv[++i], NULL, 10);
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-u") == 0))
+        {
+            Widen(options.user, argv[++i]);
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-p") == 0))
+        {
+            Widen(options.password, argv[++i]);
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-w") == 0))
+        {
+            i++;
+            if (strcmp(argv[i], "all") != 0)
+            {
+                for (workload = 0; workload != BenchWorkloadCount; workload++)
+                {
+                    if (strcmp(argv[i], _workloadNames[workload]) == 0)
+                        break;
+                }
+                if (workload == BenchWorkloadCount)
+                {
+                    Usage();
+                    return 1;
+                }
+            }
+        }
+        else
+        {
+            Usage();
+            return 1;
+        }
+    }
+
+    if ((options.iterations == 0) || (options.messageSize == 0) || (options.concurrency == 0) ||
+        (options.hostTimeoutMs == 0) || (options.stalledHosts > BENCH_MAX_HOSTS))
+    {
+        Usage();
+        return 1;
+    }
+    if (options.connectionCount == 0)
+    {
+        Widen(options.connections[options.connectionCount++], "localhost:5985");
+    }
+
+    memset(&credentials, 0, sizeof(credentials));
+    credentials.authenticationMechanism = WSMAN_FLAG_AUTH_BASIC;
+    credentials.userAccount.username = options.user;
+    credentials.userAccount.password = options.password;
+
+    errorCode = WSManInitialize(0, &api);
+    if (errorCode == 0)
+        errorCode = WSManCreateSession(api, options.connections[0], 0, &credentials, NULL, &session);
+    if (errorCode)
+    {
+        fprintf(stderr, "session setup failed, errorCode=%u\n", errorCode);
+        return 1;
+    }
+
+    /* Plain http on loopback, the same as an omiserver set up for a quick local test */
+    unencrypted.type = WSMAN_DATA_TYPE_DWORD;
+    unencrypted.number = 1;
+    WSManSetSessionOption(session, WSMAN_OPTION_UNENCRYPTED_MESSAGES, &unencrypted);
+
+    for (i = 0; i != BenchFanOutWorkload; i++)
+    {
+        if ((workload == -1) || (workload == i))
+        {
+            errorCode = RunWorkload(session, (BenchWorkload) i, &options);
+            if (errorCode)
+                failed = errorCode;
+        }
+    }
+    if (workload == BenchFanOutWorkload)
+    {
+        errorCode = RunFanOut(api, &options, &credentials, MI_FALSE);
+        if (errorCode)
+            failed = errorCode;
+        errorCode = RunFanOut(api, &options, &credentials, MI_TRUE);
+        if (errorCode)
+            failed = errorCode;
+    }
+
+    WSManCloseSession(session, 0);
+    WSManDeinitialize(api, 0);
+
+    return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,721 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <MI.h>
+#include <base/batch.h>
+#include "BufferManipulation.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CODECBENCH_HAVE_TSC
+#endif
+
+/* Codec microbenchmarks for the xpress, Base64 and UTF-8/UTF-16LE conversions the provider
+ * runs on every Send and Receive. Each codec is measured on five kinds of input:
+ *
+ *  clixml  PSRP CLIXML fragments (bench/corpus/clixml.xml)
+ *  log     provider text log lines (bench/corpus/log.txt)
+ *  random  incompressible random bytes from a fixed seed
+ *  runs    runs of one character of random length, rules and space padded table rows
+ *  fill    a single repeated character
+ *
+ * The corpus files are tiled out to each input size. The runs and fill inputs are
+ * generated; they are mostly matches shorter than the distance they copy from, which is
+ * what console output that redraws or pads looks like. The UTF conversions work on NUL
+ * terminated strings so they only run on the text inputs.
+ *
+ * Every case is run for a number of warmup passes and then timed over a number of
+ * repetitions. A repetition loops over the input enough times to process at least 1MB so
+ * small inputs are not dominated by the clock. The median repetition is reported as MB/s
+ * and cycles/byte, where cycles are time stamp counter ticks and only reported on x86.
+ *
+ * With -c nothing is timed. Instead every input is checked to come back byte for byte
+ * through CompressBuffer and CompressStream followed by DecompressBuffer, and the bytes a
+ * Send or Receive of it puts on the wire are reported with and without compression.
+ * Truncated, oversized and overflowing chunk framing must be rejected by DecompressBuffer.
+ * If the corpus directory holds <file>.xpress next to a corpus file, that is taken to be
+ * the framed chunks a Windows client sent for the file and must decompress to it exactly.
+ *
+ * usage: codecbench [-d corpusdir] [-m maxsize] [-w warmup] [-r repetitions] [-p cpu] [-j] [-c]
+ *
+ *  -d  directory holding the corpus files (default is the source tree's bench/corpus)
+ *  -m  largest input size in bytes (default 16MB)
+ *  -w  warmup passes per case (default 2)
+ *  -r  timed repetitions per case (default 9)
+ *  -p  pin the benchmark to this CPU
+ *  -j  print one JSON object per case instead of a table
+ *  -c  check round trips, malformed framing and captures and report wire bytes
+ */
+
+#ifndef CODECBENCH_CORPUS_DIR
+#define CODECBENCH_CORPUS_DIR "bench/corpus"
+#endif
+
+#define CODECBENCH_MIN_BYTES (1024 * 1024)
+#define CODECBENCH_MAX_REPETITIONS 101
+
+static const MI_Uint32 _sizes[] = { 100, 1024, 16 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+
+typedef enum _CodecSource
+{
+    CodecSourceClixml,
+    CodecSourceLog,
+    CodecSourceRandom,
+    CodecSourceRuns,
+    CodecSourceFill,
+    CodecSourceCount
+} CodecSource;
+
+static const char *_sourceNames[CodecSourceCount] = { "clixml", "log", "random", "runs", "fill" };
+static const char *_sourceFiles[CodecSourceCount] = { "clixml.xml", "log.txt", NULL, NULL, NULL };
+
+#define CODECBENCH_RUNS_SEED_BYTES (256 * 1024)
+
+/* One input of one size in every form the codecs consume */
+typedef struct _CodecInput
+{
+    CodecSource source;
+    MI_Uint32 size;
+    MI_Boolean text;
+
+    DecodeBuffer plain;         /* NUL terminated after bufferUsed */
+    DecodeBuffer compressed;
+    DecodeBuffer encoded;       /* Base64 text of plain */
+    MI_Char16 *utf16;           /* plain as UTF-16LE, text inputs only */
+    Batch *utf16Batch;
+} CodecInput;
+
+/* Runs the codec once over the input and frees what it produced */
+typedef MI_Result (*CodecFunction)(CodecInput *input);
+
+typedef struct _CodecCase
+{
+    const char *name;
+    CodecFunction function;
+    MI_Boolean textOnly;
+} CodecCase;
+
+static MI_Result RunCompress(CodecInput *input)
+{
+    DecodeBuffer output;
+    MI_Result miResult = CompressBuffer(&input->plain, &output, 0);
+
+    if (miResult == MI_RESULT_OK)
+        free(output.buffer);
+    return miResult;
+}
+
+static MI_Result RunDecompress(CodecInput *input)
+{
+    DecodeBuffer output;
+    MI_Result miResult = DecompressBuffer(&input->compressed, &output);
+
+    if (miResult == MI_RESULT_OK)
+        free(output.buffer);
+    return miResult;
+}
+
+static MI_Result RunBase64Encode(CodecInput *input)
+{
+    DecodeBuffer output;
+    MI_Result miResult = Base64EncodeBuffer(&input->plain, &output);
+
+    if (miResult == MI_RESULT_OK)
+        free(output.buffer);
+    return miResult;
+}
+
+static MI_Result RunBase64Decode(CodecInput *input)
+{
+    DecodeBuffer output;
+    MI_Result miResult = Base64DecodeBuffer(&input->encoded, &output);
+
+    if (miResult == MI_RESULT_OK)
+        free(output.buffer);
+    return miResult;
+}
+
+static MI_Result RunUtf8ToUtf16(CodecInput *input)
+{
+    Batch *batch = Batch_New(BATCH_MAX_PAGES);
+    MI_Char16 *output;
+    MI_Result miResult = MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    if (batch)
+    {
+        miResult = Utf8ToUtf16Le(batch, input->plain.buffer, &output) ? MI_RESULT_OK : MI_RESULT_FAILED;
+        Batch_Delete(batch);
+    }
+    return miResult;
+}
+
+static MI_Result RunUtf16ToUtf8(CodecInput *input)
+{
+    Batch *batch = Batch_New(BATCH_MAX_PAGES);
+    char *output;
+    MI_Result miResult = MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    if (batch)
+    {
+        miResult = Utf16LeToUtf8(batch, input->utf16, &output) ? MI_RESULT_OK : MI_RESULT_FAILED;
+        Batch_Delete(batch);
+    }
+    return miResult;
+}
+
+static const CodecCase _cases[] =
+{
+    { "compress", RunCompress, MI_FALSE },
+    { "decompress", RunDecompress, MI_FALSE },
+    { "base64encode", RunBase64Encode, MI_FALSE },
+    { "base64decode", RunBase64Decode, MI_FALSE },
+    { "utf8toutf16le", RunUtf8ToUtf16, MI_TRUE },
+    { "utf16letoutf8", RunUtf16ToUtf8, MI_TRUE }
+};
+
+static double NowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000000.0) + now.tv_nsec;
+}
+
+static MI_Uint64 NowCycles(void)
+{
+#ifdef CODECBENCH_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static MI_Uint8 *ReadCorpusFile(const char *directory, const char *fileName, MI_Uint32 *length)
+{
+    char path[1024];
+    FILE *file;
+    MI_Uint8 *data = NULL;
+    long fileLength;
+
+    snprintf(path, sizeof(path), "%s/%s", directory, fileName);
+    file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "failed to open corpus file %s\n", path);
+        return NULL;
+    }
+
+    if ((fseek(file, 0, SEEK_END) == 0) && ((fileLength = ftell(file)) > 0) && (fseek(file, 0, SEEK_SET) == 0))
+    {
+        data = malloc(fileLength);
+        if (data && (fread(data, 1, fileLength, file) != (size_t) fileLength))
+        {
+            free(data);
+            data = NULL;
+        }
+        *length = (MI_Uint32) fileLength;
+    }
+    fclose(file);
+    return data;
+}
+
+/* Generate the seed for the runs input: runs of one to a few hundred copies of a
+ * character, dashed rules and table rows padded out with spaces, all from a fixed seed.
+ */
+static MI_Uint8 *MakeRunsSeed(MI_Uint32 *length)
+{
+    static const char alphabet[] = "ab -=.0\n";
+    MI_Uint8 *seed = malloc(CODECBENCH_RUNS_SEED_BYTES);
+    MI_Uint32 random = 0x2545f491;
+    MI_Uint32 used = 0;
+
+    if (seed == NULL)
+        return NULL;
+
+    while (used != CODECBENCH_RUNS_SEED_BYTES)
+    {
+        MI_Uint32 run;
+        MI_Uint32 kind;
+
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        kind = random % 4;
+        run = 1 + (random >> 8) % 300;
+        if (run > CODECBENCH_RUNS_SEED_BYTES - used)
+            run = CODECBENCH_RUNS_SEED_BYTES - used;
+
+        if (kind == 0)
+        {
+            /* A rule the width of a console line */
+            run = run < 80 ? run : 80;
+            memset(seed + used, '-', run);
+        }
+        else if (kind == 1)
+        {
+            /* A table cell: a few characters padded out to the column width */
+            MI_Uint32 text = run < 6 ? run : 6;
+            memset(seed + used, alphabet[random % (sizeof(alphabet) - 1)], text);
+            memset(seed + used + text, ' ', run - text);
+        }
+        else
+        {
+            memset(seed + used, alphabet[(random >> 4) % (sizeof(alphabet) - 1)], run);
+        }
+        used += run;
+    }
+
+    *length = used;
+    return seed;
+}
+
+static void FreeInput(CodecInput *input)
+{
+    free(input->plain.buffer);
+    free(input->compressed.buffer);
+    free(input->encoded.buffer);
+    if (input->utf16Batch)
+        Batch_Delete(input->utf16Batch);
+    memset(input, 0, sizeof(*input));
+}
+
+/* Build the input of the given size by tiling the seed, or from random bytes without one,
+ * and prepare the compressed, Base64 and UTF-16 forms the decoders start from.
+ */
+static MI_Result MakeInput(CodecSource source, const MI_Uint8 *seed, MI_Uint32 seedLength, MI_Uint32 size, CodecInput *input)
+{
+    MI_Uint32 i;
+    MI_Uint32 random = 0x9e3779b9;
+    MI_Result miResult;
+
+    memset(input, 0, sizeof(*input));
+    input->source = source;
+    input->size = size;
+    input->text = (seed != NULL);
+
+    input->plain.buffer = malloc(size + 1);
+    if (input->plain.buffer == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    input->plain.bufferLength = size;
+    input->plain.bufferUsed = size;
+
+    for (i = 0; i != size; i++)
+    {
+        if (seed)
+        {
+            input->plain.buffer[i] = seed[i % seedLength];
+        }
+        else
+        {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            input->plain.buffer[i] = (MI_Char) random;
+        }
+    }
+    input->plain.buffer[size] = '\0';
+
+    miResult = CompressBuffer(&input->plain, &input->compressed, 0);
+    if (miResult == MI_RESULT_OK)
+    {
+        input->compressed.bufferLength = input->compressed.bufferUsed;
+        miResult = Base64EncodeBuffer(&input->plain, &input->encoded);
+    }
+    if ((miResult == MI_RESULT_OK) && input->text)
+    {
+        input->utf16Batch = Batch_New(BATCH_MAX_PAGES);
+        if ((input->utf16Batch == NULL) || !Utf8ToUtf16Le(input->utf16Batch, input->plain.buffer, &input->utf16))
+            miResult = MI_RESULT_FAILED;
+    }
+
+    if (miResult != MI_RESULT_OK)
+        FreeInput(input);
+    return miResult;
+}
+
+static int CompareDoubles(const void *a, const void *b)
+{
+    double left = *(const double*) a;
+    double right = *(const double*) b;
+    return (left > right) - (left < right);
+}
+
+static MI_Result RunCase(const CodecCase *codecCase, CodecInput *input, MI_Uint32 warmup, MI_Uint32 repetitions, MI_Boolean json)
+{
+    double nsPerByte[CODECBENCH_MAX_REPETITIONS];
+    double cyclesPerByte[CODECBENCH_MAX_REPETITIONS];
+    MI_Uint32 loops = (CODECBENCH_MIN_BYTES + input->size - 1) / input->size;
+    MI_Uint32 i, loop;
+    MI_Result miResult = MI_RESULT_OK;
+    double medianNs, medianCycles, ratio;
+
+    for (i = 0; (i != warmup) && (miResult == MI_RESULT_OK); i++)
+        miResult = codecCase->function(input);
+
+    for (i = 0; (i != repetitions) && (miResult == MI_RESULT_OK); i++)
+    {
+        double startNs = NowNs();
+        MI_Uint64 startCycles = NowCycles();
+        double bytes = (double) loops * input->size;
+
+        for (loop = 0; (loop != loops) && (miResult == MI_RESULT_OK); loop++)
+            miResult = codecCase->function(input);
+
+        cyclesPerByte[i] = (NowCycles() - startCycles) / bytes;
+        nsPerByte[i] = (NowNs() - startNs) / bytes;
+    }
+    if (miResult != MI_RESULT_OK)
+    {
+        fprintf(stderr, "%s on %s/%u failed, miResult=%u\n", codecCase->name, _sourceNames[input->source], input->size, miResult);
+        return miResult;
+    }
+
+    qsort(nsPerByte, repetitions, sizeof(double), CompareDoubles);
+    qsort(cyclesPerByte, repetitions, sizeof(double), CompareDoubles);
+    medianNs = nsPerByte[repetitions / 2];
+    medianCycles = cyclesPerByte[repetitions / 2];
+    ratio = (double) input->compressed.bufferUsed / input->size;
+
+    /* MB/s is relative to the uncompressed/unencoded size for every codec */
+    if (json)
+    {
+        printf("{\"codec\":\"%s\",\"input\":\"%s\",\"bytes\":%u,\"repetitions\":%u,\"loops\":%u,"
+            "\"mbPerSecond\":%.2f,\"bestMbPerSecond\":%.2f,\"nsPerByte\":%.4f,\"cyclesPerByte\":%.4f,"
+            "\"compressionRatio\":%.4f}\n",
+            codecCase->name, _sourceNames[input->source], input->size, repetitions, loops,
+            1000.0 / medianNs, 1000.0 / nsPerByte[0], medianNs, medianCycles, ratio);
+    }
+    else
+    {
+        printf("%-14s %-7s %9u %10.2f %10.2f %8.3f %8.3f\n",
+            codecCase->name, _sourceNames[input->source], input->size,
+            1000.0 / medianNs, 1000.0 / nsPerByte[0], medianCycles, ratio);
+    }
+    fflush(stdout);
+    return MI_RESULT_OK;
+}
+
+/* Decompresses the framed chunks and compares the result with the expected bytes */
+static MI_Boolean DecompressesTo(DecodeBuffer *compressed, const void *expected, MI_Uint32 expectedLength)
+{
+    DecodeBuffer output;
+    MI_Boolean same;
+
+    if (DecompressBuffer(compressed, &output) != MI_RESULT_OK)
+        return MI_FALSE;
+
+    same = (output.bufferUsed == expectedLength) && (memcmp(output.buffer, expected, expectedLength) == 0);
+    free(output.buffer);
+    return same;
+}
+
+/* DecompressBuffer has to fail on the framing without touching memory it does not own */
+static MI_Boolean Rejects(const MI_Uint8 *framing, MI_Uint32 length)
+{
+    DecodeBuffer compressed;
+    DecodeBuffer output;
+    MI_Uint8 *copy = malloc(length ? length : 1);
+    MI_Result miResult;
+
+    if (copy == NULL)
+        return MI_FALSE;
+
+    /* An exact size copy lets ASAN builds catch reads past the end */
+    memcpy(copy, framing, length);
+    compressed.buffer = (MI_Char*) copy;
+    compressed.bufferLength = length;
+    compressed.bufferUsed = length;
+
+    miResult = DecompressBuffer(&compressed, &output);
+    if (miResult == MI_RESULT_OK)
+        free(output.buffer);
+    free(copy);
+    return miResult != MI_RESULT_OK;
+}
+
+static MI_Result CheckInput(CodecInput *input, MI_Boolean json)
+{
+    CompressStream stream;
+    DecodeBuffer streamed;
+    DecodeBuffer rawWire, compressedWire;
+    const MI_Uint8 *framing = (const MI_Uint8*) input->compressed.buffer;
+    MI_Uint32 length = input->compressed.bufferUsed;
+    MI_Uint32 half = input->size / 2;
+    MI_Result miResult = MI_RESULT_OK;
+
+    if (!DecompressesTo(&input->compressed, input->plain.buffer, input->size))
+    {
+        fprintf(stderr, "CompressBuffer round trip of %s/%u differs\n", _sourceNames[input->source], input->size);
+        miResult = MI_RESULT_FAILED;
+    }
+
+    /* Feed the stream in two uneven pieces so a chunk straddles the feeds */
+    if (CompressStreamInit(&stream) == MI_RESULT_OK)
+    {
+        if ((CompressStreamFeed(&stream, input->plain.buffer, half) != MI_RESULT_OK) ||
+            (CompressStreamFeed(&stream, input->plain.buffer + half, input->size - half) != MI_RESULT_OK) ||
+            (CompressStreamFinish(&stream, &streamed, 0) != MI_RESULT_OK))
+        {
+            memset(&streamed, 0, sizeof(streamed));
+        }
+        if ((streamed.buffer == NULL) || !DecompressesTo(&streamed, input->plain.buffer, input->size))
+        {
+            fprintf(stderr, "CompressStream round trip of %s/%u differs\n", _sourceNames[input->source], input->size);
+            miResult = MI_RESULT_FAILED;
+        }
+        free(streamed.buffer);
+        CompressStreamDestroy(&stream);
+    }
+
+    /* A partial header, and a last chunk one byte short of its header */
+    if (!Rejects(framing, length < 3 ? length : 3) || !Rejects(framing, length - 1))
+    {
+        fprintf(stderr, "truncated framing of %s/%u was accepted\n", _sourceNames[input->source], input->size);
+        miResult = MI_RESULT_FAILED;
+    }
+
+    rawWire = input->encoded;
+    memset(&compressedWire, 0, sizeof(compressedWire));
+    if (Base64EncodeBuffer(&input->compressed, &compressedWire) != MI_RESULT_OK)
+        return MI_RESULT_FAILED;
+
+    if (json)
+    {
+        printf("{\"check\":\"%s\",\"input\":\"%s\",\"bytes\":%u,\"wireBytes\":%u,"
+            "\"compressedWireBytes\":%u}\n",
+            miResult == MI_RESULT_OK ? "ok" : "failed", _sourceNames[input->source], input->size,
+            rawWire.bufferUsed, compressedWire.bufferUsed);
+    }
+    else
+    {
+        printf("%-7s %9u %10u %10u %7.1f%% %s\n",
+            _sourceNames[input->source], input->size, rawWire.bufferUsed, compressedWire.bufferUsed,
+            100.0 - (100.0 * compressedWire.bufferUsed / rawWire.bufferUsed),
+            miResult == MI_RESULT_OK ? "ok" : "FAILED");
+    }
+    fflush(stdout);
+    free(compressedWire.buffer);
+    return miResult;
+}
+
+/* Framing no valid sender produces: a payload longer than the buffer, and enough chunks
+ * claiming 64K each for the MI_Uint32 total to wrap around to a small allocation.
+ */
+static MI_Result CheckMalformedFraming(void)
+{
+    static const MI_Uint8 oversized[] = { 0x00, 0x00, 0xff, 0xff, 'x' };
+    MI_Uint32 chunks = 65537;
+    MI_Uint32 chunkLength = 4 + 1;
+    MI_Uint8 *framing = calloc(chunks, chunkLength);
+    MI_Uint32 i;
+    MI_Result miResult = MI_RESULT_OK;
+
+    if (framing == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    for (i = 0; i != chunks; i++)
+    {
+        /* originalSize 0xffff and compressedSize 0 are 64K and 1 byte after the off-by-one */
+        framing[i * chunkLength] = 0xff;
+        framing[i * chunkLength + 1] = 0xff;
+    }
+
+    if (!Rejects(oversized, sizeof(oversized)))
+    {
+        fprintf(stderr, "chunk longer than the buffer was accepted\n");
+        miResult = MI_RESULT_FAILED;
+    }
+    if (!Rejects(framing, chunks * chunkLength))
+    {
+        fprintf(stderr, "chunks overflowing the total size were accepted\n");
+        miResult = MI_RESULT_FAILED;
+    }
+    free(framing);
+    return miResult;
+}
+
+/* Decompresses <file>.xpress captures of Windows client traffic where there are any */
+static MI_Result CheckCaptures(const char *corpusDir, MI_Uint8 **seeds, MI_Uint32 *seedLengths)
+{
+    MI_Uint32 source;
+    MI_Result miResult = MI_RESULT_OK;
+
+    for (source = 0; source != CodecSourceCount; source++)
+    {
+        char captureName[256];
+        char capturePath[1024];
+        DecodeBuffer capture;
+        FILE *file;
+
+        if (_sourceFiles[source] == NULL)
+            continue;
+
+        snprintf(captureName, sizeof(captureName), "%s.xpress", _sourceFiles[source]);
+        snprintf(capturePath, sizeof(capturePath), "%s/%s", corpusDir, captureName);
+        file = fopen(capturePath, "rb");
+        if (file == NULL)
+        {
+            printf("capture %s: not present\n", captureName);
+            continue;
+        }
+        fclose(file);
+
+        memset(&capture, 0, sizeof(capture));
+        capture.buffer = (MI_Char*) ReadCorpusFile(corpusDir, captureName, &capture.bufferUsed);
+        capture.bufferLength = capture.bufferUsed;
+        if ((capture.buffer == NULL) || !DecompressesTo(&capture, seeds[source], seedLengths[source]))
+        {
+            printf("capture %s: FAILED\n", captureName);
+            miResult = MI_RESULT_FAILED;
+        }
+        else
+        {
+            printf("capture %s: ok\n", captureName);
+        }
+        free(capture.buffer);
+    }
+    return miResult;
+}
+
+static void Usage(void)
+{
+    fprintf(stderr, "usage: codecbench [-d corpusdir] [-m maxsize] [-w warmup] [-r repetitions] [-p cpu] [-j] [-c]\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *corpusDir = CODECBENCH_CORPUS_DIR;
+    MI_Uint8 *seeds[CodecSourceCount] = { NULL };
+    MI_Uint32 seedLengths[CodecSourceCount] = { 0 };
+    MI_Uint32 maxSize = 16 * 1024 * 1024;
+    MI_Uint32 warmup = 2;
+    MI_Uint32 repetitions = 9;
+    MI_Boolean json = MI_FALSE;
+    MI_Boolean check = MI_FALSE;
+    int cpu = -1;
+    int i;
+    MI_Uint32 source, size, codec;
+    MI_Result failed = MI_RESULT_OK;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0)
+            json = MI_TRUE;
+        else if (strcmp(argv[i], "-c") == 0)
+            check = MI_TRUE;
+        else if ((i + 1) < argc && (strcmp(argv[i], "-d") == 0))
+            corpusDir = argv[++i];
+        else if ((i + 1) < argc && (strcmp(argv[i], "-m") == 0))
+            maxSize = strtoul(argv[++i], NULL, 10);
+        else if ((i + 1) < argc && (strcmp(argv[i], "-w") == 0))
+            warmup = strtoul(argv[++i], NULL, 10);
+        else if ((i + 1) < argc && (strcmp(argv[i], "-r") == 0))
+            repetitions = strtoul(argv[++i], NULL, 10);
+        else if ((i + 1) < argc && (strcmp(argv[i], "-p") == 0))
+            cpu = atoi(argv[++i]);
+        else
+        {
+            Usage();
+            return 1;
+        }
+    }
+    if ((repetitions == 0) || (repetitions > CODECBENCH_MAX_REPETITIONS))
+    {
+        Usage();
+        return 1;
+    }
+
+    if (cpu >= 0)
+    {
+        cpu_set_t cpuSet;
+
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpu, &cpuSet);
+        if (sched_setaffinity(0, sizeof(cpuSet), &cpuSet) != 0)
+        {
+            fprintf(stderr, "failed to pin to cpu %d\n", cpu);
+            return 1;
+        }
+    }
+
+    for (source = 0; source != CodecSourceCount; source++)
+    {
+        if (_sourceFiles[source])
+        {
+            seeds[source] = ReadCorpusFile(corpusDir, _sourceFiles[source], &seedLengths[source]);
+            if (seeds[source] == NULL)
+                return 1;
+        }
+    }
+    seeds[CodecSourceRuns] = MakeRunsSeed(&seedLengths[CodecSourceRuns]);
+    seeds[CodecSourceFill] = (MI_Uint8*) strdup(" ");
+    seedLengths[CodecSourceFill] = 1;
+    if ((seeds[CodecSourceRuns] == NULL) || (seeds[CodecSourceFill] == NULL))
+    {
+        fprintf(stderr, "failed to generate the runs and fill inputs\n");
+        return 1;
+    }
+
+    if (check)
+    {
+        if ((CheckMalformedFraming() != MI_RESULT_OK) || (CheckCaptures(corpusDir, seeds, seedLengths) != MI_RESULT_OK))
+            failed = MI_RESULT_FAILED;
+        if (!json)
+            printf("%-7s %9s %10s %10s %8s\n", "input", "bytes", "wire", "xpress", "saved");
+    }
+    else if (!json)
+    {
+        printf("%-14s %-7s %9s %10s %10s %8s %8s\n", "codec", "input", "bytes", "MB/s", "best MB/s", "cyc/B", "ratio");
+    }
+
+    for (source = 0; source != CodecSourceCount; source++)
+    {
+        for (size = 0; size != sizeof(_sizes) / sizeof(_sizes[0]); size++)
+        {
+            CodecInput input;
+
+            if (_sizes[size] > maxSize)
+                break;
+
+            if (MakeInput((CodecSource) source, seeds[source], seedLengths[source], _sizes[size], &input) != MI_RESULT_OK)
+            {
+                fprintf(stderr, "failed to prepare %s/%u\n", _sourceNames[source], _sizes[size]);
+                failed = MI_RESULT_FAILED;
+                continue;
+            }
+
+            if (check)
+            {
+                if (CheckInput(&input, json) != MI_RESULT_OK)
+                    failed = MI_RESULT_FAILED;
+                FreeInput(&input);
+                continue;
+            }
+
+            for (codec = 0; codec != sizeof(_cases) / sizeof(_cases[0]); codec++)
+            {
+                if (_cases[codec].textOnly && !input.text)
+                    continue;
+
+                if (RunCase(&_cases[codec], &input, warmup, repetitions, json) != MI_RESULT_OK)
+                    failed = MI_RESULT_FAILED;
+            }
+            FreeInput(&input);
+        }
+    }
+
+    for (source = 0; source != CodecSourceCount; source++)
+        free(seeds[source]);
+
+    return (failed == MI_RESULT_OK) ? 0 : 1;
+}
@@ -0,0 +1,1095 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <MI.h>
+#include <pal/thread.h>
+#include <pal/sleep.h>
+#include <pal/atomic.h>
+#include <pal/lock.h>
+#include "BufferManipulation.h"
+#include "ProviderHost.h"
+
+/* End-to-end provider benchmarks. The provider is loaded through ProviderHost and driven the
+ * way omiserver would drive it for a PSRP client, so every request goes through the same
+ * Shell_CreateInstance, Shell_Invoke_Command, Send, Receive and Signal code paths. Run it
+ * against the echo plugin (shellplugin=echo in omiserver.conf) to measure the provider alone.
+ *
+ * Each workload prints one JSON object per line with its latency percentiles, throughput,
+ * and the process thread count and RSS sampled while the workload was at its peak.
+ *
+ * usage: providerbench [-w workload] [-n iterations] [-t threads] [-s size] [-c] [-g gap]
+ *
+ *  -w  create    shell create/delete storm from every thread
+ *      pingpong  small Send followed by the Receive of its echo, one shell per thread
+ *      bulk      64KB Send/Receive blocks through one shell per thread
+ *      large     a result of more than 64KB with two Receives waiting for it, checked byte for byte
+ *      idle      open 'iterations' shells, hold them all open, then delete them
+ *      reconnect disconnect and reconnect a shell, then echo through its command to show it is back
+ *      recreate  what a client does without reconnect: a new shell and command, an echo, delete
+ *      all       run each of the above in turn (default)
+ *      first     load the provider and time its first shell, command and echo, see RunFirstCommand
+ *  -n  iterations per workload, split across the threads (default 1000)
+ *  -t  threads (default 1)
+ *  -s  message size in bytes for pingpong (default 64)
+ *  -c  create compressed shells so data goes through the xpress codec as well
+ *  -g  milliseconds between loading the provider and the first request for first (default 0)
+ */
+
+#define BENCH_RESOURCE_URI MI_T("http://schemas.microsoft.com/powershell/Microsoft.PowerShell")
+#define BENCH_SIGNAL_TERMINATE MI_T("http://schemas.microsoft.com/wbem/wsman/1/windows/shell/signal/terminate")
+#define BENCH_BULK_SIZE (64 * 1024)
+#define BENCH_LARGE_SIZE (3 * MAX_COMPRESS_BUFFER_BLOCK + 1000)
+#define BENCH_MAX_THREADS 256
+#define BENCH_SAMPLE_INTERVAL_MS 10
+
+typedef enum _BenchWorkload
+{
+    BenchCreate,
+    BenchPingPong,
+    BenchBulk,
+    BenchIdle,
+    BenchReconnect,
+    BenchRecreate,
+    BenchLarge,
+    BenchWorkloadCount
+} BenchWorkload;
+
+static const char *_workloadNames[BenchWorkloadCount] = { "create", "pingpong", "bulk", "idle", "reconnect", "recreate", "large" };
+
+typedef struct _BenchOptions
+{
+    MI_Uint32 iterations;
+    MI_Uint32 threads;
+    MI_Uint32 messageSize;
+    MI_Boolean compressed;
+} BenchOptions;
+
+/* What the threads of one workload share with the thread sampling the process */
+typedef struct _BenchShared
+{
+    volatile ptrdiff_t running;     /* Threads that have not finished their workload yet */
+    volatile ptrdiff_t holding;     /* Idle threads that have opened all their shells */
+    volatile ptrdiff_t sampled;     /* Set once the idle peak has been sampled */
+} BenchShared;
+
+/* State for one benchmark thread. Every thread has its own context and its own slice of
+ * the latency samples so nothing is shared while the clock is running.
+ */
+typedef struct _BenchThread
+{
+    ProviderHost *host;
+    const BenchOptions *options;
+    BenchWorkload workload;
+    BenchShared *shared;
+    Thread thread;
+
+    double *samples;        /* Latency of each iteration in microseconds */
+    MI_Uint32 iterations;
+    MI_Uint32 completed;
+    MI_Uint64 bytes;        /* Payload bytes echoed back to the thread */
+    MI_Result result;
+} BenchThread;
+
+typedef struct _BenchProcessStats
+{
+    unsigned long threads;
+    unsigned long rssKb;
+} BenchProcessStats;
+
+static double NowUs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000.0) + (now.tv_nsec / 1000.0);
+}
+
+/* Threads and VmRSS lines from /proc/self/status */
+static void SampleProcessStats(BenchProcessStats *stats)
+{
+    char line[256];
+    FILE *status = fopen("/proc/self/status", "r");
+
+    stats->threads = 0;
+    stats->rssKb = 0;
+    if (status == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), status))
+    {
+        if (strncmp(line, "Threads:", 8) == 0)
+            stats->threads = strtoul(line + 8, NULL, 10);
+        else if (strncmp(line, "VmRSS:", 6) == 0)
+            stats->rssKb = strtoul(line + 6, NULL, 10);
+    }
+    fclose(status);
+}
+
+static MI_Result CreateShell(ProviderHost *host, ProviderHostContext *context, MI_Boolean compressed, MI_Instance **shell)
+{
+    MI_Instance *newShell;
+    MI_Value value;
+    MI_Result miResult;
+
+    miResult = ProviderHost_NewInstance(host, MI_T("Shell"), &newShell);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    value.string = MI_T("Microsoft.PowerShell");
+    MI_Instance_SetElement(newShell, MI_T("Name"), &value, MI_STRING, 0);
+    value.string = MI_T("stdin pr");
+    MI_Instance_SetElement(newShell, MI_T("InputStreams"), &value, MI_STRING, 0);
+    value.string = MI_T("stdout");
+    MI_Instance_SetElement(newShell, MI_T("OutputStreams"), &value, MI_STRING, 0);
+    if (compressed)
+    {
+        value.string = MI_T("XpressCompression");
+        MI_Instance_SetElement(newShell, MI_T("CompressionMode"), &value, MI_STRING, 0);
+    }
+
+    ProviderHost_CreateInstance(host, context, newShell);
+    miResult = ProviderHostContext_Wait(context);
+    MI_Instance_Delete(newShell);
+
+    if ((miResult == MI_RESULT_OK) && (context->instance == NULL))
+        miResult = MI_RESULT_FAILED;
+
+    if (miResult == MI_RESULT_OK)
+    {
+        /* Keep the created shell, it is the instance name for every later request */
+        *shell = context->instance;
+        context->instance = NULL;
+    }
+    ProviderHostContext_Reset(context);
+    return miResult;
+}
+
+static MI_Result DeleteShell(ProviderHost *host, ProviderHostContext *context, MI_Instance *shell)
+{
+    MI_Result miResult;
+
+    ProviderHost_DeleteInstance(host, context, shell);
+    miResult = ProviderHostContext_Wait(context);
+    ProviderHostContext_Reset(context);
+    MI_Instance_Delete(shell);
+    return miResult;
+}
+
+/* Invoke a Shell method and wait for it. The posted output parameters are left in
+ * context->instance for the caller, who must reset the context afterwards.
+ */
+static MI_Result InvokeShell(ProviderHost *host, ProviderHostContext *context, MI_Instance *shell, const MI_Char *methodName, MI_Instance *parameters)
+{
+    MI_Result miResult;
+
+    ProviderHost_Invoke(host, context, shell, methodName, parameters);
+    miResult = ProviderHostContext_Wait(context);
+    MI_Instance_Delete(parameters);
+
+    if ((miResult == MI_RESULT_OK) && (context->instance == NULL))
+        miResult = MI_RESULT_FAILED;
+    return miResult;
+}
+
+static MI_Result CreateCommand(ProviderHost *host, ProviderHostContext *context, MI_Instance *shell, MI_Char *commandId, size_t commandIdLength)
+{
+    MI_Instance *parameters;
+    MI_Value value;
+    MI_Type type;
+    MI_Result miResult;
+
+    miResult = ProviderHost_NewParameters(host, MI_T("Shell"), MI_T("Command"), &parameters);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    value.string = MI_T("echo");
+    MI_Instance_SetElement(parameters, MI_T("command"), &value, MI_STRING, 0);
+
+    miResult = InvokeShell(host, context, shell, MI_T("Command"), parameters);
+    if (miResult == MI_RESULT_OK)
+    {
+        miResult = MI_Instance_GetElement(context->instance, MI_T("CommandId"), &value, &type, NULL, NULL);
+        if ((miResult == MI_RESULT_OK) && ((type != MI_STRING) || (value.string == NULL) || (strlen(value.string) >= commandIdLength)))
+            miResult = MI_RESULT_FAILED;
+        if (miResult == MI_RESULT_OK)
+            strcpy(commandId, value.string);
+    }
+    ProviderHostContext_Reset(context);
+    return miResult;
+}
+
+static MI_Result DisconnectShell(ProviderHost *host, ProviderHostContext *context, MI_Instance *shell)
+{
+    MI_Instance *parameters;
+    MI_Result miResult;
+
+    miResult = ProviderHost_NewParameters(host, MI_T("Shell"), MI_T("Disconnect"), &parameters);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    miResult = InvokeShell(host, context, shell, MI_T("Disconnect"), parameters);
+    ProviderHostContext_Reset(context);
+    return miResult;
+}
+
+static MI_Result ReconnectShell(ProviderHost *host, ProviderHostContext *context, MI_Instance *shell)
+{
+    MI_Instance *parameters;
+    MI_Result miResult;
+
+    miResult = ProviderHost_NewParameters(host, MI_T("Shell"), MI_T("Reconnect"), &parameters);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    miResult = InvokeShell(host, context, shell, MI_T("Reconnect"), parameters);
+    ProviderHostContext_Reset(context);
+    return miResult;
+}
+
+static MI_Result SignalCommand(ProviderHost *host, ProviderHostContext *context, MI_Instance *shell, const MI_Char *commandId)
+{
+    MI_Instance *parameters;
+    MI_Value value;
+    MI_Result miResult;
+
+    miResult = ProviderHost_NewParameters(host, MI_T("Shell"), MI_T("Signal"), &parameters);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    value.string = (MI_Char*) commandId;
+    MI_Instance_SetElement(parameters, MI_T("commandId"), &value, MI_STRING, 0);
+    value.string = BENCH_SIGNAL_TERMINATE;
+    MI_Instance_SetElement(parameters, MI_T("code"), &value, MI_STRING, 0);
+
+    miResult = InvokeShell(host, context, shell, MI_T("Signal"), parameters);
+    ProviderHostContext_Reset(context);
+    return miResult;
+}
+
+/* Send a block of data to the command's stdin, base64 encoded and compressed the same way
+ * the client would
+ */
+static MI_Result SendData(ProviderHost *host, ProviderHostContext *context, MI_Instance *shell, const MI_Char *commandId, MI_Uint8 *data, MI_Uint32 dataLength, MI_Boolean compressed)
+{
+    MI_Instance *parameters = NULL;
+    MI_Instance *stream = NULL;
+    DecodeBuffer fromBuffer, compressedBuffer, encodedBuffer;
+    MI_Value value;
+    MI_Result miResult;
+
+    memset(&compressedBuffer, 0, sizeof(compressedBuffer));
+    memset(&encodedBuffer, 0, sizeof(encodedBuffer));
+
+    fromBuffer.buffer = (MI_Char*) data;
+    fromBuffer.bufferLength = dataLength;
+    fromBuffer.bufferUsed = dataLength;
+
+    if (compressed)
+    {
+        miResult = CompressBuffer(&fromBuffer, &compressedBuffer, 0);
+        if (miResult != MI_RESULT_OK)
+            goto done;
+        fromBuffer = compressedBuffer;
+    }
+
+    miResult = Base64EncodeBuffer(&fromBuffer, &encodedBuffer);
+    if (miResult != MI_RESULT_OK)
+        goto done;
+    ((MI_Char*) encodedBuffer.buffer)[encodedBuffer.bufferUsed / sizeof(MI_Char)] = MI_T('\0');
+
+    miResult = ProviderHost_NewInstance(host, MI_T("Stream"), &stream);
+    if (miResult != MI_RESULT_OK)
+        goto done;
+
+    value.string = (MI_Char*) commandId;
+    MI_Instance_SetElement(stream, MI_T("commandId"), &value, MI_STRING, 0);
+    value.string = MI_T("stdin");
+    MI_Instance_SetElement(stream, MI_T("streamName"), &value, MI_STRING, 0);
+    value.string = (MI_Char*) encodedBuffer.buffer;
+    MI_Instance_SetElement(stream, MI_T("data"), &value, MI_STRING, 0);
+    value.uint32 = encodedBuffer.bufferUsed / sizeof(MI_Char);
+    MI_Instance_SetElement(stream, MI_T("dataLength"), &value, MI_UINT32, 0);
+    value.boolean = MI_FALSE;
+    MI_Instance_SetElement(stream, MI_T("endOfStream"), &value, MI_BOOLEAN, 0);
+
+    miResult = ProviderHost_NewParameters(host, MI_T("Shell"), MI_T("Send"), &parameters);
+    if (miResult != MI_RESULT_OK)
+        goto done;
+
+    value.instance = stream;
+    MI_Instance_SetElement(parameters, MI_T("streamData"), &value, MI_INSTANCE, 0);
+
+    miResult = InvokeShell(host, context, shell, MI_T("Send"), parameters);
+    parameters = NULL;
+    ProviderHostContext_Reset(context);
+
+done:
+    if (parameters)
+        MI_Instance_Delete(parameters);
+    if (stream)
+        MI_Instance_Delete(stream);
+    free(encodedBuffer.buffer);
+    free(compressedBuffer.buffer);
+    return miResult;
+}
+
+/* Start a Receive from the command's stdout without waiting for it. The parameters have to
+ * outlive the request, FinishReceive deletes them.
+ */
+static MI_Result StartReceive(ProviderHost *host, ProviderHostContext *context, MI_Instance *shell, const MI_Char *commandId, MI_Instance **parameters)
+{
+    MI_Instance *desiredStream;
+    MI_Value value;
+    MI_Result miResult;
+
+    *parameters = NULL;
+    miResult = ProviderHost_NewInstance(host, MI_T("DesiredStream"), &desiredStream);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    value.string = (MI_Char*) commandId;
+    MI_Instance_SetElement(desiredStream, MI_T("commandId"), &value, MI_STRING, 0);
+    value.string = MI_T("stdout");
+    MI_Instance_SetElement(desiredStream, MI_T("streamName"), &value, MI_STRING, 0);
+
+    miResult = ProviderHost_NewParameters(host, MI_T("Shell"), MI_T("Receive"), parameters);
+    if (miResult != MI_RESULT_OK)
+    {
+        MI_Instance_Delete(desiredStream);
+        return miResult;
+    }
+    value.instance = desiredStream;
+    MI_Instance_SetElement(*parameters, MI_T("DesiredStream"), &value, MI_INSTANCE, 0);
+    MI_Instance_Delete(desiredStream);
+
+    ProviderHost_Invoke(host, context, shell, MI_T("Receive"), *parameters);
+    return MI_RESULT_OK;
+}
+
+/* Wait for a Receive started with StartReceive and return the number of payload bytes in it
+ * once decoded and decompressed. Up to dataSize of them are copied to data if it is not NULL.
+ */
+static MI_Result FinishReceive(ProviderHostContext *context, MI_Instance *parameters, MI_Boolean compressed, MI_Uint8 *data, MI_Uint32 dataSize, MI_Uint32 *dataLength)
+{
+    DecodeBuffer fromBuffer, decodedBuffer, decompressedBuffer;
+    DecodeBuffer *payload;
+    MI_Value value;
+    MI_Type type;
+    MI_Result miResult;
+
+    *dataLength = 0;
+    memset(&decodedBuffer, 0, sizeof(decodedBuffer));
+    memset(&decompressedBuffer, 0, sizeof(decompressedBuffer));
+
+    miResult = ProviderHostContext_Wait(context);
+    MI_Instance_Delete(parameters);
+    if ((miResult == MI_RESULT_OK) && (context->instance == NULL))
+        miResult = MI_RESULT_FAILED;
+    if (miResult != MI_RESULT_OK)
+        goto done;
+
+    /* A Receive that only carries command state has no Stream */
+    if ((MI_Instance_GetElement(context->instance, MI_T("Stream"), &value, &type, NULL, NULL) != MI_RESULT_OK) ||
+        (type != MI_INSTANCE) || (value.instance == NULL))
+        goto done;
+
+    if ((MI_Instance_GetElement(value.instance, MI_T("data"), &value, &type, NULL, NULL) != MI_RESULT_OK) ||
+        (type != MI_STRING) || (value.string == NULL))
+        goto done;
+
+    fromBuffer.buffer = (MI_Char*) value.string;
+    fromBuffer.bufferLength = strlen(value.string) * sizeof(MI_Char);
+    fromBuffer.bufferUsed = fromBuffer.bufferLength;
+
+    miResult = Base64DecodeBuffer(&fromBuffer, &decodedBuffer);
+    if (miResult != MI_RESULT_OK)
+        goto done;
+    payload = &decodedBuffer;
+
+    if (compressed)
+    {
+        miResult = DecompressBuffer(&decodedBuffer, &decompressedBuffer);
+        if (miResult != MI_RESULT_OK)
+            goto done;
+        payload = &decompressedBuffer;
+    }
+
+    *dataLength = payload->bufferUsed;
+    if (data)
+        memcpy(data, payload->buffer, (payload->bufferUsed < dataSize) ? payload->bufferUsed : dataSize);
+
+done:
+    free(decodedBuffer.buffer);
+    free(decompressedBuffer.buffer);
+    ProviderHostContext_Reset(context);
+    return miResult;
+}
+
+/* Receive from the command's stdout and return the number of payload bytes in it once
+ * decoded and decompressed
+ */
+static MI_Result ReceiveData(ProviderHost *host, ProviderHostContext *context, MI_Instance *shell, const MI_Char *commandId, MI_Boolean compressed, MI_Uint32 *dataLength)
+{
+    MI_Instance *parameters;
+    MI_Result miResult;
+
+    *dataLength = 0;
+    miResult = StartReceive(host, context, shell, commandId, &parameters);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+    return FinishReceive(context, parameters, compressed, NULL, 0, dataLength);
+}
+
+/* Send a block and keep receiving until all of its echo has come back */
+static MI_Result EchoRoundTrip(ProviderHost *host, ProviderHostContext *context, MI_Instance *shell, const MI_Char *commandId, MI_Uint8 *data, MI_Uint32 dataLength, MI_Boolean compressed)
+{
+    MI_Uint32 received = 0;
+    MI_Uint32 chunk;
+    MI_Result miResult;
+
+    miResult = SendData(host, context, shell, commandId, data, dataLength, compressed);
+    while ((miResult == MI_RESULT_OK) && (received < dataLength))
+    {
+        miResult = ReceiveData(host, context, shell, commandId, compressed, &chunk);
+        received += chunk;
+    }
+    return miResult;
+}
+
+static MI_Result RunCreate(BenchThread *bench, ProviderHostContext *context)
+{
+    MI_Instance *shell;
+    MI_Result miResult = MI_RESULT_OK;
+    double start;
+
+    for (; bench->completed != bench->iterations; bench->completed++)
+    {
+        start = NowUs();
+        miResult = CreateShell(bench->host, context, bench->options->compressed, &shell);
+        if (miResult == MI_RESULT_OK)
+            miResult = DeleteShell(bench->host, context, shell);
+        bench->samples[bench->completed] = NowUs() - start;
+
+        if (miResult != MI_RESULT_OK)
+            break;
+    }
+    return miResult;
+}
+
+/* Shared by pingpong and bulk, which only differ in message size */
+static MI_Result RunEcho(BenchThread *bench, ProviderHostContext *context, MI_Uint32 messageSize)
+{
+    MI_Instance *shell;
+    MI_Char commandId[64];
+    MI_Uint8 *message;
+    MI_Uint32 i;
+    MI_Result miResult;
+    double start;
+
+    message = malloc(messageSize);
+    if (message == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    /* Text-like content so the compressed runs see a realistic ratio */
+    for (i = 0; i != messageSize; i++)
+        message[i] = "<Obj RefId=\"0\"><MS><S N=\"Value\">benchmark</S></MS></Obj>"[i % 56];
+
+    miResult = CreateShell(bench->host, context, bench->options->compressed, &shell);
+    if (miResult != MI_RESULT_OK)
+        goto done;
+
+    miResult = CreateCommand(bench->host, context, shell, commandId, sizeof(commandId) / sizeof(commandId[0]));
+    if (miResult == MI_RESULT_OK)
+    {
+        for (; bench->completed != bench->iterations; bench->completed++)
+        {
+            start = NowUs();
+            miResult = EchoRoundTrip(bench->host, context, shell, commandId, message, messageSize, bench->options->compressed);
+            bench->samples[bench->completed] = NowUs() - start;
+
+            if (miResult != MI_RESULT_OK)
+                break;
+            bench->bytes += messageSize;
+        }
+        SignalCommand(bench->host, context, shell, commandId);
+    }
+    DeleteShell(bench->host, context, shell);
+
+done:
+    free(message);
+    return miResult;
+}
+
+/* RunLarge
+ * Echo a result of several MAX_COMPRESS_BUFFER_BLOCKs with a second Receive already waiting
+ * behind the first, the way a PSRP client pipelines them. The provider has to answer the first
+ * with exactly one block and the second with the rest, in either compression mode, and the
+ * bytes that come back have to be the ones that were sent. Run it with and without -c.
+ */
+static MI_Result RunLarge(BenchThread *bench, ProviderHostContext *context)
+{
+    ProviderHostContext second, sendContext;
+    MI_Instance *shell;
+    MI_Instance *parameters[2];
+    MI_Char commandId[64];
+    MI_Uint8 *message;
+    MI_Uint8 *received;
+    MI_Uint32 i;
+    MI_Uint32 firstLength, secondLength, offset;
+    MI_Result miResult, secondResult;
+    double start;
+
+    message = malloc(BENCH_LARGE_SIZE);
+    received = malloc(BENCH_LARGE_SIZE);
+    if ((message == NULL) || (received == NULL))
+    {
+        free(message);
+        free(received);
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    }
+
+    /* Text with a counter in it so a block delivered twice or out of order does not compare equal */
+    for (i = 0; i != BENCH_LARGE_SIZE; i++)
+        message[i] = (i % 64) ? "<Obj RefId=\"0\"><MS><S N=\"Value\">benchmark</S></MS></Obj>"[i % 56] : (MI_Uint8) ('A' + (i / 64) % 26);
+
+    /* Both Receives are still outstanding when the Send goes in, so each needs its own context */
+    ProviderHostContext_Init(&second, bench->host);
+    ProviderHostContext_AddOption(&second, MI_T("WSMAN_ResourceURI"), BENCH_RESOURCE_URI);
+    ProviderHostContext_Init(&sendContext, bench->host);
+    ProviderHostContext_AddOption(&sendContext, MI_T("WSMAN_ResourceURI"), BENCH_RESOURCE_URI);
+
+    miResult = CreateShell(bench->host, context, bench->options->compressed, &shell);
+    if (miResult != MI_RESULT_OK)
+        goto done;
+
+    miResult = CreateCommand(bench->host, context, shell, commandId, sizeof(commandId) / sizeof(commandId[0]));
+    if (miResult == MI_RESULT_OK)
+    {
+        for (; bench->completed != bench->iterations; bench->completed++)
+        {
+            start = NowUs();
+            miResult = StartReceive(bench->host, context, shell, commandId, &parameters[0]);
+            if (miResult != MI_RESULT_OK)
+                break;
+            miResult = StartReceive(bench->host, &second, shell, commandId, &parameters[1]);
+            if (miResult != MI_RESULT_OK)
+            {
+                FinishReceive(context, parameters[0], bench->options->compressed, NULL, 0, &firstLength);
+                break;
+            }
+
+            miResult = SendData(bench->host, &sendContext, shell, commandId, message, BENCH_LARGE_SIZE, bench->options->compressed);
+            if (miResult != MI_RESULT_OK)
+            {
+                /* Terminating the command answers both Receives */
+                SignalCommand(bench->host, &sendContext, shell, commandId);
+            }
+
+            firstLength = secondLength = 0;
+            secondResult = FinishReceive(context, parameters[0], bench->options->compressed, received, BENCH_LARGE_SIZE, &firstLength);
+            if (miResult == MI_RESULT_OK)
+                miResult = secondResult;
+            offset = (firstLength < BENCH_LARGE_SIZE) ? firstLength : BENCH_LARGE_SIZE;
+            secondResult = FinishReceive(&second, parameters[1], bench->options->compressed,
+                received + offset, BENCH_LARGE_SIZE - offset, &secondLength);
+            if (miResult == MI_RESULT_OK)
+                miResult = secondResult;
+            bench->samples[bench->completed] = NowUs() - start;
+
+            if (miResult != MI_RESULT_OK)
+                break;
+
+            if ((firstLength != MAX_COMPRESS_BUFFER_BLOCK) || ((firstLength + secondLength) != BENCH_LARGE_SIZE) ||
+                (memcmp(received, message, BENCH_LARGE_SIZE) != 0))
+            {
+                fprintf(stderr, "large: sent %u bytes, got back %u then %u, expected %u then the rest%s\n",
+                    BENCH_LARGE_SIZE, firstLength, secondLength, MAX_COMPRESS_BUFFER_BLOCK,
+                    ((firstLength + secondLength) == BENCH_LARGE_SIZE) ? ", and the bytes differ" : "");
+                miResult = MI_RESULT_FAILED;
+                break;
+            }
+            bench->bytes += BENCH_LARGE_SIZE;
+        }
+        SignalCommand(bench->host, context, shell, commandId);
+    }
+    DeleteShell(bench->host, context, shell);
+
+done:
+    ProviderHostContext_Destroy(&sendContext);
+    ProviderHostContext_Destroy(&second);
+    free(message);
+    free(received);
+    return miResult;
+}
+
+/* RunReconnect
+ * What a client that lost its connection pays to carry on with reconnect: Disconnect and
+ * Reconnect the shell it already has, then one echo through its command. Compare it with
+ * recreate, which is the same client starting again from nothing.
+ */
+static MI_Result RunReconnect(BenchThread *bench, ProviderHostContext *context)
+{
+    MI_Instance *shell;
+    MI_Char commandId[64];
+    MI_Uint8 message[] = "reconnect";
+    MI_Result miResult;
+    double start;
+
+    miResult = CreateShell(bench->host, context, bench->options->compressed, &shell);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    miResult = CreateCommand(bench->host, context, shell, commandId, sizeof(commandId) / sizeof(commandId[0]));
+    if (miResult == MI_RESULT_OK)
+    {
+        for (; bench->completed != bench->iterations; bench->completed++)
+        {
+            start = NowUs();
+            miResult = DisconnectShell(bench->host, context, shell);
+            if (miResult == MI_RESULT_OK)
+                miResult = ReconnectShell(bench->host, context, shell);
+            if (miResult == MI_RESULT_OK)
+                miResult = EchoRoundTrip(bench->host, context, shell, commandId, message, sizeof(message) - 1, bench->options->compressed);
+            bench->samples[bench->completed] = NowUs() - start;
+
+            if (miResult != MI_RESULT_OK)
+                break;
+        }
+        SignalCommand(bench->host, context, shell, commandId);
+    }
+    DeleteShell(bench->host, context, shell);
+    return miResult;
+}
+
+static MI_Result RunRecreate(BenchThread *bench, ProviderHostContext *context)
+{
+    MI_Instance *shell;
+    MI_Char commandId[64];
+    MI_Uint8 message[] = "reconnect";
+    MI_Result miResult = MI_RESULT_OK;
+    double start;
+
+    for (; bench->completed != bench->iterations; bench->completed++)
+    {
+        start = NowUs();
+        miResult = CreateShell(bench->host, context, bench->options->compressed, &shell);
+        if (miResult != MI_RESULT_OK)
+            break;
+
+        miResult = CreateCommand(bench->host, context, shell, commandId, sizeof(commandId) / sizeof(commandId[0]));
+        if (miResult == MI_RESULT_OK)
+        {
+            miResult = EchoRoundTrip(bench->host, context, shell, commandId, message, sizeof(message) - 1, bench->options->compressed);
+            SignalCommand(bench->host, context, shell, commandId);
+        }
+        DeleteShell(bench->host, context, shell);
+        bench->samples[bench->completed] = NowUs() - start;
+
+        if (miResult != MI_RESULT_OK)
+            break;
+    }
+    return miResult;
+}
+
+/* RunIdle
+ * Open this thread's shells and hold them until the sampling thread has seen every idle
+ * thread holding all of its shells, then delete them.
+ */
+static MI_Result RunIdle(BenchThread *bench, ProviderHostContext *context)
+{
+    MI_Instance **shells;
+    MI_Uint32 i;
+    MI_Result miResult = MI_RESULT_OK;
+    double start;
+
+    shells = calloc(bench->iterations ? bench->iterations : 1, sizeof(MI_Instance*));
+    if (shells == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    for (; bench->completed != bench->iterations; bench->completed++)
+    {
+        start = NowUs();
+        miResult = CreateShell(bench->host, context, bench->options->compressed, &shells[bench->completed]);
+        bench->samples[bench->completed] = NowUs() - start;
+
+        if (miResult != MI_RESULT_OK)
+            break;
+    }
+
+    /* Every shell this thread could open is open now */
+    Atomic_Inc(&bench->shared->holding);
+    CondLock_Broadcast((ptrdiff_t) &bench->shared->holding);
+    while (Atomic_Read(&bench->shared->sampled) == 0)
+    {
+        CondLock_Wait((ptrdiff_t) &bench->shared->sampled, &bench->shared->sampled, 0, CONDLOCK_DEFAULT_SPINCOUNT);
+    }
+
+    for (i = 0; i != bench->completed; i++)
+        DeleteShell(bench->host, context, shells[i]);
+
+    free(shells);
+    return miResult;
+}
+
+static PAL_Uint32 THREAD_API BenchThreadProc(void *param)
+{
+    BenchThread *bench = (BenchThread*) param;
+    ProviderHostContext context;
+
+    ProviderHostContext_Init(&context, bench->host);
+    ProviderHostContext_AddOption(&context, MI_T("WSMAN_ResourceURI"), BENCH_RESOURCE_URI);
+
+    switch (bench->workload)
+    {
+    case BenchCreate:
+        bench->result = RunCreate(bench, &context);
+        break;
+    case BenchPingPong:
+        bench->result = RunEcho(bench, &context, bench->options->messageSize);
+        break;
+    case BenchBulk:
+        bench->result = RunEcho(bench, &context, BENCH_BULK_SIZE);
+        break;
+    case BenchIdle:
+        bench->result = RunIdle(bench, &context);
+        break;
+    case BenchReconnect:
+        bench->result = RunReconnect(bench, &context);
+        break;
+    case BenchRecreate:
+        bench->result = RunRecreate(bench, &context);
+        break;
+    case BenchLarge:
+        bench->result = RunLarge(bench, &context);
+        break;
+    default:
+        bench->result = MI_RESULT_NOT_SUPPORTED;
+        break;
+    }
+    Atomic_Dec(&bench->shared->running);
+
+    if (bench->result != MI_RESULT_OK)
+    {
+        fprintf(stderr, "%s failed after %u iterations, miResult=%u: %s\n",
+            _workloadNames[bench->workload], bench->completed, bench->result, context.errorMessage);
+    }
+    ProviderHostContext_Destroy(&context);
+    return 0;
+}
+
+static int CompareSamples(const void *a, const void *b)
+{
+    double left = *(const double*) a;
+    double right = *(const double*) b;
+    return (left > right) - (left < right);
+}
+
+static double Percentile(const double *samples, MI_Uint32 count, double fraction)
+{
+    MI_Uint32 index;
+
+    if (count == 0)
+        return 0;
+
+    index = (MI_Uint32) (fraction * count);
+    if (index >= count)
+        index = count - 1;
+    return samples[index];
+}
+
+/* SamplePeak
+ * Sample the process every BENCH_SAMPLE_INTERVAL_MS until the workload's threads are done
+ * and keep the highest thread count and RSS seen, so the peak is taken while the workload
+ * is in its steady state rather than as the threads start. Idle threads wait to be sampled
+ * while holding all their shells open, which is the peak for that workload.
+ */
+static void SamplePeak(BenchWorkload workload, BenchShared *shared, ptrdiff_t started, BenchProcessStats *peak)
+{
+    BenchProcessStats sample;
+
+    memset(peak, 0, sizeof(*peak));
+
+    if (workload == BenchIdle)
+    {
+        ptrdiff_t holding;
+
+        while ((holding = Atomic_Read(&shared->holding)) != started)
+        {
+            CondLock_Wait((ptrdiff_t) &shared->holding, &shared->holding, holding, CONDLOCK_DEFAULT_SPINCOUNT);
+        }
+        SampleProcessStats(peak);
+        Atomic_Swap(&shared->sampled, 1);
+        CondLock_Broadcast((ptrdiff_t) &shared->sampled);
+        return;
+    }
+
+    do
+    {
+        Sleep_Milliseconds(BENCH_SAMPLE_INTERVAL_MS);
+        SampleProcessStats(&sample);
+        if (sample.threads > peak->threads)
+            peak->threads = sample.threads;
+        if (sample.rssKb > peak->rssKb)
+            peak->rssKb = sample.rssKb;
+    }
+    while (Atomic_Read(&shared->running) != 0);
+}
+
+static MI_Result RunWorkload(ProviderHost *host, BenchWorkload workload, const BenchOptions *options)
+{
+    BenchThread threads[BENCH_MAX_THREADS];
+    BenchShared shared;
+    BenchProcessStats stats;
+    ptrdiff_t started = 0;
+    double *samples;
+    MI_Uint32 count = 0;
+    MI_Uint64 bytes = 0;
+    MI_Uint32 i;
+    MI_Result miResult = MI_RESULT_OK;
+    double start, seconds;
+
+    samples = calloc(options->iterations ? options->iterations : 1, sizeof(double));
+    if (samples == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    memset(threads, 0, sizeof(threads));
+    memset(&shared, 0, sizeof(shared));
+    for (i = 0; i != options->threads; i++)
+    {
+        threads[i].host = host;
+        threads[i].shared = &shared;
+        threads[i].options = options;
+        threads[i].workload = workload;
+        threads[i].samples = samples + ((options->iterations / options->threads) * i);
+        threads[i].iterations = options->iterations / options->threads;
+    }
+    /* The last thread picks up whatever does not divide evenly */
+    threads[options->threads - 1].iterations += options->iterations % options->threads;
+
+    start = NowUs();
+    shared.running = options->threads;
+    for (i = 0; i != options->threads; i++)
+    {
+        if (Thread_CreateJoinable(&threads[i].thread, BenchThreadProc, NULL, &threads[i]) != 0)
+        {
+            threads[i].result = MI_RESULT_SERVER_LIMITS_EXCEEDED;
+            threads[i].iterations = 0;
+            Atomic_Dec(&shared.running);
+        }
+        else
+        {
+            started++;
+        }
+    }
+
+    SamplePeak(workload, &shared, started, &stats);
+
+    for (i = 0; i != options->threads; i++)
+    {
+        PAL_Uint32 threadResult;
+
+        if (threads[i].iterations)
+        {
+            Thread_Join(&threads[i].thread, &threadResult);
+            Thread_Destroy(&threads[i].thread);
+        }
+    }
+    seconds = (NowUs() - start) / 1000000.0;
+
+    /* Pack each thread's completed samples together before sorting them */
+    for (i = 0; i != options->threads; i++)
+    {
+        memmove(samples + count, threads[i].samples, threads[i].completed * sizeof(double));
+        count += threads[i].completed;
+        bytes += threads[i].bytes;
+        if (threads[i].result != MI_RESULT_OK)
+            miResult = threads[i].result;
+    }
+    qsort(samples, count, sizeof(double), CompareSamples);
+
+    printf("{\"workload\":\"%s\",\"result\":%u,\"iterations\":%u,\"threads\":%u,\"compressed\":%s,"
+        "\"messageBytes\":%u,\"seconds\":%.6f,\"opsPerSecond\":%.1f,\"mbPerSecond\":%.3f,"
+        "\"latencyUs\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},"
+        "\"processThreads\":%lu,\"rssKb\":%lu}\n",
+        _workloadNames[workload], miResult, count, options->threads, options->compressed ? "true" : "false",
+        (workload == BenchBulk) ? BENCH_BULK_SIZE : ((workload == BenchLarge) ? BENCH_LARGE_SIZE : ((workload == BenchPingPong) ? options->messageSize : 0)),
+        seconds, seconds > 0 ? count / seconds : 0, seconds > 0 ? (bytes / (1024.0 * 1024.0)) / seconds : 0,
+        Percentile(samples, count, 0.50), Percentile(samples, count, 0.99), Percentile(samples, count, 0.999),
+        count ? samples[count - 1] : 0,
+        stats.threads, stats.rssKb);
+    fflush(stdout);
+
+    free(samples);
+    return miResult;
+}
+
+/* RunFirstCommand
+ * What the first client of a fresh omiagent sees: load the provider, wait gapMs the way a
+ * client takes a while to get to its first request, then time creating a shell and a command
+ * and the first echo through them. There is one sample per process, so compare runs with and
+ * without psrpwarmup in omiserver.conf to see what warming up buys. warmbench.sh does that.
+ */
+static MI_Result RunFirstCommand(const BenchOptions *options, MI_Uint32 gapMs)
+{
+    ProviderHost *host;
+    ProviderHostContext context;
+    MI_Instance *shell;
+    MI_Char commandId[64];
+    MI_Uint8 message[] = "first";
+    MI_Result miResult;
+    double start, loadUs, firstCommandUs = 0;
+
+    start = NowUs();
+    miResult = ProviderHost_Load(&host);
+    loadUs = NowUs() - start;
+    if (miResult != MI_RESULT_OK)
+    {
+        fprintf(stderr, "provider load failed, miResult=%u\n", miResult);
+        return miResult;
+    }
+
+    if (gapMs)
+        Sleep_Milliseconds(gapMs);
+
+    ProviderHostContext_Init(&context, host);
+    ProviderHostContext_AddOption(&context, MI_T("WSMAN_ResourceURI"), BENCH_RESOURCE_URI);
+
+    start = NowUs();
+    miResult = CreateShell(host, &context, options->compressed, &shell);
+    if (miResult == MI_RESULT_OK)
+    {
+        miResult = CreateCommand(host, &context, shell, commandId, sizeof(commandId) / sizeof(commandId[0]));
+        if (miResult == MI_RESULT_OK)
+        {
+            miResult = EchoRoundTrip(host, &context, shell, commandId, message, sizeof(message) - 1, options->compressed);
+            firstCommandUs = NowUs() - start;
+            SignalCommand(host, &context, shell, commandId);
+        }
+        DeleteShell(host, &context, shell);
+    }
+    if (miResult != MI_RESULT_OK)
+    {
+        fprintf(stderr, "first failed, miResult=%u: %s\n", miResult, context.errorMessage);
+    }
+    ProviderHostContext_Destroy(&context);
+
+    printf("{\"workload\":\"first\",\"result\":%u,\"compressed\":%s,\"gapMs\":%u,\"loadUs\":%.1f,\"firstCommandUs\":%.1f}\n",
+        miResult, options->compressed ? "true" : "false", gapMs, loadUs, firstCommandUs);
+    fflush(stdout);
+
+    ProviderHost_Unload(host);
+    return miResult;
+}
+
+static void Usage(void)
+{
+    fprintf(stderr, "usage: providerbench [-w create|pingpong|bulk|large|idle|reconnect|recreate|all|first] [-n iterations] [-t threads] [-s size] [-c] [-g gap]\n");
+}
+
+int main(int argc, char **argv)
+{
+    ProviderHost *host;
+    BenchOptions options;
+    int workload = -1;  /* -1 runs all of them */
+    MI_Boolean first = MI_FALSE;
+    MI_Uint32 gapMs = 0;
+    int i;
+    MI_Result miResult;
+    MI_Result failed = MI_RESULT_OK;
+
+    options.iterations = 1000;
+    options.threads = 1;
+    options.messageSize = 64;
+    options.compressed = MI_FALSE;
+
+    for (i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-c") == 0))
+        {
+            options.compressed = MI_TRUE;
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-n") == 0))
+        {
+            options.iterations = strtoul(argv[++i], NULL, 10);
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-t") == 0))
+        {
+            options.threads = strtoul(argv[++i], NULL, 10);
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-s") == 0))
+        {
+            options.messageSize = strtoul(argv[++i], NULL, 10);
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-g") == 0))
+        {
+            gapMs = strtoul(argv[++i], NULL, 10);
+        }
+        else if ((i + 1) < argc && (strcmp(argv[i], "-w") == 0))
+        {
+            i++;
+            if (strcmp(argv[i], "first") == 0)
+            {
+                first = MI_TRUE;
+            }
+            else if (strcmp(argv[i], "all") != 0)
+            {
+                for (workload = 0; workload != BenchWorkloadCount; workload++)
+                {
+                    if (strcmp(argv[i], _workloadNames[workload]) == 0)
+                        break;
+                }
+                if (workload == BenchWorkloadCount)
+                {
+                    Usage();
+                    return 1;
+                }
+            }
+        }
+        else
+        {
+            Usage();
+            return 1;
+        }
+    }
+
+    if ((options.threads == 0) || (options.threads > BENCH_MAX_THREADS) ||
+        (options.iterations < options.threads) || (options.messageSize == 0))
+    {
+        Usage();
+        return 1;
+    }
+
+    /* Has to be the first thing the process does with the provider */
+    if (first)
+        return (RunFirstCommand(&options, gapMs) == MI_RESULT_OK) ? 0 : 1;
+
+    miResult = ProviderHost_Load(&host);
+    if (miResult != MI_RESULT_OK)
+    {
+        fprintf(stderr, "provider load failed, miResult=%u\n", miResult);
+        return 1;
+    }
+
+    for (i = 0; i != BenchWorkloadCount; i++)
+    {
+        if ((workload == -1) || (workload == i))
+        {
+            miResult = RunWorkload(host, (BenchWorkload) i, &options);
+            if (miResult != MI_RESULT_OK)
+                failed = miResult;
+        }
+    }
+
+    ProviderHost_Unload(host);
+
+    return (failed == MI_RESULT_OK) ? 0 : 1;
+}
@@ -0,0 +1,513 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <MI.h>
+#include <pal/strings.h>
+#include <pal/atomic.h>
+#include <pal/lock.h>
+#include <base/instance.h>
+#include <base/parameters.h>
+#include "ProviderHost.h"
+
+/* Namespace the provider is registered in, see the 'reg' target */
+#define PROVIDERHOST_NAMESPACE MI_T("interop")
+
+MI_EXTERN_C MI_Module* MI_MAIN_CALL MI_Main(MI_Server* server);
+
+typedef struct _ProviderHostClass
+{
+    const MI_ClassDecl *classDecl;
+    void *self;
+    MI_Boolean loaded;
+} ProviderHostClass;
+
+struct _ProviderHost
+{
+    MI_Server server;
+    MI_Module *module;
+    MI_Module_Self *moduleSelf;
+    MI_Boolean moduleLoaded;
+    ProviderHostClass *classes;
+    MI_Uint32 classCount;
+};
+
+static ProviderHostContext *_Context(MI_Context *context)
+{
+    return (ProviderHostContext*) context;
+}
+
+/* _Complete
+ * Record the final result of the request and wake up anyone waiting on it. The context
+ * may be reused or freed by the waiter as soon as completed is set so it is the last
+ * thing we touch.
+ */
+static MI_Result _Complete(ProviderHostContext *context, MI_Result result)
+{
+    if (Atomic_Read(&context->completed))
+        return MI_RESULT_FAILED;
+
+    context->result = result;
+    if (context->postResult)
+        context->postResult(context, result);
+
+    Atomic_Swap(&context->completed, 1);
+    CondLock_Broadcast((ptrdiff_t) context);
+    return MI_RESULT_OK;
+}
+
+static MI_Result MI_CALL _Context_PostResult(MI_Context* context, MI_Result result)
+{
+    return _Complete(_Context(context), result);
+}
+
+static MI_Result MI_CALL _Context_PostInstance(MI_Context* context, const MI_Instance* instance)
+{
+    ProviderHostContext *hostContext = _Context(context);
+
+    if (hostContext->instance)
+    {
+        MI_Instance_Delete(hostContext->instance);
+        hostContext->instance = NULL;
+    }
+    if (Instance_Clone(instance, &hostContext->instance, NULL) != MI_RESULT_OK)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    hostContext->instanceCount++;
+    if (hostContext->postInstance)
+        hostContext->postInstance(hostContext, instance);
+
+    return MI_RESULT_OK;
+}
+
+static MI_Result MI_CALL _Context_PostError(MI_Context* context, MI_Uint32 resultCode, const MI_Char* resultType, const MI_Char* errorMessage)
+{
+    ProviderHostContext *hostContext = _Context(context);
+
+    if (errorMessage)
+        Tcslcpy(hostContext->errorMessage, errorMessage, MI_COUNT(hostContext->errorMessage));
+
+    return _Complete(hostContext, (MI_Result) resultCode);
+}
+
+static MI_Result MI_CALL _Context_PostCimError(MI_Context* context, const MI_Instance *error)
+{
+    return _Complete(_Context(context), MI_RESULT_FAILED);
+}
+
+static MI_Result MI_CALL _Context_ConstructInstance(MI_Context* context, const MI_ClassDecl* classDecl, MI_Instance* instance)
+{
+    return Instance_Construct(instance, classDecl, NULL);
+}
+
+static MI_Result MI_CALL _Context_ConstructParameters(MI_Context* context, const MI_MethodDecl* methodDecl, MI_Instance* instance)
+{
+    return Parameters_Init(instance, methodDecl, NULL);
+}
+
+static MI_Result MI_CALL _Context_NewInstance(MI_Context* context, const MI_ClassDecl* classDecl, MI_Instance** instance)
+{
+    return Instance_New(instance, classDecl, NULL);
+}
+
+static MI_Result MI_CALL _Context_NewDynamicInstance(MI_Context* context, const MI_Char* className, MI_Uint32 flags, MI_Instance** instance)
+{
+    return Instance_NewDynamic(instance, className, flags, NULL);
+}
+
+static MI_Result MI_CALL _Context_NewParameters(MI_Context* context, const MI_MethodDecl* methodDecl, MI_Instance** instance)
+{
+    return Parameters_New(instance, methodDecl, NULL);
+}
+
+static MI_Result MI_CALL _Context_Canceled(const MI_Context* context, MI_Boolean* flag)
+{
+    *flag = MI_FALSE;
+    return MI_RESULT_OK;
+}
+
+static MI_Result MI_CALL _Context_RegisterCancel(MI_Context* context, MI_CancelCallback callback, void* callbackData)
+{
+    return MI_RESULT_OK;
+}
+
+static MI_Result MI_CALL _Context_RequestUnload(MI_Context* context)
+{
+    _Context(context)->requestedUnload = MI_TRUE;
+    return MI_RESULT_OK;
+}
+
+static MI_Result MI_CALL _Context_RefuseUnload(MI_Context* context)
+{
+    _Context(context)->refusedUnload = MI_TRUE;
+    return MI_RESULT_OK;
+}
+
+static const ProviderHostOption *_FindOption(ProviderHostContext *context, const MI_Char *name)
+{
+    MI_Uint32 i;
+
+    for (i = 0; i != context->optionCount; i++)
+    {
+        if (Tcscmp(context->options[i].name, name) == 0)
+            return &context->options[i];
+    }
+    return NULL;
+}
+
+static MI_Result MI_CALL _Context_GetStringOption(MI_Context* context, const MI_Char* name, const MI_Char** value)
+{
+    const ProviderHostOption *option = _FindOption(_Context(context), name);
+
+    if (option == NULL)
+        return MI_RESULT_NO_SUCH_PROPERTY;
+
+    *value = option->value;
+    return MI_RESULT_OK;
+}
+
+static MI_Result MI_CALL _Context_GetNumberOption(MI_Context* context, const MI_Char *name, MI_Uint32* value)
+{
+    return MI_RESULT_NO_SUCH_PROPERTY;
+}
+
+static MI_Result MI_CALL _Context_GetCustomOption(MI_Context* context, const MI_Char* name, MI_Type* valueType, MI_Value* value)
+{
+    const ProviderHostOption *option = _FindOption(_Context(context), name);
+
+    if (option == NULL)
+        return MI_RESULT_NO_SUCH_PROPERTY;
+
+    if (valueType)
+        *valueType = MI_STRING;
+    if (value)
+        value->string = (MI_Char*) option->value;
+    return MI_RESULT_OK;
+}
+
+static MI_Result MI_CALL _Context_GetCustomOptionCount(MI_Context* context, MI_Uint32* count)
+{
+    if (count)
+        *count = _Context(context)->optionCount;
+    return MI_RESULT_OK;
+}
+
+static MI_Result MI_CALL _Context_GetCustomOptionAt(MI_Context* context, MI_Uint32 index, const MI_Char** name, MI_Type* valueType, MI_Value* value)
+{
+    ProviderHostContext *hostContext = _Context(context);
+
+    if (index >= hostContext->optionCount)
+        return MI_RESULT_INVALID_PARAMETER;
+
+    if (name)
+        *name = hostContext->options[index].name;
+    if (valueType)
+        *valueType = MI_STRING;
+    if (value)
+        value->string = (MI_Char*) hostContext->options[index].value;
+    return MI_RESULT_OK;
+}
+
+static MI_Result MI_CALL _Context_WriteMessage(MI_Context* context, MI_Uint32 channel, const MI_Char* message)
+{
+    return MI_RESULT_OK;
+}
+
+static const MI_ContextFT _contextFT =
+{
+    .PostResult = _Context_PostResult,
+    .PostInstance = _Context_PostInstance,
+    .ConstructInstance = _Context_ConstructInstance,
+    .ConstructParameters = _Context_ConstructParameters,
+    .NewInstance = _Context_NewInstance,
+    .NewDynamicInstance = _Context_NewDynamicInstance,
+    .NewParameters = _Context_NewParameters,
+    .Canceled = _Context_Canceled,
+    .RegisterCancel = _Context_RegisterCancel,
+    .RequestUnload = _Context_RequestUnload,
+    .RefuseUnload = _Context_RefuseUnload,
+    .GetStringOption = _Context_GetStringOption,
+    .GetNumberOption = _Context_GetNumberOption,
+    .GetCustomOption = _Context_GetCustomOption,
+    .GetCustomOptionCount = _Context_GetCustomOptionCount,
+    .GetCustomOptionAt = _Context_GetCustomOptionAt,
+    .WriteMessage = _Context_WriteMessage,
+    .PostError = _Context_PostError,
+    .PostCimError = _Context_PostCimError,
+};
+
+static MI_Result MI_CALL _Server_GetVersion(MI_Uint32* version)
+{
+    *version = MI_VERSION;
+    return MI_RESULT_OK;
+}
+
+static MI_Result MI_CALL _Server_GetSystemName(const MI_Char** systemName)
+{
+    *systemName = MI_T("localhost");
+    return MI_RESULT_OK;
+}
+
+static const MI_ServerFT _serverFT =
+{
+    .GetVersion = _Server_GetVersion,
+    .GetSystemName = _Server_GetSystemName,
+};
+
+void ProviderHostContext_Init(ProviderHostContext *context, ProviderHost *host)
+{
+    memset(context, 0, sizeof(*context));
+    context->miContext.ft = &_contextFT;
+    context->host = host;
+}
+
+MI_Result ProviderHostContext_AddOption(ProviderHostContext *context, const MI_Char *name, const MI_Char *value)
+{
+    if (context->optionCount == PROVIDERHOST_MAX_OPTIONS)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    context->options[context->optionCount].name = name;
+    context->options[context->optionCount].value = value;
+    context->optionCount++;
+    return MI_RESULT_OK;
+}
+
+MI_Result ProviderHostContext_Wait(ProviderHostContext *context)
+{
+    while (Atomic_Read(&context->completed) == 0)
+    {
+        CondLock_Wait((ptrdiff_t) context, &context->completed, 0, CONDLOCK_DEFAULT_SPINCOUNT);
+    }
+    return context->result;
+}
+
+void ProviderHostContext_Reset(ProviderHostContext *context)
+{
+    if (context->instance)
+    {
+        MI_Instance_Delete(context->instance);
+        context->instance = NULL;
+    }
+    context->instanceCount = 0;
+    context->result = MI_RESULT_OK;
+    context->errorMessage[0] = MI_T('\0');
+    context->refusedUnload = MI_FALSE;
+    context->requestedUnload = MI_FALSE;
+    Atomic_Swap(&context->completed, 0);
+}
+
+void ProviderHostContext_Destroy(ProviderHostContext *context)
+{
+    if (context->instance)
+    {
+        MI_Instance_Delete(context->instance);
+        context->instance = NULL;
+    }
+}
+
+static ProviderHostClass *_FindClass(ProviderHost *host, const MI_Char *className)
+{
+    MI_Uint32 i;
+
+    for (i = 0; i != host->classCount; i++)
+    {
+        if (Tcscasecmp(host->classes[i].classDecl->name, className) == 0)
+            return &host->classes[i];
+    }
+    return NULL;
+}
+
+static const MI_MethodDecl *_FindMethod(const MI_ClassDecl *classDecl, const MI_Char *methodName)
+{
+    MI_Uint32 i;
+
+    for (i = 0; i != classDecl->numMethods; i++)
+    {
+        if (Tcscasecmp(classDecl->methods[i]->name, methodName) == 0)
+            return classDecl->methods[i];
+    }
+    return NULL;
+}
+
+/* ProviderHost_Load
+ * Load the provider module and every class provider in its schema, the same as omiagent
+ * does the first time a request for each class arrives.
+ */
+MI_Result ProviderHost_Load(ProviderHost **host)
+{
+    ProviderHostContext context;
+    const MI_SchemaDecl *schemaDecl;
+    MI_Result miResult;
+    MI_Uint32 i;
+
+    *host = calloc(1, sizeof(ProviderHost));
+    if (*host == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    (*host)->server.serverFT = &_serverFT;
+    (*host)->server.contextFT = &_contextFT;
+    (*host)->server.instanceFT = &__mi_instanceFT;
+
+    (*host)->module = MI_Main(&(*host)->server);
+    if ((*host)->module == NULL)
+    {
+        miResult = MI_RESULT_FAILED;
+        goto error;
+    }
+
+    ProviderHostContext_Init(&context, *host);
+    (*host)->module->Load(&(*host)->moduleSelf, &context.miContext);
+    miResult = ProviderHostContext_Wait(&context);
+    ProviderHostContext_Destroy(&context);
+    if (miResult != MI_RESULT_OK)
+        goto error;
+    (*host)->moduleLoaded = MI_TRUE;
+
+    schemaDecl = (*host)->module->schemaDecl;
+    (*host)->classes = calloc(schemaDecl->numClassDecls, sizeof(ProviderHostClass));
+    if ((*host)->classes == NULL)
+    {
+        miResult = MI_RESULT_SERVER_LIMITS_EXCEEDED;
+        goto error;
+    }
+
+    for (i = 0; i != schemaDecl->numClassDecls; i++)
+    {
+        ProviderHostClass *hostClass = &(*host)->classes[(*host)->classCount++];
+
+        hostClass->classDecl = schemaDecl->classDecls[i];
+        if ((hostClass->classDecl->providerFT == NULL) || (hostClass->classDecl->providerFT->Load == NULL))
+            continue;
+
+        ProviderHostContext_Init(&context, *host);
+        hostClass->classDecl->providerFT->Load(&hostClass->self, (*host)->moduleSelf, &context.miContext);
+        miResult = ProviderHostContext_Wait(&context);
+        ProviderHostContext_Destroy(&context);
+        if (miResult != MI_RESULT_OK)
+            goto error;
+
+        hostClass->loaded = MI_TRUE;
+    }
+
+    return MI_RESULT_OK;
+
+error:
+    ProviderHost_Unload(*host);
+    *host = NULL;
+    return miResult;
+}
+
+/* ProviderHost_Unload
+ * Unload the class providers and the module. Every request must have completed first.
+ */
+void ProviderHost_Unload(ProviderHost *host)
+{
+    ProviderHostContext context;
+    MI_Uint32 i;
+
+    if (host == NULL)
+        return;
+
+    for (i = host->classCount; i != 0; i--)
+    {
+        ProviderHostClass *hostClass = &host->classes[i - 1];
+
+        if (!hostClass->loaded || (hostClass->classDecl->providerFT->Unload == NULL))
+            continue;
+
+        ProviderHostContext_Init(&context, host);
+        hostClass->classDecl->providerFT->Unload(hostClass->self, &context.miContext);
+        ProviderHostContext_Wait(&context);
+        ProviderHostContext_Destroy(&context);
+    }
+
+    if (host->moduleLoaded && host->module->Unload)
+    {
+        ProviderHostContext_Init(&context, host);
+        host->module->Unload(host->moduleSelf, &context.miContext);
+        ProviderHostContext_Wait(&context);
+        ProviderHostContext_Destroy(&context);
+    }
+
+    free(host->classes);
+    free(host);
+}
+
+MI_Result ProviderHost_NewInstance(ProviderHost *host, const MI_Char *className, MI_Instance **instance)
+{
+    ProviderHostClass *hostClass = _FindClass(host, className);
+
+    if (hostClass == NULL)
+        return MI_RESULT_INVALID_CLASS;
+
+    return Instance_New(instance, hostClass->classDecl, NULL);
+}
+
+MI_Result ProviderHost_NewParameters(ProviderHost *host, const MI_Char *className, const MI_Char *methodName, MI_Instance **parameters)
+{
+    ProviderHostClass *hostClass = _FindClass(host, className);
+    const MI_MethodDecl *methodDecl;
+
+    if (hostClass == NULL)
+        return MI_RESULT_INVALID_CLASS;
+
+    methodDecl = _FindMethod(hostClass->classDecl, methodName);
+    if (methodDecl == NULL)
+        return MI_RESULT_METHOD_NOT_FOUND;
+
+    return Parameters_New(parameters, methodDecl, NULL);
+}
+
+void ProviderHost_CreateInstance(ProviderHost *host, ProviderHostContext *context, const MI_Instance *instance)
+{
+    ProviderHostClass *hostClass = _FindClass(host, instance->classDecl->name);
+
+    if ((hostClass == NULL) || !hostClass->loaded || (hostClass->classDecl->providerFT->CreateInstance == NULL))
+    {
+        _Complete(context, MI_RESULT_NOT_SUPPORTED);
+        return;
+    }
+
+    hostClass->classDecl->providerFT->CreateInstance(hostClass->self, &context->miContext,
+            PROVIDERHOST_NAMESPACE, hostClass->classDecl->name, instance);
+}
+
+void ProviderHost_DeleteInstance(ProviderHost *host, ProviderHostContext *context, const MI_Instance *instanceName)
+{
+    ProviderHostClass *hostClass = _FindClass(host, instanceName->classDecl->name);
+
+    if ((hostClass == NULL) || !hostClass->loaded || (hostClass->classDecl->providerFT->DeleteInstance == NULL))
+    {
+        _Complete(context, MI_RESULT_NOT_SUPPORTED);
+        return;
+    }
+
+    hostClass->classDecl->providerFT->DeleteInstance(hostClass->self, &context->miContext,
+            PROVIDERHOST_NAMESPACE, hostClass->classDecl->name, instanceName);
+}
+
+void ProviderHost_Invoke(ProviderHost *host, ProviderHostContext *context, const MI_Instance *instanceName, const MI_Char *methodName, const MI_Instance *parameters)
+{
+    ProviderHostClass *hostClass = _FindClass(host, instanceName->classDecl->name);
+    const MI_MethodDecl *methodDecl = NULL;
+
+    if (hostClass && hostClass->loaded)
+    {
+        methodDecl = _FindMethod(hostClass->classDecl, methodName);
+    }
+    if ((methodDecl == NULL) || (methodDecl->function == NULL))
+    {
+        _Complete(context, MI_RESULT_METHOD_NOT_FOUND);
+        return;
+    }
+
+    methodDecl->function(hostClass->self, &context->miContext,
+            PROVIDERHOST_NAMESPACE, hostClass->classDecl->name, methodName, instanceName, parameters);
+}
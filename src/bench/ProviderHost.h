@@ -0,0 +1,96 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#ifndef _ProviderHost_h_
+#define _ProviderHost_h_
+#include <stddef.h>
+#include <MI.h>
+
+/* ProviderHost is a stand-in for omiserver/omiagent that loads the provider in-process.
+ * It calls MI_Main, loads every class provider in the schema and dispatches CreateInstance,
+ * DeleteInstance and method invocations to them with an MI_Context it implements itself.
+ * This lets the provider be driven, profiled and benchmarked without an OMI server.
+ */
+typedef struct _ProviderHost ProviderHost;
+typedef struct _ProviderHostContext ProviderHostContext;
+
+/* Number of WSMAN/HTTP string options and custom options a context can carry */
+#define PROVIDERHOST_MAX_OPTIONS 16
+
+/* Called for every instance the provider posts on the context. The instance is only valid
+ * for the duration of the call. It is called on whatever thread the provider posted from.
+ */
+typedef void (*ProviderHost_PostInstanceCallback)(ProviderHostContext *context, const MI_Instance *instance);
+
+/* Called once the provider posts the final result for the context, before any waiter is
+ * woken up. It is called on whatever thread the provider posted from.
+ */
+typedef void (*ProviderHost_PostResultCallback)(ProviderHostContext *context, MI_Result result);
+
+typedef struct _ProviderHostOption
+{
+    const MI_Char *name;
+    const MI_Char *value;
+} ProviderHostOption;
+
+/* The MI_Context handed to the provider for one request. The caller owns the memory and it
+ * must stay valid until the provider has posted its final result.
+ */
+struct _ProviderHostContext
+{
+    MI_Context miContext;   /* Must be first, it is all the provider ever sees */
+    ProviderHost *host;
+
+    ProviderHost_PostInstanceCallback postInstance;
+    ProviderHost_PostResultCallback postResult;
+    void *callbackData;
+
+    /* Returned from GetStringOption and the custom option functions. Names starting with
+     * WSMAN_ or HTTP_ are the ones omiserver adds from the request headers.
+     */
+    ProviderHostOption options[PROVIDERHOST_MAX_OPTIONS];
+    MI_Uint32 optionCount;
+
+    /* Outcome of the request, valid once completed is set */
+    volatile ptrdiff_t completed;
+    MI_Result result;
+    MI_Char errorMessage[256];
+    MI_Instance *instance;      /* Clone of the last instance posted, NULL if none */
+    MI_Uint32 instanceCount;
+    MI_Boolean refusedUnload;
+    MI_Boolean requestedUnload;
+};
+
+MI_Result ProviderHost_Load(ProviderHost **host);
+void ProviderHost_Unload(ProviderHost *host);
+
+/* Create a new instance of a provider class or the input parameters of one of its methods.
+ * Delete them with MI_Instance_Delete.
+ */
+MI_Result ProviderHost_NewInstance(ProviderHost *host, const MI_Char *className, MI_Instance **instance);
+MI_Result ProviderHost_NewParameters(ProviderHost *host, const MI_Char *className, const MI_Char *methodName, MI_Instance **parameters);
+
+/* Dispatch a request to the provider owning the instance's class. The outcome is reported
+ * through the context; use ProviderHostContext_Wait for the provider to finish with it.
+ */
+void ProviderHost_CreateInstance(ProviderHost *host, ProviderHostContext *context, const MI_Instance *instance);
+void ProviderHost_DeleteInstance(ProviderHost *host, ProviderHostContext *context, const MI_Instance *instanceName);
+void ProviderHost_Invoke(ProviderHost *host, ProviderHostContext *context, const MI_Instance *instanceName, const MI_Char *methodName, const MI_Instance *parameters);
+
+void ProviderHostContext_Init(ProviderHostContext *context, ProviderHost *host);
+MI_Result ProviderHostContext_AddOption(ProviderHostContext *context, const MI_Char *name, const MI_Char *value);
+
+/* Wait for the provider to post the final result on the context and return it */
+MI_Result ProviderHostContext_Wait(ProviderHostContext *context);
+
+/* Make a finished context ready for another request, keeping its options and callbacks */
+void ProviderHostContext_Reset(ProviderHostContext *context);
+void ProviderHostContext_Destroy(ProviderHostContext *context);
+
+#endif /* _ProviderHost_h_ */
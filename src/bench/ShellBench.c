@@ -0,0 +1,122 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <MI.h>
+#include "ProviderHost.h"
+
+/* Loads the provider through ProviderHost and times provider load plus a loop of shell
+ * create/delete round trips.
+ *
+ * usage: shellbench [iterations]
+ */
+
+static double NowMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000.0) + (now.tv_nsec / 1000000.0);
+}
+
+static MI_Result CreateShell(ProviderHost *host, ProviderHostContext *context, MI_Instance **shell)
+{
+    MI_Instance *newShell;
+    MI_Value value;
+    MI_Result miResult;
+
+    miResult = ProviderHost_NewInstance(host, MI_T("Shell"), &newShell);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    value.string = MI_T("Microsoft.PowerShell");
+    MI_Instance_SetElement(newShell, MI_T("Name"), &value, MI_STRING, 0);
+    value.string = MI_T("stdin pr");
+    MI_Instance_SetElement(newShell, MI_T("InputStreams"), &value, MI_STRING, 0);
+    value.string = MI_T("stdout");
+    MI_Instance_SetElement(newShell, MI_T("OutputStreams"), &value, MI_STRING, 0);
+
+    ProviderHost_CreateInstance(host, context, newShell);
+    miResult = ProviderHostContext_Wait(context);
+    MI_Instance_Delete(newShell);
+
+    if ((miResult == MI_RESULT_OK) && (context->instance == NULL))
+        miResult = MI_RESULT_FAILED;
+
+    if (miResult == MI_RESULT_OK)
+    {
+        /* Keep the created shell, it is the instance name for every later request */
+        *shell = context->instance;
+        context->instance = NULL;
+    }
+    return miResult;
+}
+
+int main(int argc, char **argv)
+{
+    ProviderHost *host;
+    ProviderHostContext context;
+    MI_Instance *shell;
+    MI_Result miResult;
+    unsigned long iterations = 100;
+    unsigned long i;
+    double start, createMs = 0, deleteMs = 0;
+
+    if (argc > 1)
+        iterations = strtoul(argv[1], NULL, 10);
+
+    start = NowMs();
+    miResult = ProviderHost_Load(&host);
+    if (miResult != MI_RESULT_OK)
+    {
+        fprintf(stderr, "provider load failed, miResult=%u\n", miResult);
+        return 1;
+    }
+    printf("load: %.3f ms\n", NowMs() - start);
+
+    ProviderHostContext_Init(&context, host);
+    ProviderHostContext_AddOption(&context, MI_T("WSMAN_ResourceURI"), MI_T("http://schemas.microsoft.com/powershell/Microsoft.PowerShell"));
+
+    for (i = 0; i != iterations; i++)
+    {
+        start = NowMs();
+        miResult = CreateShell(host, &context, &shell);
+        createMs += NowMs() - start;
+        if (miResult != MI_RESULT_OK)
+        {
+            fprintf(stderr, "shell create failed, miResult=%u: %s\n", miResult, context.errorMessage);
+            break;
+        }
+        ProviderHostContext_Reset(&context);
+
+        start = NowMs();
+        ProviderHost_DeleteInstance(host, &context, shell);
+        miResult = ProviderHostContext_Wait(&context);
+        deleteMs += NowMs() - start;
+        MI_Instance_Delete(shell);
+        ProviderHostContext_Reset(&context);
+        if (miResult != MI_RESULT_OK)
+        {
+            fprintf(stderr, "shell delete failed, miResult=%u\n", miResult);
+            break;
+        }
+    }
+
+    if (i)
+    {
+        printf("shell create: %lu iterations, %.3f ms avg\n", i, createMs / i);
+        printf("shell delete: %lu iterations, %.3f ms avg\n", i, deleteMs / i);
+    }
+
+    ProviderHostContext_Destroy(&context);
+    ProviderHost_Unload(host);
+
+    return (miResult == MI_RESULT_OK) ? 0 : 1;
+}
@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+#
+# Compare shell create latency and RSS across CoreCLR runtime settings. Each setting is
+# written to a [clr] section of a scratch psrp.conf, which the provider picks up through
+# PSRP_CONFIG_FILE, and providerbench's create workload is run against it. The provider
+# has to be using PowerShell rather than the echo plugin for the settings to matter.
+#
+# usage: clrbench.sh <providerbench> [iterations] [name:key=value[,key=value]...]...
+#
+# With no settings given a default set is run: the defaults, server GC, non-concurrent GC,
+# tiered compilation off and a 200MB GC heap hard limit. Every result line is providerbench's
+# JSON with the setting name added.
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <providerbench> [iterations] [name:key=value[,key=value]...]..." >&2
+    exit 1
+fi
+
+PROVIDERBENCH=$1
+shift
+ITERATIONS=200
+if [ $# -gt 0 ] && [[ $1 =~ ^[0-9]+$ ]]; then
+    ITERATIONS=$1
+    shift
+fi
+
+if [ $# -eq 0 ]; then
+    set -- \
+        "default:" \
+        "servergc:System.GC.Server=true" \
+        "nonconcurrentgc:System.GC.Concurrent=false" \
+        "notiered:System.Runtime.TieredCompilation=false" \
+        "heaplimit:System.GC.HeapHardLimit=209715200"
+fi
+
+CONFIG=$(mktemp)
+trap 'rm -f "$CONFIG"' EXIT
+export PSRP_CONFIG_FILE=$CONFIG
+
+for setting in "$@"; do
+    name=${setting%%:*}
+    properties=${setting#*:}
+
+    echo "[clr]" > "$CONFIG"
+    if [ -n "$properties" ]; then
+        echo "$properties" | tr ',' '\n' >> "$CONFIG"
+    fi
+
+    "$PROVIDERBENCH" -w create -n "$ITERATIONS" | sed "s/^{/{\"clr\":\"$name\",/"
+done
@@ -0,0 +1,53 @@
+#!/usr/bin/env bash
+#
+# Compare first-command latency of a fresh provider with and without psrpwarmup. For every
+# psrpwarmup setting the omiserver.conf the provider reads is rewritten with just that
+# setting changed, and providerbench's first workload is run in a new process for each run.
+# The provider has to be using PowerShell rather than the echo plugin for the numbers to mean
+# anything. omiserver.conf is put back the way it was when the script exits.
+#
+# usage: warmbench.sh <providerbench> <omiserver.conf> [runs] [gap milliseconds]...
+#
+# With no gaps given 0 and 2000 are run: a client that shows up with the provider load, and
+# one that gives the background warm-up time to finish. Every result line is providerbench's
+# JSON with the psrpwarmup setting added, followed by a median line for each setting and gap.
+
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 <providerbench> <omiserver.conf> [runs] [gap milliseconds]..." >&2
+    exit 1
+fi
+
+PROVIDERBENCH=$1
+OMISERVER_CONF=$2
+shift 2
+RUNS=10
+if [ $# -gt 0 ]; then
+    RUNS=$1
+    shift
+fi
+if [ $# -eq 0 ]; then
+    set -- 0 2000
+fi
+
+SAVED=$(mktemp)
+RESULTS=$(mktemp)
+cp "$OMISERVER_CONF" "$SAVED"
+trap 'cp "$SAVED" "$OMISERVER_CONF"; rm -f "$SAVED" "$RESULTS"' EXIT
+
+for warmup in off true shell; do
+    grep -v '^[[:space:]]*psrpwarmup[[:space:]]*=' "$SAVED" > "$OMISERVER_CONF" || true
+    if [ "$warmup" != off ]; then
+        echo "psrpwarmup=$warmup" >> "$OMISERVER_CONF"
+    fi
+
+    for gap in "$@"; do
+        : > "$RESULTS"
+        for ((run = 0; run < RUNS; run++)); do
+            "$PROVIDERBENCH" -w first -g "$gap" | sed "s/^{/{\"warmup\":\"$warmup\",/" | tee -a "$RESULTS"
+        done
+        sed -n 's/.*"firstCommandUs":\([0-9.]*\).*/\1/p' "$RESULTS" | sort -n |
+            awk -v warmup="$warmup" -v gap="$gap" '{ v[NR] = $1 } END { if (NR) printf "{\"warmup\":\"%s\",\"gapMs\":%s,\"runs\":%d,\"medianFirstCommandUs\":%.1f}\n", warmup, gap, NR, v[int((NR + 1) / 2)] }'
+    done
+done
@@ -10,12 +10,18 @@
 #include "coreclrutil.h"
 #include <dirent.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <string>
 #include <set>
+#include <vector>
+#include <algorithm>
 #include <cstdlib>
 #include "base/logbase.h"
 
@@ -70,8 +76,14 @@ std::string GetEnvAbsolutePath(const char* env)
     return std::string(ptr);
 }
 
+static bool CompareTpaExtension(const std::pair<unsigned int, std::string>& left, const std::pair<unsigned int, std::string>& right)
+{
+    return left.first < right.first;
+}
+
 // Add all *.dll, *.ni.dll, *.exe, and *.ni.exe files from the specified directory to the tpaList string.
-// Note: copied from unixcorerun
+// Note: based on unixcorerun, which walks the directory once per extension. This makes a single pass
+// and orders the result afterwards, which gives the same list.
 void AddFilesFromDirectoryToTpaList(const char* directory, std::string& tpaList)
 {
     const char * const tpaExtensions[] = {
@@ -80,6 +92,7 @@ void AddFilesFromDirectoryToTpaList(const char* directory, std::string& tpaList)
         ".ni.exe",
         ".exe",
     };
+    const unsigned int tpaExtensionCount = sizeof(tpaExtensions) / sizeof(tpaExtensions[0]);
 
     DIR* dir = opendir(directory);
     if (dir == NULL)
@@ -87,82 +100,247 @@ void AddFilesFromDirectoryToTpaList(const char* directory, std::string& tpaList)
         return;
     }
 
-    std::set<std::string> addedAssemblies;
+    // Every matching file with the index of the first extension it matches, in directory order
+    std::vector<std::pair<unsigned int, std::string> > candidates;
+    struct dirent* entry;
 
-    // Walk the directory for each extension separately so that we first get files with .ni.dll extension,
-    // then files with .dll extension, etc.
-    for (unsigned int extIndex = 0; extIndex < sizeof(tpaExtensions) / sizeof(tpaExtensions[0]); extIndex++)
+    // For all entries in the directory
+    while ((entry = readdir(dir)) != NULL)
     {
-        const char* ext = tpaExtensions[extIndex];
-        int extLength = strlen(ext);
+        size_t nameLength = strlen(entry->d_name);
+        unsigned int extIndex;
 
-        struct dirent* entry;
-
-        // For all entries in the directory
-        while ((entry = readdir(dir)) != NULL)
+        // Check the extension first so that only assemblies ever need a stat
+        for (extIndex = 0; extIndex < tpaExtensionCount; extIndex++)
         {
-            // We are interested in files only
-            switch (entry->d_type)
+            size_t extLength = strlen(tpaExtensions[extIndex]);
+            if ((nameLength > extLength) &&
+                (strcmp(entry->d_name + nameLength - extLength, tpaExtensions[extIndex]) == 0))
             {
-            case DT_REG:
                 break;
-
-                // Handle symlinks and file systems that do not support d_type
-            case DT_LNK:
-            case DT_UNKNOWN:
-            {
-                std::string fullFilename;
-
-                fullFilename.append(directory);
-                fullFilename.append("/");
-                fullFilename.append(entry->d_name);
-
-                struct stat sb;
-                if (stat(fullFilename.c_str(), &sb) == -1)
-                {
-                    continue;
-                }
-
-                if (!S_ISREG(sb.st_mode))
-                {
-                    continue;
-                }
             }
+        }
+        if (extIndex == tpaExtensionCount)
+        {
+            continue;
+        }
+
+        // We are interested in files only
+        switch (entry->d_type)
+        {
+        case DT_REG:
             break;
 
-            default:
+            // Handle symlinks and file systems that do not support d_type
+        case DT_LNK:
+        case DT_UNKNOWN:
+        {
+            struct stat sb;
+            if ((fstatat(dirfd(dir), entry->d_name, &sb, 0) == -1) || !S_ISREG(sb.st_mode))
+            {
                 continue;
             }
+        }
+        break;
 
-            std::string filename(entry->d_name);
+        default:
+            continue;
+        }
 
-            // Check if the extension matches the one we are looking for
-            int extPos = filename.length() - extLength;
-            if ((extPos <= 0) || (filename.compare(extPos, extLength, ext) != 0))
-            {
-                continue;
-            }
+        candidates.push_back(std::make_pair(extIndex, std::string(entry->d_name, nameLength)));
+    }
+    closedir(dir);
 
-            std::string filenameWithoutExt(filename.substr(0, extPos));
+    // All .ni.dll files first, then .dll and so on, keeping directory order within each
+    std::stable_sort(candidates.begin(), candidates.end(), CompareTpaExtension);
 
-            // Make sure if we have an assembly with multiple extensions present,
-            // we insert only one version of it.
-            if (addedAssemblies.find(filenameWithoutExt) == addedAssemblies.end())
-            {
-                addedAssemblies.insert(filenameWithoutExt);
+    std::set<std::string> addedAssemblies;
+    size_t directoryLength = strlen(directory);
+    size_t listLength = tpaList.length();
 
-                tpaList.append(directory);
-                tpaList.append("/");
-                tpaList.append(filename);
-                tpaList.append(":");
-            }
+    for (size_t index = 0; index < candidates.size(); index++)
+    {
+        listLength += directoryLength + candidates[index].second.length() + 2;
+    }
+    tpaList.reserve(listLength);
+
+    for (size_t index = 0; index < candidates.size(); index++)
+    {
+        const std::string& filename = candidates[index].second;
+        size_t extPos = filename.length() - strlen(tpaExtensions[candidates[index].first]);
+
+        // Make sure if we have an assembly with multiple extensions present,
+        // we insert only one version of it.
+        if (addedAssemblies.insert(filename.substr(0, extPos)).second)
+        {
+            tpaList.append(directory);
+            tpaList.append("/");
+            tpaList.append(filename);
+            tpaList.append(":");
         }
+    }
+}
+
+// The TPA list only changes when files are added to or removed from the CoreCLR directory,
+// which changes the directory's mtime, so it is cached per user along with the directory's
+// identity and mtime. The cache file is:
+//     psrp-tpa <version>
+//     <directory>
+//     <device> <inode> <mtime seconds> <mtime nanoseconds>
+//     <TPA list>
+#define TPA_CACHE_HEADER "psrp-tpa 1"
+
+// Coarsest mtime granularity we expect from a file system, in seconds. A directory changed
+// this recently can change again without its mtime moving, so its list is not cached.
+#define TPA_CACHE_MTIME_GRANULARITY 2
 
-        // Rewind the directory stream to be able to iterate over it for the next extension
-        rewinddir(dir);
+static std::string GetTpaCachePath()
+{
+    const char* cacheHome = std::getenv("XDG_CACHE_HOME");
+    std::string path;
+
+    if (cacheHome && cacheHome[0] == '/')
+    {
+        path = cacheHome;
+    }
+    else
+    {
+        const char* home = std::getenv("HOME");
+        if (!home || home[0] != '/')
+        {
+            return std::string("");
+        }
+        path = home;
+        path += "/.cache";
     }
+    path += "/psrp";
+    return path;
+}
 
-    closedir(dir);
+static std::string GetTpaCacheKey(const char* directory, time_t& modified)
+{
+    struct stat sb;
+    char key[128];
+
+    if (stat(directory, &sb) == -1)
+    {
+        return std::string("");
+    }
+#if defined(__APPLE__)
+    long nanoseconds = sb.st_mtimespec.tv_nsec;
+#else
+    long nanoseconds = sb.st_mtim.tv_nsec;
+#endif
+    snprintf(key, sizeof(key), "%llu %llu %lld %ld",
+        (unsigned long long) sb.st_dev, (unsigned long long) sb.st_ino, (long long) sb.st_mtime, nanoseconds);
+    modified = sb.st_mtime;
+
+    std::string header(TPA_CACHE_HEADER "\n");
+    header += directory;
+    header += "\n";
+    header += key;
+    header += "\n";
+    return header;
+}
+
+static bool ReadTpaCache(const std::string& cacheFile, const std::string& key, std::string& tpaList)
+{
+    FILE* file = fopen(cacheFile.c_str(), "r");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    std::string contents;
+    char buffer[16384];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) != 0)
+    {
+        contents.append(buffer, read);
+    }
+    fclose(file);
+
+    if ((contents.length() <= key.length()) || (contents.compare(0, key.length(), key) != 0))
+    {
+        return false;
+    }
+    tpaList.assign(contents, key.length(), std::string::npos);
+    return true;
+}
+
+// Best effort, a cache that cannot be written only costs the next start a directory scan
+static void WriteTpaCache(const std::string& cacheDirectory, const std::string& cacheFile, const std::string& key, const std::string& tpaList)
+{
+    std::string tempFile(cacheFile);
+    char suffix[32];
+
+    if ((mkdir(cacheDirectory.substr(0, cacheDirectory.rfind('/')).c_str(), 0700) == -1 && errno != EEXIST) ||
+        (mkdir(cacheDirectory.c_str(), 0700) == -1 && errno != EEXIST))
+    {
+        return;
+    }
+
+    // Agents for the same user can start at the same time so each writes its own file
+    snprintf(suffix, sizeof(suffix), ".%d", (int) getpid());
+    tempFile += suffix;
+
+    int fd = open(tempFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+    {
+        return;
+    }
+    std::string contents(key);
+    contents += tpaList;
+    bool written = (write(fd, contents.data(), contents.length()) == (ssize_t) contents.length());
+    if ((close(fd) != 0) || !written || (rename(tempFile.c_str(), cacheFile.c_str()) != 0))
+    {
+        unlink(tempFile.c_str());
+    }
+}
+
+static unsigned long GetMicroseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Get the TPA list from the cache if the directory has not changed since it was written,
+// otherwise scan the directory and update the cache. Returns whether it came from the cache.
+bool GetTpaList(const char* directory, std::string& tpaList)
+{
+    unsigned long startTime = GetMicroseconds();
+    std::string cacheDirectory = GetTpaCachePath();
+    time_t modified = 0;
+    std::string key = GetTpaCacheKey(directory, modified);
+    std::string cacheFile;
+    bool cached = false;
+
+    if (!cacheDirectory.empty() && !key.empty())
+    {
+        std::string directoryName(directory);
+        std::replace(directoryName.begin(), directoryName.end(), '/', '_');
+        cacheFile = cacheDirectory + "/tpa" + directoryName;
+
+        cached = ReadTpaCache(cacheFile, key, tpaList);
+    }
+
+    if (!cached)
+    {
+        tpaList.clear();
+        AddFilesFromDirectoryToTpaList(directory, tpaList);
+        // A file added within the same mtime tick as the scan would not change the key, so
+        // only cache a directory that has been left alone for longer than that
+        if (!cacheFile.empty() && !tpaList.empty() &&
+            (time(NULL) - modified > TPA_CACHE_MTIME_GRANULARITY))
+        {
+            WriteTpaCache(cacheDirectory, cacheFile, key, tpaList);
+        }
+    }
+
+    __LOGD(("GetTpaList - %s %s in %luus, %u bytes", cached ? "loaded" : "built", directory,
+        GetMicroseconds() - startTime, (unsigned int) tpaList.length()));
+    return cached;
 }
 
 //
@@ -170,11 +348,17 @@ void AddFilesFromDirectoryToTpaList(const char* directory, std::string& tpaList)
 //
 int startCoreCLR(
     const char* appDomainFriendlyName,
+    int extraPropertyCount,
+    const char** extraPropertyKeys,
+    const char** extraPropertyValues,
     void** hostHandle,
-    unsigned int* domainId)
+    unsigned int* domainId,
+    CoreCLRStartupTimes* startupTimes)
 {
     char exePath[PATH_MAX];
 
+    memset(startupTimes, 0, sizeof(*startupTimes));
+
     // get path to current executable
     ssize_t len = readlink("/proc/self/exe", exePath, PATH_MAX);
     if (len == -1 || len == sizeof(exePath))
@@ -220,7 +404,10 @@ int startCoreCLR(
 #endif
     }
 
+    strncpy(startupTimes->runtimeDirectory, clrAbsolutePath.c_str(), sizeof(startupTimes->runtimeDirectory) - 1);
+
     // get the CoreCLR shared library path
+    unsigned long phaseStart = GetMicroseconds();
     std::string coreClrDllPath(clrAbsolutePath);
     coreClrDllPath += coreClrDll;
 
@@ -258,12 +445,13 @@ int startCoreCLR(
         __LOGE(("function coreclr_create_delegate not found in CoreCLR library"));
         return -1;
     }
+    startupTimes->loadLibrary = GetMicroseconds() - phaseStart;
 
-    // generate the Trusted Platform Assemblies list
+    // generate the Trusted Platform Assemblies list from the assemblies in the CoreCLR root path
     std::string tpaList;
-
-    // add assemblies in the CoreCLR root path
-    AddFilesFromDirectoryToTpaList(clrAbsolutePath.c_str(), tpaList);
+    phaseStart = GetMicroseconds();
+    startupTimes->tpaListCached = GetTpaList(clrAbsolutePath.c_str(), tpaList);
+    startupTimes->tpaList = GetMicroseconds() - phaseStart;
 
     // create list of properties to initialize CoreCLR
     const char* propertyKeys[] = {
@@ -300,15 +488,46 @@ int startCoreCLR(
         clrAbsolutePath.c_str()
     };
 
+    // Configured properties replace the defaults above or are added after them
+    std::vector<const char*> keys(propertyKeys, propertyKeys + sizeof(propertyKeys)/sizeof(propertyKeys[0]));
+    std::vector<const char*> values(propertyValues, propertyValues + sizeof(propertyValues)/sizeof(propertyValues[0]));
+    for (int extraIndex = 0; extraIndex < extraPropertyCount; extraIndex++)
+    {
+        size_t index;
+        for (index = 0; index < keys.size(); index++)
+        {
+            if (strcmp(keys[index], extraPropertyKeys[extraIndex]) == 0)
+                break;
+        }
+        if (index == keys.size())
+        {
+            keys.push_back(extraPropertyKeys[extraIndex]);
+            values.push_back(extraPropertyValues[extraIndex]);
+        }
+        else
+        {
+            values[index] = extraPropertyValues[extraIndex];
+        }
+    }
+
+    // The TPA list is long and only depends on the directory, which is logged anyway
+    for (size_t index = 1; index < keys.size(); index++)
+    {
+        __LOGD(("startCoreCLR - %s = %s", keys[index], values[index]));
+    }
+
     // initialize CoreCLR
+    phaseStart = GetMicroseconds();
     int status = initializeCoreCLR(
         exePath,
         appDomainFriendlyName,
-        sizeof(propertyKeys)/sizeof(propertyKeys[0]),
-        propertyKeys,
-        propertyValues,
+        (int) keys.size(),
+        &keys[0],
+        &values[0],
         hostHandle,
         domainId);
+    startupTimes->initialize = GetMicroseconds() - phaseStart;
+    __LOGD(("startCoreCLR - coreclr_initialize took %luus, status %X", startupTimes->initialize, status));
 
     return status;
 }
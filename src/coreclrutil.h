@@ -13,8 +13,10 @@
 
 /* PowerShell on Linux custom host interface
  *
- * startCoreCLR() takes a friendly name, e.g. "powershell", and a
- * writable pointer and identifier
+ * startCoreCLR() takes a friendly name, e.g. "powershell", any extra
+ * runtime properties, and a writable pointer and identifier. Extra
+ * properties override the defaults of the same name. It also reports
+ * how long each phase of starting the runtime took.
  *
  * executeAssmbly() will be made available after starting CoreCLR, and
  * is used to launch assemblies with a main function
@@ -30,10 +32,24 @@
 extern "C"
 {
 #endif
+    /* Microseconds startCoreCLR spent in each phase of starting the runtime */
+    typedef struct _CoreCLRStartupTimes
+    {
+        unsigned long loadLibrary;      /* dlopen of libcoreclr and its entry points */
+        unsigned long tpaList;          /* loading or building the TPA list */
+        unsigned long initialize;       /* coreclr_initialize */
+        int tpaListCached;
+        char runtimeDirectory[256];     /* CoreCLR root, which identifies the PowerShell install */
+    } CoreCLRStartupTimes;
+
     int startCoreCLR(
         const char* appDomainFriendlyName,
+        int extraPropertyCount,
+        const char** extraPropertyKeys,
+        const char** extraPropertyValues,
         void** hostHandle,
-        unsigned int* domainId);
+        unsigned int* domainId,
+        CoreCLRStartupTimes* startupTimes);
 
     int stopCoreCLR(void* hostHandle, unsigned int domainId);
 
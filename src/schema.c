@@ -653,6 +653,40 @@ static MI_CONST MI_PropertyDecl Shell_CreationXml_prop =
     NULL,
 };
 
+/* property Shell.BytesIn */
+static MI_CONST MI_PropertyDecl Shell_BytesIn_prop =
+{
+    MI_FLAG_PROPERTY, /* flags */
+    0x00626E07, /* code */
+    MI_T("BytesIn"), /* name */
+    NULL, /* qualifiers */
+    0, /* numQualifiers */
+    MI_UINT64, /* type */
+    NULL, /* className */
+    0, /* subscript */
+    offsetof(Shell, BytesIn), /* offset */
+    MI_T("Shell"), /* origin */
+    MI_T("Shell"), /* propagator */
+    NULL,
+};
+
+/* property Shell.BytesOut */
+static MI_CONST MI_PropertyDecl Shell_BytesOut_prop =
+{
+    MI_FLAG_PROPERTY, /* flags */
+    0x00627408, /* code */
+    MI_T("BytesOut"), /* name */
+    NULL, /* qualifiers */
+    0, /* numQualifiers */
+    MI_UINT64, /* type */
+    NULL, /* className */
+    0, /* subscript */
+    offsetof(Shell, BytesOut), /* offset */
+    MI_T("Shell"), /* origin */
+    MI_T("Shell"), /* propagator */
+    NULL,
+};
+
 static MI_PropertyDecl MI_CONST* MI_CONST Shell_props[] =
 {
     &Shell_ShellId_prop,
@@ -675,6 +709,8 @@ static MI_PropertyDecl MI_CONST* MI_CONST Shell_props[] =
     &Shell_ShellRunTime_prop,
     &Shell_ShellInactivity_prop,
     &Shell_CreationXml_prop,
+    &Shell_BytesIn_prop,
+    &Shell_BytesOut_prop,
 };
 
 /* parameter Shell.Command(): command */
@@ -17,6 +17,8 @@
 #define ERROR_WSMAN_SERVICE_STREAM_DISCONNECTED 0x803381DE
 #define ERROR_WSMAN_REDIRECT_REQUESTED 0x80338199
 #define ERROR_INSUFFICIENT_BUFFER 122
+#define ERROR_WSMAN_OPERATION_TIMEDOUT 0x80338029
+#define WSMAN_ERROR_OPERATION_ABORTED 995
 
 /* NOTE: All strings need to be UTF-16. */
 typedef void * HANDLE;
@@ -380,6 +382,28 @@ MI_Uint32 WINAPI WSManCloseSession(
     MI_Uint32 flags
     );
 
+//
+// -----------------------------------------------------------------------------
+// Counters for the client's pool of idle sessions, see sessionpoolmaxperhost
+//  in omiserver.conf. A shell given a pooled session skips the TCP connect,
+//  the TLS handshake on https and authentication. The hit rate is
+//  hits / requests.
+// -----------------------------------------------------------------------------
+//
+typedef struct _WSMAN_SESSION_POOL_STATISTICS
+{
+    MI_Uint64 requests;             // shells that asked the pool for a session
+    MI_Uint64 hits;                 // ... and were given an idle one
+    MI_Uint64 failed;               // pooled sessions a shell create failed on, retried on a new session
+    MI_Uint64 expired;              // idle sessions closed after sessionpoolmaxidle seconds
+    MI_Uint32 idleSessions;         // idle sessions held right now
+} WSMAN_SESSION_POOL_STATISTICS;
+
+MI_Uint32 WINAPI WSManGetSessionPoolStatistics(
+    _In_ WSMAN_API_HANDLE apiHandle,
+    _Out_ WSMAN_SESSION_POOL_STATISTICS *statistics
+    );
+
 //
 // default operation timeout for network operations - 1 min = 60000ms
 //
@@ -882,6 +906,30 @@ void WINAPI WSManReceiveShellOutput(
     _Out_ WSMAN_OPERATION_HANDLE *receiveOperation // should be closed using WSManCloseOperation
 );
 
+//
+// Caller owned buffer for WSManReceiveShellOutputEx. Stream data is decoded
+// straight into it and streamData.binaryData.data points into it for the
+// duration of the completion callback. Data that does not fit is delivered
+// from a temporary buffer instead, so a small buffer is never an error.
+// The buffer must stay valid until the receive operation is closed.
+//
+typedef struct _WSMAN_RECEIVE_BUFFER
+{
+    MI_Uint32 bufferLength;
+    _In_reads_(bufferLength) MI_Uint8 *buffer;
+} WSMAN_RECEIVE_BUFFER;
+
+void WINAPI WSManReceiveShellOutputEx(
+
+    _Inout_ WSMAN_SHELL_HANDLE shell,
+    _In_opt_ WSMAN_COMMAND_HANDLE command,
+    MI_Uint32 flags,
+    _In_opt_ WSMAN_STREAM_ID_SET *desiredStreamSet,  // request output from a particular stream or list of streams
+    _In_opt_ WSMAN_RECEIVE_BUFFER *receiveBuffer,    // if NULL, behaves as WSManReceiveShellOutput
+    _In_ WSMAN_SHELL_ASYNC *async,
+    _Out_ WSMAN_OPERATION_HANDLE *receiveOperation // should be closed using WSManCloseOperation
+);
+
 //
 // -----------------------------------------------------------------------------
 //  WSManSendShellInput API - rsp:Send
@@ -1039,6 +1087,90 @@ void WINAPI WSManConnectShellCommand(
     _Out_ WSMAN_COMMAND_HANDLE *command // should be closed using WSManCloseCommand
 );
 
+//
+// -----------------------------------------------------------------------------
+// WSManRunShellCommandFanOut API - runs one command in a new shell on each of
+//  a list of hosts. At most maxConcurrency hosts are worked on at once, each
+//  with its own session. A host whose command is still running hostTimeoutMs
+//  after connecting has the command terminated and finishes with
+//  ERROR_WSMAN_OPERATION_TIMEDOUT; no single request to it may take longer.
+//  credentials must be a user name and password for basic, negotiate or
+//  kerberos authentication, and sessionOptions are set on every host's
+//  session as WSManSetSessionOption would.
+//
+// The completion function is never called from two threads at once. It is
+//  called with the host's receive data and flags for each output stream
+//  element, with WSMAN_FLAG_CALLBACK_END_OF_OPERATION and the host's result
+//  once that host is done, and a last time with the same flag, hostIndex
+//  WSMAN_FANOUT_ALL_HOSTS and no error once every host is done.
+// -----------------------------------------------------------------------------
+//
+typedef struct WSMAN_FANOUT *WSMAN_FANOUT_HANDLE;
+
+#define WSMAN_FANOUT_ALL_HOSTS 0xFFFFFFFF
+#define WSMAN_FANOUT_DEFAULT_CONCURRENCY 16
+
+typedef void (*WSMAN_FANOUT_COMPLETION_FUNCTION)(
+    _In_opt_ void *operationContext,
+    MI_Uint32 flags,
+    _In_ WSMAN_ERROR *error,
+    MI_Uint32 hostIndex,                            // index into WSMAN_FANOUT_INFO.hosts
+    _In_opt_ const MI_Char16* host,
+    _In_opt_ WSMAN_RECEIVE_DATA_RESULT *data        // valid only within this function
+    );
+
+typedef struct _WSMAN_FANOUT_ASYNC
+{
+    _In_opt_ void *operationContext;
+    _In_ WSMAN_FANOUT_COMPLETION_FUNCTION completionFunction;
+} WSMAN_FANOUT_ASYNC;
+
+typedef struct _WSMAN_FANOUT_SESSION_OPTION
+{
+    WSManSessionOption option;
+    WSMAN_DATA data;
+} WSMAN_FANOUT_SESSION_OPTION;
+
+typedef struct _WSMAN_FANOUT_INFO
+{
+    MI_Uint32 hostCount;
+    _In_reads_(hostCount) const MI_Char16* *hosts;  // connections as given to WSManCreateSession
+    _In_ WSMAN_AUTHENTICATION_CREDENTIALS *credentials;
+    MI_Uint32 shellFlags;                           // as for WSManCreateShellEx
+    _In_ const MI_Char16* resourceUri;
+    _In_opt_ WSMAN_SHELL_STARTUP_INFO *startupInfo;
+    _In_opt_ WSMAN_OPTION_SET *options;
+    _In_opt_ WSMAN_DATA *createXml;
+    _In_ const MI_Char16* commandLine;
+    _In_opt_ WSMAN_COMMAND_ARG_SET *args;
+    MI_Uint32 maxConcurrency;                       // 0 for WSMAN_FANOUT_DEFAULT_CONCURRENCY
+    MI_Uint32 hostTimeoutMs;                        // 0 for no limit
+    MI_Uint32 sessionOptionCount;
+    _In_reads_opt_(sessionOptionCount) WSMAN_FANOUT_SESSION_OPTION *sessionOptions; // set on every host's session
+} WSMAN_FANOUT_INFO;
+
+MI_Uint32 WINAPI WSManRunShellCommandFanOut(
+    _In_ WSMAN_API_HANDLE apiHandle,
+    MI_Uint32 flags,
+    _In_ WSMAN_FANOUT_INFO *info,                   // copied, need not outlive the call
+    _In_ WSMAN_FANOUT_ASYNC *async,
+    _Out_ WSMAN_FANOUT_HANDLE *fanOut               // should be closed using WSManCloseFanOut
+);
+
+//
+// -----------------------------------------------------------------------------
+// WSManCloseFanOut API - cancels the create and run requests of hosts still
+//  starting and terminates the commands of hosts still running, which finish
+//  with WSMAN_ERROR_OPERATION_ABORTED, then waits for the last completion
+//  callback and frees the fan-out. Must not be called from the fan-out's own
+//  completion function.
+// -----------------------------------------------------------------------------
+//
+MI_Uint32 WINAPI WSManCloseFanOut(
+    _Inout_opt_ WSMAN_FANOUT_HANDLE fanOut,
+    MI_Uint32 flags
+);
+
 
 
 
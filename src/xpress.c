@@ -107,6 +107,27 @@ typedef struct _XPRESS_LZ_WORKSPACE {
 
 #define HUFFMAN_DECODE_LENGTH        10
 
+//
+// A previous block's Huffman table is reused when its cost for the new block
+// is within 1/2^HUFFMAN_REUSE_SLACK_SHIFT of the entropy of the new block.
+// Costs are estimated with log2 values that have HUFFMAN_LOG2_FRACTION_BITS
+// bits of fraction.
+//
+
+#define HUFFMAN_REUSE_SLACK_SHIFT    5
+#define HUFFMAN_LOG2_FRACTION_BITS   8
+
+//
+// A table built for reuse costs more to build than an exact one, so once one
+// goes unused HUFFMAN_REUSE_RETRY_BLOCKS full blocks build exact tables before
+// another reusable table is tried.
+//
+
+#define HUFFMAN_REUSE_RETRY_BLOCKS   16
+
+#define HUFFMAN_LOG2(Workspace, Value) \
+    ((Value) < 256 ? (Workspace)->Log2Table[(Value)] : XpressLog2(Value))
+
 typedef struct _HUFFMAN_NODE {
     ULONG_PTR Frequency;
     union {
@@ -150,6 +171,32 @@ typedef struct _HUFFMAN_WORKSPACE {
     MI_Uint32 Frequencies[HUFFMAN_ALPHABET_SIZE];
 
     MI_Uint8 CompactBitLengths[HUFFMAN_ALPHABET_SIZE / 2];
+
+    //
+    // Set once Encodings, SymbolToBitLength and CompactBitLengths hold a
+    // table from a previous block that the next block may reuse.
+    //
+
+    LOGICAL PreviousEncodingsValid;
+
+    //
+    // Full blocks left to build exact tables for before the next reusable one.
+    //
+
+    ULONG_PTR ReuseRetryCountdown;
+
+    //
+    // Bitmap of the symbols given a code by XpressBuildReusableHuffmanEncodings
+    // even though they do not occur in the block.
+    //
+
+    MI_Uint8 PaddedSymbols[HUFFMAN_ALPHABET_SIZE / 8];
+
+    //
+    // XpressLog2 of 1 to 255, the frequencies most symbols have.
+    //
+
+    USHORT Log2Table[256];
 } HUFFMAN_WORKSPACE, *PHUFFMAN_WORKSPACE;
 
 typedef struct _XPRESS_HUFF_WORKSPACE {
@@ -399,8 +446,117 @@ Return Value:
 
 }
 
+static ULONG_PTR
+XpressLog2 (
+    _In_ ULONG_PTR Value
+    )
+
+/*++
+
+Routine Description:
+
+    Computes log2 of a non-zero value as a fixed point number with
+    HUFFMAN_LOG2_FRACTION_BITS bits of fraction.  The integer part comes from
+    the highest set bit and each fraction bit from squaring the normalized
+    mantissa, so no floating point is needed.
+
+Arguments:
+
+    Value - The value.  Must be non-zero and less than 2^24.
+
+Return Value:
+
+    log2(Value) * 2^HUFFMAN_LOG2_FRACTION_BITS, rounded down.
+
+--*/
+
+{
+    ULONG_PTR Result;
+    ULONG_PTR Bit;
+    MI_Uint64 Mantissa;
+    INT HighBit;
+
+    assert(Value != 0);
+
+    if (Value >= (1 << 16)) {
+        HighBit = XpressHighBitIndexTable[Value >> 16] + 16;
+    } else if (Value >= (1 << 8)) {
+        HighBit = XpressHighBitIndexTable[Value >> 8] + 8;
+    } else {
+        HighBit = XpressHighBitIndexTable[Value];
+    }
+
+    Result = (ULONG_PTR)HighBit << HUFFMAN_LOG2_FRACTION_BITS;
+
+    //
+    // Normalize the mantissa to [1, 2) with 15 bits of fraction.
+    //
+
+    if (HighBit <= 15) {
+        Mantissa = (MI_Uint64)Value << (15 - HighBit);
+    } else {
+        Mantissa = (MI_Uint64)Value >> (HighBit - 15);
+    }
+
+    for (Bit = (ULONG_PTR)1 << (HUFFMAN_LOG2_FRACTION_BITS - 1); Bit != 0; Bit >>= 1) {
+
+        Mantissa = (Mantissa * Mantissa) >> 15;
+
+        if (Mantissa >= (2 << 15)) {
+            Mantissa >>= 1;
+            Result |= Bit;
+        }
+    }
+
+    return Result;
+}
+
+MI_Uint32
+CompressWorkSpaceInitXpressHuff (
+    _Out_ void* WorkSpace
+    )
+
+/*++
+
+Routine Description:
+
+    This routine prepares a newly allocated compression work space.  The work
+    space carries the Huffman table of the last block it encoded from one call
+    to CompressBufferProgress to the next so that similar blocks can reuse it,
+    so it must be initialized once before its first use.
+
+Arguments:
+
+    WorkSpace - A buffer of the size returned by CompressWorkSpaceSizeXpressHuff.
+
+Return Value:
+
+    STATUS_SUCCESS
+
+--*/
+
+{
+    PXPRESS_HUFF_WORKSPACE HuffStandardWorkspace;
+    ULONG_PTR i;
+
+    HuffStandardWorkspace = (PXPRESS_HUFF_WORKSPACE)ALIGN_UP_POINTER(WorkSpace, ULONG_PTR);
+
+    HuffStandardWorkspace->Huffman.PreviousEncodingsValid = MI_FALSE;
+
+    //
+    // The first block builds an exact table.  A buffer of a single block has
+    // no use for a reusable one and PSRP messages mostly fit in one.
+    //
+
+    HuffStandardWorkspace->Huffman.ReuseRetryCountdown = 1;
 
+    HuffStandardWorkspace->Huffman.Log2Table[0] = 0;
+    for (i = 1; i < 256; ++i) {
+        HuffStandardWorkspace->Huffman.Log2Table[i] = (USHORT)XpressLog2(i);
+    }
 
+    return STATUS_SUCCESS;
+}
 
 ULONG_PTR
 XpressBuildHuffmanEncodings (
@@ -860,6 +1016,151 @@ Return Value:
     return TotalBitCount;
 }
 
+static ULONG_PTR
+XpressReuseHuffmanEncodings (
+    _In_ PHUFFMAN_WORKSPACE Workspace
+    )
+
+/*++
+
+Routine Description:
+
+    Decides whether the Huffman encodings built for the previous block can be
+    used for the symbol frequencies of the current block.  They can only be
+    used if every symbol in the current block has a code in the previous table,
+    and they are only worth using if the cost of the current block encoded with
+    them is within the reuse slack of the entropy of the block, which is a lower
+    bound for the cost of any table XpressBuildHuffmanEncodings could build.
+
+    When the encodings are reused the Encodings and CompactBitLengths arrays
+    are left as they are, so the previous table is written out again in front
+    of the block as the format requires.
+
+Arguments:
+
+    Workspace - Contains input symbol frequencies and the previous code tables.
+
+Return Value:
+
+    The total bit length of the data using the previous encodings, or zero if
+    they cannot or should not be reused.
+
+--*/
+
+{
+    ULONG_PTR i;
+    ULONG_PTR Freq;
+    ULONG_PTR TotalBitCount;
+    ULONG_PTR TotalFrequency;
+    ULONG_PTR EntropyBitCount;
+    ULONG_PTR FrequencyLog2Sum;
+
+    if (!Workspace->PreviousEncodingsValid) {
+        return 0;
+    }
+
+    TotalBitCount = 0;
+    TotalFrequency = 0;
+    FrequencyLog2Sum = 0;
+
+    for (i = 0; i < HUFFMAN_ALPHABET_SIZE; ++i) {
+
+        Freq = Workspace->Frequencies[i];
+
+        if (Freq != 0) {
+
+            if (Workspace->SymbolToBitLength[i] == 0) {
+
+                //
+                // This symbol has no code in the previous table.
+                //
+
+                return 0;
+            }
+
+            TotalBitCount += Freq * Workspace->SymbolToBitLength[i];
+            TotalFrequency += Freq;
+            FrequencyLog2Sum += Freq * HUFFMAN_LOG2(Workspace, Freq);
+        }
+    }
+
+    //
+    // Entropy = sum over symbols of Freq * log2(TotalFrequency / Freq), which
+    // is TotalFrequency * log2(TotalFrequency) - sum of Freq * log2(Freq).
+    //
+
+    EntropyBitCount = (TotalFrequency * XpressLog2(TotalFrequency) -
+                       FrequencyLog2Sum) >> HUFFMAN_LOG2_FRACTION_BITS;
+
+    if (TotalBitCount > EntropyBitCount +
+                        (EntropyBitCount >> HUFFMAN_REUSE_SLACK_SHIFT)) {
+        return 0;
+    }
+
+    return TotalBitCount;
+}
+
+static ULONG_PTR
+XpressBuildReusableHuffmanEncodings (
+    _In_ PHUFFMAN_WORKSPACE Workspace
+    )
+
+/*++
+
+Routine Description:
+
+    Computes canonical Huffman codes like XpressBuildHuffmanEncodings, except
+    that symbols that do not occur in the block are counted once so that they
+    still get a (long) code.  A table built from one block almost never covers
+    every match symbol of the next one, so without this the table could hardly
+    ever be reused.  It costs a little compression, so it is only worth doing
+    for full blocks of a long buffer.
+
+Arguments:
+
+    Workspace - Contains input symbol frequencies and output code tables.
+
+Return Value:
+
+    The total bit length of the data, counting only the symbols that actually
+    occur in the block.
+
+--*/
+
+{
+    ULONG_PTR i;
+    ULONG_PTR TotalBitCount;
+
+    memset(&Workspace->PaddedSymbols[0], 0, sizeof(Workspace->PaddedSymbols));
+
+    for (i = 0; i < HUFFMAN_ALPHABET_SIZE; ++i) {
+
+        if (Workspace->Frequencies[i] == 0) {
+            Workspace->Frequencies[i] = 1;
+            Workspace->PaddedSymbols[i / 8] |= (MI_Uint8)(1 << (i % 8));
+        }
+    }
+
+    XpressBuildHuffmanEncodings(Workspace);
+
+    TotalBitCount = 0;
+
+    for (i = 0; i < HUFFMAN_ALPHABET_SIZE; ++i) {
+
+        if (Workspace->PaddedSymbols[i / 8] & (1 << (i % 8))) {
+            Workspace->Frequencies[i] = 0;
+        } else {
+            TotalBitCount += Workspace->Frequencies[i] *
+                             Workspace->SymbolToBitLength[i];
+        }
+    }
+
+    return TotalBitCount;
+}
+
+
+
+
 MI_Uint8 *
 XpressDoHuffmanPass (
     _In_ PHUFFMAN_WORKSPACE Workspace,
@@ -899,7 +1200,7 @@ Return Value:
     USHORT NextShort;
     MI_Uint8 * HuffOutputPos1;
     MI_Uint8 * HuffOutputPos2;
-    INT Tags;
+    MI_Uint32 Tags;
     HUFFMAN_ENCODING* HuffCode;
     MI_Uint8 HuffValue;
     ULONG_PTR MatchLen;
@@ -933,7 +1234,7 @@ Return Value:
 
         for (;;) {
 
-            if (Tags < 0) {
+            if ((INT)Tags < 0) {
                 break;
             }
 
@@ -996,7 +1297,8 @@ Return Value:
         HuffEncodeGetTags:
 
             //
-            // Load the next 32 tags.
+            // Load the next 32 tags.  They are shifted as unsigned so that the
+            // sentinel bit can move through the sign bit without overflowing.
             //
 
 #if defined(_ARM_) || defined(_ARM64_)
@@ -1004,10 +1306,10 @@ Return Value:
             __prefetch(LzInputPos + 64);
 #endif
 
-            Tags = *((INT UNALIGNED *)LzInputPos);
+            Tags = *((MI_Uint32 UNALIGNED *)LzInputPos);
             LzInputPos += sizeof(Tags);
 
-            if (Tags < 0) {
+            if ((INT)Tags < 0) {
                 Tags = Tags * 2 + 1;
             } else {
                 Tags = Tags * 2 + 1;
@@ -1245,6 +1547,7 @@ Return Value:
     ULONG_PTR BlockByteSize;
     MI_Uint8 HuffValue;
     LOGICAL ReachedEnd;
+    LOGICAL FullBlock;
     XPRESS_CALLBACK_PARAMS CallbackParams;
 
     InputBufferEnd = UncompressedBuffer + UncompressedBufferSize;
@@ -1358,9 +1661,11 @@ Return Value:
         //
 
         HuffBlockEnd = InputPos + HUFFMAN_BLOCK_SIZE;
+        FullBlock = MI_TRUE;
 
         if (HuffBlockEnd > InputBufferEnd) {
             HuffBlockEnd = InputBufferEnd;
+            FullBlock = MI_FALSE;
         }
 
         SafeHuffBlockEnd = HuffBlockEnd - 40;
@@ -1784,10 +2089,36 @@ Return Value:
         }
 
         //
-        // Build the canonical Huffman encodings.
+        // Reuse the previous block's Huffman encodings if they are nearly as
+        // good as new ones would be, otherwise build the canonical Huffman
+        // encodings.  Only a full block is likely to be followed by another
+        // one, so only full blocks build a table meant for reuse, and only
+        // while such tables are actually getting reused.
         //
 
-        BlockBitSize = XpressBuildHuffmanEncodings(&Workspace->Huffman);
+        BlockBitSize = XpressReuseHuffmanEncodings(&Workspace->Huffman);
+
+        if (BlockBitSize == 0) {
+
+            if (Workspace->Huffman.PreviousEncodingsValid) {
+                Workspace->Huffman.ReuseRetryCountdown = HUFFMAN_REUSE_RETRY_BLOCKS;
+            }
+
+            if (FullBlock && (Workspace->Huffman.ReuseRetryCountdown == 0)) {
+
+                BlockBitSize = XpressBuildReusableHuffmanEncodings(&Workspace->Huffman);
+                Workspace->Huffman.PreviousEncodingsValid = MI_TRUE;
+
+            } else {
+
+                BlockBitSize = XpressBuildHuffmanEncodings(&Workspace->Huffman);
+                Workspace->Huffman.PreviousEncodingsValid = MI_FALSE;
+
+                if (FullBlock && (Workspace->Huffman.ReuseRetryCountdown != 0)) {
+                    --Workspace->Huffman.ReuseRetryCountdown;
+                }
+            }
+        }
 
         //
         // Compute the byte size of the Huffman chunk we're about to write, and
@@ -2223,6 +2554,54 @@ Return Value:
 
 
 
+static __inline void
+XpressCopyMatch (
+    _Out_ MI_Uint8 * OutputPos,
+    _In_ MI_Uint8 * MatchSrc,
+    _In_ ULONG_PTR MatchLen
+    )
+
+/*++
+
+Routine Description:
+
+    This routine copies an LZ77 match forwards.  When the match distance is
+    shorter than its length the source runs into the bytes being written,
+    which is how a match repeats the last few bytes, so memcpy cannot be used.
+    Eight bytes are copied at a time only when they cannot overlap.
+
+Arguments:
+
+    OutputPos - Supplies where the match is written.
+
+    MatchSrc - Supplies the start of the match in the output already decoded.
+
+    MatchLen - Supplies the length, in bytes, of the match.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    if ((ULONG_PTR)(OutputPos - MatchSrc) >= 8) {
+        while (MatchLen >= 8) {
+            memcpy(OutputPos, MatchSrc, 8);
+            OutputPos += 8;
+            MatchSrc += 8;
+            MatchLen -= 8;
+        }
+    }
+
+    while (MatchLen != 0) {
+        *OutputPos++ = *MatchSrc++;
+        MatchLen -= 1;
+    }
+}
+
+
+
 MI_Uint32
 DecompressBufferProgress (
     _Out_ MI_Uint8 * UncompressedBuffer,
@@ -2712,7 +3091,7 @@ Return Value:
                                 return STATUS_BAD_COMPRESSION_BUFFER;
                             }
 
-                            memcpy(OutputPos, MatchSrc, MatchLen);
+                            XpressCopyMatch(OutputPos, MatchSrc, MatchLen);
                             OutputPos += MatchLen;
 
                             goto SafeDecode;
@@ -2898,11 +3277,10 @@ Return Value:
             }
 
             //
-            // The movsb instruction seems to be an efficient way to copy in a
-            // precise boundary-aware way.
+            // Matches may overlap their own output, so copy them forwards.
             //
 
-            memcpy(OutputPos, MatchSrc, MatchLen);
+            XpressCopyMatch(OutputPos, MatchSrc, MatchLen);
             OutputPos += MatchLen;
         }
     }
@@ -72,4 +72,9 @@ CompressWorkSpaceSizeXpressHuff (
     _Out_ MI_Uint32* DecompressBufferWorkSpaceSize
     );
 
+MI_Uint32
+CompressWorkSpaceInitXpressHuff (
+    _Out_ void * WorkSpace
+    );
+
 #endif